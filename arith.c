@@ -0,0 +1,1018 @@
+#include "./arith.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "parsing.h"
+#include "vars.h"
+
+typedef enum {
+    A_NUM,
+    A_VAR,
+    // unary operators
+    A_NEG,
+    A_POS,
+    A_NOT,
+    A_BNOT,
+    A_PREINC,
+    A_PREDEC,
+    A_POSTINC,
+    A_POSTDEC,
+    // binary operators, in the same order as binops[] below
+    A_MUL,
+    A_DIV,
+    A_MOD,
+    A_ADD,
+    A_SUB,
+    A_SHL,
+    A_SHR,
+    A_LT,
+    A_LE,
+    A_GT,
+    A_GE,
+    A_EQ,
+    A_NE,
+    A_BAND,
+    A_BXOR,
+    A_BOR,
+    A_LAND,
+    A_LOR,
+    // everything else
+    A_COND,
+    A_ASSIGN,
+    A_COMMA
+} arith_op_t;
+
+struct arith_node {
+    arith_op_t op;
+    long val;    // value of A_NUM, compound operator (or -1) of A_ASSIGN
+    char *name;  // variable name of A_VAR, A_ASSIGN and the inc/dec operators
+    arith_node_t *a, *b, *c;
+};
+
+// binary operators, with their C precedence (higher binds tighter)
+static const struct {
+    const char *str;
+    int prec;
+} binops[] = {
+    {"*", 10}, {"/", 10}, {"%", 10}, {"+", 9}, {"-", 9},  {"<<", 8},
+    {">>", 8}, {"<", 7},  {"<=", 7}, {">", 7}, {">=", 7}, {"==", 6},
+    {"!=", 6}, {"&", 5},  {"^", 4},  {"|", 3}, {"&&", 2}, {"||", 1},
+};
+#define NBINOPS (int)(sizeof(binops) / sizeof(binops[0]))
+
+// every operator the lexer recognizes, longest first
+static const char *operators[] = {
+    "<<=", ">>=", "&&", "||", "==", "!=", "<=", ">=", "<<", ">>",
+    "++",  "--",  "+=", "-=", "*=", "/=", "%=", "&=", "^=", "|=",
+    "*",   "/",   "%",  "+",  "-",  "<",  ">",  "&",  "^",  "|",
+    "!",   "~",   "?",  ":",  "=",  "(",  ")",  ",",  NULL};
+
+// parser state: the expression text and the current token
+typedef struct {
+    const char *pos;
+    const char *end;
+    const char *tok;  // start of the current token
+    size_t toklen;    // length of the current token, 0 at end of input
+    int error;
+} parser_t;
+
+static arith_node_t *parse_comma(parser_t *p);
+static arith_node_t *parse_assign(parser_t *p);
+
+/* reads the next token of the expression into p->tok */
+static void next(parser_t *p) {
+    while (p->pos < p->end && isspace((unsigned char)*p->pos)) {
+        p->pos++;
+    }
+
+    p->tok = p->pos;
+    if (p->pos == p->end) {
+        p->toklen = 0;
+        return;
+    }
+
+    if (isalnum((unsigned char)*p->pos) || *p->pos == '_') {
+        // number or variable name
+        while (p->pos < p->end &&
+               (isalnum((unsigned char)*p->pos) || *p->pos == '_')) {
+            p->pos++;
+        }
+    } else {
+        const char **op;
+        for (op = operators; *op; op++) {
+            size_t len = strlen(*op);
+            if ((size_t)(p->end - p->pos) >= len &&
+                !strncmp(p->pos, *op, len)) {
+                p->pos += len;
+                break;
+            }
+        }
+
+        if (!*op) {  // unknown character
+            p->pos++;
+            p->error = 1;
+        }
+    }
+
+    p->toklen = (size_t)(p->pos - p->tok);
+}
+
+/* returns 1 if the current token is exactly str */
+static int is(parser_t *p, const char *str) {
+    return p->toklen == strlen(str) && !strncmp(p->tok, str, p->toklen);
+}
+
+/* allocates a new node */
+static arith_node_t *node(arith_op_t op, arith_node_t *a, arith_node_t *b) {
+    arith_node_t *n = (arith_node_t *)calloc(1, sizeof(arith_node_t));
+    if (!n) {
+        perror("calloc");
+        exit(1);
+    }
+
+    n->op = op;
+    n->a = a;
+    n->b = b;
+    return n;
+}
+
+/*
+ * apply()
+ *
+ * - Description: applies a unary or binary operator to constant operands.
+ * Arithmetic wraps around on overflow rather than being undefined. Returns 0
+ * on success, -1 on division by zero.
+ *
+ * - Arguments: op: the operator, x: left (or only) operand, y: right operand,
+ * result: where to store the result
+ */
+static int apply(arith_op_t op, long x, long y, long *result) {
+    unsigned long ux = (unsigned long)x, uy = (unsigned long)y;
+
+    switch (op) {
+        case A_NEG:
+            *result = (long)(0 - ux);
+            break;
+        case A_POS:
+            *result = x;
+            break;
+        case A_NOT:
+            *result = !x;
+            break;
+        case A_BNOT:
+            *result = ~x;
+            break;
+        case A_MUL:
+            *result = (long)(ux * uy);
+            break;
+        case A_DIV:
+        case A_MOD:
+            if (!y) {
+                return -1;
+            }
+
+            if (y == -1) {  // LONG_MIN / -1 overflows
+                *result = op == A_DIV ? (long)(0 - ux) : 0;
+            } else {
+                *result = op == A_DIV ? x / y : x % y;
+            }
+            break;
+        case A_ADD:
+            *result = (long)(ux + uy);
+            break;
+        case A_SUB:
+            *result = (long)(ux - uy);
+            break;
+        case A_SHL:
+            *result = (long)(ux << (uy & 63));
+            break;
+        case A_SHR:
+            *result = x >> (uy & 63);
+            break;
+        case A_LT:
+            *result = x < y;
+            break;
+        case A_LE:
+            *result = x <= y;
+            break;
+        case A_GT:
+            *result = x > y;
+            break;
+        case A_GE:
+            *result = x >= y;
+            break;
+        case A_EQ:
+            *result = x == y;
+            break;
+        case A_NE:
+            *result = x != y;
+            break;
+        case A_BAND:
+            *result = x & y;
+            break;
+        case A_BXOR:
+            *result = x ^ y;
+            break;
+        case A_BOR:
+            *result = x | y;
+            break;
+        case A_LAND:
+            *result = x && y;
+            break;
+        case A_LOR:
+            *result = x || y;
+            break;
+        default:
+            return -1;
+    }
+
+    return 0;
+}
+
+/* turns n into a constant node holding val, freeing its children */
+static void make_const(arith_node_t *n, long val) {
+    arith_free(n->a);
+    arith_free(n->b);
+    arith_free(n->c);
+    n->a = n->b = n->c = NULL;
+    n->op = A_NUM;
+    n->val = val;
+}
+
+/* replaces n with its child, freeing everything else */
+static arith_node_t *take_child(arith_node_t *n, arith_node_t **child) {
+    arith_node_t *keep = *child;
+    *child = NULL;
+    arith_free(n);
+    return keep;
+}
+
+/*
+ * fold()
+ *
+ * - Description: constant-folds a freshly built node whose children have
+ * already been folded. Returns the (possibly replaced) node.
+ *
+ * - Arguments: n: the node to fold
+ *
+ * - Usage: 2 * 3 + x -> 6 + x, 0 && x -> 0, 1 ? x : y -> x. Division by a
+ * constant zero is left alone so it is reported when the expression is used.
+ */
+static arith_node_t *fold(arith_node_t *n) {
+    long val;
+    int a_const = n->a && n->a->op == A_NUM;
+    int b_const = n->b && n->b->op == A_NUM;
+
+    switch (n->op) {
+        case A_NEG:
+        case A_POS:
+        case A_NOT:
+        case A_BNOT:
+            if (a_const && !apply(n->op, n->a->val, 0, &val)) {
+                make_const(n, val);
+            }
+            break;
+        case A_LAND:
+        case A_LOR:
+            // short-circuit on a constant left operand
+            if (a_const && (n->op == A_LAND) == !n->a->val) {
+                make_const(n, n->op == A_LOR);
+            } else if (a_const && b_const) {
+                make_const(n, !!n->b->val);
+            }
+            break;
+        case A_COND:
+            if (a_const) {
+                return take_child(n, n->a->val ? &n->b : &n->c);
+            }
+            break;
+        case A_COMMA:
+            if (a_const) {
+                return take_child(n, &n->b);
+            }
+            break;
+        default:
+            if (n->op >= A_MUL && n->op <= A_BOR && a_const && b_const &&
+                !apply(n->op, n->a->val, n->b->val, &val)) {
+                make_const(n, val);
+            }
+            break;
+    }
+
+    return n;
+}
+
+/* primary: number, variable, or parenthesized expression */
+static arith_node_t *parse_primary(parser_t *p) {
+    arith_node_t *n;
+
+    if (is(p, "(")) {
+        next(p);
+        n = parse_comma(p);
+        if (!is(p, ")")) {
+            p->error = 1;
+        }
+        next(p);
+        return n;
+    }
+
+    if (!p->toklen) {
+        p->error = 1;
+        return node(A_NUM, NULL, NULL);
+    }
+
+    if (isdigit((unsigned char)*p->tok)) {
+        // decimal, octal (leading 0) or hexadecimal (leading 0x)
+        char num[32];
+        char *end;
+        if (p->toklen >= sizeof(num)) {
+            p->error = 1;
+            return node(A_NUM, NULL, NULL);
+        }
+
+        memcpy(num, p->tok, p->toklen);
+        num[p->toklen] = '\0';
+        n = node(A_NUM, NULL, NULL);
+        errno = 0;
+        n->val = (long)strtoul(num, &end, 0);
+        if (*end || errno) {
+            p->error = 1;
+        }
+    } else if (isalpha((unsigned char)*p->tok) || *p->tok == '_') {
+        n = node(A_VAR, NULL, NULL);
+        n->name = strndup(p->tok, p->toklen);
+    } else {
+        p->error = 1;
+        return node(A_NUM, NULL, NULL);
+    }
+
+    next(p);
+    if (n->op == A_VAR && (is(p, "++") || is(p, "--"))) {
+        n->op = is(p, "++") ? A_POSTINC : A_POSTDEC;
+        next(p);
+    }
+
+    return n;
+}
+
+/* unary operators: + - ! ~ and prefix ++ -- */
+static arith_node_t *parse_unary(parser_t *p) {
+    arith_op_t op;
+
+    if (is(p, "++") || is(p, "--")) {
+        op = is(p, "++") ? A_PREINC : A_PREDEC;
+        next(p);
+        arith_node_t *n = parse_unary(p);
+        if (n->op != A_VAR) {  // can only increment a variable
+            p->error = 1;
+        }
+
+        n->op = op;
+        return n;
+    }
+
+    if (is(p, "-")) {
+        op = A_NEG;
+    } else if (is(p, "+")) {
+        op = A_POS;
+    } else if (is(p, "!")) {
+        op = A_NOT;
+    } else if (is(p, "~")) {
+        op = A_BNOT;
+    } else {
+        return parse_primary(p);
+    }
+
+    next(p);
+    return fold(node(op, parse_unary(p), NULL));
+}
+
+/* returns the index of the current token in binops[], or -1 */
+static int binop(parser_t *p) {
+    for (int i = 0; i < NBINOPS; i++) {
+        if (is(p, binops[i].str)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* binary operators binding at least as tightly as min_prec, left-to-right */
+static arith_node_t *parse_binary(parser_t *p, int min_prec) {
+    arith_node_t *lhs = parse_unary(p);
+
+    int i;
+    while (!p->error && (i = binop(p)) >= 0 && binops[i].prec >= min_prec) {
+        next(p);
+        arith_node_t *rhs = parse_binary(p, binops[i].prec + 1);
+        lhs = fold(node((arith_op_t)(A_MUL + i), lhs, rhs));
+    }
+
+    return lhs;
+}
+
+/* conditional operator: a ? b : c */
+static arith_node_t *parse_cond(parser_t *p) {
+    arith_node_t *n = parse_binary(p, 1);
+
+    if (is(p, "?")) {
+        next(p);
+        n = node(A_COND, n, parse_comma(p));
+        if (!is(p, ":")) {
+            p->error = 1;
+        }
+        next(p);
+        n->c = parse_cond(p);
+        n = fold(n);
+    }
+
+    return n;
+}
+
+/* assignment operators: = *= /= %= += -= <<= >>= &= ^= |= */
+static arith_node_t *parse_assign(parser_t *p) {
+    static const char *assignops[] = {
+        "*=", "/=", "%=", "+=", "-=", "<<=", ">>=", "&=", "^=", "|=", NULL};
+    static const arith_op_t compound[] = {A_MUL, A_DIV, A_MOD,  A_ADD,  A_SUB,
+                                          A_SHL, A_SHR, A_BAND, A_BXOR, A_BOR};
+
+    arith_node_t *n = parse_cond(p);
+
+    long aop;
+    if (is(p, "=")) {
+        aop = -1;
+    } else {
+        for (aop = 0; assignops[aop]; aop++) {
+            if (is(p, assignops[aop])) {
+                break;
+            }
+        }
+
+        if (!assignops[aop]) {
+            return n;
+        }
+
+        aop = compound[aop];
+    }
+
+    if (n->op != A_VAR) {  // can only assign to a variable
+        p->error = 1;
+        return n;
+    }
+
+    next(p);
+    n->op = A_ASSIGN;
+    n->val = aop;
+    n->b = parse_assign(p);  // assignment is right-associative
+    return n;
+}
+
+/* comma operator: a, b */
+static arith_node_t *parse_comma(parser_t *p) {
+    arith_node_t *n = parse_assign(p);
+
+    while (!p->error && is(p, ",")) {
+        next(p);
+        n = fold(node(A_COMMA, n, parse_assign(p)));
+    }
+
+    return n;
+}
+
+/*
+ * arith_compile()
+ *
+ * - Description: parses an arithmetic expression using the C integer
+ * operators and precedence rules into a tree, folding constant subtrees as it
+ * goes. Returns NULL and prints an error message if the expression is
+ * malformed.
+ *
+ * - Arguments: expr: the expression text (need not be NUL-terminated), len:
+ * length of the expression
+ *
+ * - Usage: arith_compile("1 + 2 * 3", 9) -> a single constant node 7
+ *          arith_compile("i += 2 * 3", 10) -> (i += 6)
+ */
+arith_node_t *arith_compile(const char *expr, size_t len) {
+    parser_t p = {expr, expr + len, expr, 0, 0};
+    next(&p);
+
+    arith_node_t *n = parse_comma(&p);
+    if (p.error || p.toklen) {
+        char msg[1100];
+        int mlen = snprintf(msg, sizeof(msg),
+                            "syntax error: bad arithmetic expression: %.*s\n",
+                            (int)len, expr);
+        syntax_error(msg,
+                     mlen < (int)sizeof(msg) ? (size_t)mlen : sizeof(msg) - 1);
+        arith_free(n);
+        return NULL;
+    }
+
+    return n;
+}
+
+/* reads the value of a shell variable; unset and empty variables are 0 */
+static int get_var(const char *name, long *val) {
+    const char *str = var_get(shell_vars, name);
+    if (!str || !*str) {
+        *val = 0;
+        return 0;
+    }
+
+    char *end;
+    errno = 0;
+    *val = strtol(str, &end, 0);
+    if (*end || errno) {
+        fprintf(stderr, "arith: %s: not a number\n", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* sets a shell variable to the given value */
+static int set_var(const char *name, long val) {
+    char str[32];
+    snprintf(str, sizeof(str), "%ld", val);
+    return var_set(shell_vars, name, str);
+}
+
+/*
+ * arith_eval()
+ *
+ * - Description: evaluates an expression tree. Variables are read from and
+ * assigned to shell_vars (see vars.h). Returns 0 on success, -1 (after printing
+ * an error) on division by zero or if a variable does not hold a number.
+ *
+ * - Arguments: node: the expression, result: where to store its value
+ */
+int arith_eval(arith_node_t *node, long *result) {
+    long x, y;
+
+    switch (node->op) {
+        case A_NUM:
+            *result = node->val;
+            return 0;
+        case A_VAR:
+            return get_var(node->name, result);
+        case A_PREINC:
+        case A_PREDEC:
+        case A_POSTINC:
+        case A_POSTDEC:
+            if (get_var(node->name, &x) < 0) {
+                return -1;
+            }
+
+            y = (node->op == A_PREINC || node->op == A_POSTINC)
+                    ? (long)((unsigned long)x + 1)
+                    : (long)((unsigned long)x - 1);
+            *result = (node->op == A_PREINC || node->op == A_PREDEC) ? y : x;
+            return set_var(node->name, y);
+        case A_LAND:
+        case A_LOR:
+            if (arith_eval(node->a, &x) < 0) {
+                return -1;
+            }
+
+            if ((node->op == A_LAND) == !x) {  // short-circuit
+                *result = node->op == A_LOR;
+                return 0;
+            }
+
+            if (arith_eval(node->b, &y) < 0) {
+                return -1;
+            }
+
+            *result = !!y;
+            return 0;
+        case A_COND:
+            if (arith_eval(node->a, &x) < 0) {
+                return -1;
+            }
+
+            return arith_eval(x ? node->b : node->c, result);
+        case A_COMMA:
+            if (arith_eval(node->a, &x) < 0) {
+                return -1;
+            }
+
+            return arith_eval(node->b, result);
+        case A_ASSIGN:
+            if (arith_eval(node->b, &y) < 0) {
+                return -1;
+            }
+
+            if (node->val >= 0) {  // compound assignment
+                if (get_var(node->name, &x) < 0) {
+                    return -1;
+                }
+
+                if (apply((arith_op_t)node->val, x, y, &y) < 0) {
+                    fprintf(stderr, "arith: division by zero\n");
+                    return -1;
+                }
+            }
+
+            *result = y;
+            return set_var(node->name, y);
+        default:
+            break;
+    }
+
+    // plain unary and binary operators
+    if (arith_eval(node->a, &x) < 0 ||
+        (node->b && arith_eval(node->b, &y) < 0)) {
+        return -1;
+    }
+
+    if (apply(node->op, x, node->b ? y : 0, result) < 0) {
+        fprintf(stderr, "arith: division by zero\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* frees an expression tree */
+void arith_free(arith_node_t *node) {
+    if (!node) {
+        return;
+    }
+
+    arith_free(node->a);
+    arith_free(node->b);
+    arith_free(node->c);
+    free(node->name);
+    free(node);
+}
+
+// start of an expansion that is to be evaluated (see ARITH_MARK)
+static const char ARITH_EXPANSION[] = {ARITH_MARK, '(', '(', '\0'};
+
+// a word is a sequence of literal text and $((...)) segments
+typedef struct {
+    char *text;          // literal text, or NULL for an expression
+    arith_node_t *expr;  // expression, or NULL for literal text
+} segment_t;
+
+struct word {
+    segment_t *segs;
+    int nsegs;
+    char *literal;  // set if every expression folded to a constant
+};
+
+/*
+ * find_expansion()
+ *
+ * - Description: finds the next $((...)) expansion in tok. Returns a pointer
+ * to its start (the ARITH_MARK that replaced its '$') or NULL if there is none.
+ * If there is one, *end is set to point just past its closing "))", or to NULL
+ * if it is not terminated.
+ *
+ * - Arguments: tok: the string to search, end: where to store the end of the
+ * expansion
+ */
+static const char *find_expansion(const char *tok, const char **end) {
+    const char *start = strstr(tok, ARITH_EXPANSION);
+    if (!start) {
+        return NULL;
+    }
+
+    int depth = 0;
+    *end = NULL;
+    for (const char *c = start + 3; *c; c++) {
+        if (*c == '(') {
+            depth++;
+        } else if (*c == ')' && depth) {
+            depth--;
+        } else if (*c == ')' && c[1] == ')') {
+            *end = c + 2;
+            break;
+        }
+    }
+
+    return start;
+}
+
+/* returns 1 if tok contains a $((...)) expansion, 0 otherwise */
+int has_expansion(const char *tok) {
+    return strstr(tok, ARITH_EXPANSION) != NULL;
+}
+
+/* appends a segment to a word */
+static void add_segment(word_t *word, char *text, arith_node_t *expr) {
+    segment_t *segs = (segment_t *)realloc(
+        word->segs, (size_t)(word->nsegs + 1) * sizeof(segment_t));
+    if (!segs) {
+        perror("realloc");
+        exit(1);
+    }
+
+    word->segs = segs;
+    word->segs[word->nsegs].text = text;
+    word->segs[word->nsegs].expr = expr;
+    word->nsegs++;
+}
+
+/*
+ * compile_word()
+ *
+ * - Description: splits a token into literal text and $((...)) expressions and
+ * compiles each expression. If every expression folds to a constant, the word
+ * is expanded once here and word_literal() returns the result. Returns NULL
+ * and prints an error message if an expression is malformed or unterminated.
+ *
+ * - Arguments: tok: the token to compile
+ *
+ * - Usage: compile_word("a$((1+2))b") -> literal word "a3b"
+ *          compile_word("$((i++))") -> word expanded on every use
+ */
+word_t *compile_word(const char *tok) {
+    word_t *word = (word_t *)calloc(1, sizeof(word_t));
+    if (!word) {
+        perror("calloc");
+        return NULL;
+    }
+
+    int dynamic = 0;
+    const char *start, *end;
+    while ((start = find_expansion(tok, &end))) {
+        if (!end) {
+            syntax_error("syntax error: unterminated $((\n", 31);
+            free_word(word);
+            return NULL;
+        }
+
+        if (start > tok) {
+            add_segment(word, strndup(tok, (size_t)(start - tok)), NULL);
+        }
+
+        arith_node_t *expr;
+        if (!(expr = arith_compile(start + 3, (size_t)(end - start - 5)))) {
+            free_word(word);
+            return NULL;
+        }
+
+        dynamic |= expr->op != A_NUM;
+        add_segment(word, NULL, expr);
+        tok = end;
+    }
+
+    if (*tok) {
+        add_segment(word, strdup(tok), NULL);
+    }
+
+    if (!dynamic) {
+        word->literal = expand_word(word);
+    }
+
+    return word;
+}
+
+/* returns the expansion of a constant word, NULL if it must be expanded */
+char *word_literal(word_t *word) { return word->literal; }
+
+/*
+ * expand_word()
+ *
+ * - Description: evaluates the expressions in a word and returns the resulting
+ * string, which the caller must free. Returns NULL if an expression could not
+ * be evaluated.
+ *
+ * - Arguments: word: the word to expand
+ */
+char *expand_word(word_t *word) {
+    // each expression expands to at most 20 digits and a sign
+    size_t size = 1;
+    for (int i = 0; i < word->nsegs; i++) {
+        size += word->segs[i].text ? strlen(word->segs[i].text) : 21;
+    }
+
+    char *str = (char *)malloc(size);
+    if (!str) {
+        perror("malloc");
+        return NULL;
+    }
+
+    char *out = str;
+    for (int i = 0; i < word->nsegs; i++) {
+        if (word->segs[i].text) {
+            out = stpcpy(out, word->segs[i].text);
+        } else {
+            long val;
+            if (arith_eval(word->segs[i].expr, &val) < 0) {
+                free(str);
+                return NULL;
+            }
+
+            out += sprintf(out, "%ld", val);
+        }
+    }
+
+    *out = '\0';
+    return str;
+}
+
+/* frees a word */
+void free_word(word_t *word) {
+    if (!word) {
+        return;
+    }
+
+    for (int i = 0; i < word->nsegs; i++) {
+        free(word->segs[i].text);
+        arith_free(word->segs[i].expr);
+    }
+
+    free(word->segs);
+    free(word->literal);
+    free(word);
+}
+
+/*
+ * the serialized form of a word is a byte stream (no alignment):
+ *      u32 nsegs, then per segment:
+ *          u8 0, u32 len, text bytes           (literal text)
+ *          u8 1, expression nodes in preorder  (expression)
+ *      where each node is:
+ *          u8 op, u8 children (bit 0: a, bit 1: b, bit 2: c), i64 val,
+ *          u32 namelen, name bytes
+ */
+
+/* appends len bytes to out (if not NULL) at *pos, advancing *pos */
+static void put(char *out, size_t *pos, const void *data, size_t len) {
+    if (out) {
+        memcpy(out + *pos, data, len);
+    }
+
+    *pos += len;
+}
+
+/* serializes an expression tree in preorder */
+static void save_node(arith_node_t *node, char *out, size_t *pos) {
+    unsigned char op = (unsigned char)node->op;
+    unsigned char kids = (unsigned char)((node->a ? 1 : 0) | (node->b ? 2 : 0) |
+                                         (node->c ? 4 : 0));
+    int64_t val = node->val;
+    uint32_t namelen = node->name ? (uint32_t)strlen(node->name) : 0;
+
+    put(out, pos, &op, 1);
+    put(out, pos, &kids, 1);
+    put(out, pos, &val, sizeof(val));
+    put(out, pos, &namelen, sizeof(namelen));
+    put(out, pos, node->name, namelen);
+
+    if (node->a) {
+        save_node(node->a, out, pos);
+    }
+    if (node->b) {
+        save_node(node->b, out, pos);
+    }
+    if (node->c) {
+        save_node(node->c, out, pos);
+    }
+}
+
+/*
+ * save_word()
+ *
+ * - Description: serializes a compiled word into out. Returns the number of
+ * bytes written.
+ *
+ * - Arguments: word: the word to serialize, out: buffer to write to, or NULL
+ * to only compute the size of the serialized word
+ */
+size_t save_word(word_t *word, char *out) {
+    size_t pos = 0;
+    uint32_t nsegs = (uint32_t)word->nsegs;
+    put(out, &pos, &nsegs, sizeof(nsegs));
+
+    for (int i = 0; i < word->nsegs; i++) {
+        unsigned char kind = word->segs[i].expr != NULL;
+        put(out, &pos, &kind, 1);
+
+        if (kind) {
+            save_node(word->segs[i].expr, out, &pos);
+        } else {
+            uint32_t len = (uint32_t)strlen(word->segs[i].text);
+            put(out, &pos, &len, sizeof(len));
+            put(out, &pos, word->segs[i].text, len);
+        }
+    }
+
+    return pos;
+}
+
+/* reads len bytes from the stream, returns -1 if it is too short */
+static int get(const char **pos, const char *end, void *data, size_t len) {
+    if ((size_t)(end - *pos) < len) {
+        return -1;
+    }
+
+    memcpy(data, *pos, len);
+    *pos += len;
+    return 0;
+}
+
+/* reads a length-prefixed string from the stream, NULL if malformed */
+static char *get_str(const char **pos, const char *end) {
+    uint32_t len;
+    if (get(pos, end, &len, sizeof(len)) < 0 || (size_t)(end - *pos) < len) {
+        return NULL;
+    }
+
+    char *str = strndup(*pos, len);
+    *pos += len;
+    return str;
+}
+
+/* returns the children (in save_node()'s bit layout) a node must have */
+static unsigned char node_kids(arith_op_t op) {
+    if (op >= A_NEG && op <= A_BNOT) {
+        return 1;
+    } else if ((op >= A_MUL && op <= A_LOR) || op == A_COMMA) {
+        return 3;
+    } else if (op == A_COND) {
+        return 7;
+    } else if (op == A_ASSIGN) {
+        return 2;
+    }
+
+    return 0;
+}
+
+/* deserializes an expression tree, NULL if malformed */
+static arith_node_t *load_node(const char **pos, const char *end, int depth) {
+    unsigned char op, kids;
+    int64_t val;
+    if (depth > 1024 || get(pos, end, &op, 1) < 0 ||
+        get(pos, end, &kids, 1) < 0 || get(pos, end, &val, sizeof(val)) < 0 ||
+        op > A_COMMA || kids != node_kids((arith_op_t)op) ||
+        (op == A_ASSIGN && val != -1 && (val < A_MUL || val > A_BOR))) {
+        return NULL;
+    }
+
+    arith_node_t *n = node((arith_op_t)op, NULL, NULL);
+    n->val = (long)val;
+    if (!(n->name = get_str(pos, end)) ||
+        ((n->op == A_VAR || n->op == A_ASSIGN ||
+          (n->op >= A_PREINC && n->op <= A_POSTDEC)) &&
+         !*n->name)) {
+        arith_free(n);
+        return NULL;
+    }
+
+    if (((kids & 1) && !(n->a = load_node(pos, end, depth + 1))) ||
+        ((kids & 2) && !(n->b = load_node(pos, end, depth + 1))) ||
+        ((kids & 4) && !(n->c = load_node(pos, end, depth + 1)))) {
+        arith_free(n);
+        return NULL;
+    }
+
+    return n;
+}
+
+/*
+ * load_word()
+ *
+ * - Description: deserializes a word written by save_word(). Returns NULL if
+ * the data is malformed.
+ *
+ * - Arguments: data: the serialized word, len: number of bytes available
+ */
+word_t *load_word(const char *data, size_t len) {
+    const char *end = data + len;
+    uint32_t nsegs;
+    if (get(&data, end, &nsegs, sizeof(nsegs)) < 0 || nsegs > len) {
+        return NULL;
+    }
+
+    word_t *word = (word_t *)calloc(1, sizeof(word_t));
+    if (!word) {
+        perror("calloc");
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < nsegs; i++) {
+        unsigned char kind;
+        char *text = NULL;
+        arith_node_t *expr = NULL;
+
+        if (get(&data, end, &kind, 1) < 0 ||
+            (kind ? !(expr = load_node(&data, end, 0))
+                  : !(text = get_str(&data, end)))) {
+            free_word(word);
+            return NULL;
+        }
+
+        add_segment(word, text, expr);
+    }
+
+    return word;
+}
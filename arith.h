@@ -0,0 +1,51 @@
+#ifndef ARITH_H_
+#define ARITH_H_
+
+#include <stddef.h>
+
+/*
+ * the lexer replaces the '$' of every $((...)) that is to be expanded with
+ * this byte, so that quoted or escaped "$((" is left alone
+ */
+#define ARITH_MARK '\001'
+
+/* a parsed (and constant-folded) arithmetic expression */
+typedef struct arith_node arith_node_t;
+
+/* a word containing one or more $((...)) expansions */
+typedef struct word word_t;
+
+/*
+ * parses the expression in expr[0..len) into a tree, folding constant
+ * subtrees. returns NULL (after printing an error) on a syntax error
+ */
+arith_node_t *arith_compile(const char *expr, size_t len);
+/* evaluates a tree, returns 0 on success, -1 (after printing an error) on
+ * failure */
+int arith_eval(arith_node_t *node, long *result);
+/* frees a tree */
+void arith_free(arith_node_t *node);
+
+/* returns 1 if tok contains a $((...)) expansion, 0 otherwise */
+int has_expansion(const char *tok);
+/*
+ * compiles a token containing $((...)) expansions. returns NULL (after
+ * printing an error) if any of the expressions is malformed
+ */
+word_t *compile_word(const char *tok);
+/*
+ * returns the text of a word whose expressions all folded to constants, or
+ * NULL if the word has to be expanded each time it is used
+ */
+char *word_literal(word_t *word);
+/* expands a word into a newly allocated string, NULL on failure */
+char *expand_word(word_t *word);
+/* serializes a word into out (or just measures it if out is NULL), returns
+ * the number of bytes */
+size_t save_word(word_t *word, char *out);
+/* deserializes a word written by save_word(), NULL if data is malformed */
+word_t *load_word(const char *data, size_t len);
+/* frees a word */
+void free_word(word_t *word);
+
+#endif  // ARITH_H_
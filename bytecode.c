@@ -0,0 +1,537 @@
+#include "./bytecode.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * A bytecode file is laid out as:
+ *
+ *      header (bc_header_t)
+ *      string pool: every token and the source path, NUL-terminated
+ *      command records, each 4-byte aligned:
+ *          bc_command_t
+ *          u32 token offsets into the pool [ntok]
+ *          u32 argv offsets into the pool [argc]
+ *          per dynamic word: u32 token index, u32 length, serialized word
+ *              (see save_word()), padded to 4 bytes
+ *
+ * argv offsets may point into the middle of a token (see parse()), so the
+ * argument arrays are rebuilt by adding the offsets to the pool address,
+ * without looking at the strings themselves.
+ */
+
+#define BC_MAGIC "33SHBC\r\n"
+#define BC_VERSION 1
+
+// identifies the build of the shell that wrote a file; every build recompiles
+// this file, so a file from any other build is recompiled on load
+static const char build_id[32] = __DATE__ " " __TIME__;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t ncmds;
+    char build[32];
+    uint32_t src;       // pool offset of the source path
+    uint32_t pool_off;  // file offset of the string pool
+    uint32_t pool_len;
+    uint32_t cmds_off;  // file offset of the first command record
+    uint64_t size;      // size of the whole file
+} bc_header_t;
+
+typedef struct {
+    uint32_t ntok;
+    uint32_t argc;
+    int32_t redir[4];
+    uint32_t nwords;  // number of dynamic words
+} bc_command_t;
+
+// growable output buffer
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} buf_t;
+
+/* makes room for len more bytes, returns a pointer to them or NULL */
+static char *reserve(buf_t *buf, size_t len) {
+    if (buf->len + len > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : 4096;
+        while (cap < buf->len + len) {
+            cap *= 2;
+        }
+
+        char *data = (char *)realloc(buf->data, cap);
+        if (!data) {
+            perror("realloc");
+            return NULL;
+        }
+
+        buf->data = data;
+        buf->cap = cap;
+    }
+
+    char *ret = buf->data + buf->len;
+    memset(ret, 0, len);
+    buf->len += len;
+    return ret;
+}
+
+/* appends len bytes to buf, returns 0 on success, -1 on failure */
+static int append(buf_t *buf, const void *data, size_t len) {
+    char *dst;
+    if (!(dst = reserve(buf, len))) {
+        return -1;
+    }
+
+    memcpy(dst, data, len);
+    return 0;
+}
+
+/* appends a u32 to buf */
+static int append_u32(buf_t *buf, uint32_t val) {
+    return append(buf, &val, sizeof(val));
+}
+
+/* pads buf with zeroes to a multiple of 4 bytes */
+static int align4(buf_t *buf) {
+    size_t pad = (4 - buf->len % 4) % 4;
+    return !pad || reserve(buf, pad) ? 0 : -1;
+}
+
+/*
+ * write_command()
+ *
+ * - Description: appends the strings of a command to the pool and its record
+ * to cmds. Returns 0 on success, -1 on failure.
+ *
+ * - Arguments: cmd: the command to write, pool: string pool, cmds: command
+ * records
+ */
+static int write_command(command_t *cmd, buf_t *pool, buf_t *cmds) {
+    uint32_t offs[cmd->ntok];
+    bc_command_t rec;
+
+    rec.ntok = (uint32_t)cmd->ntok;
+    rec.argc = (uint32_t)cmd->argc;
+    rec.nwords = 0;
+    for (int i = 0; i < 4; i++) {
+        rec.redir[i] = cmd->redir[i];
+    }
+
+    for (int i = 0; i < cmd->ntok; i++) {
+        offs[i] = (uint32_t)pool->len;
+        if (append(pool, cmd->tokens[i], strlen(cmd->tokens[i]) + 1) < 0) {
+            return -1;
+        }
+
+        if (cmd->words && cmd->words[i] && !word_literal(cmd->words[i])) {
+            rec.nwords++;
+        }
+    }
+
+    if (align4(cmds) < 0 || append(cmds, &rec, sizeof(rec)) < 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < cmd->ntok; i++) {
+        if (append_u32(cmds, offs[i]) < 0) {
+            return -1;
+        }
+    }
+
+    // argv entries point into (possibly the middle of) tokens
+    for (int i = 0; i < cmd->argc; i++) {
+        int j = 0;
+        while (j < cmd->ntok &&
+               (cmd->argv[i] < cmd->tokens[j] ||
+                cmd->argv[i] > cmd->tokens[j] + strlen(cmd->tokens[j]))) {
+            j++;
+        }
+
+        if (j == cmd->ntok) {
+            write(STDERR_FILENO, "compile: argument is not a token\n", 33);
+            return -1;
+        }
+
+        uint32_t off = offs[j] + (uint32_t)(cmd->argv[i] - cmd->tokens[j]);
+        if (append_u32(cmds, off) < 0) {
+            return -1;
+        }
+    }
+
+    for (int i = 0; rec.nwords && i < cmd->ntok; i++) {
+        if (!cmd->words[i] || word_literal(cmd->words[i])) {
+            continue;
+        }
+
+        size_t len = save_word(cmd->words[i], NULL);
+        char *dst;
+        if (append_u32(cmds, (uint32_t)i) < 0 ||
+            append_u32(cmds, (uint32_t)len) < 0 ||
+            !(dst = reserve(cmds, len)) || align4(cmds) < 0) {
+            return -1;
+        }
+
+        save_word(cmd->words[i], dst);
+    }
+
+    return 0;
+}
+
+/*
+ * compile_bytecode()
+ *
+ * - Description: compiles a script and writes it to a bytecode file that can
+ * later be mapped and executed without being parsed. The file is written to a
+ * temporary name and renamed into place, so a running shell that has the old
+ * file mapped is unaffected. Returns 0 on success, -1 on failure.
+ *
+ * - Arguments: src: path to the script, out: path of the file to write
+ *
+ * - Usage: 33sh --compile script.sh -o script.33c
+ */
+int compile_bytecode(const char *src, const char *out) {
+    script_t *script;
+    if (!(script = load_script(AT_FDCWD, src))) {
+        return -1;
+    }
+
+    int ret = -1;
+    buf_t pool = {NULL, 0, 0};
+    buf_t cmds = {NULL, 0, 0};
+    bc_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+
+    // source path goes first so the file can be recompiled from it, made
+    // absolute since the file may be run from any directory
+    char *abs;
+    if (!(abs = realpath(src, NULL))) {
+        perror(src);
+        goto done;
+    }
+    hdr.src = 0;
+    int added = append(&pool, abs, strlen(abs) + 1);
+    free(abs);
+    if (added < 0) {
+        goto done;
+    }
+
+    for (int i = 0; i < script_length(script); i++) {
+        if (write_command(script_command(script, i), &pool, &cmds) < 0) {
+            goto done;
+        }
+    }
+
+    if (align4(&pool) < 0 || align4(&cmds) < 0) {
+        goto done;
+    }
+
+    memcpy(hdr.magic, BC_MAGIC, sizeof(hdr.magic));
+    memcpy(hdr.build, build_id, sizeof(hdr.build));
+    hdr.version = BC_VERSION;
+    hdr.ncmds = (uint32_t)script_length(script);
+    hdr.pool_off = sizeof(hdr);
+    hdr.pool_len = (uint32_t)pool.len;
+    hdr.cmds_off = (uint32_t)(sizeof(hdr) + pool.len);
+    hdr.size = sizeof(hdr) + pool.len + cmds.len;
+
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.%d.tmp", out, getpid()) >=
+        (int)sizeof(tmp)) {
+        write(STDERR_FILENO, "compile: output path too long\n", 30);
+        goto done;
+    }
+
+    int fd;
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        perror("compile");
+        goto done;
+    }
+
+    if (write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+        write(fd, pool.data, pool.len) != (ssize_t)pool.len ||
+        write(fd, cmds.data, cmds.len) != (ssize_t)cmds.len) {
+        perror("compile");
+        close(fd);
+        unlink(tmp);
+        goto done;
+    }
+
+    close(fd);
+    if (rename(tmp, out) < 0) {
+        perror("compile");
+        unlink(tmp);
+        goto done;
+    }
+
+    ret = 0;
+
+done:
+    free(pool.data);
+    free(cmds.data);
+    release_script(script);
+    return ret;
+}
+
+/* returns 1 if the file at path starts with the bytecode magic, 0 otherwise */
+int is_bytecode(const char *path) {
+    int fd;
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return 0;
+    }
+
+    char magic[8];
+    ssize_t len = read(fd, magic, sizeof(magic));
+    close(fd);
+
+    return len == (ssize_t)sizeof(magic) && !memcmp(magic, BC_MAGIC, 8);
+}
+
+/* checks that a pool offset lies within the pool */
+static int in_pool(bc_header_t *hdr, uint32_t off) {
+    return off < hdr->pool_len;
+}
+
+/*
+ * read_command()
+ *
+ * - Description: rebuilds a command from its record. Returns the command and
+ * advances *pos past the record, or returns NULL if the record is malformed.
+ *
+ * - Arguments: hdr: the file header, pool: the string pool, pos: current
+ * position in the command records, end: end of the file
+ */
+static command_t *read_command(bc_header_t *hdr, char *pool, const char **pos,
+                               const char *end) {
+    bc_command_t rec;
+    if (*pos > end || (size_t)(end - *pos) < sizeof(rec)) {
+        return NULL;
+    }
+
+    memcpy(&rec, *pos, sizeof(rec));
+    *pos += sizeof(rec);
+
+    // the records after this one must hold ntok + argc offsets
+    if (rec.ntok > 512 || rec.argc > rec.ntok ||
+        (size_t)(end - *pos) < (rec.ntok + rec.argc) * sizeof(uint32_t)) {
+        return NULL;
+    }
+
+    // redirection files are indices into the tokens (0 for none), and the
+    // last entry is the background flag
+    for (int i = 0; i < 3; i++) {
+        if (rec.redir[i] < 0 ||
+            (rec.redir[i] && (uint32_t)rec.redir[i] >= rec.ntok)) {
+            return NULL;
+        }
+    }
+    if (rec.redir[3] != 0 && rec.redir[3] != 1) {
+        return NULL;
+    }
+
+    command_t *cmd = (command_t *)calloc(1, sizeof(command_t));
+    if (!cmd) {
+        perror("calloc");
+        return NULL;
+    }
+
+    cmd->ntok = (int)rec.ntok;
+    cmd->argc = (int)rec.argc;
+    for (int i = 0; i < 4; i++) {
+        cmd->redir[i] = rec.redir[i];
+    }
+
+    cmd->tokens = (char **)calloc(rec.ntok + 1, sizeof(char *));
+    cmd->argv = (char **)calloc(rec.ntok + 1, sizeof(char *));
+    if (!cmd->tokens || !cmd->argv) {
+        perror("calloc");
+        free_command(cmd);
+        return NULL;
+    }
+
+    const uint32_t *offs = (const uint32_t *)(const void *)*pos;
+    for (uint32_t i = 0; i < rec.ntok + rec.argc; i++) {
+        if (!in_pool(hdr, offs[i])) {
+            free_command(cmd);
+            return NULL;
+        }
+
+        if (i < rec.ntok) {
+            cmd->tokens[i] = pool + offs[i];
+        } else {
+            cmd->argv[i - rec.ntok] = pool + offs[i];
+        }
+    }
+
+    *pos += (rec.ntok + rec.argc) * sizeof(uint32_t);
+
+    if (rec.nwords) {
+        if (!(cmd->words = (word_t **)calloc(rec.ntok, sizeof(word_t *)))) {
+            perror("calloc");
+            free_command(cmd);
+            return NULL;
+        }
+
+        cmd->dynamic = 1;
+    }
+
+    for (uint32_t i = 0; i < rec.nwords; i++) {
+        uint32_t hdr_words[2];  // token index, length
+        if ((size_t)(end - *pos) < sizeof(hdr_words)) {
+            free_command(cmd);
+            return NULL;
+        }
+
+        memcpy(hdr_words, *pos, sizeof(hdr_words));
+        *pos += sizeof(hdr_words);
+
+        // the word is padded to 4 bytes, and the padding must be there too
+        size_t padded = ((size_t)hdr_words[1] + 3) / 4 * 4;
+        if (hdr_words[0] >= rec.ntok || cmd->words[hdr_words[0]] ||
+            (size_t)(end - *pos) < padded ||
+            !(cmd->words[hdr_words[0]] = load_word(*pos, hdr_words[1]))) {
+            free_command(cmd);
+            return NULL;
+        }
+
+        *pos += padded;
+    }
+
+    return cmd;
+}
+
+/*
+ * map_bytecode()
+ *
+ * - Description: maps a bytecode file and rebuilds its commands. Returns the
+ * script, or NULL on failure. If the file is valid but was written by another
+ * build of the shell, sets *stale to 1 and copies the source path into src.
+ *
+ * - Arguments: path: the bytecode file, stale: set if the file must be
+ * recompiled, src: buffer for the source path (4096 bytes)
+ */
+static script_t *map_bytecode(const char *path, int *stale, char *src) {
+    int fd;
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        perror(path);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(bc_header_t)) {
+        fprintf(stderr, "%s: not a bytecode file\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = (size_t)st.st_size;
+    char *map = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+
+    bc_header_t hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+    if (memcmp(hdr.magic, BC_MAGIC, 8)) {
+        fprintf(stderr, "%s: not a bytecode file\n", path);
+        munmap(map, size);
+        return NULL;
+    }
+
+    if (hdr.version != BC_VERSION ||
+        memcmp(hdr.build, build_id, sizeof(build_id))) {
+        // written by another build: find the source path to recompile from
+        size_t off = (size_t)hdr.pool_off + hdr.src;
+        const char *nul = off < size ? memchr(map + off, '\0', size - off) : 0;
+        if (nul && nul - (map + off) < 4096) {
+            strcpy(src, map + off);
+            *stale = 1;
+        } else {
+            fprintf(stderr, "%s: corrupt bytecode file\n", path);
+        }
+
+        munmap(map, size);
+        return NULL;
+    }
+
+    // the pool ends in a NUL, so every string in it is terminated
+    char *pool = map + hdr.pool_off;
+    int valid = hdr.size == size && hdr.pool_off == sizeof(hdr) &&
+                hdr.pool_len > 0 &&
+                hdr.cmds_off == (uint64_t)hdr.pool_off + hdr.pool_len &&
+                hdr.cmds_off <= size && !pool[hdr.pool_len - 1] &&
+                hdr.ncmds <= (size - hdr.cmds_off) / sizeof(bc_command_t);
+
+    command_t **cmds = NULL;
+    if (valid && hdr.ncmds &&
+        !(cmds = (command_t **)calloc(hdr.ncmds, sizeof(command_t *)))) {
+        perror("calloc");
+        valid = 0;
+    }
+
+    const char *pos = map + hdr.cmds_off;
+    for (uint32_t i = 0; valid && i < hdr.ncmds; i++) {
+        // (padding to 4 bytes can step past the end of a truncated file)
+        pos = map + ((size_t)(pos - map) + 3) / 4 * 4;
+        if (pos > map + size ||
+            !(cmds[i] = read_command(&hdr, pool, &pos, map + size))) {
+            valid = 0;
+        }
+    }
+
+    script_t *script = NULL;
+    if (valid && !(script = make_script(cmds, (int)hdr.ncmds, map, size))) {
+        valid = 0;
+    }
+
+    if (!valid) {
+        fprintf(stderr, "%s: corrupt bytecode file\n", path);
+        for (uint32_t i = 0; cmds && i < hdr.ncmds; i++) {
+            free_command(cmds[i]);
+        }
+
+        free(cmds);
+        munmap(map, size);
+        return NULL;
+    }
+
+    return script;
+}
+
+/*
+ * load_bytecode()
+ *
+ * - Description: maps a bytecode file and returns its script. The commands'
+ * strings point straight into the mapping, so nothing is lexed or parsed. If
+ * the file was written by a different build of the shell, it is recompiled
+ * from the script it was compiled from and rewritten; if it cannot be
+ * rewritten, the script is compiled in memory instead. Returns NULL on failure.
+ *
+ * - Arguments: path: path to the bytecode file
+ *
+ * - Usage: the returned script must be released with release_script().
+ */
+script_t *load_bytecode(const char *path) {
+    int stale = 0;
+    char src[4096];
+    script_t *script;
+
+    if ((script = map_bytecode(path, &stale, src)) || !stale) {
+        return script;
+    }
+
+    if (compile_bytecode(src, path) < 0 ||
+        !(script = map_bytecode(path, &stale, src))) {
+        return load_script(AT_FDCWD, src);
+    }
+
+    return script;
+}
@@ -0,0 +1,20 @@
+#ifndef BYTECODE_H_
+#define BYTECODE_H_
+
+#include "script.h"
+
+/*
+ * compiles the script at src and writes it to out as a bytecode file.
+ * returns 0 on success, -1 (after printing an error) on failure
+ */
+int compile_bytecode(const char *src, const char *out);
+/* returns 1 if the file at path starts with the bytecode magic, 0 otherwise */
+int is_bytecode(const char *path);
+/*
+ * maps the bytecode file at path and returns the script it contains. files
+ * written by a different build of the shell are recompiled from their source.
+ * returns NULL (after printing an error) on failure
+ */
+script_t *load_bytecode(const char *path);
+
+#endif  // BYTECODE_H_
@@ -0,0 +1,222 @@
+#define _GNU_SOURCE  // memfd_create()
+#include "./capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "./events.h"
+
+/*
+ * Each captured job writes to a pipe, which the event loop drains into a
+ * ring buffer: a memfd of CAPTURE_SIZE bytes mapped into the shell. Nothing
+ * is ever copied out of the way; total counts every byte ever written, so
+ * byte n of the output lives at n % CAPTURE_SIZE for as long as it is kept,
+ * and readers (joblog -f) just remember how far they got. A job that is not
+ * being looked at costs one read() per pipe buffer of output, and the
+ * shell's memory stays bounded no matter how much its jobs print.
+ */
+struct capture {
+    job_list_t *jobs;
+    int jid;
+    int fd;  // read end of the job's pipe, -1 once the job has closed it
+    int memfd;
+    char *ring;
+    uint64_t total;  // bytes written so far
+};
+
+static capture_t *captures[MAX_CAPTURES];
+static int ncaptures = 0;
+
+/* frees a capture, which must no longer be in captures */
+static void free_capture(capture_t *cap) {
+    if (cap->fd >= 0) {
+        unwatch_fd(cap->fd);
+        close(cap->fd);
+    }
+    munmap(cap->ring, CAPTURE_SIZE);
+    close(cap->memfd);
+    free(cap);
+}
+
+/*
+ * drain()
+ *
+ * - Description: event callback for a captured job's pipe: reads everything
+ * available straight into the ring buffer, and stops watching the pipe at
+ * end of file (i.e. once the job and anything it started have exited).
+ */
+static void drain(int fd, void *arg) {
+    capture_t *cap = (capture_t *)arg;
+    while (1) {
+        size_t off = cap->total % CAPTURE_SIZE;
+        ssize_t n = read(fd, cap->ring + off, CAPTURE_SIZE - off);
+        if (n > 0) {
+            cap->total += (uint64_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            return;
+        } else {  // end of file, or an error
+            unwatch_fd(fd);
+            close(fd);
+            cap->fd = -1;
+            return;
+        }
+    }
+}
+
+/*
+ * make_room()
+ *
+ * - Description: makes sure there is a free slot in captures, dropping the
+ * oldest capture of a finished job if need be. Returns 0, or -1 if every
+ * slot holds a job that is still running.
+ */
+static int make_room() {
+    if (ncaptures < MAX_CAPTURES) {
+        return 0;
+    }
+
+    for (int i = 0; i < ncaptures; i++) {
+        if (captures[i]->fd < 0) {
+            free_capture(captures[i]);
+            for (; i < ncaptures - 1; i++) {  // keep them oldest first
+                captures[i] = captures[i + 1];
+            }
+            ncaptures--;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * start_capture()
+ *
+ * - Description: starts capturing a job's output. Returns 0, or -1 (after
+ * printing an error) on failure, in which case fd is closed and the job's
+ * output is lost.
+ *
+ * - Arguments: job_list: the list the job is in, jid: its job id, fd: read
+ * end of the pipe the job's standard output and error go to (the capture
+ * takes ownership of it)
+ *
+ * - Usage: called by the shell right after launching a captured job, once
+ * the write end of the pipe has been closed in the shell
+ */
+int start_capture(job_list_t *job_list, int jid, int fd) {
+    if (make_room() < 0) {
+        fprintf(stderr, "capture: too many jobs\n");
+        close(fd);
+        return -1;
+    }
+
+    capture_t *cap = (capture_t *)malloc(sizeof(capture_t));
+    if (!cap) {
+        perror("capture");
+        close(fd);
+        return -1;
+    }
+    cap->jobs = job_list;
+    cap->jid = jid;
+    cap->fd = fd;
+    cap->total = 0;
+    cap->ring = MAP_FAILED;
+
+    if ((cap->memfd = memfd_create("33sh-capture", MFD_CLOEXEC)) < 0 ||
+        ftruncate(cap->memfd, CAPTURE_SIZE) < 0 ||
+        (cap->ring = (char *)mmap(NULL, CAPTURE_SIZE, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED, cap->memfd, 0)) == MAP_FAILED) {
+        perror("capture");
+        if (cap->memfd >= 0) {
+            close(cap->memfd);
+        }
+        close(fd);
+        free(cap);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if (watch_fd(fd, drain, cap) < 0) {
+        cap->fd = -1;
+        close(fd);
+        free_capture(cap);
+        return -1;
+    }
+
+    captures[ncaptures++] = cap;
+    return 0;
+}
+
+/* returns the capture of job jid of a job list, or NULL if there is none */
+capture_t *find_capture(job_list_t *job_list, int jid) {
+    for (int i = 0; i < ncaptures; i++) {
+        if (captures[i]->jobs == job_list && captures[i]->jid == jid) {
+            return captures[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* returns 1 while the job may still write to its capture */
+int capture_live(capture_t *cap) { return cap->fd >= 0; }
+
+/*
+ * write_capture()
+ *
+ * - Description: writes the captured output from offset pos up to what has
+ * been drained so far to fd. Output that has already been overwritten is
+ * skipped, along with the rest of the line it ends in. Returns the offset to
+ * pass next time, to write only new output.
+ *
+ * - Arguments: cap: the capture, fd: where to write, pos: offset (in bytes
+ * since the job started) to start at
+ *
+ * - Usage: pos = write_capture(cap, STDOUT_FILENO, 0);
+ *          ...
+ *          pos = write_capture(cap, STDOUT_FILENO, pos);
+ */
+uint64_t write_capture(capture_t *cap, int fd, uint64_t pos) {
+    if (cap->total > CAPTURE_SIZE && pos < cap->total - CAPTURE_SIZE) {
+        // start at the first whole line still kept
+        pos = cap->total - CAPTURE_SIZE;
+        while (pos < cap->total && cap->ring[pos++ % CAPTURE_SIZE] != '\n') {
+        }
+    }
+
+    while (pos < cap->total) {
+        size_t off = pos % CAPTURE_SIZE;
+        size_t len = CAPTURE_SIZE - off;  // up to the end of the ring
+        if (len > cap->total - pos) {
+            len = (size_t)(cap->total - pos);
+        }
+
+        ssize_t n = write(fd, cap->ring + off, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {  // (i.e. a closed pipe) give up on the rest
+            return cap->total;
+        }
+        pos += (uint64_t)n;
+    }
+
+    return pos;
+}
+
+/* drops (and frees) every capture of jobs of a job list */
+void drop_captures(job_list_t *job_list) {
+    int kept = 0;
+    for (int i = 0; i < ncaptures; i++) {
+        if (captures[i]->jobs == job_list) {
+            free_capture(captures[i]);
+        } else {
+            captures[kept++] = captures[i];
+        }
+    }
+
+    ncaptures = kept;
+}
@@ -0,0 +1,35 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdint.h>
+#include "./jobs.h"
+
+// bytes of output kept for each captured job (the most recent ones)
+#define CAPTURE_SIZE (64 * 1024)
+// most captures kept at once (those of finished jobs are dropped first)
+#define MAX_CAPTURES 256
+
+/* the output of one background job, kept in a ring buffer */
+typedef struct capture capture_t;
+
+/*
+ * starts capturing the output of job jid of a job list: fd is the read end of
+ * the pipe the job writes its standard output and error to, which is drained
+ * by the event loop (see events.h). the capture takes ownership of fd.
+ * returns 0, or -1 (after printing an error, and closing fd) on failure
+ */
+int start_capture(job_list_t *job_list, int jid, int fd);
+/* returns the capture of job jid of a job list, or NULL if there is none */
+capture_t *find_capture(job_list_t *job_list, int jid);
+/* returns 1 while the job may still write to its capture, 0 once it is done */
+int capture_live(capture_t *cap);
+/*
+ * writes the output captured from offset pos on to fd (starting at the
+ * oldest output still kept if pos is older), returns the offset to continue
+ * from, i.e. pos = write_capture(cap, STDOUT_FILENO, 0) dumps everything
+ */
+uint64_t write_capture(capture_t *cap, int fd, uint64_t pos);
+/* drops (and frees) every capture of jobs of a job list */
+void drop_captures(job_list_t *job_list);
+
+#endif  // CAPTURE_H_
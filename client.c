@@ -0,0 +1,185 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "server.h"
+
+/*
+ * run_request()
+ *
+ * - Description: sends one command line over a connection and waits for its
+ * exit status. Returns 0, or -1 (after printing an error) if the server went
+ * away.
+ *
+ * - Arguments: sock: connection to the server, line: the command line, len:
+ * its length, status: where to store the exit status
+ */
+int run_request(int sock, const char *line, size_t len, int *status) {
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    if (send_request(sock, line, len, fds) < 0) {
+        return -1;
+    } else if (recv_status(sock, status) < 0) {
+        write(STDERR_FILENO, "33sh-client: server closed the connection\n", 42);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * ends_session()
+ *
+ * - Description: returns 1 if line is the exit builtin, after which the
+ * server ends the session, 0 otherwise.
+ *
+ * - Arguments: line: a NUL-terminated command line
+ */
+int ends_session(const char *line) {
+    while (isspace((unsigned char)*line)) {
+        line++;
+    }
+
+    if (strncmp(line, "exit", 4)) {
+        return 0;
+    }
+
+    line += 4;
+    while (isspace((unsigned char)*line)) {
+        line++;
+    }
+
+    return !*line;
+}
+
+/*
+ * run_session()
+ *
+ * - Description: sends every line read from standard input over a single
+ * connection, one after the other, so that a 33sh --sessions server runs
+ * them all in one session, until a line ends the session. Returns the exit
+ * status of the last command.
+ *
+ * - Arguments: sock: connection to the server
+ */
+int run_session(int sock) {
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int status = 0;
+    while ((len = getline(&line, &size, stdin)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+
+        if (run_request(sock, line, (size_t)len, &status) < 0) {
+            status = 1;
+            break;
+        } else if (ends_session(line)) {
+            break;
+        }
+    }
+
+    free(line);
+    return status;
+}
+
+/*
+ * quote_word()
+ *
+ * - Description: appends word to line (of size bytes, len used so far) in
+ * single quotes, each quote in it written as '\'', so that the server's
+ * lexer gives it back as one argument, as is. Returns the new length, or 0
+ * if it does not fit.
+ *
+ * - Arguments: line: the line being built, size: its size, len: its length,
+ * word: the word to add
+ */
+size_t quote_word(char *line, size_t size, size_t len, const char *word) {
+    if (len + 2 >= size) {
+        return 0;
+    }
+
+    line[len++] = '\'';
+    for (; *word; word++) {
+        size_t n = *word == '\'' ? 4 : 1;
+        if (len + n + 1 >= size) {
+            return 0;
+        }
+
+        memcpy(line + len, *word == '\'' ? "'\\''" : word, n);
+        len += n;
+    }
+    line[len++] = '\'';
+
+    return len;
+}
+
+/*
+ * main()
+ *
+ * - Description: sends a command line to a shell started with
+ * 33sh --server (or --sessions) and waits for it to finish. The command runs
+ * in the server with this process's standard input, output and error, and
+ * the client exits with the command's exit status. Without a command, sends
+ * each line of standard input in turn, as one session.
+ *
+ * - Arguments: argv[1]: path of the server's socket, argv[2...]: the command
+ * line; a single argument is sent as the line itself, several are each
+ * quoted (see quote_word()) and joined with spaces, so that the command gets
+ * them as they are
+ *
+ * - Usage: 33sh-client /tmp/33sh.sock /bin/sh -c 'exit 3' (exits with 3)
+ *          33sh-client /tmp/33sh.sock '/bin/ls -l > listing'
+ *          33sh-client /tmp/33sh.sock < commands
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        write(STDERR_FILENO, "usage: 33sh-client socket [command...]\n", 39);
+        return 2;
+    } else if (argc == 2) {
+        int sock;
+        if ((sock = connect_server(argv[1])) < 0) {
+            return 1;
+        }
+
+        int status = run_session(sock);
+        close(sock);
+        return status;
+    }
+
+    // a single argument is the line, several are quoted and joined into one
+    char line[1024];
+    size_t len = 0;
+    if (argc == 3) {
+        len = strlen(argv[2]);
+        if (len >= sizeof(line)) {
+            write(STDERR_FILENO, "33sh-client: line too long\n", 27);
+            return 2;
+        }
+        memcpy(line, argv[2], len + 1);
+    }
+    for (int i = 2; argc > 3 && i < argc; i++) {
+        if (i > 2) {
+            line[len++] = ' ';
+        }
+        if (!(len = quote_word(line, sizeof(line), len, argv[i]))) {
+            write(STDERR_FILENO, "33sh-client: line too long\n", 27);
+            return 2;
+        }
+    }
+    line[len] = '\0';
+
+    int sock;
+    if ((sock = connect_server(argv[1])) < 0) {
+        return 1;
+    }
+
+    int status;
+    if (run_request(sock, line, len, &status) < 0) {
+        status = 1;
+    }
+
+    close(sock);
+    return status;
+}
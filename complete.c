@@ -0,0 +1,462 @@
+#include "./complete.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "./dirs.h"
+
+/*
+ * Command names are completed from a trie of every executable in the PATH
+ * directories, built by a background thread when the interactive shell
+ * starts, so the first prompt never waits for it. The trie remembers the
+ * mtime of each directory; completing a command checks them (a stat() per
+ * directory) and rebuilds the trie in the background if one has changed,
+ * meanwhile completing from the old one. Before the first trie is ready, the
+ * directories are scanned on the spot instead. The trie is only touched with
+ * lock held, so the thread can swap in a new one at any time.
+ */
+typedef struct node {
+    struct node *child;  // first child, children sorted by c
+    struct node *next;   // next sibling
+    char *path;          // full path, if a command ends here
+    char c;
+} node_t;
+
+typedef struct {
+    node_t root;
+    char *dirs;  // copy of PATH, with ':' replaced by NULs
+    int ndirs;
+    struct timespec *mtimes;  // of each directory when it was read
+} trie_t;
+
+// names completed besides executables
+static const char *builtins[] = {
+    "bg",       "cd",      "dirs",  "exit",   "export", "fds",    "fg",
+    "head",     "history", "jobs",  "joblog", "kill",   "ln",     "ls",
+    "onchange", "popd",    "pushd", "rm",     "set",    "source", "spawn",
+    "tail",     "unset",   "wait",  "watch",  "wc"};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static trie_t *trie = NULL;  // the index once built
+static int building = 0;     // set while the thread runs
+static char *path_copy = NULL;
+
+/* returns the directories of a copy of PATH one after the other */
+static const char *next_dir(const char *dirs, int *i, int ndirs) {
+    if (*i >= ndirs) {
+        return NULL;
+    }
+
+    const char *dir = dirs;
+    for (int k = 0; k < *i; k++) {
+        dir += strlen(dir) + 1;
+    }
+    (*i)++;
+    return *dir ? dir : ".";  // an empty entry means the current directory
+}
+
+/* splits a copy of PATH into NUL-separated directories, returns how many */
+static int split_path(char *dirs) {
+    int n = 1;
+    for (char *p = dirs; *p; p++) {
+        if (*p == ':') {
+            *p = '\0';
+            n++;
+        }
+    }
+    return n;
+}
+
+/* returns 1 if name in directory dirfd is an executable file */
+static int is_command(int dirfd, const char *name, unsigned char type) {
+    if (type == DT_DIR || faccessat(dirfd, name, X_OK, 0) < 0) {
+        return 0;
+    } else if (type == DT_REG) {
+        return 1;
+    }
+
+    struct stat st;
+    return fstatat(dirfd, name, &st, 0) == 0 && S_ISREG(st.st_mode);
+}
+
+/* adds a command (and its full path) to a trie, unless a directory earlier
+ * in PATH had it */
+static void insert(node_t *node, const char *name, const char *path) {
+    for (; *name; name++) {
+        node_t **link = &node->child;
+        while (*link && (*link)->c < *name) {
+            link = &(*link)->next;
+        }
+
+        if (!*link || (*link)->c != *name) {
+            node_t *new_node = (node_t *)calloc(1, sizeof(node_t));
+            if (!new_node) {
+                return;
+            }
+            new_node->c = *name;
+            new_node->next = *link;
+            *link = new_node;
+        }
+        node = *link;
+    }
+
+    if (!node->path) {
+        node->path = strdup(path);
+    }
+}
+
+/* frees the nodes below node */
+static void free_nodes(node_t *node) {
+    node_t *child = node->child;
+    while (child) {
+        node_t *next = child->next;
+        free_nodes(child);
+        free(child->path);
+        free(child);
+        child = next;
+    }
+}
+
+/* frees a trie */
+static void free_trie(trie_t *t) {
+    if (t) {
+        free_nodes(&t->root);
+        free(t->dirs);
+        free(t->mtimes);
+        free(t);
+    }
+}
+
+// what the callbacks of list_dir() need
+typedef struct {
+    int dirfd;
+    const char *dir;
+    trie_t *trie;      // for build()
+    const char *word;  // for scan_path() and complete_file()
+    size_t len;
+    matches_t *m;
+} scan_t;
+
+/* adds a match, with copies of name and path (which may be NULL) */
+static void add_match(matches_t *m, const char *name, size_t len,
+                      const char *path) {
+    if (m->n == m->cap) {
+        int cap = m->cap ? m->cap * 2 : 16;
+        match_t *items =
+            (match_t *)realloc(m->items, (size_t)cap * sizeof(match_t));
+        if (!items) {
+            return;
+        }
+        m->items = items;
+        m->cap = cap;
+    }
+
+    char *copy = (char *)malloc(len + 1);
+    if (!copy) {
+        return;
+    }
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+
+    m->items[m->n].name = copy;
+    m->items[m->n].path = path ? strdup(path) : NULL;
+    m->n++;
+}
+
+/* list_dir() callback for build(): adds commands to the trie */
+static void add_entry(const char *name, unsigned char type, void *arg) {
+    scan_t *s = (scan_t *)arg;
+    if (is_command(s->dirfd, name, type)) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", s->dir, name);
+        insert(&s->trie->root, name, path);
+    }
+}
+
+/*
+ * build()
+ *
+ * - Description: the background thread: reads every PATH directory into a
+ * new trie and swaps it in for the old one.
+ *
+ * - Arguments: arg: a copy of PATH, owned by the thread
+ */
+static void *build(void *arg) {
+    trie_t *t = (trie_t *)calloc(1, sizeof(trie_t));
+    if (!t) {
+        free(arg);
+        pthread_mutex_lock(&lock);
+        building = 0;
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+
+    t->dirs = (char *)arg;
+    t->ndirs = split_path(t->dirs);
+    t->mtimes =
+        (struct timespec *)calloc((size_t)t->ndirs, sizeof(struct timespec));
+
+    const char *dir;
+    for (int i = 0; (dir = next_dir(t->dirs, &i, t->ndirs));) {
+        struct stat st;
+        scan_t s = {-1, dir, t, NULL, 0, NULL};
+        if ((s.dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+            continue;
+        }
+        if (t->mtimes && fstat(s.dirfd, &st) == 0) {
+            t->mtimes[i - 1] = st.st_mtim;
+        }
+
+        list_dir(s.dirfd, add_entry, &s);
+        close(s.dirfd);
+    }
+
+    pthread_mutex_lock(&lock);
+    trie_t *old = trie;
+    trie = t;
+    building = 0;
+    pthread_mutex_unlock(&lock);
+
+    free_trie(old);
+    return NULL;
+}
+
+/* starts the thread (with lock held, and building not set) */
+static void start_build(const char *path) {
+    char *copy = strdup(path);
+    pthread_t thread;
+    if (!copy) {
+        return;
+    }
+
+    building = 1;
+    if (pthread_create(&thread, NULL, build, copy) != 0) {
+        free(copy);
+        building = 0;
+        return;
+    }
+    pthread_detach(thread);
+}
+
+/*
+ * start_completion()
+ *
+ * - Description: starts indexing the commands in the PATH directories in
+ * the background.
+ *
+ * - Arguments: path: the value of PATH (NULL for none)
+ *
+ * - Usage: called once, when the interactive shell starts
+ */
+void start_completion(const char *path) {
+    pthread_mutex_lock(&lock);
+    free(path_copy);
+    path_copy = path ? strdup(path) : NULL;
+    if (path_copy && !building) {
+        start_build(path_copy);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* rebuilds the trie (in the background) if a directory has changed; must be
+ * called with lock held */
+static void check_stale() {
+    if (building || !trie || !trie->mtimes) {
+        return;
+    }
+
+    const char *dir;
+    for (int i = 0; (dir = next_dir(trie->dirs, &i, trie->ndirs));) {
+        struct stat st;
+        struct timespec *then = &trie->mtimes[i - 1];
+        if (stat(dir, &st) == 0 && (st.st_mtim.tv_sec != then->tv_sec ||
+                                    st.st_mtim.tv_nsec != then->tv_nsec)) {
+            start_build(path_copy);
+            return;
+        }
+    }
+}
+
+/* adds every command at or below node, whose name so far is in name */
+static void collect(node_t *node, char *name, size_t len, matches_t *m) {
+    if (node->path) {
+        add_match(m, name, len, node->path);
+    }
+
+    for (node_t *child = node->child; child && len < 4095;
+         child = child->next) {
+        name[len] = child->c;
+        collect(child, name, len + 1, m);
+    }
+}
+
+/* list_dir() callback for scan_path(): adds commands matching the word */
+static void add_command(const char *name, unsigned char type, void *arg) {
+    scan_t *s = (scan_t *)arg;
+    if (!strncmp(name, s->word, s->len) && is_command(s->dirfd, name, type)) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", s->dir, name);
+        add_match(s->m, name, strlen(name), path);
+    }
+}
+
+/* completes a command by reading the PATH directories, for before the trie
+ * is ready; matches in later directories are dropped as duplicates */
+static void scan_path(const char *path, const char *word, size_t len,
+                      matches_t *m) {
+    char *dirs = strdup(path);
+    if (!dirs) {
+        return;
+    }
+
+    int ndirs = split_path(dirs);
+    const char *dir;
+    for (int i = 0; (dir = next_dir(dirs, &i, ndirs));) {
+        scan_t s = {-1, dir, NULL, word, len, m};
+        if ((s.dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+            list_dir(s.dirfd, add_command, &s);
+            close(s.dirfd);
+        }
+    }
+
+    free(dirs);
+}
+
+/* orders matches by name, builtins (without a path) first */
+static int compare_matches(const void *a, const void *b) {
+    const match_t *x = (const match_t *)a, *y = (const match_t *)b;
+    int c = strcmp(x->name, y->name);
+    return c ? c : (x->path != NULL) - (y->path != NULL);
+}
+
+/* sorts matches and drops repeated names (keeping the first) */
+static void sort_matches(matches_t *m) {
+    qsort(m->items, (size_t)m->n, sizeof(match_t), compare_matches);
+
+    int kept = 0;
+    for (int i = 0; i < m->n; i++) {
+        if (kept && !strcmp(m->items[kept - 1].name, m->items[i].name)) {
+            free(m->items[i].name);
+            free(m->items[i].path);
+        } else {
+            m->items[kept++] = m->items[i];
+        }
+    }
+    m->n = kept;
+}
+
+/*
+ * complete_command()
+ *
+ * - Description: finds the builtins and PATH commands whose names start
+ * with word. Commands come with their full path, which is what the shell
+ * needs to run them.
+ *
+ * - Arguments: word: the start of the name, len: its length, m: where to add
+ * the completions (initially all zero)
+ */
+void complete_command(const char *word, size_t len, matches_t *m) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (!strncmp(builtins[i], word, len)) {
+            add_match(m, builtins[i], strlen(builtins[i]), NULL);
+        }
+    }
+
+    pthread_mutex_lock(&lock);
+    check_stale();
+    if (trie) {
+        node_t *node = &trie->root;
+        for (size_t i = 0; node && i < len; i++) {
+            node = node->child;
+            while (node && node->c != word[i]) {
+                node = node->next;
+            }
+        }
+
+        if (node && len < 4096) {
+            char name[4096];
+            memcpy(name, word, len);
+            collect(node, name, len, m);
+        }
+        pthread_mutex_unlock(&lock);
+    } else {
+        // not indexed yet: scan (without holding up the thread)
+        char *path = path_copy ? strdup(path_copy) : NULL;
+        pthread_mutex_unlock(&lock);
+        if (path) {
+            scan_path(path, word, len, m);
+            free(path);
+        }
+    }
+
+    sort_matches(m);
+}
+
+/* list_dir() callback for complete_file() */
+static void add_file(const char *name, unsigned char type, void *arg) {
+    scan_t *s = (scan_t *)arg;
+    if (strncmp(name, s->word, s->len) || (name[0] == '.' && !s->len)) {
+        return;  // (hidden files only when asked for with a leading '.')
+    }
+
+    struct stat st;
+    int dir = type == DT_DIR ||
+              ((type == DT_UNKNOWN || type == DT_LNK) &&
+               fstatat(s->dirfd, name, &st, 0) == 0 && S_ISDIR(st.st_mode));
+
+    // the match is the whole word: the directory part, the name, and a '/'
+    char full[4096];
+    int n =
+        snprintf(full, sizeof(full), "%s%s%s", s->dir, name, dir ? "/" : "");
+    if (n > 0 && (size_t)n < sizeof(full)) {
+        add_match(s->m, full, (size_t)n, NULL);
+    }
+}
+
+/*
+ * complete_file()
+ *
+ * - Description: finds the files whose paths start with word, reading the
+ * directory with getdents64() (see dirs.c). Directories end in '/'.
+ *
+ * - Arguments: word: the start of the path, len: its length, m: where to add
+ * the completions (initially all zero)
+ */
+void complete_file(const char *word, size_t len, matches_t *m) {
+    // split the word into its directory part (up to the last '/') and name
+    size_t base = len;
+    while (base > 0 && word[base - 1] != '/') {
+        base--;
+    }
+
+    char dir[4096];
+    if (base >= sizeof(dir)) {
+        return;
+    }
+    memcpy(dir, word, base);
+    dir[base] = '\0';
+
+    scan_t s = {-1, dir, NULL, word + base, len - base, m};
+    if ((s.dirfd = open(base ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) <
+        0) {
+        return;
+    }
+
+    list_dir(s.dirfd, add_file, &s);
+    close(s.dirfd);
+    sort_matches(m);
+}
+
+/* frees the completions in m */
+void free_matches(matches_t *m) {
+    for (int i = 0; i < m->n; i++) {
+        free(m->items[i].name);
+        free(m->items[i].path);
+    }
+    free(m->items);
+    m->items = NULL;
+    m->n = m->cap = 0;
+}
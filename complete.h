@@ -0,0 +1,37 @@
+#ifndef COMPLETE_H_
+#define COMPLETE_H_
+
+#include <stddef.h>
+
+/* one completion: name is what the word completes to, path (if not NULL)
+ * what to put in the line instead when name is the only completion */
+typedef struct {
+    char *name;
+    char *path;
+} match_t;
+
+/* completions of a word, sorted by name without duplicates */
+typedef struct {
+    match_t *items;
+    int n;
+    int cap;
+} matches_t;
+
+/*
+ * starts indexing the executables in the directories of path (i.e. $PATH)
+ * in a background thread, for complete_command()
+ */
+void start_completion(const char *path);
+/*
+ * completes a command name (of length len): builtins, and executables in the
+ * PATH directories, whose path is filled in (since the shell does not search
+ * PATH itself). never waits for the index: until it is ready, the PATH
+ * directories are scanned on the spot
+ */
+void complete_command(const char *word, size_t len, matches_t *m);
+/* completes a filename (of length len), adding '/' to directories */
+void complete_file(const char *word, size_t len, matches_t *m);
+/* frees the completions in m */
+void free_matches(matches_t *m);
+
+#endif  // COMPLETE_H_
@@ -0,0 +1,419 @@
+#define _GNU_SOURCE  // O_PATH
+#include "./dirs.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "./vars.h"
+
+// bytes of directory entries fetched per getdents64() call
+#define DENTS_BUF 32768
+
+// flags of the descriptors kept for directories
+#define DIR_FLAGS (O_PATH | O_DIRECTORY | O_CLOEXEC)
+
+/*
+ * PWD is kept logically, like other shells do: cd works out the new path from
+ * PWD and its argument instead of asking the kernel with getcwd(), which
+ * walks up every component of the path (slow over NFS, for deep
+ * directories). Relative directories are opened relative to the current one,
+ * so only their own components are resolved; only paths with .. in them
+ * (which go up along PWD, not along the physical directory) and absolute
+ * ones are resolved from the root. Directories on the stack, and the
+ * previous one (for cd -), are kept open with O_PATH, so popd, pushd without
+ * arguments and cd - go back with fchdir() and resolve nothing.
+ */
+static dirstack_t shell_dirs = {{-1, NULL}, NULL, 0, 0};
+dirstack_t *dir_stack = &shell_dirs;
+
+/* the records getdents64() fills its buffer with (see getdents64(2)) */
+struct dirent64_rec {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/*
+ * list_dir()
+ *
+ * - Description: calls fn for every entry of a directory. Entries are
+ * fetched straight from the kernel with getdents64(), many per call, without
+ * the extra copying and per-entry bookkeeping of readdir(). Returns 0, or -1
+ * on a read error (after calling fn for the entries read before it).
+ *
+ * - Arguments: fd: an open directory (read from its current offset), fn,
+ * arg: the callback and its argument
+ */
+int list_dir(int fd, dirent_fn fn, void *arg) {
+    // (aligned for the records' 64-bit fields)
+    uint64_t buf[DENTS_BUF / sizeof(uint64_t)];
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        for (long off = 0; off < n;) {
+            struct dirent64_rec *d = (struct dirent64_rec *)((char *)buf + off);
+            off += d->d_reclen;
+
+            const char *name = d->d_name;
+            if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) {
+                continue;
+            }
+            fn(name, d->d_type, arg);
+        }
+    }
+
+    return n < 0 ? -1 : 0;
+}
+
+/*
+ * init_dirs()
+ *
+ * - Description: makes sure PWD names the current directory, which is when
+ * getcwd() is called, once at startup, if it is missing or stale.
+ */
+void init_dirs(void) {
+    const char *pwd = var_get(shell_vars, "PWD");
+    struct stat named, cur;
+    if (pwd && pwd[0] == '/' && !stat(pwd, &named) && !stat(".", &cur) &&
+        named.st_dev == cur.st_dev && named.st_ino == cur.st_ino) {
+        return;
+    }
+
+    char buf[4096];
+    if (getcwd(buf, sizeof(buf))) {
+        var_export(shell_vars, "PWD", buf);
+    }
+}
+
+/* creates an empty directory stack */
+dirstack_t *new_dirstack(void) {
+    dirstack_t *dirs = (dirstack_t *)calloc(1, sizeof(dirstack_t));
+    if (!dirs) {
+        perror("dirs");
+        return NULL;
+    }
+    dirs->prev.fd = -1;
+    return dirs;
+}
+
+/* closes and frees a kept directory */
+static void drop_dir(dir_t *dir) {
+    if (dir->fd >= 0) {
+        close(dir->fd);
+    }
+    free(dir->path);
+    dir->fd = -1;
+    dir->path = NULL;
+}
+
+/* frees a directory stack */
+void free_dirstack(dirstack_t *dirs) {
+    if (!dirs) {
+        return;
+    }
+    drop_dir(&dirs->prev);
+    for (int i = 0; i < dirs->n; i++) {
+        drop_dir(&dirs->stack[i]);
+    }
+    free(dirs->stack);
+    free(dirs);
+}
+
+/*
+ * logical_path()
+ *
+ * - Description: returns (in a new string, or NULL on failure) the absolute
+ * path of path taken from directory base (if it is relative), with . and ..
+ * components and repeated slashes removed without looking at the
+ * filesystem, i.e. .. removes the component before it.
+ *
+ * - Arguments: base: an absolute path, path: the path to add to it
+ */
+static char *logical_path(const char *base, const char *path) {
+    const char *parts[2] = {path[0] == '/' ? "" : base, path};
+    char *out = (char *)malloc(strlen(parts[0]) + strlen(path) + 2);
+    if (!out) {
+        return NULL;
+    }
+
+    size_t n = 0;
+    for (int i = 0; i < 2; i++) {
+        for (const char *p = parts[i]; *p;) {
+            const char *end = strchr(p, '/');
+            size_t len = end ? (size_t)(end - p) : strlen(p);
+            if (len == 2 && p[0] == '.' && p[1] == '.') {
+                while (n > 0 && out[--n] != '/') {
+                }
+            } else if (len && !(len == 1 && p[0] == '.')) {
+                out[n++] = '/';
+                memcpy(out + n, p, len);
+                n += len;
+            }
+            p += end ? len + 1 : len;
+        }
+    }
+
+    if (!n) {
+        out[n++] = '/';
+    }
+    out[n] = '\0';
+    return out;
+}
+
+/* true if a path has a .. component */
+static int has_dotdot(const char *path) {
+    for (const char *p = path; (p = strstr(p, "..")); p += 2) {
+        if ((p == path || p[-1] == '/') && (!p[2] || p[2] == '/')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* opens directory path (relative to cwd) into *dir, see above */
+static int try_dir(const char *path, int cwd, dir_t *dir) {
+    const char *pwd = var_get(shell_vars, "PWD");
+    char *logical = NULL;
+    if (path[0] == '/' || (pwd && pwd[0] == '/')) {
+        logical = logical_path(pwd, path);
+    }
+
+    if (logical && (path[0] == '/' || has_dotdot(path))) {
+        dir->fd = open(logical, DIR_FLAGS);
+    } else {
+        dir->fd = openat(cwd, path, DIR_FLAGS);
+    }
+
+    if (dir->fd < 0) {
+        free(logical);
+        return -1;
+    }
+    dir->path = logical;
+    return 0;
+}
+
+/*
+ * find_dir()
+ *
+ * - Description: opens the directory named by the argument of cd or pushd.
+ * Unless it is absolute or starts with . or .., it is first looked for in
+ * each directory of CDPATH (an empty entry meaning the current directory),
+ * then taken as it is. Returns 0, or -1 (with errno set) if there is no such
+ * directory.
+ *
+ * - Arguments: arg: the argument, cwd: the directory relative paths are
+ * taken from, dir: set to the directory found, found: set to whether it was
+ * found through a CDPATH entry other than the current directory (in which
+ * case cd prints where it went)
+ */
+static int find_dir(const char *arg, int cwd, dir_t *dir, int *found) {
+    const char *cdpath = var_get(shell_vars, "CDPATH");
+    *found = 0;
+    if (cdpath && arg[0] != '/' && strcmp(arg, ".") && strcmp(arg, "..") &&
+        strncmp(arg, "./", 2) && strncmp(arg, "../", 3)) {
+        for (const char *p = cdpath;;) {
+            const char *end = strchr(p, ':');
+            int len = end ? (int)(end - p) : (int)strlen(p);
+            char path[4096];
+            snprintf(path, sizeof(path), "%.*s%s%s", len, p, len ? "/" : "",
+                     arg);
+            if (!try_dir(path, cwd, dir)) {
+                *found = len && !(len == 1 && p[0] == '.');
+                return 0;
+            }
+
+            if (!end) {
+                break;
+            }
+            p = end + 1;
+        }
+    }
+
+    return try_dir(arg, cwd, dir);
+}
+
+/*
+ * enter_dir()
+ *
+ * - Description: makes a directory the current one and sets PWD (to its path,
+ * or, if that is not known, from getcwd()) and OLDPWD. Returns 0 (after
+ * which the directory's descriptor and path belong to this function), or -1
+ * if fchdir() failed.
+ *
+ * - Arguments: to: the directory, cwd: see cd_dir(), from: set to the
+ * directory that was current (if not NULL; else it is closed)
+ */
+static int enter_dir(dir_t *to, int *cwd, dir_t *from) {
+    dir_t old = {*cwd, NULL};
+    if (*cwd == AT_FDCWD) {
+        old.fd = from ? open(".", DIR_FLAGS) : -1;
+        if (fchdir(to->fd) < 0) {
+            if (old.fd >= 0) {
+                close(old.fd);
+            }
+            return -1;
+        }
+        close(to->fd);
+    } else {
+        *cwd = to->fd;
+    }
+
+    const char *pwd = var_get(shell_vars, "PWD");
+    if (pwd) {
+        old.path = strdup(pwd);
+        var_export(shell_vars, "OLDPWD", pwd);
+    }
+
+    char buf[4096];
+    if (to->path) {
+        var_set(shell_vars, "PWD", to->path);
+    } else if (*cwd == AT_FDCWD && getcwd(buf, sizeof(buf))) {
+        var_set(shell_vars, "PWD", buf);
+    }
+    free(to->path);
+
+    if (from) {
+        *from = old;
+    } else {
+        drop_dir(&old);
+    }
+    return 0;
+}
+
+/* prints PWD (as cd does when it did not go where it was told) */
+static void print_pwd(void) {
+    const char *pwd = var_get(shell_vars, "PWD");
+    printf("%s\n", pwd ? pwd : "");
+}
+
+/*
+ * cd_dir()
+ *
+ * - Description: the cd builtin, see dirs.h.
+ */
+int cd_dir(const char *arg, int *cwd) {
+    dir_t to, old;
+    int back = !strcmp(arg, "-"), found = 0;
+    if (back) {
+        if (dir_stack->prev.fd < 0) {
+            write(STDERR_FILENO, "cd: OLDPWD not set\n", 19);
+            return -1;
+        }
+        to = dir_stack->prev;
+    } else if (find_dir(arg, *cwd, &to, &found) < 0) {
+        perror("cd");
+        return -1;
+    }
+
+    if (enter_dir(&to, cwd, &old) < 0) {
+        perror("cd");
+        if (!back) {
+            drop_dir(&to);
+        }
+        return -1;
+    }
+
+    if (!back) {  // (else it was just entered)
+        drop_dir(&dir_stack->prev);
+    }
+    dir_stack->prev = old;
+    if (back || found) {
+        print_pwd();
+    }
+    return 0;
+}
+
+/*
+ * push_dir()
+ *
+ * - Description: the pushd builtin, see dirs.h. Prints the directory stack.
+ */
+int push_dir(const char *arg, int *cwd) {
+    if (dir_stack->n == dir_stack->cap) {
+        int cap = dir_stack->cap ? 2 * dir_stack->cap : 8;
+        dir_t *stack =
+            (dir_t *)realloc(dir_stack->stack, (size_t)cap * sizeof(dir_t));
+        if (!stack) {
+            perror("pushd");
+            return -1;
+        }
+        dir_stack->stack = stack;
+        dir_stack->cap = cap;
+    }
+
+    dir_t to;
+    int found;
+    if (!arg) {
+        if (!dir_stack->n) {
+            write(STDERR_FILENO, "pushd: no other directory\n", 26);
+            return -1;
+        }
+        to = dir_stack->stack[--dir_stack->n];
+    } else if (find_dir(arg, *cwd, &to, &found) < 0) {
+        perror("pushd");
+        return -1;
+    }
+
+    dir_t *old = &dir_stack->stack[dir_stack->n];
+    if (enter_dir(&to, cwd, old) < 0) {
+        perror("pushd");
+        if (arg) {
+            drop_dir(&to);
+        } else {
+            dir_stack->n++;  // (still there)
+        }
+        return -1;
+    }
+
+    // cd - goes back to it too
+    drop_dir(&dir_stack->prev);
+    if (old->fd >= 0) {
+        dir_stack->prev.fd = fcntl(old->fd, F_DUPFD_CLOEXEC, 0);
+        dir_stack->prev.path = old->path ? strdup(old->path) : NULL;
+    }
+
+    dir_stack->n++;
+    print_dirs();
+    return 0;
+}
+
+/*
+ * pop_dir()
+ *
+ * - Description: the popd builtin: goes back to the directory on top of the
+ * stack, removing it. Prints the directory stack.
+ */
+int pop_dir(int *cwd) {
+    if (!dir_stack->n) {
+        write(STDERR_FILENO, "popd: directory stack empty\n", 28);
+        return -1;
+    }
+
+    dir_t old;
+    if (enter_dir(&dir_stack->stack[dir_stack->n - 1], cwd, &old) < 0) {
+        perror("popd");
+        return -1;
+    }
+
+    dir_stack->n--;
+    drop_dir(&dir_stack->prev);
+    dir_stack->prev = old;
+    print_dirs();
+    return 0;
+}
+
+/* prints the current directory, then the stack from the top down */
+void print_dirs(void) {
+    const char *pwd = var_get(shell_vars, "PWD");
+    printf("%s", pwd ? pwd : ".");
+    for (int i = dir_stack->n - 1; i >= 0; i--) {
+        const char *path = dir_stack->stack[i].path;
+        printf(" %s", path ? path : "?");
+    }
+    printf("\n");
+}
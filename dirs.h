@@ -0,0 +1,56 @@
+#ifndef DIRS_H_
+#define DIRS_H_
+
+#include <dirent.h>
+
+/* called for each entry of a directory, with its name and d_type (DT_*) */
+typedef void (*dirent_fn)(const char *name, unsigned char type, void *arg);
+
+/*
+ * calls fn(name, type, arg) for every entry (other than . and ..) of the open
+ * directory fd, reading it with getdents64() in large batches. type is
+ * DT_UNKNOWN on filesystems that do not report it. returns 0, or -1 (with
+ * errno set) on a read error
+ */
+int list_dir(int fd, dirent_fn fn, void *arg);
+
+/* a directory to go back to: an O_PATH descriptor of it (so going back never
+ * resolves its path again), and its path when it was left (or NULL) */
+typedef struct {
+    int fd;
+    char *path;
+} dir_t;
+
+/* the directories of pushd/popd (top last), and the one cd - goes back to */
+typedef struct {
+    dir_t prev;
+    dir_t *stack;
+    int n;
+    int cap;
+} dirstack_t;
+
+/* the directory stack of the running shell (or of the session being served) */
+extern dirstack_t *dir_stack;
+
+/* sets PWD to the current directory, unless it already names it */
+void init_dirs(void);
+/* creates an empty directory stack (for a session), NULL on failure */
+dirstack_t *new_dirstack(void);
+/* frees a directory stack, closing its descriptors */
+void free_dirstack(dirstack_t *dirs);
+
+/*
+ * the cd, pushd and popd builtins: they change the current directory (or, if
+ * *cwd is not AT_FDCWD, replace the directory descriptor *cwd) and set PWD
+ * and OLDPWD. cd takes a directory (looked up in CDPATH), or - for the
+ * previous one; pushd takes a directory, or NULL to swap the current
+ * directory with the top of the stack. return 0, or -1 after printing an
+ * error
+ */
+int cd_dir(const char *arg, int *cwd);
+int push_dir(const char *arg, int *cwd);
+int pop_dir(int *cwd);
+/* the dirs builtin: prints the current directory and the directory stack */
+void print_dirs(void);
+
+#endif  // DIRS_H_
@@ -0,0 +1,716 @@
+#include "./editor.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+#include "./complete.h"
+#include "./events.h"
+#include "./history.h"
+
+// longest line that can be edited
+#define EDIT_MAX 1024
+// bytes of output batched into a single write()
+#define OUT_MAX 8192
+// how long to wait for the rest of a split escape sequence, in milliseconds
+#define ESC_WAIT 50
+// most completions listed below the line
+#define MAX_LISTED 200
+
+/*
+ * The terminal is put in raw mode while a line is edited, and the editor
+ * keeps a copy of what is on the screen. After each chunk of input (one
+ * read(), which may hold a single keystroke or a whole paste), the new line
+ * is compared to that copy and only the cells from the first difference on
+ * are rewritten, followed by an erase if the line got shorter; moving the
+ * cursor alone writes a single escape sequence. All output for a chunk goes
+ * out in one write(). Positions are kept as offsets from the start of the
+ * prompt and turned into rows and columns with the terminal width, so lines
+ * longer than the terminal wrap correctly.
+ */
+typedef struct {
+    char line[EDIT_MAX];
+    size_t len;  // bytes in line
+    size_t pos;  // cursor, as a byte offset in line
+    size_t max;  // most bytes line may hold
+    const char *prompt;
+    size_t pwidth;         // width of the prompt
+    char shown[EDIT_MAX];  // line as it is on the screen
+    size_t nshown;
+    size_t cursor;  // screen offset of the cursor (0 is the prompt's start)
+    size_t cols;    // terminal width
+    char out[OUT_MAX];
+    size_t nout;
+    int hist;  // history entry being shown, history_count() for a new line
+    char saved[EDIT_MAX];  // the new line, while history is shown
+    size_t nsaved;
+    int cancelled;          // set by ^C
+    int searching;          // set during reverse search (^R)
+    char search[EDIT_MAX];  // text being searched for
+    size_t nsearch;
+    int match;                 // entry found, or -1
+    char search_prompt[1100];  // replaces the prompt while searching
+} editor_t;
+
+// input read but not used yet (i.e. the rest of a paste after a newline)
+static char pending[4096];
+static size_t npending = 0;
+
+/* returns 1 for the continuation bytes of a UTF-8 character */
+static int is_cont(char c) { return ((unsigned char)c & 0xC0) == 0x80; }
+
+/* returns the width (in cells) of n bytes of text, one per character */
+static size_t width(const char *s, size_t n) {
+    size_t w = 0;
+    for (size_t i = 0; i < n; i++) {
+        w += !is_cont(s[i]);
+    }
+    return w;
+}
+
+/* writes out the batched output */
+static void flush_out(editor_t *e) {
+    size_t done = 0;
+    while (done < e->nout) {
+        ssize_t n = write(STDOUT_FILENO, e->out + done, e->nout - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+        done += (size_t)n;
+    }
+    e->nout = 0;
+}
+
+/* batches n bytes of output */
+static void put(editor_t *e, const char *s, size_t n) {
+    if (e->nout + n > OUT_MAX) {
+        flush_out(e);
+    }
+    if (n > OUT_MAX) {  // (cannot happen with lines of up to EDIT_MAX)
+        n = OUT_MAX;
+    }
+    memcpy(e->out + e->nout, s, n);
+    e->nout += n;
+}
+
+/* batches an escape sequence moving the cursor n cells or rows */
+static void put_move(editor_t *e, size_t n, char dir) {
+    char seq[32];
+    int len = snprintf(seq, sizeof(seq), "\x1b[%zu%c", n, dir);
+    put(e, seq, (size_t)len);
+}
+
+/* moves the cursor to screen offset to */
+static void move_to(editor_t *e, size_t to) {
+    size_t row = e->cursor / e->cols, col = e->cursor % e->cols;
+    size_t to_row = to / e->cols, to_col = to % e->cols;
+    if (to_row < row) {
+        put_move(e, row - to_row, 'A');
+    } else if (to_row > row) {
+        put_move(e, to_row - row, 'B');
+    }
+
+    if (to_col > col) {
+        put_move(e, to_col - col, 'C');
+    } else if (to_col < col) {
+        put_move(e, col - to_col, 'D');
+    }
+    e->cursor = to;
+}
+
+/* writes text at the cursor, advancing it */
+static void put_text(editor_t *e, const char *s, size_t n) {
+    put(e, s, n);
+    e->cursor += width(s, n);
+    // after writing the last column, the terminal only moves to the next row
+    // with the next character: move there now, so offsets stay right
+    if (n && e->cursor % e->cols == 0) {
+        put(e, "\r\n", 2);
+    }
+}
+
+/*
+ * render()
+ *
+ * - Description: brings the screen up to date with the line being edited,
+ * rewriting only the cells that changed (from the first difference to the
+ * end of the line), erasing what is left of a longer line, and moving the
+ * cursor where it belongs.
+ */
+static void render(editor_t *e) {
+    size_t common = 0;
+    while (common < e->len && common < e->nshown &&
+           e->line[common] == e->shown[common]) {
+        common++;
+    }
+    while (common > 0 && common < e->len && is_cont(e->line[common])) {
+        common--;  // rewrite whole characters
+    }
+
+    if (common < e->len || common < e->nshown) {
+        size_t old_end = e->pwidth + width(e->shown, e->nshown);
+        move_to(e, e->pwidth + width(e->line, common));
+        put_text(e, e->line + common, e->len - common);
+        if (old_end > e->cursor) {
+            put(e, "\x1b[J", 3);  // erase the rest of the old line
+        }
+
+        memcpy(e->shown, e->line, e->len);
+        e->nshown = e->len;
+    }
+
+    move_to(e, e->pwidth + width(e->line, e->pos));
+}
+
+/* redraws the prompt and line from scratch (i.e. after ^L, or in search) */
+static void redraw(editor_t *e) {
+    move_to(e, 0);
+    put(e, "\r\x1b[J", 4);
+    e->cursor = 0;
+    e->pwidth = width(e->prompt, strlen(e->prompt));
+    put_text(e, e->prompt, strlen(e->prompt));
+    e->nshown = 0;
+    render(e);
+}
+
+/* reads the terminal width */
+static void get_cols(editor_t *e) {
+    struct winsize ws;
+    e->cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col
+                  ? ws.ws_col
+                  : 80;
+}
+
+/* replaces the line with n bytes of s, with the cursor at the end */
+static void set_line(editor_t *e, const char *s, size_t n) {
+    if (n > e->max) {
+        n = e->max;
+    }
+    memcpy(e->line, s, n);
+    e->len = e->pos = n;
+}
+
+/* inserts byte c at the cursor */
+static void insert(editor_t *e, char c) {
+    if (e->len == e->max) {
+        return;
+    }
+    memmove(e->line + e->pos + 1, e->line + e->pos, e->len - e->pos);
+    e->line[e->pos++] = c;
+    e->len++;
+}
+
+/* deletes the bytes from offset from up to the cursor */
+static void delete_back(editor_t *e, size_t from) {
+    memmove(e->line + from, e->line + e->pos, e->len - e->pos);
+    e->len -= e->pos - from;
+    e->pos = from;
+}
+
+/* returns the offset of the character before (dir -1) or after offset */
+static size_t step(editor_t *e, size_t at, int dir) {
+    if (dir < 0) {
+        while (at > 0 && is_cont(e->line[--at])) {
+        }
+    } else if (at < e->len) {
+        while (++at < e->len && is_cont(e->line[at])) {
+        }
+    }
+    return at;
+}
+
+/* shows history entry hist, or the new line */
+static void recall(editor_t *e, int hist) {
+    if (hist > history_count()) {  // (the history file has shrunk)
+        hist = history_count();
+    }
+    if (e->hist == history_count()) {  // leaving the new line: keep it
+        memcpy(e->saved, e->line, e->len);
+        e->nsaved = e->len;
+    }
+
+    e->hist = hist;
+    if (hist == history_count()) {
+        set_line(e, e->saved, e->nsaved);
+    } else {
+        size_t n;
+        const char *entry = history_entry(hist, &n);
+        set_line(e, entry, n);
+    }
+}
+
+/* replaces the bytes from offset start up to the cursor with n bytes of s */
+static void replace(editor_t *e, size_t start, const char *s, size_t n) {
+    delete_back(e, start);
+    for (size_t i = 0; i < n; i++) {
+        insert(e, s[i]);
+    }
+}
+
+/* the last component of a completed filename (keeping a trailing '/') */
+static const char *last_part(const char *name) {
+    size_t len = strlen(name);
+    const char *part = name;
+    for (size_t i = 0; i + 1 < len; i++) {
+        if (name[i] == '/') {
+            part = name + i + 1;
+        }
+    }
+    return part;
+}
+
+/* lists completions below the line, then puts the prompt and line back */
+static void list_matches(editor_t *e, const matches_t *m) {
+    // (files are listed by their last component, like other shells)
+    size_t widest = 0;
+    for (int i = 0; i < m->n; i++) {
+        const char *name = last_part(m->items[i].name);
+        if (width(name, strlen(name)) > widest) {
+            widest = width(name, strlen(name));
+        }
+    }
+
+    render(e);  // (keys typed ahead of the tab are not shown yet)
+    move_to(e, e->pwidth + width(e->line, e->len));
+    if (e->cursor % e->cols) {
+        put(e, "\r\n", 2);
+    }
+
+    size_t per_row = e->cols / (widest + 2);
+    int shown = m->n < MAX_LISTED ? m->n : MAX_LISTED;
+    for (int i = 0; i < shown; i++) {
+        const char *name = last_part(m->items[i].name);
+        size_t len = strlen(name);
+        put(e, name, len);
+        if (!per_row || (size_t)(i + 1) % per_row == 0 || i == shown - 1) {
+            put(e, "\r\n", 2);
+        } else {
+            for (size_t pad = width(name, len); pad < widest + 2; pad++) {
+                put(e, " ", 1);
+            }
+        }
+    }
+    if (shown < m->n) {
+        char more[64];
+        int n = snprintf(more, sizeof(more), "(%d more)\r\n", m->n - shown);
+        put(e, more, (size_t)n);
+    }
+
+    e->cursor = 0;
+    e->nshown = 0;
+    put_text(e, e->prompt, strlen(e->prompt));
+}
+
+/*
+ * complete()
+ *
+ * - Description: completes the word before the cursor when tab is pressed:
+ * a command name if it is the first word (and has no '/'), else a filename
+ * (see complete.c). A single completion replaces the word (a command by its
+ * full path, since the shell runs programs by path), followed by a space
+ * unless it is a directory; several complete the word as far as they agree,
+ * or, if that adds nothing, are listed below the line.
+ */
+static void complete(editor_t *e) {
+    size_t start = e->pos;
+    while (start > 0 && e->line[start - 1] != ' ') {
+        start--;
+    }
+    size_t first = 0;
+    while (first < start && e->line[first] == ' ') {
+        first++;
+    }
+
+    matches_t m = {NULL, 0, 0};
+    size_t len = e->pos - start;
+    if (first == start && !memchr(e->line + start, '/', len)) {
+        complete_command(e->line + start, len, &m);
+    } else {
+        complete_file(e->line + start, len, &m);
+    }
+
+    if (!m.n) {
+        put(e, "\a", 1);
+    } else if (m.n == 1) {
+        const char *text = m.items[0].path ? m.items[0].path : m.items[0].name;
+        size_t n = strlen(text);
+        replace(e, start, text, n);
+        if (text[n - 1] != '/') {
+            insert(e, ' ');
+        }
+    } else {
+        size_t common = strlen(m.items[0].name);
+        for (int i = 1; i < m.n; i++) {
+            size_t k = 0;
+            while (k < common && m.items[i].name[k] == m.items[0].name[k]) {
+                k++;
+            }
+            common = k;
+        }
+
+        if (common > len) {
+            replace(e, start, m.items[0].name, common);
+        } else {
+            list_matches(e, &m);
+        }
+    }
+
+    free_matches(&m);
+}
+
+/* looks for the search text from entry before back, and shows the result */
+static void search_from(editor_t *e, int before) {
+    int found = history_search(e->search, e->nsearch, before);
+    if (found >= 0) {
+        size_t n;
+        const char *entry = history_entry(found, &n);
+        e->match = found;
+        set_line(e, entry, n);
+        // put the cursor on the match, like other shells do
+        for (size_t i = 0; e->nsearch && i + e->nsearch <= e->len; i++) {
+            if (!memcmp(e->line + i, e->search, e->nsearch)) {
+                e->pos = i;
+                break;
+            }
+        }
+    }
+
+    snprintf(e->search_prompt, sizeof(e->search_prompt),
+             "(%sreverse-i-search)`%.*s': ",
+             found < 0 && e->nsearch ? "failed " : "", (int)e->nsearch,
+             e->search);
+    e->prompt = e->search_prompt;
+    redraw(e);
+}
+
+/*
+ * search_key()
+ *
+ * - Description: handles a key during reverse search: printable keys extend
+ * the search text, ^R finds the next older match, backspace shortens the
+ * text, ^G and ^C give up. Any other key ends the search, leaving the match
+ * to be edited. Returns 1 if the key was used up, 0 if it should be handled
+ * as a normal key (after the search has ended).
+ */
+static int search_key(editor_t *e, char c, const char *prompt) {
+    if (c == 18) {  // ^R
+        search_from(e, e->match >= 0 ? e->match : history_count());
+        return 1;
+    } else if (c == 127 || c == 8) {
+        if (e->nsearch) {
+            e->nsearch--;
+        }
+        search_from(e, history_count());
+        return 1;
+    } else if ((unsigned char)c >= 32 && e->nsearch < EDIT_MAX) {
+        e->search[e->nsearch++] = c;
+        search_from(e, e->match >= 0 ? e->match + 1 : history_count());
+        return 1;
+    }
+
+    e->searching = 0;
+    e->prompt = prompt;
+    if (c == 7 || c == 3) {  // ^G, ^C: back to the line as it was
+        set_line(e, e->saved, e->nsaved);
+        redraw(e);
+        return 1;
+    }
+
+    redraw(e);
+    return 0;
+}
+
+/*
+ * escape()
+ *
+ * - Description: handles an escape sequence (arrow and editing keys) at the
+ * start of in. Returns the number of bytes it took up, or 0 if in ends
+ * before the sequence does.
+ */
+static size_t escape(editor_t *e, const char *in, size_t n) {
+    if (n < 2) {
+        return 0;
+    } else if (in[1] != '[' && in[1] != 'O') {
+        return 1;  // a lone escape
+    }
+
+    // CSI: parameters, then a final byte in @..~
+    size_t i = 2;
+    while (i < n && (in[i] < '@' || in[i] > '~')) {
+        i++;
+    }
+    if (i == n) {
+        return 0;
+    }
+
+    char key = in[i];
+    char param = i > 2 ? in[2] : 0;
+    if (key == 'A') {  // up
+        if (e->hist > 0) {
+            recall(e, e->hist - 1);
+        }
+    } else if (key == 'B') {  // down
+        if (e->hist < history_count()) {
+            recall(e, e->hist + 1);
+        }
+    } else if (key == 'C') {  // right
+        e->pos = step(e, e->pos, 1);
+    } else if (key == 'D') {  // left
+        e->pos = step(e, e->pos, -1);
+    } else if (key == 'H' || (key == '~' && (param == '1' || param == '7'))) {
+        e->pos = 0;
+    } else if (key == 'F' || (key == '~' && (param == '4' || param == '8'))) {
+        e->pos = e->len;
+    } else if (key == '~' && param == '3' && e->pos < e->len) {  // delete
+        size_t at = e->pos;
+        e->pos = step(e, at, 1);
+        delete_back(e, at);
+    }
+
+    return i + 1;
+}
+
+/*
+ * key()
+ *
+ * - Description: handles the key at the start of in. Returns the number of
+ * bytes it took up (0 if an escape sequence is cut short), and sets done to
+ * 1 when the line is finished or -1 at end of input.
+ */
+static size_t key(editor_t *e, const char *in, size_t n, int *done,
+                  const char *prompt) {
+    char c = in[0];
+    if (e->searching) {
+        if (c == '\r' || c == '\n') {
+            e->searching = 0;
+            e->prompt = prompt;
+            redraw(e);
+            *done = 1;
+            return 1;
+        } else if (c != 27 && search_key(e, c, prompt)) {
+            return 1;
+        } else if (c == 27) {
+            e->searching = 0;
+            e->prompt = prompt;
+            redraw(e);
+        }
+    }
+
+    switch (c) {
+        case '\r':
+        case '\n':
+            *done = 1;
+            break;
+        case 1:  // ^A
+            e->pos = 0;
+            break;
+        case 2:  // ^B
+            e->pos = step(e, e->pos, -1);
+            break;
+        case 3:  // ^C: abandon the line, leaving it on the screen
+            render(e);
+            move_to(e, e->pwidth + width(e->line, e->len));
+            put(e, "^C", 2);
+            e->len = e->pos = 0;
+            e->cancelled = 1;
+            *done = 1;
+            break;
+        case 4:  // ^D: end of input on an empty line, else delete
+            if (!e->len) {
+                *done = -1;
+            } else if (e->pos < e->len) {
+                size_t at = e->pos;
+                e->pos = step(e, at, 1);
+                delete_back(e, at);
+            }
+            break;
+        case 5:  // ^E
+            e->pos = e->len;
+            break;
+        case 6:  // ^F
+            e->pos = step(e, e->pos, 1);
+            break;
+        case '\t':
+            complete(e);
+            break;
+        case 8:  // ^H
+        case 127:
+            delete_back(e, step(e, e->pos, -1));
+            break;
+        case 11:  // ^K
+            e->len = e->pos;
+            break;
+        case 12:  // ^L
+            put(e, "\x1b[H\x1b[2J", 7);
+            e->cursor = 0;
+            redraw(e);
+            break;
+        case 14:  // ^N
+            if (e->hist < history_count()) {
+                recall(e, e->hist + 1);
+            }
+            break;
+        case 16:  // ^P
+            if (e->hist > 0) {
+                recall(e, e->hist - 1);
+            }
+            break;
+        case 18:  // ^R
+            memcpy(e->saved, e->line, e->len);
+            e->nsaved = e->len;
+            e->searching = 1;
+            e->nsearch = 0;
+            e->match = -1;
+            search_from(e, history_count());
+            break;
+        case 21:  // ^U
+            delete_back(e, 0);
+            break;
+        case 23: {  // ^W: the word before the cursor
+            size_t at = e->pos;
+            while (at > 0 && e->line[at - 1] == ' ') {
+                at--;
+            }
+            while (at > 0 && e->line[at - 1] != ' ') {
+                at--;
+            }
+            delete_back(e, at);
+            break;
+        }
+        case 27:
+            return escape(e, in, n);
+        default:
+            if ((unsigned char)c >= 32) {
+                insert(e, c);
+            }
+    }
+
+    return 1;
+}
+
+/* waits up to ESC_WAIT ms for more input, appends it, returns bytes read */
+static size_t read_more() {
+    struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+    if (npending == sizeof(pending) || poll(&fd, 1, ESC_WAIT) <= 0) {
+        return 0;
+    }
+
+    ssize_t n =
+        read(STDIN_FILENO, pending + npending, sizeof(pending) - npending);
+    if (n <= 0) {
+        return 0;
+    }
+    npending += (size_t)n;
+    return (size_t)n;
+}
+
+/*
+ * read_line()
+ *
+ * - Description: the interactive shell's line editor. Puts the terminal in
+ * raw mode, writes the prompt and edits a line until return is pressed,
+ * then restores the terminal, so commands run with it as it was. Input is
+ * read a chunk at a time and the screen is updated once per chunk, so a
+ * large paste costs a few reads and writes rather than a redraw per byte.
+ * Whatever follows the end of the line in a chunk is kept for the next
+ * call. While waiting for input, the output of captured and merged jobs
+ * keeps being drained (see events.h). Returns the length of the line
+ * (ending in '\n'), 0 at end of input, or -1 on a read error.
+ *
+ * - Arguments: prompt: the prompt, buf: where to store the line, size: the
+ * size of buf (the line, its newline and a NUL terminator must fit)
+ *
+ * - Keys: left/right, ^B/^F: move, home/end, ^A/^E: go to the start/end,
+ * backspace, delete, ^D: delete, ^W: delete a word, ^U/^K: delete to the
+ * start/end, up/down, ^P/^N: recall history, ^R: search history, ^L: clear
+ * the screen, ^C: abandon the line, ^D on an empty line: end of input, tab:
+ * complete a command or filename
+ */
+ssize_t read_line(const char *prompt, char *buf, size_t size) {
+    struct termios saved, raw;
+    if (!isatty(STDOUT_FILENO) || tcgetattr(STDIN_FILENO, &saved) < 0) {
+        write(STDOUT_FILENO, prompt, strlen(prompt));
+        return read(STDIN_FILENO, buf, size);
+    }
+
+    raw = saved;
+    raw.c_iflag &= (tcflag_t) ~(ICRNL | INLCR | IGNCR | IXON);
+    raw.c_lflag &= (tcflag_t) ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+    static editor_t e;  // (too big for the stack of a small thread)
+    memset(&e, 0, sizeof(e));
+    e.max = (size < EDIT_MAX ? size : EDIT_MAX) - 2;
+    e.prompt = prompt;
+    e.hist = history_count();
+    e.match = -1;
+    get_cols(&e);
+    e.pwidth = width(prompt, strlen(prompt));
+    put_text(&e, prompt, strlen(prompt));
+    flush_out(&e);
+
+    int done = 0;
+    ssize_t ret = 0;
+    while (!done) {
+        if (!npending) {
+            // drain captured output while waiting for a key
+            while (watching() && !wait_events(STDIN_FILENO, -1)) {
+            }
+
+            ssize_t n;
+            if ((n = read(STDIN_FILENO, pending, sizeof(pending))) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ret = -1;
+                break;
+            } else if (n == 0) {
+                done = -1;
+                break;
+            }
+            npending = (size_t)n;
+        }
+
+        get_cols(&e);  // (the terminal may have been resized)
+
+        size_t used = 0;
+        while (used < npending && !done) {
+            size_t k = key(&e, pending + used, npending - used, &done, prompt);
+            if (!k && !read_more()) {
+                k = 1;  // the sequence never finished: drop the escape
+            }
+            used += k;
+        }
+        memmove(pending, pending + used, npending - used);
+        npending -= used;
+
+        if (!e.cancelled) {
+            render(&e);
+        }
+        flush_out(&e);
+    }
+
+    // leave the cursor after the line, and the terminal as it was
+    if (!e.cancelled) {
+        move_to(&e, e.pwidth + width(e.line, e.len));
+    }
+    if (e.cancelled || e.cursor % e.cols) {  // (else put_text() moved down)
+        put(&e, "\r\n", 2);
+    }
+    flush_out(&e);
+    tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+
+    if (ret < 0 || (done < 0 && !e.len)) {
+        return ret;
+    }
+
+    memcpy(buf, e.line, e.len);
+    buf[e.len] = '\n';
+    return (ssize_t)e.len + 1;
+}
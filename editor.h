@@ -0,0 +1,16 @@
+#ifndef EDITOR_H_
+#define EDITOR_H_
+
+#include <sys/types.h>
+
+/*
+ * reads a line from the terminal on standard input with line editing
+ * (cursor movement, history recall and search), after writing prompt. the
+ * line is stored in buf like read() would store it, ending in '\n'. returns
+ * its length, 0 at end of input (^D on an empty line) or -1 (with errno set)
+ * on a read error. falls back to a plain read() if standard input is not a
+ * terminal
+ */
+ssize_t read_line(const char *prompt, char *buf, size_t size);
+
+#endif  // EDITOR_H_
@@ -0,0 +1,256 @@
+#define _GNU_SOURCE  // pipe2()
+#include "./events.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+// most descriptors that can be watched at once
+#define MAX_WATCHED 1024
+// events dispatched per epoll_wait() call
+#define BATCH 64
+
+/*
+ * Every watched descriptor, and the read end of a pipe that the SIGCHLD
+ * handler writes to, is registered with one epoll instance. Blocking waits
+ * (for input at the prompt, for a foreground job, for a server's next
+ * client) poll that instance along with the descriptor they are waiting
+ * for, so output of background jobs keeps being drained whatever the shell
+ * is doing.
+ */
+typedef struct watch {
+    int fd;
+    event_fn fn;
+    void *arg;
+    struct watch *next;  // in the list of unwatched ones
+} watch_t;
+
+static int ep = -1;
+static int sigchld_pipe[2];
+static volatile int child_pending = 0;
+
+static watch_t *watches[MAX_WATCHED];
+static int nwatches = 0;
+
+// unwatched while events were being dispatched, to be freed once they are
+static watch_t *unwatched = NULL;
+static int dispatching = 0;  // run_events() calls in progress (they nest)
+
+/* SIGCHLD handler: wakes up whoever is waiting on the epoll instance */
+static void note_sigchld(int sig) {
+    (void)sig;
+    int saved = errno;
+    write(sigchld_pipe[1], "", 1);  // if the pipe is full, a wakeup is pending
+    errno = saved;
+}
+
+/*
+ * init_events()
+ *
+ * - Description: sets up the event loop, if that has not been done yet.
+ * SIGCHLD is handled with SA_RESTART, so blocking calls elsewhere in the
+ * shell are not interrupted by it. Returns 0, or -1 (after printing an
+ * error) on failure.
+ *
+ * - Usage: called before the first descriptor is watched, and by
+ * run_sessions()
+ */
+int init_events() {
+    if (ep >= 0) {
+        return 0;
+    }
+
+    if (pipe2(sigchld_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("pipe");
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;  // marks the pipe
+    if ((ep = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        epoll_ctl(ep, EPOLL_CTL_ADD, sigchld_pipe[0], &ev) < 0) {
+        perror("epoll");
+        close(sigchld_pipe[0]);
+        close(sigchld_pipe[1]);
+        if (ep >= 0) {
+            close(ep);
+        }
+        ep = -1;
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = note_sigchld;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, NULL);
+    return 0;
+}
+
+/* returns a descriptor that is readable whenever an event is pending */
+int events_fd() { return ep; }
+
+/*
+ * watch_fd()
+ *
+ * - Description: registers fd, so that fn(fd, arg) is called from
+ * run_events() whenever it is readable (or at end of file). Returns 0, or -1
+ * (after printing an error) on failure.
+ *
+ * - Arguments: fd: descriptor to watch (best non-blocking), fn, arg: the
+ * callback and its argument
+ */
+int watch_fd(int fd, event_fn fn, void *arg) {
+    if (init_events() < 0) {
+        return -1;
+    } else if (nwatches == MAX_WATCHED) {
+        fprintf(stderr, "events: too many descriptors\n");
+        return -1;
+    }
+
+    watch_t *w = (watch_t *)malloc(sizeof(watch_t));
+    if (!w) {
+        perror("malloc");
+        return -1;
+    }
+    w->fd = fd;
+    w->fn = fn;
+    w->arg = arg;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = w;
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        free(w);
+        return -1;
+    }
+
+    watches[nwatches++] = w;
+    return 0;
+}
+
+/*
+ * unwatch_fd()
+ *
+ * - Description: stops watching fd. Must be called before fd is closed, and
+ * may be called from any callback, including fd's own.
+ */
+void unwatch_fd(int fd) {
+    for (int i = 0; i < nwatches; i++) {
+        if (watches[i]->fd == fd) {
+            epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL);
+            watch_t *w = watches[i];
+            watches[i] = watches[--nwatches];
+            if (!dispatching) {
+                free(w);
+                return;
+            }
+
+            // (the callback may still be pending in a batch being
+            // dispatched, so only mark it as gone; run_events() frees it)
+            w->fn = NULL;
+            w->next = unwatched;
+            unwatched = w;
+            return;
+        }
+    }
+}
+
+/* returns the number of descriptors being watched */
+int watching() { return nwatches; }
+
+/*
+ * run_events()
+ *
+ * - Description: calls the callback of every watched descriptor that is
+ * readable, and notes whether a child has changed state (see
+ * take_child_event()), without blocking.
+ */
+void run_events() {
+    if (ep < 0) {
+        return;
+    }
+
+    struct epoll_event events[BATCH];
+    int n;
+    dispatching++;
+    while ((n = epoll_wait(ep, events, BATCH, 0)) > 0) {
+        for (int i = 0; i < n; i++) {
+            watch_t *w = (watch_t *)events[i].data.ptr;
+            if (!w) {
+                char drain[64];
+                while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0) {
+                }
+                child_pending = 1;
+                continue;
+            }
+
+            if (w->fn) {
+                w->fn(w->fd, w->arg);
+            }
+        }
+
+        if (n < BATCH) {
+            break;
+        }
+    }
+
+    // a callback may have run events itself, so only the outermost call
+    // frees what was unwatched meanwhile
+    if (!--dispatching) {
+        while (unwatched) {
+            watch_t *w = unwatched;
+            unwatched = w->next;
+            free(w);
+        }
+    }
+}
+
+/*
+ * wait_events()
+ *
+ * - Description: blocks until fd is readable, dispatching events (i.e.
+ * draining the output of background jobs) in the meantime. Also returns
+ * when a child changes state, a signal arrives or the timeout passes, so
+ * that callers can check whatever they are waiting for. Returns 1 if fd is
+ * readable, 0 otherwise.
+ *
+ * - Arguments: fd: descriptor to wait for, or -1 to wait for events only,
+ * timeout: in milliseconds, -1 for none
+ *
+ * - Usage: while (!wait_events(STDIN_FILENO, -1)) { check other things }
+ */
+int wait_events(int fd, int timeout) {
+    if (init_events() < 0) {
+        return 0;
+    }
+
+    struct pollfd fds[2] = {{ep, POLLIN, 0}, {fd, POLLIN, 0}};
+    int n = poll(fds, fd >= 0 ? 2 : 1, timeout);
+    if (n <= 0) {  // timeout, or interrupted (i.e. by SIGCHLD)
+        run_events();
+        return 0;
+    }
+
+    if (fds[0].revents) {
+        run_events();
+    }
+
+    return fd >= 0 && fds[1].revents != 0;
+}
+
+/* returns (and clears) whether a child has changed state */
+int take_child_event() {
+    run_events();
+
+    int pending = child_pending;
+    child_pending = 0;
+    return pending;
+}
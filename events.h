@@ -0,0 +1,40 @@
+#ifndef EVENTS_H_
+#define EVENTS_H_
+
+/* called when a watched descriptor is readable */
+typedef void (*event_fn)(int fd, void *arg);
+
+/*
+ * sets up the event loop: a SIGCHLD handler (which writes to a self-pipe)
+ * and an epoll instance. does nothing if already set up. returns 0 or -1
+ * (after printing an error) on failure
+ */
+int init_events();
+/*
+ * returns a descriptor that is readable whenever an event is pending, so the
+ * loop can be nested in another one (see run_sessions())
+ */
+int events_fd();
+
+/* calls fn(fd, arg) whenever fd is readable, returns 0 or -1 on failure */
+int watch_fd(int fd, event_fn fn, void *arg);
+/* stops watching fd (before it is closed) */
+void unwatch_fd(int fd);
+/* returns the number of descriptors being watched */
+int watching();
+
+/* dispatches every pending event without blocking */
+void run_events();
+/*
+ * waits until fd (unless it is -1) is readable, a child changes state, a
+ * signal arrives or timeout milliseconds pass (-1 for no timeout),
+ * dispatching events in the meantime. returns 1 if fd is readable, else 0
+ */
+int wait_events(int fd, int timeout);
+/*
+ * returns 1 if a child has changed state since the last call (i.e. it is
+ * time to reap), 0 otherwise
+ */
+int take_child_event();
+
+#endif  // EVENTS_H_
@@ -0,0 +1,408 @@
+#include "./history.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// number of trigram buckets in the search index (a power of two)
+#define NBUCKETS 65536
+
+/*
+ * The history file is an append-only log, one command per line. Every shell
+ * appends with a single write() on an O_APPEND descriptor, so entries of
+ * shells sharing the file never interleave. At startup the file is only
+ * mapped, not read: entries are located (with memchr over the mapping) the
+ * first time they are asked for, and the mapping is redone when the file has
+ * grown. If another shell replaced the file (a different inode at the path),
+ * truncated it, or rewrote it so that its first bytes or the bytes before the
+ * end of the last entry located differ, the mapping is thrown away along with
+ * the entries and the index, and started over; a rewrite that keeps those
+ * bytes and the length is not noticed. A search index is built on the
+ * first search, and extended as entries are added: for each trigram (hashed
+ * into NBUCKETS buckets), the sorted list of entries containing it. A search
+ * walks the shortest list among its text's trigrams and checks each candidate,
+ * so it only touches a small fraction of a large history.
+ */
+typedef struct {
+    uint32_t *entries;  // ascending
+    uint32_t n;
+    uint32_t cap;
+} posting_t;
+
+static int hist_fd = -1;
+static char *hist_path = NULL;
+static char *map = NULL;  // (mapped read-only)
+static size_t map_size = 0;
+
+static uint64_t *starts = NULL;  // offset of each entry in the file
+static uint32_t nentries = 0;
+static uint32_t cap_entries = 0;
+static size_t scanned = 0;  // bytes of the file split into entries so far
+
+// copies of the first bytes of the file and of the bytes up to scanned, to
+// tell that the file was rewritten
+static char head[64], tail[64];
+static size_t head_len = 0, tail_len = 0;
+
+static posting_t *buckets = NULL;  // NULL until the first search
+static uint32_t indexed = 0;       // entries in the index so far
+
+/*
+ * open_history()
+ *
+ * - Description: opens the history file (creating it if need be) and maps
+ * it. Returns 0, or -1 (after printing an error) on failure, in which case
+ * the shell runs without history.
+ *
+ * - Arguments: path: the history file, i.e. ~/.33sh_history
+ */
+int open_history(const char *path) {
+    if ((hist_fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) <
+        0) {
+        perror(path);
+        return -1;
+    } else if (!(hist_path = strdup(path))) {
+        perror("strdup");
+        close(hist_fd);
+        hist_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* returns 1 if a history file is open */
+int have_history() { return hist_fd >= 0; }
+
+/*
+ * forgets the mapping, the entries located and the index (keeping the
+ * buckets' memory), for a file that has shrunk or been rewritten: pages of
+ * the mapping past its new end would fault (SIGBUS) when read, and the
+ * entries no longer match
+ */
+static void forget() {
+    if (map) {
+        munmap(map, map_size);
+    }
+    map = NULL;
+    map_size = 0;
+    nentries = 0;
+    scanned = 0;
+    head_len = 0;
+    tail_len = 0;
+    indexed = 0;
+    for (uint32_t i = 0; buckets && i < NBUCKETS; i++) {
+        buckets[i].n = 0;
+    }
+}
+
+/*
+ * returns 1 if the entries located so far are still in the file (which is at
+ * least map_size bytes long), i.e. it was only appended to
+ */
+static int unchanged() {
+    return !memcmp(map, head, head_len) &&
+           !memcmp(map + scanned - tail_len, tail, tail_len);
+}
+
+/*
+ * maps the file again if it has grown (or from scratch if it has shrunk or
+ * been rewritten, or reopens it if it has been replaced), returns 0 or -1 on
+ * failure
+ */
+static int refresh() {
+    struct stat st, at;
+    if (fstat(hist_fd, &st) < 0) {
+        return -1;
+    }
+
+    int fd;
+    if (!stat(hist_path, &at) &&
+        (at.st_ino != st.st_ino || at.st_dev != st.st_dev) &&
+        (fd = open(hist_path, O_RDWR | O_APPEND | O_CLOEXEC)) >= 0) {
+        close(hist_fd);
+        hist_fd = fd;
+        forget();
+        if (fstat(hist_fd, &st) < 0) {
+            return -1;
+        }
+    } else if (map && ((size_t)st.st_size < map_size || !unchanged())) {
+        forget();
+    }
+    if ((size_t)st.st_size <= map_size) {
+        return 0;
+    }
+
+    void *new_map =
+        mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, hist_fd, 0);
+    if (new_map == MAP_FAILED) {
+        return -1;
+    }
+
+    if (map) {
+        munmap(map, map_size);
+    }
+    map = (char *)new_map;
+    map_size = (size_t)st.st_size;
+    return 0;
+}
+
+/* locates the entries (complete lines) not located yet */
+static void split() {
+    if (refresh() < 0) {
+        return;
+    }
+
+    const char *nl;
+    while (scanned < map_size &&
+           (nl = memchr(map + scanned, '\n', map_size - scanned))) {
+        if (nentries == cap_entries) {
+            uint32_t cap = cap_entries ? cap_entries * 2 : 1024;
+            uint64_t *grown =
+                (uint64_t *)realloc(starts, cap * sizeof(uint64_t));
+            if (!grown) {
+                break;
+            }
+            starts = grown;
+            cap_entries = cap;
+        }
+
+        starts[nentries++] = scanned;
+        scanned = (size_t)(nl - map) + 1;
+    }
+
+    if (map) {
+        head_len = scanned < sizeof(head) ? scanned : sizeof(head);
+        tail_len = head_len;
+        memcpy(head, map, head_len);
+        memcpy(tail, map + scanned - tail_len, tail_len);
+    }
+}
+
+/* returns the bucket of the trigram starting at s */
+static uint32_t bucket(const char *s) {
+    uint32_t t = (uint32_t)(unsigned char)s[0] << 16 |
+                 (uint32_t)(unsigned char)s[1] << 8 | (unsigned char)s[2];
+    return (t * 2654435761u) >> 16;
+}
+
+/* adds the entries located since the last call to the index */
+static void index_entries() {
+    if (!buckets &&
+        !(buckets = (posting_t *)calloc(NBUCKETS, sizeof(posting_t)))) {
+        return;
+    }
+
+    for (; indexed < nentries; indexed++) {
+        size_t len;
+        const char *line = history_entry((int)indexed, &len);
+        for (size_t i = 0; i + 3 <= len; i++) {
+            posting_t *p = &buckets[bucket(line + i)];
+            if (p->n && p->entries[p->n - 1] == indexed) {
+                continue;  // (the same trigram, or bucket, twice in a line)
+            }
+
+            if (p->n == p->cap) {
+                uint32_t cap = p->cap ? p->cap * 2 : 8;
+                uint32_t *grown =
+                    (uint32_t *)realloc(p->entries, cap * sizeof(uint32_t));
+                if (!grown) {
+                    return;  // (the index is only extended up to here)
+                }
+                p->entries = grown;
+                p->cap = cap;
+            }
+            p->entries[p->n++] = indexed;
+        }
+    }
+}
+
+/*
+ * add_history()
+ *
+ * - Description: appends a command line to the history file, in one write()
+ * so that it is atomic with respect to other shells appending to the file.
+ * Empty lines and repeats of the previous entry are not added.
+ *
+ * - Arguments: line: the command line, len: its length (without a newline)
+ */
+void add_history(const char *line, size_t len) {
+    if (hist_fd < 0 || !len) {
+        return;
+    }
+
+    size_t prev_len;
+    int n = history_count();
+    if (n > 0) {
+        const char *prev = history_entry(n - 1, &prev_len);
+        if (prev_len == len && !memcmp(prev, line, len)) {
+            return;
+        }
+    }
+
+    char buf[len + 1];
+    memcpy(buf, line, len);
+    buf[len] = '\n';
+    if (write(hist_fd, buf, len + 1) < 0) {
+        perror("history");
+    }
+}
+
+/* returns the number of entries in the history file */
+int history_count() {
+    if (hist_fd < 0) {
+        return 0;
+    }
+
+    split();
+    return (int)nentries;
+}
+
+/* returns entry i (0 is the oldest) and stores its length in len */
+const char *history_entry(int i, size_t *len) {
+    if (i < 0 || (uint32_t)i >= nentries) {  // (the file has shrunk since)
+        *len = 0;
+        return "";
+    }
+
+    size_t end = (uint32_t)i + 1 < nentries ? starts[i + 1] : scanned;
+    *len = end - starts[i] - 1;  // (without the newline)
+    return map + starts[i];
+}
+
+/* returns 1 if entry i contains text */
+static int contains(int i, const char *text, size_t len) {
+    size_t n;
+    const char *line = history_entry(i, &n);
+    const char *end = line + n;
+    while ((size_t)(end - line) >= len &&
+           (line = memchr(line, text[0], (size_t)(end - line) - len + 1))) {
+        if (!memcmp(line, text, len)) {
+            return 1;
+        }
+        line++;
+    }
+
+    return 0;
+}
+
+/*
+ * history_search()
+ *
+ * - Description: reverse search: finds the most recent entry before entry
+ * before that contains text. Texts of three or more characters are looked up
+ * in the trigram index (which is built on the first search); shorter ones
+ * are searched for entry by entry. Returns the entry's index, or -1.
+ *
+ * - Arguments: text: the text to search for, len: its length, before: index
+ * to search back from (history_count() to search everything)
+ *
+ * - Usage: for (int i = history_count(); (i = history_search(t, n, i)) >= 0;)
+ *              visits every match, most recent first
+ */
+int history_search(const char *text, size_t len, int before) {
+    if (history_count() < before) {
+        before = (int)nentries;
+    }
+
+    if (!len) {
+        return before - 1;
+    } else if (len < 3) {
+        while (--before >= 0 && !contains(before, text, len)) {
+        }
+        return before;
+    }
+
+    index_entries();
+    if (!buckets) {  // (out of memory)
+        while (--before >= 0 && !contains(before, text, len)) {
+        }
+        return before;
+    }
+
+    // only entries holding every trigram of text can match, so any one list
+    // will do: take the shortest
+    posting_t *shortest = NULL;
+    for (size_t i = 0; i + 3 <= len; i++) {
+        posting_t *p = &buckets[bucket(text + i)];
+        if (!shortest || p->n < shortest->n) {
+            shortest = p;
+        }
+    }
+
+    // find the last entry before before, then walk back
+    uint32_t lo = 0, hi = shortest->n;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (shortest->entries[mid] < (uint32_t)before) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    while (lo-- > 0) {
+        int i = (int)shortest->entries[lo];
+        if (i < (int)indexed && contains(i, text, len)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* prints entry i, numbered from 1 */
+static void print_entry(int i) {
+    size_t len;
+    const char *line = history_entry(i, &len);
+    printf("%5d  %.*s\n", i + 1, (int)len, line);
+}
+
+/*
+ * print_history()
+ *
+ * - Description: the history builtin: prints the last n entries, oldest
+ * first, numbered from the start of the history.
+ *
+ * - Arguments: n: number of entries to print, 0 for all of them
+ */
+void print_history(int n) {
+    int count = history_count();
+    for (int i = n && n < count ? count - n : 0; i < count; i++) {
+        print_entry(i);
+    }
+}
+
+/*
+ * print_matches()
+ *
+ * - Description: history -s: prints every entry containing text, oldest
+ * first, numbered like print_history().
+ *
+ * - Arguments: text: the text to search for
+ */
+void print_matches(const char *text) {
+    size_t len = strlen(text);
+    int *found = NULL;
+    int nfound = 0, cap = 0;
+    for (int i = history_count(); (i = history_search(text, len, i)) >= 0;) {
+        if (nfound == cap) {
+            cap = cap ? cap * 2 : 64;
+            int *grown = (int *)realloc(found, (size_t)cap * sizeof(int));
+            if (!grown) {
+                break;
+            }
+            found = grown;
+        }
+        found[nfound++] = i;
+    }
+
+    while (nfound-- > 0) {
+        print_entry(found[nfound]);
+    }
+    free(found);
+}
@@ -0,0 +1,34 @@
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <stddef.h>
+
+/*
+ * opens (creating it if need be) the history file at path and maps it, for
+ * the interactive shell. returns 0, or -1 (after printing an error)
+ */
+int open_history(const char *path);
+/* returns 1 if a history file is open */
+int have_history();
+
+/* appends a command line (of length len, without a newline) to the history */
+void add_history(const char *line, size_t len);
+/*
+ * returns the number of entries, including those appended since the file was
+ * opened (by this shell or any other using the same file)
+ */
+int history_count();
+/* returns entry i (0 is the oldest) and stores its length in len */
+const char *history_entry(int i, size_t *len);
+/*
+ * returns the index of the most recent entry before entry before that
+ * contains text (of length len), or -1 if there is none
+ */
+int history_search(const char *text, size_t len, int before);
+
+/* history builtin: prints the last n entries (all if n is 0), numbered */
+void print_history(int n);
+/* history -s: prints the entries containing text, oldest first, numbered */
+void print_matches(const char *text);
+
+#endif  // HISTORY_H_
@@ -1,24 +1,37 @@
 #include "./jobs.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+
+// most subscribers a job list pushes events to
+#define MAX_SUBSCRIBERS 16
 
 struct job_element {
     int jid;
     pid_t pid;
     process_state_t state;
     char *command;
+    struct timespec start;  // when the job was added
     struct job_element *next;
 };
 typedef struct job_element job_element_t;
 
 // head is the head of the list
 // current is the current element being iterated over
+// subs are the descriptors job events are written to
 struct job_list {
     job_element_t *head;
     job_element_t *current;
     pid_t shell_pid;
+    int subs[MAX_SUBSCRIBERS];
+    int nsubs;
 };
 
 /* initializes job list, returns pointer */
@@ -27,6 +40,7 @@ job_list_t *init_job_list() {
     job_list->head = NULL;
     job_list->current = NULL;
     job_list->shell_pid = getpid();
+    job_list->nsubs = 0;
     return job_list;
 }
 
@@ -61,6 +75,10 @@ void cleanup_job_list(job_list_t *job_list) {
         cur = nextElement;
     }
 
+    for (int i = 0; i < job_list->nsubs; i++) {
+        close(job_list->subs[i]);
+    }
+
     job_list->head = NULL;
     job_list->current = NULL;
     job_list->shell_pid = 0;
@@ -87,6 +105,7 @@ int add_job(job_list_t *job_list, int jid, pid_t pid, process_state_t state,
     new->command = (char *)malloc(sizeof(char) * (cmdlen + 1));
     memcpy(new->command, command, cmdlen);
     new->command[cmdlen] = 0;
+    clock_gettime(CLOCK_REALTIME, &new->start);
     new->next = NULL;
 
     if (job_list->head == NULL) {
@@ -105,6 +124,48 @@ int add_job(job_list_t *job_list, int jid, pid_t pid, process_state_t state,
     return 0;
 }
 
+/*
+ * adds n new jobs to list at once, with JIDs jid to jid + n - 1 and the PIDs
+ * in pids. the tail of the list is found once, and all the jobs share one
+ * start time, instead of walking the list for each of them
+ */
+int add_jobs(job_list_t *job_list, int jid, const pid_t *pids, int n,
+             process_state_t state, char *command) {
+    if (job_list == NULL || (state != RUNNING && state != STOPPED) ||
+        command == NULL || n < 1) {
+        return -1;
+    }
+
+    int empty = job_list->head == NULL;
+    job_element_t **tail = &job_list->head;
+    while (*tail != NULL) {
+        tail = &(*tail)->next;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_REALTIME, &start);
+    size_t cmdlen = strlen(command);
+    for (int i = 0; i < n; i++) {
+        job_element_t *new = (job_element_t *)malloc(sizeof(job_element_t));
+        new->jid = jid + i;
+        new->pid = pids[i];
+        new->state = state;
+        new->command = (char *)malloc(sizeof(char) * (cmdlen + 1));
+        memcpy(new->command, command, cmdlen + 1);
+        new->start = start;
+        new->next = NULL;
+
+        *tail = new;
+        tail = &new->next;
+    }
+
+    if (empty) {  // (as in add_job())
+        job_list->current = job_list->head;
+    }
+
+    return 0;
+}
+
 /* removes job from list, given job's JID,
     returns 0 on success, -1 on failure */
 int remove_job_jid(job_list_t *job_list, int jid) {
@@ -295,3 +356,199 @@ void jobs(job_list_t *job_list) {
         cur = cur->next;
     }
 }
+
+/* finds the job with the given PID, NULL if there is none */
+static job_element_t *find_job(job_list_t *job_list, pid_t pid) {
+    job_element_t *cur = job_list->head;
+    while (cur != NULL && cur->pid != pid) {
+        cur = cur->next;
+    }
+
+    return cur;
+}
+
+/* writes str into out (of the given size) as a JSON string literal */
+static void json_string(char *out, size_t size, const char *str) {
+    size_t n = 0;
+    out[n++] = '"';
+    for (; *str && n + 8 < size; str++) {
+        unsigned char c = (unsigned char)*str;
+        if (c == '"' || c == '\\') {
+            out[n++] = '\\';
+            out[n++] = (char)c;
+        } else if (c < 0x20) {
+            n += (size_t)snprintf(out + n, size - n, "\\u%04x", c);
+        } else {
+            out[n++] = (char)c;
+        }
+    }
+    out[n++] = '"';
+    out[n] = '\0';
+}
+
+/*
+ * reads the CPU time (in clock ticks) and resident set size (in pages) of a
+ * process from /proc, returns 0 or -1 if it is gone
+ */
+static int proc_usage(pid_t pid, unsigned long *utime, unsigned long *stime,
+                      long *rss) {
+    char path[32];
+    char buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+    int fd;
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return -1;
+    }
+    buf[len] = '\0';
+
+    // the command name may contain spaces and parentheses, so skip past the
+    // last ')' and count fields from the state (field 3)
+    char *pos = strrchr(buf, ')');
+    if (!pos || sscanf(pos + 2,
+                       "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu "
+                       "%*d %*d %*d %*d %*d %*d %*u %*u %ld",
+                       utime, stime, rss) != 3) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* jobs --json, prints out the jobs list as a JSON array */
+void jobs_json(job_list_t *job_list) {
+    if (job_list == NULL) {
+        return;
+    }
+
+    long hz = sysconf(_SC_CLK_TCK);
+    long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+
+    printf("[");
+    for (job_element_t *cur = job_list->head; cur != NULL; cur = cur->next) {
+        char command[512];
+        json_string(command, sizeof(command), cur->command);
+        printf(
+            "%s{\"jid\":%d,\"pgid\":%d,\"state\":\"%s\",\"command\":%s,"
+            "\"start\":%ld.%03ld",
+            cur == job_list->head ? "" : ",", cur->jid, cur->pid,
+            cur->state == RUNNING ? "running" : "stopped", command,
+            (long)cur->start.tv_sec, cur->start.tv_nsec / 1000000);
+
+        unsigned long utime, stime;
+        long rss;
+        if (!proc_usage(cur->pid, &utime, &stime, &rss)) {
+            printf(",\"utime\":%.2f,\"stime\":%.2f,\"rss_kb\":%ld",
+                   (double)utime / (double)hz, (double)stime / (double)hz,
+                   rss * page_kb);
+        }
+        printf("}");
+    }
+    printf("]\n");
+}
+
+/*
+ * adds fd as a subscriber to the list's job events, returns 0 on success, -1
+ * on failure (fd is closed then). the list takes ownership of fd
+ */
+int subscribe_jobs(job_list_t *job_list, int fd) {
+    if (job_list == NULL || job_list->nsubs == MAX_SUBSCRIBERS) {
+        close(fd);
+        return -1;
+    }
+
+    job_list->subs[job_list->nsubs++] = fd;
+    return 0;
+}
+
+/* writes a JSON event line to every subscriber of the list */
+static void push_event(job_list_t *job_list, pid_t pid, const char *event,
+                       const char *extra) {
+    if (job_list == NULL || !job_list->nsubs) {
+        return;
+    }
+
+    job_element_t *job = find_job(job_list, pid);
+    char command[512];
+    json_string(command, sizeof(command), job ? job->command : "");
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    char line[1024];
+    int len = snprintf(line, sizeof(line),
+                       "{\"event\":\"%s\",\"jid\":%d,\"pgid\":%d,"
+                       "\"command\":%s,\"time\":%ld.%03ld%s}\n",
+                       event, job ? job->jid : -1, pid, command,
+                       (long)now.tv_sec, now.tv_nsec / 1000000, extra);
+    if (len < 0 || (size_t)len >= sizeof(line)) {
+        return;
+    }
+
+    // a subscriber that stops reading must not block the shell, but its
+    // descriptor shares a file description with stdout (the shell's and its
+    // children's), so its flags are left alone: sockets are sent to without
+    // waiting, anything else is only written once poll() says it has room.
+    // a subscriber that has gone away is dropped (without a SIGPIPE)
+    __sighandler_t old = signal(SIGPIPE, SIG_IGN);
+    for (int i = 0; i < job_list->nsubs; i++) {
+        int fd = job_list->subs[i];
+        ssize_t sent = send(fd, line, (size_t)len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0 && errno == ENOTSOCK) {
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            if (poll(&pfd, 1, 0) == 0) {
+                continue;  // full, this event is skipped
+            }
+            sent = pfd.revents & POLLOUT ? write(fd, line, (size_t)len) : -1;
+        }
+        if (sent < 0 && errno != EAGAIN && errno != EINTR) {
+            close(fd);
+            job_list->subs[i--] = job_list->subs[--job_list->nsubs];
+        }
+    }
+    signal(SIGPIPE, old);
+}
+
+/* pushes a "started" event for the job with the given PID */
+void notify_started(job_list_t *job_list, pid_t pid) {
+    push_event(job_list, pid, "started", "");
+}
+
+/*
+ * pushes an event for a change in the state of the job with the given PID,
+ * with status as set by waitpid() and the job's resource usage (or NULL)
+ */
+void notify_status(job_list_t *job_list, pid_t pid, int status,
+                   struct rusage *ru) {
+    char extra[128] = "";
+    const char *event;
+    int n = 0;
+    if (WIFEXITED(status)) {
+        event = "exited";
+        n = snprintf(extra, sizeof(extra), ",\"status\":%d",
+                     WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+        event = "killed";
+        n = snprintf(extra, sizeof(extra), ",\"signal\":%d", WTERMSIG(status));
+    } else if (WIFSTOPPED(status)) {
+        event = "stopped";
+        n = snprintf(extra, sizeof(extra), ",\"signal\":%d", WSTOPSIG(status));
+    } else {
+        event = "continued";
+    }
+
+    if (ru && (WIFEXITED(status) || WIFSIGNALED(status))) {
+        snprintf(extra + n, sizeof(extra) - (size_t)n,
+                 ",\"utime\":%ld.%02ld,\"stime\":%ld.%02ld,\"maxrss_kb\":%ld",
+                 (long)ru->ru_utime.tv_sec, (long)ru->ru_utime.tv_usec / 10000,
+                 (long)ru->ru_stime.tv_sec, (long)ru->ru_stime.tv_usec / 10000,
+                 ru->ru_maxrss);
+    }
+
+    push_event(job_list, pid, event, extra);
+}
@@ -1,6 +1,7 @@
 #ifndef JOBS_H_
 #define JOBS_H_
 
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -21,6 +22,13 @@ void cleanup_job_list(job_list_t *job_list);
 int add_job(job_list_t *job_list, int jid, pid_t pid, process_state_t state,
             char *command);
 
+/*
+ * adds n new jobs to list at once, with JIDs jid to jid + n - 1 and the PIDs
+ * in pids, all running command. returns 0 on success, -1 on failure
+ */
+int add_jobs(job_list_t *job_list, int jid, const pid_t *pids, int n,
+             process_state_t state, char *command);
+
 /* removes job from list, given job's JID,
         returns 0 on success, -1 on failure */
 int remove_job_jid(job_list_t *job_list, int jid);
@@ -48,5 +56,26 @@ pid_t get_next_pid(job_list_t *job_list);
 
 /* jobs command, prints out the jobs list */
 void jobs(job_list_t *job_list);
+/*
+ * jobs --json, prints out the jobs list as a JSON array of objects with the
+ * jid, pgid, state, command, start time and (for jobs that are still around)
+ * CPU time and resident size of each job
+ */
+void jobs_json(job_list_t *job_list);
+
+/*
+ * adds fd as a subscriber to the list's job events, returns 0 on success, -1
+ * on failure (fd is closed then). the list takes ownership of fd
+ */
+int subscribe_jobs(job_list_t *job_list, int fd);
+/* pushes a "started" event for the job with the given PID to subscribers */
+void notify_started(job_list_t *job_list, pid_t pid);
+/*
+ * pushes an "exited", "killed", "stopped" or "continued" event for the job
+ * with the given PID to subscribers, with status as set by waitpid() and the
+ * job's resource usage (or NULL). must be called before the job is removed
+ */
+void notify_status(job_list_t *job_list, pid_t pid, int status,
+                   struct rusage *ru);
 
 #endif  // JOBS_H_
@@ -1,5 +1,7 @@
+#include <errno.h>
 #include <signal.h>
 #include <stdio.h>
+#include <termios.h>
 #include <unistd.h>
 #include "jobs.h"
 
@@ -18,7 +20,9 @@ job_list_t *my_jobs;
  */
 void checked_stdwrite(char *str) {
     size_t len = strnlen(str, 1024);
-    if (write(STDOUT_FILENO, str, len) < 0) {
+    // EPIPE only gets here when SIGPIPE is ignored (server mode), and means a
+    // client stopped reading, which is no reason for the server to exit
+    if (write(STDOUT_FILENO, str, len) < 0 && errno != EPIPE) {
         perror("write:");
         cleanup_job_list(my_jobs);
         exit(1);
@@ -92,7 +96,10 @@ void checked_signal(int signum, __sighandler_t handler) {
  * checked_setpgrp()
  *
  * - Description: attempts to set process group id to the given pgid using the
- * tcsetgrp library call. Exits program if it fails.
+ * tcsetgrp library call. Exits program if it fails. Does nothing if standard
+ * input is not the shell's controlling terminal (i.e. when running a script
+ * from a pipe, or a command for a server client), since there is no terminal
+ * to hand over.
  *
  * - Arguments: pgrp: id of the process group to transfer control to
  *
@@ -101,6 +108,11 @@ void checked_signal(int signum, __sighandler_t handler) {
  *
  */
 void checked_setpgrp(pid_t pgrp) {
+    // tcgetsid() fails for anything but a terminal
+    if (tcgetsid(STDIN_FILENO) != getsid(0)) {
+        return;
+    }
+
     if (tcsetpgrp(STDIN_FILENO, pgrp) < 0) {
         perror("tcsetgrp");
         cleanup_job_list(my_jobs);
@@ -0,0 +1,651 @@
+#define _GNU_SOURCE  // statx(), qsort_r()
+#include "./ls.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "./dirs.h"
+
+/*
+ * Entries are read with list_dir() (getdents64, see dirs.c), which also
+ * gives their type, so a plain listing never stats anything: it is one
+ * getdents64() per few hundred entries, a sort, and a write() per 64 KiB of
+ * output. Only what an output format needs is asked of statx(): -F only
+ * needs the mode of regular files (to mark executables), and of entries
+ * whose type the filesystem did not report; -l needs a few fields of every
+ * entry. Stats cost a system call each (and, on network filesystems, a round
+ * trip), so in large directories they are spread over several threads, each
+ * statting a contiguous range of entries into its own slots.
+ */
+
+// entries statted per thread, at least, in long listings
+#define STAT_CHUNK 2048
+// most threads statting one directory
+#define MAX_STAT_THREADS 8
+// bytes of output buffered between write()s
+#define LS_OUT 65536
+// owner and group names remembered
+#define NAME_CACHE 16
+
+/* what ls was asked for */
+typedef struct {
+    int all;       // -a
+    int lng;       // -l
+    int classify;  // -F
+    int cols;      // width of the terminal, 0 for one entry per line
+} ls_opts_t;
+
+/* an entry of a listing */
+typedef struct {
+    size_t name;         // offset of its name in the listing's names
+    unsigned char type;  // DT_*
+} entry_t;
+
+/* the entries of a directory (or the files named on the command line) */
+typedef struct {
+    char *names;  // the names, one after the other
+    size_t nnames;
+    size_t names_cap;
+    entry_t *items;
+    size_t n;
+    size_t cap;
+    struct statx *st;  // (stx_mask 0 for entries not statted)
+    int failed;        // out of memory
+    int all;           // see ls_opts_t
+} listing_t;
+
+/* a range of entries for a thread to stat */
+typedef struct {
+    listing_t *l;
+    int dir;
+    unsigned int mask;
+    int every;  // stat every entry, not only those -F needs
+    size_t from;
+    size_t to;
+} stat_range_t;
+
+/* a uid or gid and its name */
+typedef struct {
+    unsigned int id;
+    char name[32];
+} id_name_t;
+
+static char out[LS_OUT];
+static size_t nout = 0;
+
+/* writes out the buffered output */
+static void flush_out(void) {
+    size_t done = 0;
+    while (done < nout) {
+        ssize_t n = write(STDOUT_FILENO, out + done, nout - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+        done += (size_t)n;
+    }
+    nout = 0;
+}
+
+/* buffers n bytes of output */
+static void emit(const char *s, size_t n) {
+    while (n) {
+        if (nout == LS_OUT) {
+            flush_out();
+        }
+        size_t k = LS_OUT - nout < n ? LS_OUT - nout : n;
+        memcpy(out + nout, s, k);
+        nout += k;
+        s += k;
+        n -= k;
+    }
+}
+
+/* buffers formatted output */
+static void emitf(const char *fmt, ...) {
+    char buf[4096 + 64];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n > 0) {
+        emit(buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+    }
+}
+
+/* adds an entry to a listing (a dirent_fn, see dirs.h) */
+static void add_entry(const char *name, unsigned char type, void *arg) {
+    listing_t *l = (listing_t *)arg;
+    if ((name[0] == '.' && !l->all) || l->failed) {
+        return;
+    }
+
+    size_t len = strlen(name) + 1;
+    if (l->nnames + len > l->names_cap) {
+        size_t cap = l->names_cap ? 2 * l->names_cap : 65536;
+        while (cap < l->nnames + len) {
+            cap *= 2;
+        }
+        char *names = (char *)realloc(l->names, cap);
+        if (!names) {
+            l->failed = 1;
+            return;
+        }
+        l->names = names;
+        l->names_cap = cap;
+    }
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? 2 * l->cap : 1024;
+        entry_t *items = (entry_t *)realloc(l->items, cap * sizeof(entry_t));
+        if (!items) {
+            l->failed = 1;
+            return;
+        }
+        l->items = items;
+        l->cap = cap;
+    }
+
+    memcpy(l->names + l->nnames, name, len);
+    l->items[l->n].name = l->nnames;
+    l->items[l->n].type = type;
+    l->nnames += len;
+    l->n++;
+}
+
+/* orders entries by name (for qsort_r(), with the names as arg) */
+static int by_name(const void *a, const void *b, void *arg) {
+    const char *names = (const char *)arg;
+    return strcmp(names + ((const entry_t *)a)->name,
+                  names + ((const entry_t *)b)->name);
+}
+
+/* orders paths (for qsort()) */
+static int by_path(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* the name of entry i */
+static const char *name_of(const listing_t *l, size_t i) {
+    return l->names + l->items[i].name;
+}
+
+/* stats a range of entries (a thread function) */
+static void *stat_range(void *arg) {
+    stat_range_t *r = (stat_range_t *)arg;
+    listing_t *l = r->l;
+    for (size_t i = r->from; i < r->to; i++) {
+        unsigned char type = l->items[i].type;
+        if ((!r->every && type != DT_REG && type != DT_UNKNOWN) ||
+            statx(r->dir, name_of(l, i), AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+                  r->mask, &l->st[i]) < 0) {
+            l->st[i].stx_mask = 0;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * stat_entries()
+ *
+ * - Description: fills in l->st, splitting the entries between up to
+ * MAX_STAT_THREADS threads (one per STAT_CHUNK entries, and no more than
+ * there are processors). Returns 0, or -1 if out of memory.
+ *
+ * - Arguments: l: the listing, dir: the directory its names are relative to,
+ * mask: the STATX_* fields wanted, every: whether every entry is needed (or
+ * only those -F needs)
+ */
+static int stat_entries(listing_t *l, int dir, unsigned int mask, int every) {
+    if (!l->n) {
+        return 0;
+    }
+    if (!(l->st = (struct statx *)malloc(l->n * sizeof(struct statx)))) {
+        return -1;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = l->n / STAT_CHUNK;
+    if (cpus > 0 && nthreads > (size_t)cpus) {
+        nthreads = (size_t)cpus;
+    }
+    if (nthreads > MAX_STAT_THREADS) {
+        nthreads = MAX_STAT_THREADS;
+    } else if (!nthreads) {
+        nthreads = 1;
+    }
+
+    stat_range_t ranges[MAX_STAT_THREADS];
+    pthread_t threads[MAX_STAT_THREADS];
+    int started[MAX_STAT_THREADS] = {0};
+    for (size_t t = 0; t < nthreads; t++) {
+        ranges[t].l = l;
+        ranges[t].dir = dir;
+        ranges[t].mask = mask;
+        ranges[t].every = every;
+        ranges[t].from = l->n * t / nthreads;
+        ranges[t].to = l->n * (t + 1) / nthreads;
+        // (the first range is statted by this thread, as are any whose
+        // thread could not be started)
+        started[t] =
+            t && !pthread_create(&threads[t], NULL, stat_range, &ranges[t]);
+    }
+
+    for (size_t t = 0; t < nthreads; t++) {
+        if (!started[t]) {
+            stat_range(&ranges[t]);
+        }
+    }
+    for (size_t t = 0; t < nthreads; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+    return 0;
+}
+
+/* the mode of entry i (as far as it is known: just its type if not statted) */
+static unsigned int mode_of(const listing_t *l, size_t i) {
+    if (l->st && (l->st[i].stx_mask & STATX_MODE)) {
+        return l->st[i].stx_mode;
+    }
+    switch (l->items[i].type) {
+        case DT_DIR:
+            return S_IFDIR;
+        case DT_LNK:
+            return S_IFLNK;
+        case DT_FIFO:
+            return S_IFIFO;
+        case DT_SOCK:
+            return S_IFSOCK;
+        case DT_CHR:
+            return S_IFCHR;
+        case DT_BLK:
+            return S_IFBLK;
+        default:
+            return S_IFREG;
+    }
+}
+
+/* the mark -F adds to a name with the given mode, or '\0' */
+static char mark_of(unsigned int mode) {
+    switch (mode & S_IFMT) {
+        case S_IFDIR:
+            return '/';
+        case S_IFLNK:
+            return '@';
+        case S_IFIFO:
+            return '|';
+        case S_IFSOCK:
+            return '=';
+        case S_IFREG:
+            return mode & (S_IXUSR | S_IXGRP | S_IXOTH) ? '*' : '\0';
+        default:
+            return '\0';
+    }
+}
+
+/* returns the name of a user (or, if group, a group), or NULL */
+static const char *id_name(unsigned int id, int group) {
+    static id_name_t cache[2][NAME_CACHE];
+    static int ncached[2] = {0, 0}, next[2] = {0, 0};
+    id_name_t *c = cache[group];
+    for (int i = 0; i < ncached[group]; i++) {
+        if (c[i].id == id) {
+            return c[i].name[0] ? c[i].name : NULL;
+        }
+    }
+
+    const char *name = NULL;
+    if (group) {
+        struct group *gr = getgrgid(id);
+        name = gr ? gr->gr_name : NULL;
+    } else {
+        struct passwd *pw = getpwuid(id);
+        name = pw ? pw->pw_name : NULL;
+    }
+
+    id_name_t *slot = &c[next[group]];
+    next[group] = (next[group] + 1) % NAME_CACHE;
+    if (ncached[group] < NAME_CACHE) {
+        ncached[group]++;
+    }
+    slot->id = id;
+    snprintf(slot->name, sizeof(slot->name), "%s", name ? name : "");
+    return slot->name[0] ? slot->name : NULL;
+}
+
+/* formats a uid or gid (as its name if it has one) into buf */
+static void format_id(char *buf, size_t size, unsigned int id, int group) {
+    const char *name = id_name(id, group);
+    if (name) {
+        snprintf(buf, size, "%s", name);
+    } else {
+        snprintf(buf, size, "%u", id);
+    }
+}
+
+/* formats a mode like ls -l does (i.e. drwxr-xr-x) into buf */
+static void format_mode(char buf[11], unsigned int mode) {
+    const char *types = "?pc?d?b?-?l?s???";
+    buf[0] = types[(mode & S_IFMT) >> 12];
+    const char *rwx = "rwxrwxrwx";
+    for (int i = 0; i < 9; i++) {
+        buf[1 + i] = mode & (1u << (8 - i)) ? rwx[i] : '-';
+    }
+    if (mode & S_ISUID) {
+        buf[3] = mode & S_IXUSR ? 's' : 'S';
+    }
+    if (mode & S_ISGID) {
+        buf[6] = mode & S_IXGRP ? 's' : 'S';
+    }
+    if (mode & S_ISVTX) {
+        buf[9] = mode & S_IXOTH ? 't' : 'T';
+    }
+    buf[10] = '\0';
+}
+
+/* number of digits in n */
+static int digits(unsigned long long n) {
+    int d = 1;
+    while (n >= 10) {
+        n /= 10;
+        d++;
+    }
+    return d;
+}
+
+/* prints a long listing of l (whose names are relative to dir), starting
+ * with its total size if total, marking names if classify (i.e. -F) */
+static void print_long(const listing_t *l, int dir, int total, int classify) {
+    int wlinks = 1, wuser = 1, wgroup = 1, wsize = 1, wmajor = 0, wminor = 0;
+    unsigned long long blocks = 0;
+    char buf[64];
+    for (size_t i = 0; i < l->n; i++) {
+        const struct statx *st = &l->st[i];
+        if (!st->stx_mask) {
+            continue;
+        }
+        blocks += st->stx_blocks;
+        int w;
+        if ((w = digits(st->stx_nlink)) > wlinks) {
+            wlinks = w;
+        }
+        if ((w = digits(st->stx_size)) > wsize) {
+            wsize = w;
+        }
+        if (S_ISCHR(st->stx_mode) || S_ISBLK(st->stx_mode)) {
+            // (devices show their numbers instead, as "major, minor")
+            if ((w = digits(st->stx_rdev_major)) > wmajor) {
+                wmajor = w;
+            }
+            if ((w = digits(st->stx_rdev_minor)) > wminor) {
+                wminor = w;
+            }
+        }
+        format_id(buf, sizeof(buf), st->stx_uid, 0);
+        if ((w = (int)strlen(buf)) > wuser) {
+            wuser = w;
+        }
+        format_id(buf, sizeof(buf), st->stx_gid, 1);
+        if ((w = (int)strlen(buf)) > wgroup) {
+            wgroup = w;
+        }
+    }
+
+    if (wmajor && wmajor + 2 + wminor > wsize) {
+        wsize = wmajor + 2 + wminor;
+    }
+
+    if (total) {  // (in 1 KiB blocks, like ls)
+        emitf("total %llu\n", (blocks + 1) / 2);
+    }
+
+    time_t now = time(NULL);
+    for (size_t i = 0; i < l->n; i++) {
+        const struct statx *st = &l->st[i];
+        const char *name = name_of(l, i);
+        if (!st->stx_mask) {
+            emitf("?????????? %*s %-*s %-*s %*s ? %s\n", wlinks, "?", wuser,
+                  "?", wgroup, "?", wsize, "?", name);
+            continue;
+        }
+
+        char mode[11], user[64], group[64], when[32];
+        format_mode(mode, st->stx_mode);
+        format_id(user, sizeof(user), st->stx_uid, 0);
+        format_id(group, sizeof(group), st->stx_gid, 1);
+        // like ls: the time if within the last six months, else the year
+        time_t mtime = (time_t)st->stx_mtime.tv_sec;
+        struct tm tm;
+        localtime_r(&mtime, &tm);
+        int recent = mtime <= now && now - mtime < 365 * 24 * 3600 / 2;
+        strftime(when, sizeof(when), recent ? "%b %e %H:%M" : "%b %e  %Y", &tm);
+
+        char size[48];
+        if (S_ISCHR(st->stx_mode) || S_ISBLK(st->stx_mode)) {
+            snprintf(size, sizeof(size), "%*u, %*u", wsize - 2 - wminor,
+                     st->stx_rdev_major, wminor, st->stx_rdev_minor);
+        } else {
+            snprintf(size, sizeof(size), "%*llu", wsize,
+                     (unsigned long long)st->stx_size);
+        }
+        emitf("%s %*u %-*s %-*s %s %s %s", mode, wlinks, st->stx_nlink, wuser,
+              user, wgroup, group, size, when, name);
+        // (-F marks a link by what it points to, like ls -lF)
+        unsigned int marked = st->stx_mode;
+        if (S_ISLNK(st->stx_mode)) {
+            char target[4096];
+            ssize_t n = readlinkat(dir, name, target, sizeof(target) - 1);
+            if (n >= 0) {
+                target[n] = '\0';
+                emitf(" -> %s", target);
+            }
+
+            struct statx to;
+            marked = classify && statx(dir, name, AT_NO_AUTOMOUNT,
+                                       STATX_TYPE | STATX_MODE, &to) == 0
+                         ? to.stx_mode
+                         : 0;
+        }
+        char mark = classify ? mark_of(marked) : '\0';
+        emitf(mark ? "%c\n" : "\n", mark);
+    }
+}
+
+/* prints l by name only: in columns down the screen, or one per line */
+static void print_short(const listing_t *l, const ls_opts_t *opts) {
+    size_t widest = 0;
+    if (opts->cols) {
+        for (size_t i = 0; i < l->n; i++) {
+            size_t len = strlen(name_of(l, i)) + (size_t)opts->classify;
+            if (len > widest) {
+                widest = len;
+            }
+        }
+    }
+
+    size_t per_row = opts->cols ? (size_t)opts->cols / (widest + 2) : 0;
+    if (per_row <= 1) {  // one per line
+        for (size_t i = 0; i < l->n; i++) {
+            const char *name = name_of(l, i);
+            emit(name, strlen(name));
+            char mark = opts->classify ? mark_of(mode_of(l, i)) : '\0';
+            if (mark) {
+                emit(&mark, 1);
+            }
+            emit("\n", 1);
+        }
+        return;
+    }
+
+    size_t rows = (l->n + per_row - 1) / per_row;
+    for (size_t r = 0; r < rows; r++) {
+        for (size_t i = r; i < l->n; i += rows) {
+            const char *name = name_of(l, i);
+            size_t len = strlen(name);
+            emit(name, len);
+            char mark = opts->classify ? mark_of(mode_of(l, i)) : '\0';
+            if (mark) {
+                emit(&mark, 1);
+                len++;
+            }
+            if (i + rows < l->n) {
+                for (; len < widest + 2; len++) {
+                    emit(" ", 1);
+                }
+            }
+        }
+        emit("\n", 1);
+    }
+}
+
+/*
+ * print_listing()
+ *
+ * - Description: sorts a listing, stats what the output format needs, and
+ * prints it. Returns 0, or 1 if out of memory.
+ *
+ * - Arguments: l: the listing, dir: the directory its names are relative to,
+ * opts: the options, total: whether a long listing starts with its total
+ * size (which ls only prints for directories)
+ */
+static int print_listing(listing_t *l, int dir, const ls_opts_t *opts,
+                         int total) {
+    if (l->failed) {
+        fprintf(stderr, "ls: out of memory\n");
+        return 1;
+    }
+    qsort_r(l->items, l->n, sizeof(entry_t), by_name, l->names);
+
+    if (opts->lng) {
+        unsigned int mask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID |
+                            STATX_GID | STATX_SIZE | STATX_MTIME | STATX_BLOCKS;
+        if (stat_entries(l, dir, mask, 1) < 0) {
+            fprintf(stderr, "ls: out of memory\n");
+            return 1;
+        }
+        print_long(l, dir, total, opts->classify);
+    } else {
+        if (opts->classify &&
+            stat_entries(l, dir, STATX_TYPE | STATX_MODE, 0) < 0) {
+            fprintf(stderr, "ls: out of memory\n");
+            return 1;
+        }
+        print_short(l, opts);
+    }
+    return 0;
+}
+
+/* frees the entries of a listing and empties it */
+static void clear_listing(listing_t *l) {
+    free(l->names);
+    free(l->items);
+    free(l->st);
+    int all = l->all;
+    memset(l, 0, sizeof(listing_t));
+    l->all = all;
+}
+
+/*
+ * list_files()
+ *
+ * - Description: the ls builtin, see ls.h. Files named on the command line
+ * are listed first, together, then each directory (under a heading if more
+ * than one thing was named), like ls does.
+ */
+int list_files(char *argv[], int argc, int cwd) {
+    ls_opts_t opts = {0, 0, 0, 0};
+    int one = 0, i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        for (const char *o = argv[i] + 1; *o; o++) {
+            if (*o == 'a') {
+                opts.all = 1;
+            } else if (*o == 'l') {
+                opts.lng = 1;
+            } else if (*o == '1') {
+                one = 1;
+            } else if (*o == 'F') {
+                opts.classify = 1;
+            } else {
+                write(STDERR_FILENO, "ls: syntax error\n", 17);
+                return 1;
+            }
+        }
+    }
+
+    struct winsize ws;
+    if (!one && isatty(STDOUT_FILENO) &&
+        ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0) {
+        opts.cols = ws.ws_col ? ws.ws_col : 80;
+    }
+
+    char *dot[] = {"."};
+    char **paths = i < argc ? argv + i : dot;
+    int npaths = i < argc ? argc - i : 1;
+
+    // like ls, list them in order (sorting a copy: argv must stay as it is)
+    char *sorted[npaths];
+    memcpy(sorted, paths, sizeof(sorted));
+    qsort(sorted, (size_t)npaths, sizeof(char *), by_path);
+    paths = sorted;
+
+    // open the directories; whatever is not one is listed as a file
+    int ret = 0, fds[npaths];
+    listing_t files = {0};
+    files.all = 1;
+    for (int p = 0; p < npaths; p++) {
+        fds[p] = openat(cwd, paths[p], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fds[p] < 0 && errno == ENOTDIR) {
+            add_entry(paths[p], DT_UNKNOWN, &files);
+        } else if (fds[p] < 0) {
+            fprintf(stderr, "ls: %s: %s\n", paths[p], strerror(errno));
+            ret = 1;
+        }
+    }
+
+    fflush(stdout);  // (ahead of this output)
+    int printed = files.n > 0;
+    if (printed) {
+        ret |= print_listing(&files, cwd, &opts, 0);
+    }
+    clear_listing(&files);
+
+    listing_t l = {0};
+    l.all = opts.all;
+    for (int p = 0; p < npaths; p++) {
+        if (fds[p] < 0) {
+            continue;
+        }
+
+        if (opts.all) {
+            add_entry(".", DT_DIR, &l);
+            add_entry("..", DT_DIR, &l);
+        }
+        if (list_dir(fds[p], add_entry, &l) < 0) {
+            fprintf(stderr, "ls: %s: %s\n", paths[p], strerror(errno));
+            ret = 1;
+        }
+
+        if (npaths > 1) {
+            emitf("%s%s:\n", printed ? "\n" : "", paths[p]);
+        }
+        ret |= print_listing(&l, fds[p], &opts, 1);
+        printed = 1;
+
+        clear_listing(&l);
+        close(fds[p]);
+    }
+
+    flush_out();
+    return ret;
+}
@@ -0,0 +1,13 @@
+#ifndef LS_H_
+#define LS_H_
+
+/*
+ * the ls builtin: lists the directories and files named by argv[1...] (the
+ * current directory if there are none), relative to directory cwd (i.e.
+ * cwd_fd). options: -a (show hidden entries), -l (long listing), -1 (one entry
+ * per line), -F (mark directories, links, executables...). returns 0, or 1
+ * if something could not be listed
+ */
+int list_files(char *argv[], int argc, int cwd);
+
+#endif  // LS_H_
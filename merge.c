@@ -0,0 +1,312 @@
+#include "./merge.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "./events.h"
+
+/*
+ * With set merge, background jobs do not share the terminal directly: each
+ * writes to a pipe that the shell drains, and the shell writes their output
+ * on in whole lines. A line is never written in two pieces, so lines of
+ * different jobs cannot tear each other, and lines are batched into a single
+ * write() per pipe read (up to MERGE_BATCH bytes), so the cost per line stays
+ * low when many jobs print at once. A trailing partial line is held back
+ * until its newline arrives (or the job closes the pipe).
+ *
+ * set outlimit gives each job a budget per second. Lines over the line budget
+ * are dropped, and a "[jid] N lines suppressed" line is written in their
+ * place with the job's first output after the second is over (or when it
+ * exits). Once a job has written its byte budget, its
+ * pipe is not read again until the second is over (a timerfd wakes the
+ * merger up then), so the job blocks on the full pipe instead of flooding the
+ * terminal or keeping the shell busy.
+ */
+typedef struct {
+    int jid;
+    int in;  // read end of the job's pipe
+    int out;
+    merge_mode_t mode;
+    char prefix[48];  // prefix for lines read by the current drain
+    size_t nprefix;
+    char line[MERGE_LINE];  // partial line carried over
+    size_t nline;
+    char batch[MERGE_BATCH];  // lines waiting to be written
+    size_t nbatch;
+    outlimit_t limit;
+    struct timespec window;  // start of the current second
+    long lines;              // lines and bytes read in it
+    long bytes;
+    long suppressed;  // lines dropped in it
+} merge_t;
+
+static void merge_drain(int fd, void *arg);
+
+/* writes out the batched lines, dropping them if out has gone away */
+static void flush_batch(merge_t *m) {
+    size_t done = 0;
+    while (done < m->nbatch) {
+        ssize_t n = write(m->out, m->batch + done, m->nbatch - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+        done += (size_t)n;
+    }
+
+    m->nbatch = 0;
+}
+
+/* adds a line (without its newline) to the batch, with the prefix */
+static void emit(merge_t *m, const char *data, size_t len) {
+    if (m->limit.lines && m->lines++ >= m->limit.lines) {
+        m->suppressed++;
+        return;
+    }
+
+    if (m->nbatch + m->nprefix + len + 1 > MERGE_BATCH) {
+        flush_batch(m);
+    }
+
+    char *p = m->batch + m->nbatch;
+    memcpy(p, m->prefix, m->nprefix);
+    memcpy(p + m->nprefix, data, len);
+    p[m->nprefix + len] = '\n';
+    m->nbatch += m->nprefix + len + 1;
+}
+
+/* reports lines dropped in the current second, if any */
+static void report_suppressed(merge_t *m) {
+    if (!m->suppressed) {
+        return;
+    }
+
+    char msg[64];
+    int n = snprintf(msg, sizeof(msg), "[%d] %ld lines suppressed\n", m->jid,
+                     m->suppressed);
+    if (m->nbatch + (size_t)n > MERGE_BATCH) {
+        flush_batch(m);
+    }
+    memcpy(m->batch + m->nbatch, msg, (size_t)n);
+    m->nbatch += (size_t)n;
+    m->suppressed = 0;
+}
+
+/*
+ * window_left()
+ *
+ * - Description: returns the milliseconds left in the current second of a
+ * job's budgets, first starting a new second (and reporting the lines
+ * suppressed in the last one) if it is over.
+ */
+static long window_left(merge_t *m) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (now.tv_sec - m->window.tv_sec) * 1000 +
+              (now.tv_nsec - m->window.tv_nsec) / 1000000;
+    if (ms < 1000) {
+        return 1000 - ms;
+    }
+
+    report_suppressed(m);
+    m->window = now;
+    m->lines = 0;
+    m->bytes = 0;
+    return 1000;
+}
+
+/* event callback for a throttled job's timerfd: reads its pipe again */
+static void resume(int fd, void *arg) {
+    merge_t *m = (merge_t *)arg;
+    unwatch_fd(fd);
+    close(fd);
+
+    watch_fd(m->in, merge_drain, m);
+    merge_drain(m->in, m);  // (it has probably filled up meanwhile)
+}
+
+/*
+ * throttle()
+ *
+ * - Description: stops reading a job's pipe for ms milliseconds (the rest of
+ * the current second), once its byte budget is spent. Returns 0, or -1 if no
+ * timer could be set up, in which case the pipe keeps being read.
+ */
+static int throttle(merge_t *m, long ms) {
+    struct itimerspec when;
+    memset(&when, 0, sizeof(when));
+    when.it_value.tv_sec = ms / 1000;
+    when.it_value.tv_nsec = (ms % 1000) * 1000000;
+
+    int fd;
+    if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) <
+        0) {
+        return -1;
+    } else if (timerfd_settime(fd, 0, &when, NULL) < 0 ||
+               watch_fd(fd, resume, m) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    unwatch_fd(m->in);
+    return 0;
+}
+
+/* adds data (not containing a newline) to the partial line */
+static void hold(merge_t *m, const char *data, size_t len) {
+    while (len) {
+        size_t n = MERGE_LINE - m->nline;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(m->line + m->nline, data, n);
+        m->nline += n;
+        data += n;
+        len -= n;
+
+        if (m->nline == MERGE_LINE) {  // too long to hold back any further
+            emit(m, m->line, m->nline);
+            m->nline = 0;
+        }
+    }
+}
+
+/* sets the prefix for the lines about to be read */
+static void set_prefix(merge_t *m) {
+    int n = 0;
+    if (m->mode == MERGE_TAG || m->mode == MERGE_TIME) {
+        n = snprintf(m->prefix, sizeof(m->prefix), "[%d] ", m->jid);
+    }
+
+    if (m->mode == MERGE_TIME) {
+        struct timespec now;
+        struct tm tm;
+        clock_gettime(CLOCK_REALTIME, &now);
+        localtime_r(&now.tv_sec, &tm);
+        n += snprintf(m->prefix + n, sizeof(m->prefix) - (size_t)n,
+                      "%02d:%02d:%02d.%03ld ", tm.tm_hour, tm.tm_min, tm.tm_sec,
+                      now.tv_nsec / 1000000);
+    }
+
+    m->nprefix = (size_t)n;
+}
+
+/*
+ * merge_drain()
+ *
+ * - Description: event callback for a merged job's pipe: reads what is
+ * available, batches the whole lines in it and writes them out. At end of
+ * file, writes out the last partial line (with a newline added) and frees
+ * the merger.
+ */
+static void merge_drain(int fd, void *arg) {
+    merge_t *m = (merge_t *)arg;
+    set_prefix(m);
+
+    char buf[MERGE_LINE];
+    ssize_t n;
+    while (1) {
+        long left = window_left(m);
+        size_t size = sizeof(buf);
+        if (m->limit.bytes && m->bytes >= m->limit.bytes) {
+            if (throttle(m, left) == 0) {
+                flush_batch(m);
+                return;
+            }
+        } else if (m->limit.bytes && m->limit.bytes - m->bytes < (long)size) {
+            size = (size_t)(m->limit.bytes - m->bytes);
+        }
+
+        if ((n = read(fd, buf, size)) < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+        m->bytes += n;
+
+        const char *p = buf;
+        const char *end = buf + n;
+        const char *nl;
+        while ((nl = memchr(p, '\n', (size_t)(end - p)))) {
+            if (m->nline) {
+                hold(m, p, (size_t)(nl - p));
+                emit(m, m->line, m->nline);
+                m->nline = 0;
+            } else {
+                emit(m, p, (size_t)(nl - p));
+            }
+            p = nl + 1;
+        }
+        hold(m, p, (size_t)(end - p));
+    }
+
+    if (n < 0 && errno == EAGAIN) {
+        flush_batch(m);
+        return;
+    }
+
+    // end of file (or an error): the job is done with the pipe
+    if (m->nline) {
+        emit(m, m->line, m->nline);
+    }
+    report_suppressed(m);
+    flush_batch(m);
+
+    unwatch_fd(fd);
+    close(fd);
+    close(m->out);
+    free(m);
+}
+
+/*
+ * start_merge()
+ *
+ * - Description: starts merging a background job's output. Returns 0, or -1
+ * (after printing an error) on failure, in which case fd is closed and the
+ * job's output is lost.
+ *
+ * - Arguments: jid: the job's id (for the prefix), fd: read end of the pipe
+ * the job's standard output and error go to (the merger takes ownership of
+ * it), out: where to write the lines (a copy is kept, i.e. of the session's
+ * standard output), mode: prefix to write, limit: budgets (copied)
+ *
+ * - Usage: called by the shell right after launching the job, once the write
+ * end of the pipe has been closed in the shell
+ */
+int start_merge(int jid, int fd, int out, merge_mode_t mode,
+                const outlimit_t *limit) {
+    merge_t *m = (merge_t *)malloc(sizeof(merge_t));
+    if (!m || (m->out = fcntl(out, F_DUPFD_CLOEXEC, 3)) < 0) {
+        perror("merge");
+        free(m);
+        close(fd);
+        return -1;
+    }
+
+    m->jid = jid;
+    m->in = fd;
+    m->mode = mode;
+    m->nprefix = 0;
+    m->nline = 0;
+    m->nbatch = 0;
+    m->limit = *limit;
+    clock_gettime(CLOCK_MONOTONIC, &m->window);
+    m->lines = 0;
+    m->bytes = 0;
+    m->suppressed = 0;
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if (watch_fd(fd, merge_drain, m) < 0) {
+        close(m->out);
+        free(m);
+        close(fd);
+        return -1;
+    }
+
+    return 0;
+}
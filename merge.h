@@ -0,0 +1,29 @@
+#ifndef MERGE_H_
+#define MERGE_H_
+
+// how merged output lines are prefixed (see set merge)
+typedef enum { MERGE_OFF, MERGE_ON, MERGE_TAG, MERGE_TIME } merge_mode_t;
+
+// per-job output budgets for set outlimit, per second (0 for no limit)
+typedef struct {
+    long lines;  // lines over this are dropped, and counted
+    long bytes;  // past this, the job's pipe is not read until the next second
+} outlimit_t;
+
+// longest line written in one piece; longer lines are split
+#define MERGE_LINE 4096
+// most bytes (of whole lines) written to the terminal in one write()
+#define MERGE_BATCH 16384
+
+/*
+ * starts merging the output of job jid: fd is the read end of the pipe the
+ * job writes its standard output and error to, which is drained by the event
+ * loop (see events.h) and written to out in whole lines, each prefixed
+ * according to mode, within the budgets in limit. takes ownership of fd, and
+ * dups out. returns 0, or -1 (after printing an error, and closing fd) on
+ * failure
+ */
+int start_merge(int jid, int fd, int out, merge_mode_t mode,
+                const outlimit_t *limit);
+
+#endif  // MERGE_H_
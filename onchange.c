@@ -0,0 +1,480 @@
+#define _GNU_SOURCE  // memfd_create()
+#include "./onchange.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include "./dirs.h"
+#include "./events.h"
+
+/*
+ * Each watcher has an inotify descriptor and a timerfd, both watched by the
+ * event loop (see events.c), so they are handled while the shell waits for
+ * input, or for a job. Every event notes the path that changed and pushes
+ * the timer back to a window from now; the command is only run when the
+ * timer goes off, i.e. once a burst of events (say, a file being written
+ * bit by bit, or a directory being unpacked) has been quiet for a window,
+ * with every path that changed in it, once. With -r, directories created
+ * in a watched one are watched as they appear.
+ */
+
+// milliseconds of quiet that end a burst of changes, when not told
+#define DEFAULT_WINDOW 100
+// most changed paths kept for one run (a burst with more runs early)
+#define MAX_CHANGED 256
+// events a watch reports
+#define WATCH_EVENTS                                                      \
+    (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM | \
+     IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* an inotify watch, and the path it was added for */
+typedef struct {
+    int wd;
+    char *path;
+} watch_t;
+
+/* a running onchange */
+typedef struct watcher {
+    int id;
+    int ifd;    // inotify descriptor
+    int timer;  // timerfd ending a burst
+    int recursive;
+    int on_stdin;  // whether paths go to the command's standard input
+    long window;   // milliseconds
+    command_t *cmd;
+    char *text;  // the paths and command, for listing
+    trigger_fn run;
+    watch_t *watches;
+    int nwatches;
+    int cap;
+    char *changed[MAX_CHANGED];  // paths changed in this burst
+    int nchanged;
+    struct watcher *next;
+} watcher_t;
+
+static watcher_t *watchers = NULL;
+static int next_id = 1;
+
+static void add_tree(watcher_t *w, int cwd, const char *path);
+
+/* watches path (relative to cwd); returns 0 or -1 (with errno set) */
+static int add_watch(watcher_t *w, int cwd, const char *path) {
+    char proc[4096];
+    const char *at = path;
+    if (cwd != AT_FDCWD && path[0] != '/') {  // (inotify has no *at())
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d/%s", cwd, path);
+        at = proc;
+    }
+
+    int wd;
+    if ((wd = inotify_add_watch(w->ifd, at, WATCH_EVENTS)) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < w->nwatches; i++) {
+        if (w->watches[i].wd == wd) {  // (already watched, under a path)
+            return 0;
+        }
+    }
+
+    if (w->nwatches == w->cap) {
+        int cap = w->cap ? 2 * w->cap : 8;
+        watch_t *grown =
+            (watch_t *)realloc(w->watches, (size_t)cap * sizeof(watch_t));
+        if (!grown) {
+            return -1;
+        }
+        w->watches = grown;
+        w->cap = cap;
+    }
+
+    char *copy;
+    if (!(copy = strdup(path))) {
+        return -1;
+    }
+    w->watches[w->nwatches].wd = wd;
+    w->watches[w->nwatches].path = copy;
+    w->nwatches++;
+    return 0;
+}
+
+/* returns dir/name, malloc()ed (or NULL) */
+static char *join_path(const char *dir, const char *name) {
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    int slash = dlen && dir[dlen - 1] != '/';
+    char *path;
+    if ((path = (char *)malloc(dlen + (size_t)slash + nlen + 1))) {
+        memcpy(path, dir, dlen);
+        path[dlen] = '/';
+        memcpy(path + dlen + (size_t)slash, name, nlen + 1);
+    }
+    return path;
+}
+
+/*
+ * returns path made absolute (relative to directory cwd, i.e. the shell's or
+ * a session's), malloc()ed, or NULL (with errno set). watches keep absolute
+ * paths, so directories found later are added, and changed paths reported,
+ * the same wherever the shell has gone since
+ */
+static char *absolute_path(int cwd, const char *path) {
+    if (path[0] == '/') {
+        return strdup(path);
+    }
+
+    char dir[4096], link[64];
+    if (cwd == AT_FDCWD) {
+        if (!getcwd(dir, sizeof(dir))) {
+            return NULL;
+        }
+    } else {
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", cwd);
+        ssize_t len = readlink(link, dir, sizeof(dir) - 1);
+        if (len < 0) {
+            return NULL;
+        }
+        dir[len] = '\0';
+    }
+
+    while (!strncmp(path, "./", 2)) {
+        path += 2;
+    }
+    return strcmp(path, ".") ? join_path(dir, path) : strdup(dir);
+}
+
+/* a directory being walked by add_tree() */
+typedef struct {
+    watcher_t *w;
+    int cwd;
+    int fd;
+    const char *path;
+} walk_t;
+
+/* list_dir() callback: watches the subdirectories of a directory */
+static void walk_entry(const char *name, unsigned char type, void *arg) {
+    walk_t *walk = (walk_t *)arg;
+    struct stat st;
+    if (type == DT_UNKNOWN &&
+        !fstatat(walk->fd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+        type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+    }
+    if (type != DT_DIR) {
+        return;
+    }
+
+    char *path;
+    if ((path = join_path(walk->path, name))) {
+        add_tree(walk->w, walk->cwd, path);
+        free(path);
+    }
+}
+
+/* watches path and, if it is a directory, every directory under it */
+static void add_tree(watcher_t *w, int cwd, const char *path) {
+    if (add_watch(w, cwd, path) < 0) {
+        return;  // (it may be gone already)
+    }
+
+    walk_t walk = {w, cwd, -1, path};
+    if ((walk.fd = openat(
+             cwd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+        return;
+    }
+    list_dir(walk.fd, walk_entry, &walk);
+    close(walk.fd);
+}
+
+/* starts (or restarts) the timer ending a burst, ms milliseconds from now */
+static void arm_timer(watcher_t *w, long ms) {
+    struct itimerspec when;
+    memset(&when, 0, sizeof(when));
+    when.it_value.tv_sec = ms / 1000;
+    when.it_value.tv_nsec = (ms % 1000) * 1000000;
+    timerfd_settime(w->timer, 0, &when, NULL);
+}
+
+/* notes that path changed, unless it already did in this burst */
+static void note_change(watcher_t *w, const char *dir, const char *name) {
+    char *path;
+    if (!(path = *name ? join_path(dir, name) : strdup(dir))) {
+        return;
+    }
+
+    for (int i = 0; i < w->nchanged; i++) {
+        if (!strcmp(w->changed[i], path)) {
+            free(path);
+            return;
+        }
+    }
+    if (w->nchanged < MAX_CHANGED) {
+        w->changed[w->nchanged++] = path;
+    } else {
+        free(path);
+    }
+}
+
+/* event callback for a watcher's inotify descriptor */
+static void on_events(int fd, void *arg) {
+    watcher_t *w = (watcher_t *)arg;
+    // (aligned for the events' int fields)
+    uint64_t buf[4096 / sizeof(uint64_t)];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t off = 0; off < n;) {
+            struct inotify_event *ev =
+                (struct inotify_event *)((char *)buf + off);
+            off += (ssize_t)(sizeof(struct inotify_event) + ev->len);
+
+            int i = 0;
+            while (i < w->nwatches && w->watches[i].wd != ev->wd) {
+                i++;
+            }
+            if (ev->mask & IN_Q_OVERFLOW) {  // (events were lost)
+                for (int k = 0; k < w->nwatches; k++) {
+                    note_change(w, w->watches[k].path, "");
+                }
+                continue;
+            } else if (i == w->nwatches) {
+                continue;
+            }
+
+            const char *dir = w->watches[i].path;
+            const char *name = ev->len ? ev->name : "";
+            if (ev->mask & IN_IGNORED) {  // (the watch is gone)
+                free(w->watches[i].path);
+                w->watches[i] = w->watches[--w->nwatches];
+                continue;
+            }
+            if (w->recursive && (ev->mask & IN_ISDIR) &&
+                (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+                char *path;
+                if ((path = join_path(dir, name))) {
+                    add_tree(w, AT_FDCWD, path);
+                    free(path);
+                }
+            }
+            note_change(w, dir, name);
+        }
+    }
+
+    if (w->nchanged) {
+        // a full list ends the burst now, anything else pushes its end back
+        arm_timer(w, w->nchanged == MAX_CHANGED ? 1 : w->window);
+    }
+}
+
+/* event callback for a watcher's timer: runs its command */
+static void on_timer(int fd, void *arg) {
+    watcher_t *w = (watcher_t *)arg;
+    uint64_t ticks;
+    if (read(fd, &ticks, sizeof(ticks)) < 0 || !w->nchanged) {
+        return;
+    }
+
+    // with -s, the paths are listed in a memfd for the command to read
+    int in = -1;
+    if (w->on_stdin && (in = memfd_create("onchange", MFD_CLOEXEC)) >= 0) {
+        for (int i = 0; i < w->nchanged; i++) {
+            dprintf(in, "%s\n", w->changed[i]);
+        }
+        lseek(in, 0, SEEK_SET);
+    }
+
+    int ran = w->run(w->cmd, w->on_stdin ? NULL : w->changed,
+                     w->on_stdin ? 0 : w->nchanged, in);
+    if (in >= 0) {
+        close(in);
+    }
+    if (ran < 0) {  // (the shell is busy: try again after another window)
+        arm_timer(w, w->window);
+        return;
+    }
+
+    for (int i = 0; i < w->nchanged; i++) {
+        free(w->changed[i]);
+    }
+    w->nchanged = 0;
+}
+
+/* stops a watcher and frees it */
+static void free_watcher(watcher_t *w) {
+    if (w->ifd >= 0) {
+        unwatch_fd(w->ifd);
+        close(w->ifd);
+    }
+    if (w->timer >= 0) {
+        unwatch_fd(w->timer);
+        close(w->timer);
+    }
+    for (int i = 0; i < w->nwatches; i++) {
+        free(w->watches[i].path);
+    }
+    for (int i = 0; i < w->nchanged; i++) {
+        free(w->changed[i]);
+    }
+    free(w->watches);
+    free_command(w->cmd);
+    free(w->text);
+    free(w);
+}
+
+/*
+ * start_watcher()
+ *
+ * - Description: sets up a watcher for argv[first...] (paths, then -- and
+ * the command) and adds it to the list. Returns 0, or 1 (after printing an
+ * error) on failure.
+ */
+static int start_watcher(watcher_t *w, char *argv[], int argc, int first,
+                         int cwd) {
+    int sep = first;
+    while (sep < argc && strcmp(argv[sep], "--")) {
+        sep++;
+    }
+    if (sep == first || sep + 1 >= argc) {
+        write(STDERR_FILENO, "onchange: syntax error\n", 23);
+        return 1;
+    }
+
+    // the command, built once, and the whole line, for listing
+    size_t len = 0, cmd_at = 0;
+    for (int i = first; i < argc; i++) {
+        len += strlen(argv[i]) + 1;
+        cmd_at = i == sep ? len : cmd_at;
+    }
+    if (!(w->text = (char *)malloc(len))) {
+        perror("onchange");
+        return 1;
+    }
+    char *at = w->text;
+    for (int i = first; i < argc; i++) {
+        at = stpcpy(at, argv[i]);
+        *at++ = i + 1 < argc ? ' ' : '\0';
+    }
+    // (several words are taken as they were parsed, a single one is compiled
+    // as a line, as with watch)
+    w->cmd = sep + 2 == argc
+                 ? compile_command(w->text + cmd_at, len - cmd_at - 1)
+                 : words_command(argv + sep + 1, argc - sep - 1);
+    if (!w->cmd) {
+        return 1;
+    }
+
+    if ((w->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0 ||
+        (w->timer =
+             timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        perror("onchange");
+        return 1;
+    }
+
+    for (int i = first; i < sep; i++) {
+        int before = w->nwatches;
+        char *path;
+        if (!(path = absolute_path(cwd, argv[i]))) {
+            perror("onchange");
+            return 1;
+        }
+        if (w->recursive) {
+            add_tree(w, AT_FDCWD, path);
+        } else {
+            add_watch(w, AT_FDCWD, path);
+        }
+        int err = errno;
+        free(path);
+        if (w->nwatches == before) {
+            fprintf(stderr, "onchange: %s: %s\n", argv[i], strerror(err));
+            return 1;
+        }
+    }
+
+    if (watch_fd(w->ifd, on_events, w) < 0) {
+        return 1;
+    } else if (watch_fd(w->timer, on_timer, w) < 0) {
+        unwatch_fd(w->ifd);
+        return 1;
+    }
+
+    w->id = next_id++;
+    w->next = watchers;
+    watchers = w;
+    return 0;
+}
+
+/*
+ * onchange()
+ *
+ * - Description: the onchange builtin, see onchange.h.
+ */
+int onchange(char *argv[], int argc, int cwd, trigger_fn run) {
+    if (argc == 1) {  // list the watchers, oldest first
+        int n = 0;
+        for (watcher_t *w = watchers; w; w = w->next) {
+            n++;
+        }
+        for (int k = n; k > 0; k--) {
+            watcher_t *w = watchers;
+            for (int i = 1; i < k; i++) {
+                w = w->next;
+            }
+            printf("[%d] %s\n", w->id, w->text);
+        }
+        fflush(stdout);
+        return 0;
+    }
+
+    if (!strcmp(argv[1], "-k")) {
+        char *end;
+        long id = argc == 3 ? strtol(argv[2], &end, 10) : 0;
+        for (watcher_t **w = &watchers; id > 0 && !*end && *w;
+             w = &(*w)->next) {
+            if ((*w)->id == id) {
+                watcher_t *gone = *w;
+                *w = gone->next;
+                free_watcher(gone);
+                return 0;
+            }
+        }
+        write(STDERR_FILENO, "onchange: no such watcher\n", 26);
+        return 1;
+    }
+
+    watcher_t *w;
+    if (!(w = (watcher_t *)calloc(1, sizeof(watcher_t)))) {
+        perror("onchange");
+        return 1;
+    }
+    w->ifd = w->timer = -1;
+    w->window = DEFAULT_WINDOW;
+    w->run = run;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && strcmp(argv[i], "--"); i++) {
+        if (!strcmp(argv[i], "-r")) {
+            w->recursive = 1;
+        } else if (!strcmp(argv[i], "-s")) {
+            w->on_stdin = 1;
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            char *end;
+            w->window = strtol(argv[++i], &end, 10);
+            if (*end || w->window < 1) {
+                i = argc;  // (a syntax error)
+                break;
+            }
+        } else {
+            i = argc;
+            break;
+        }
+    }
+
+    if (start_watcher(w, argv, argc, i, cwd)) {
+        free_watcher(w);
+        return 1;
+    }
+    return 0;
+}
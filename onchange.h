@@ -0,0 +1,25 @@
+#ifndef ONCHANGE_H_
+#define ONCHANGE_H_
+
+#include "./parsing.h"
+
+/*
+ * called once a burst of changes is over, to run a watcher's command with the
+ * paths that changed (as extra arguments), or with in (if it is not -1) as
+ * its standard input, on which they are listed instead. returns 0 if the
+ * command was run, -1 if it cannot be now (the shell is busy), in which case
+ * it is tried again later
+ */
+typedef int (*trigger_fn)(command_t *cmd, char **paths, int npaths, int in);
+
+/*
+ * the onchange builtin: onchange [-r] [-s] [-t ms] path... -- cmd... watches
+ * the paths (directories recursively with -r, relative to directory cwd),
+ * and once changes to them have stopped for ms milliseconds, runs cmd by
+ * calling run(), with the changed paths (made absolute) as arguments (or on
+ * its standard input with -s). with no arguments, lists the watchers; onchange
+ * -k id removes one. returns 0, or 1 on an error
+ */
+int onchange(char *argv[], int argc, int cwd, trigger_fn run);
+
+#endif  // ONCHANGE_H_
@@ -6,6 +6,244 @@
 #include <string.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include "scan.h"
+
+// the buffer being tokenized, and which of its tokens were quoted (per
+// thread, since batch input is compiled ahead on a thread of its own)
+static __thread char *lex_base = NULL;
+static __thread char lex_quoted[1024];
+
+// where syntax errors are kept instead of being written (see defer_errors())
+static __thread char *err_buf = NULL;
+static __thread size_t err_size = 0;
+static __thread size_t *err_len = NULL;
+
+/*
+ * defer_errors()
+ *
+ * - Description: makes the syntax errors of the calling thread be appended to
+ * buf (truncated at size bytes), with *len the number of bytes in it, rather
+ * than written to standard error; or, if buf is NULL, written again.
+ *
+ * - Usage: lets a line be compiled ahead of time, and its errors be written
+ * when it would have been compiled, so that they stay in order with the
+ * output of the commands before it.
+ */
+void defer_errors(char *buf, size_t size, size_t *len) {
+    err_buf = buf;
+    err_size = size;
+    err_len = len;
+}
+
+/*
+ * syntax_error()
+ *
+ * - Description: reports a syntax error, msg (of len bytes, ending in a
+ * newline), on standard error, or to the buffer given to defer_errors().
+ */
+void syntax_error(const char *msg, size_t len) {
+    if (!err_buf) {
+        write(STDERR_FILENO, msg, len);
+        return;
+    }
+
+    size_t room = err_size - *err_len;
+    len = len < room ? len : room;
+    memcpy(err_buf + *err_len, msg, len);
+    *err_len += len;
+}
+
+/*
+ * skip_expansion()
+ *
+ * - Description: returns a pointer just past the "))" closing the $((...))
+ * expansion that starts at p, or to the terminating NUL if it is unterminated
+ *
+ * - Arguments: p: pointer to the "$((" (or ARITH_MARK "((") of an expansion
+ */
+static char *skip_expansion(char *p) {
+    int depth = 0;
+    for (p += 3; *p; p++) {
+        if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && depth) {
+            depth--;
+        } else if (*p == ')' && p[1] == ')') {
+            return p + 2;
+        }
+    }
+
+    return p;
+}
+
+/*
+ * check_quotes()
+ *
+ * - Description: checks that every quote in the buffer is closed. Returns 0 if
+ * so, -1 (after printing an error) otherwise.
+ *
+ * - Arguments: p: the buffer to check
+ */
+static int check_quotes(char *p) {
+    while (*p) {
+        if (!strncmp(p, "$((", 3)) {
+            p = skip_expansion(p);
+        } else if (*p == '\\') {
+            p += p[1] ? 2 : 1;
+        } else if (*p == '\'' || *p == '"') {
+            char quote = *p++;
+            while (*p && *p != quote) {
+                p += (quote == '"' && *p == '\\' && p[1]) ? 2 : 1;
+            }
+
+            if (!*p) {
+                syntax_error("syntax error: unterminated quote\n", 33);
+                return -1;
+            }
+            p++;
+        } else {
+            p++;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * copy_expansion()
+ *
+ * - Description: copies a $((...)) expansion verbatim from *in to *out,
+ * replacing the '$' with ARITH_MARK so that the expansion is evaluated later
+ * (a '$' that was quoted or escaped stays a plain '$'). Advances both
+ * pointers.
+ *
+ * - Arguments: in: read position, at the "$((", out: write position
+ */
+static void copy_expansion(char **in, char **out) {
+    char *end = skip_expansion(*in);
+    **out = ARITH_MARK;
+    memmove(*out + 1, *in + 1, (size_t)(end - *in - 1));
+    *out += end - *in;
+    *in = end;
+}
+
+/*
+ * next_token()
+ *
+ * - Description: strtok()-style tokenizer that splits the buffer on tabs and
+ * spaces and removes quoting, in place. Single quotes preserve everything up
+ * to the closing quote; double quotes preserve everything except $((...)) and
+ * backslash escapes of ", \, $ and `; a backslash outside of quotes preserves
+ * the next character. $((...)) expansions are kept whole even if they contain
+ * whitespace. Returns the next token, or NULL if there are none left.
+ *
+ * - Arguments: str: the buffer to start tokenizing, or NULL to continue with
+ * the buffer given in the previous call
+ *
+ * - Usage: runs of plain characters are skipped with scan_plain(), so long
+ * unquoted arguments are copied 16-32 bytes at a time.
+ *
+ *      /bin/echo 'Hello world!' -> "/bin/echo", "Hello world!", NULL
+ *      /bin/echo a\ b"c d"'$((1))' -> "/bin/echo", "a bc d$((1))", NULL
+ *      /bin/echo $(( 1 + 2 ))x -> "/bin/echo", "\1(( 1 + 2 ))x", NULL
+ */
+char *next_token(char *str) {
+    static __thread char *pos = NULL;
+    if (str) {
+        pos = str;
+        lex_base = str;
+        memset(lex_quoted, 0, sizeof(lex_quoted));
+        if (check_quotes(str) < 0) {
+            pos = NULL;
+        }
+    }
+
+    if (!pos) {
+        return NULL;
+    }
+
+    pos += strspn(pos, "\t ");
+    if (!*pos) {
+        pos = NULL;
+        return NULL;
+    }
+
+    char *tok = pos;
+    char *out = pos;  // unquoted text is written here, never ahead of pos
+    int quoted = 0;
+    while (1) {
+        size_t n = scan_plain(pos);
+        if (out != pos) {
+            memmove(out, pos, n);
+        }
+        out += n;
+        pos += n;
+
+        if (!*pos || *pos == ' ' || *pos == '\t') {
+            break;
+        } else if (*pos == '$') {
+            if (!strncmp(pos, "$((", 3)) {
+                copy_expansion(&pos, &out);
+            } else {
+                *out++ = *pos++;
+            }
+        } else if (*pos == '\\') {
+            quoted = 1;
+            if (*++pos) {
+                *out++ = *pos++;
+            }
+        } else if (*pos == '\'') {
+            quoted = 1;
+            char *close = strchr(pos + 1, '\'');
+            memmove(out, pos + 1, (size_t)(close - pos - 1));
+            out += close - pos - 1;
+            pos = close + 1;
+        } else {  // double quote
+            quoted = 1;
+            pos++;
+            while (*pos && *pos != '"') {
+                if (*pos == '\\' && pos[1] && strchr("\"\\$`", pos[1])) {
+                    pos++;
+                    *out++ = *pos++;
+                } else if (!strncmp(pos, "$((", 3)) {
+                    copy_expansion(&pos, &out);
+                } else {
+                    *out++ = *pos++;
+                }
+            }
+
+            if (*pos) {
+                pos++;
+            }
+        }
+    }
+
+    // terminate the token, then step past the delimiter (if any)
+    char delim = *pos;
+    *out = '\0';
+    pos = delim ? pos + 1 : NULL;
+
+    if (tok - lex_base < (long)sizeof(lex_quoted)) {
+        lex_quoted[tok - lex_base] = (char)quoted;
+    }
+
+    return tok;
+}
+
+/*
+ * is_quoted()
+ *
+ * - Description: returns 1 if the given token (returned by next_token() for
+ * the buffer currently being parsed) contained any quoting, 0 otherwise.
+ * Quoted tokens are never treated as operators, so '>' or "&" are plain
+ * arguments.
+ *
+ * - Arguments: tok: the token
+ */
+int is_quoted(char *tok) {
+    long off = tok - lex_base;
+    return off >= 0 && off < (long)sizeof(lex_quoted) && lex_quoted[off];
+}
 
 /*
  * id_rd_tok()
@@ -18,14 +256,14 @@
  *
  * - Usage:
  *          if token is:
- *              null -> -1
+ *              null or quoted -> -1
  *              "<" -> 0 (input)
  *              ">" -> 1 (normal output)
  *              ">>" -> 2 (append output)
  *              anything else -> -1
  */
 int id_rd_tok(char *tok) {
-    if (!tok) {
+    if (!tok || is_quoted(tok)) {  // quoted symbols are plain arguments
         return -1;
     } else if (!strncmp(tok, "<", 2)) {  // input is set
         return 0;
@@ -69,30 +307,29 @@ int set_tok(char **tok_ptr, int mode, int i, int *offset, char *tokens[512],
     tokens[i + *offset] = *tok_ptr;
     (*offset)++;
 
-    if (!(*tok_ptr = strtok(NULL, "\t "))) {  // if next tok is null
+    if (!(*tok_ptr = next_token(NULL))) {  // if next tok is null
         switch (mode) {
             case 0:
-                write(STDERR_FILENO, "syntax error: no input file\n", 28);
+                syntax_error("syntax error: no input file\n", 28);
                 break;
             case 1:
             case 2:
-                write(STDERR_FILENO, "syntax error: no output file\n", 29);
+                syntax_error("syntax error: no output file\n", 29);
                 break;
         }
 
         return -1;
     } else {                             // there is a file
         if (id_rd_tok(*tok_ptr) >= 0) {  // file is redirection symbol
-            write(STDERR_FILENO,
-                  "syntax error: input file is a redirection symbol\n", 49);
+            syntax_error("syntax error: input file is a redirection symbol\n",
+                         49);
             return -1;
         }
 
         switch (mode) {  // checking if redir is already set
             case 0:
                 if (redir[0]) {  // already an input file
-                    write(STDERR_FILENO, "syntax error: multiple input files\n",
-                          35);
+                    syntax_error("syntax error: multiple input files\n", 35);
                     return -1;
                 }
 
@@ -100,8 +337,7 @@ int set_tok(char **tok_ptr, int mode, int i, int *offset, char *tokens[512],
             case 1:
             case 2:
                 if (redir[1] + redir[2]) {  // already an output file
-                    write(STDERR_FILENO,
-                          "syntax error: multiple output files\n", 36);
+                    syntax_error("syntax error: multiple output files\n", 36);
                     return -1;
                 }
 
@@ -111,9 +347,9 @@ int set_tok(char **tok_ptr, int mode, int i, int *offset, char *tokens[512],
         tokens[i + *offset] = *tok_ptr;  // put new token in array
         redir[mode] = i + *offset;       // set redir appropriately
         (*offset)++;                     // increment offset
-        *tok_ptr = strtok(NULL, "\t ");  // get new token
+        *tok_ptr = next_token(NULL);     // get new token
         if (!*tok_ptr && !i) {  // no more tokens but argv is still empty
-            write(STDERR_FILENO, "error: redirects with no command\n", 33);
+            syntax_error("error: redirects with no command\n", 33);
             return -1;
         }
 
@@ -176,22 +412,21 @@ char *handle_redir(char *tok, char *tokens[512], int *offset, int *redir,
  *
  *      cd dir -> [cd, dir]
  *      [tab]mkdir[tab][space]name -> [mkdir, name]
- *      /bin/echo 'Hello world!' -> [/bin/echo, 'Hello, world!']
+ *      /bin/echo 'Hello world!' -> [/bin/echo, Hello world!]
  *
  *      For the argv array:
  *
- *       char *argv[4];
+ *       char *argv[3];
  *       argv[0] = echo;
- *       argv[1] = 'Hello;
- *       argv[2] = world!';
- *       argv[3] = NULL;
+ *       argv[1] = Hello world!;
+ *       argv[2] = NULL;
  *
  */
 int parse(char buffer[1024], char *tokens[512], char *argv[512], int redir[4]) {
     int i = 0;  // indicates current position in tokens/args arrays
 
     // first token
-    char *curr_tok = strtok(buffer, "\t ");
+    char *curr_tok = next_token(buffer);
     int offset = 0;
 
     if ((curr_tok = handle_redir(curr_tok, tokens, &offset, redir, i)) ==
@@ -216,7 +451,7 @@ int parse(char buffer[1024], char *tokens[512], char *argv[512], int redir[4]) {
 
     // remaining arguments
     for (i = 1; i < 512 && curr_tok != NULL; i++) {
-        curr_tok = strtok(NULL, "\t ");
+        curr_tok = next_token(NULL);
         if ((curr_tok = handle_redir(curr_tok, tokens, &offset, redir, i)) ==
             (char *)1) {
             // redirection returned an error
@@ -227,11 +462,291 @@ int parse(char buffer[1024], char *tokens[512], char *argv[512], int redir[4]) {
         argv[i] = curr_tok;  // last iteration null-terminates argv
     }
 
-    if (!strncmp(argv[i - 2], "&", 2)) {
+    if (!strncmp(argv[i - 2], "&", 2) && !is_quoted(argv[i - 2])) {
         redir[3] = 1;  // launch process in bg
         i--;
         argv[i - 1] = NULL;
     }
 
     return i - 1;  // i = number of elements in argv including final null
-}
\ No newline at end of file
+}
+/*
+ * build_argv()
+ *
+ * - Description: rebuilds the argv array for a tokens array that was laid out
+ * by parse(), skipping redirection symbols and files and a trailing & that
+ * sends the job to the background. Returns the number of arguments.
+ *
+ * - Arguments: tokens: NULL-terminated array of tokens, redir: redirection
+ * information filled in by parse(), argv: array to fill in (must have room for
+ * every token plus a terminating NULL)
+ *
+ * - Usage: used when tokens are replaced after parsing (i.e. by expansion), so
+ * that argv points at the new tokens.
+ *
+ *      tokens = [/bin/echo, 3, >, out, &], redir = {0, 3, 0, 1}
+ *          -> argv = [/echo, 3, NULL], returns 2
+ */
+int build_argv(char **tokens, int redir[4], char **argv) {
+    int argc = 0;
+    for (int i = 0; tokens[i]; i++) {
+        int skip = 0;
+        for (int mode = 0; mode < 3; mode++) {
+            if (redir[mode] && (i == redir[mode] || i == redir[mode] - 1)) {
+                skip = 1;  // redirection symbol or file
+            }
+        }
+
+        if (!skip) {
+            argv[argc++] = tokens[i];
+        }
+    }
+
+    if (redir[3] && argc) {  // drop the trailing &
+        argc--;
+    }
+
+    argv[argc] = NULL;
+
+    // see parse(): argv[0] of a file path keeps only the last '/'
+    if (argc && argv[0][0] == '/') {
+        argv[0] = strrchr(argv[0], '/');
+    }
+
+    return argc;
+}
+
+/*
+ * compile_command()
+ *
+ * - Description: parses a single line of input into a heap-allocated command
+ * that can be executed any number of times. Returns NULL if the line was empty
+ * or could not be parsed (parse() reports syntax errors itself). Tokens with
+ * $((...)) arithmetic expansions are compiled as well; expansions that fold to
+ * constants are substituted right away, the rest are expanded on every
+ * execution by expand_command().
+ *
+ * - Arguments: line: the line to parse (need not be NUL-terminated and must not
+ * contain the trailing newline), len: length of the line in bytes
+ *
+ * - Usage: the returned command owns copies of everything it points to and
+ * must be released with free_command().
+ *
+ *      command_t *cmd = compile_command("/bin/echo hi > out", 18);
+ *          cmd->argv -> [/echo, hi, NULL]
+ *          cmd->tokens -> [/bin/echo, hi, >, out, NULL]
+ *          cmd->redir -> {0, 3, 0, 0}
+ */
+command_t *compile_command(const char *line, size_t len) {
+    char buf[1024];
+    char *tokens[512];
+    char *argv[512];
+    int redir[4] = {0, 0, 0, 0};
+
+    if (len >= 1024) {
+        syntax_error("syntax error: line too long\n", 28);
+        return NULL;
+    }
+
+    memset(buf, 0, 1024);
+    memset(tokens, 0, 512 * sizeof(char *));
+    memset(argv, 0, 512 * sizeof(char *));
+    memcpy(buf, line, len);
+
+    int argc;
+    if ((argc = parse(buf, tokens, argv, redir)) < 0) {
+        return NULL;
+    }
+
+    int ntok = 0;
+    while (ntok < 511 && tokens[ntok]) {
+        ntok++;
+    }
+
+    command_t *cmd = (command_t *)malloc(sizeof(command_t));
+    if (!cmd) {
+        perror("malloc");
+        return NULL;
+    }
+
+    cmd->store = (char *)malloc(len + 1);
+    cmd->tokens = (char **)calloc((size_t)ntok + 1, sizeof(char *));
+    cmd->argv = (char **)calloc((size_t)ntok + 1, sizeof(char *));
+    cmd->words = NULL;
+    cmd->ntok = ntok;
+    cmd->dynamic = 0;
+    if (!cmd->store || !cmd->tokens || !cmd->argv) {
+        perror("malloc");
+        free_command(cmd);
+        return NULL;
+    }
+
+    // tokens point into buf, so rebase them onto our own copy of it
+    memcpy(cmd->store, buf, len + 1);
+    for (int i = 0; i < ntok; i++) {
+        cmd->tokens[i] = cmd->store + (tokens[i] - buf);
+    }
+    for (int i = 0; i < argc; i++) {
+        cmd->argv[i] = cmd->store + (argv[i] - buf);
+    }
+
+    cmd->argc = argc;
+    memcpy(cmd->redir, redir, sizeof(redir));
+
+    // compile arithmetic expansions
+    for (int i = 0; i < ntok; i++) {
+        if (!has_expansion(cmd->tokens[i])) {
+            continue;
+        }
+
+        if (!cmd->words &&
+            !(cmd->words = (word_t **)calloc((size_t)ntok, sizeof(word_t *)))) {
+            perror("calloc");
+            free_command(cmd);
+            return NULL;
+        }
+
+        if (!(cmd->words[i] = compile_word(cmd->tokens[i]))) {
+            free_command(cmd);
+            return NULL;
+        }
+
+        if (word_literal(cmd->words[i])) {  // folded to a constant
+            cmd->tokens[i] = word_literal(cmd->words[i]);
+        } else {
+            cmd->dynamic = 1;
+        }
+    }
+
+    if (cmd->words) {
+        cmd->argc = build_argv(cmd->tokens, cmd->redir, cmd->argv);
+    }
+
+    return cmd;
+}
+
+/*
+ * words_command()
+ *
+ * - Description: builds a command out of words that were already parsed (and
+ * expanded) as part of another command, i.e. the command a builtin like watch
+ * runs. Each word stays one argument, as it was quoted: nothing is split,
+ * redirected, expanded or sent to the background again. Returns NULL if there
+ * are no words or memory runs out.
+ *
+ * - Arguments: words: the words, n: how many there are
+ *
+ * - Usage: the returned command must be released with free_command().
+ *
+ *      words = [/bin/grep, foo bar, f] -> argv = [/grep, foo bar, f, NULL]
+ */
+command_t *words_command(char **words, int n) {
+    if (n <= 0 || n > 511) {
+        return NULL;
+    }
+
+    size_t len = 0;
+    for (int i = 0; i < n; i++) {
+        len += strlen(words[i]) + 1;
+    }
+
+    command_t *cmd = (command_t *)malloc(sizeof(command_t));
+    if (!cmd) {
+        perror("malloc");
+        return NULL;
+    }
+
+    cmd->store = (char *)malloc(len);
+    cmd->tokens = (char **)calloc((size_t)n + 1, sizeof(char *));
+    cmd->argv = (char **)calloc((size_t)n + 1, sizeof(char *));
+    cmd->words = NULL;
+    cmd->ntok = n;
+    cmd->dynamic = 0;
+    memset(cmd->redir, 0, sizeof(cmd->redir));
+    if (!cmd->store || !cmd->tokens || !cmd->argv) {
+        perror("malloc");
+        free_command(cmd);
+        return NULL;
+    }
+
+    char *at = cmd->store;
+    for (int i = 0; i < n; i++) {
+        cmd->tokens[i] = at;
+        at = stpcpy(at, words[i]) + 1;
+    }
+    cmd->argc = build_argv(cmd->tokens, cmd->redir, cmd->argv);
+
+    return cmd;
+}
+
+/*
+ * expand_command()
+ *
+ * - Description: evaluates the arithmetic expansions of a command that has
+ * words which did not fold to constants, filling in tokens and argv with the
+ * expanded words. Returns the new argc, or -1 if an expansion failed. The
+ * expanded tokens must be released with free_expansion().
+ *
+ * - Arguments: cmd: the command to expand, tokens: array to fill in with the
+ * expanded tokens, argv: array to fill in with the expanded arguments (both
+ * must have room for cmd->ntok + 1 entries)
+ */
+int expand_command(command_t *cmd, char **tokens, char **argv) {
+    for (int i = 0; i <= cmd->ntok; i++) {
+        tokens[i] = cmd->tokens[i];
+    }
+
+    for (int i = 0; i < cmd->ntok; i++) {
+        if (!cmd->words[i] || word_literal(cmd->words[i])) {
+            continue;
+        }
+
+        if (!(tokens[i] = expand_word(cmd->words[i]))) {
+            tokens[i] = cmd->tokens[i];
+            free_expansion(cmd, tokens);
+            return -1;
+        }
+    }
+
+    return build_argv(tokens, cmd->redir, argv);
+}
+
+/*
+ * free_expansion()
+ *
+ * - Description: frees the tokens allocated by expand_command()
+ *
+ * - Arguments: cmd: the command that was expanded, tokens: the expanded tokens
+ */
+void free_expansion(command_t *cmd, char **tokens) {
+    for (int i = 0; i < cmd->ntok; i++) {
+        if (tokens[i] != cmd->tokens[i]) {
+            free(tokens[i]);
+        }
+    }
+}
+
+/*
+ * free_command()
+ *
+ * - Description: releases a command created by compile_command()
+ *
+ * - Arguments: cmd: the command to free (may be NULL)
+ */
+void free_command(command_t *cmd) {
+    if (!cmd) {
+        return;
+    }
+
+    if (cmd->words) {
+        for (int i = 0; i < cmd->ntok; i++) {
+            free_word(cmd->words[i]);
+        }
+    }
+
+    free(cmd->words);
+    free(cmd->store);
+    free(cmd->tokens);
+    free(cmd->argv);
+    free(cmd);
+}
@@ -5,16 +5,43 @@
  */
 
 #include <stddef.h>
+#include "arith.h"
 
 #ifndef PARSING
 #define PARSING
 
+/*
+ * a single parsed line of input. tokens and argv point into store (or into
+ * constant-folded words), which are owned by the command, so a command can be
+ * kept around and executed many times without being parsed again
+ */
+typedef struct command {
+    char *store;    // tokenized copy of the line (tokens are NUL-separated)
+    char **tokens;  // all tokens, including redirection symbols and files
+    char **argv;    // argument array for execv, NULL-terminated
+    int argc;
+    int redir[4];  // same layout as the redir array filled in by parse()
+    int ntok;
+    word_t **words;  // compiled $((...)) words, parallel to tokens (or NULL)
+    int dynamic;     // set if some word must be expanded on every execution
+} command_t;
+
 /* function declaration */
-int parse(char buffer[1024], char *tokens[512], char *argv[512], int redir[3]);
+int parse(char buffer[1024], char *tokens[512], char *argv[512], int redir[4]);
 int set_tok(char **tok_ptr, int mode, int i, int *offset, char *tokens[512],
             int *redir);
 int id_rd_tok(char *tok);
+char *next_token(char *str);
+int is_quoted(char *tok);
+int build_argv(char **tokens, int redir[4], char **argv);
 char *handle_redir(char *tok, char *tokens[512], int *offset, int *redir,
                    int i);
+command_t *compile_command(const char *line, size_t len);
+command_t *words_command(char **words, int n);
+int expand_command(command_t *cmd, char **tokens, char **argv);
+void free_expansion(command_t *cmd, char **tokens);
+void free_command(command_t *cmd);
+void defer_errors(char *buf, size_t size, size_t *len);
+void syntax_error(const char *msg, size_t len);
 
 #endif
@@ -0,0 +1,337 @@
+#include "./scan.h"
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define SCAN_SIMD
+#endif
+
+/*
+ * Vector versions load 16 or 32 bytes at a time and may read past the
+ * terminating NUL, which is safe as long as a load never crosses into the
+ * next page (the bytes before the NUL are all on pages we can read). Loads
+ * that would cross a page boundary fall back to the scalar loop for a while.
+ */
+#define PAGE 4096
+#define CROSSES_PAGE(p, n) (((uintptr_t)(p) & (PAGE - 1)) > PAGE - (n))
+
+// 1 for every byte the lexer has to stop at (constant, since the lexer runs
+// on more than one thread, see run_stream())
+static const unsigned char special_table[256] = {
+    [0] = 1,   [' '] = 1,  ['\t'] = 1, ['\''] = 1,
+    ['"'] = 1, ['\\'] = 1, ['$'] = 1};
+
+/* scalar fallback: table lookup, one byte at a time */
+static size_t scan_scalar(const char *s, size_t n) {
+    size_t i = 0;
+    while (i < n && !special_table[(unsigned char)s[i]]) {
+        i++;
+    }
+
+    return i;
+}
+
+#ifdef SCAN_SIMD
+/* SSE2: 16 bytes at a time */
+static size_t scan_sse2(const char *s) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i sp = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i sq = _mm_set1_epi8('\'');
+    const __m128i dq = _mm_set1_epi8('"');
+    const __m128i bs = _mm_set1_epi8('\\');
+    const __m128i dollar = _mm_set1_epi8('$');
+
+    const char *p = s;
+    while (1) {
+        if (CROSSES_PAGE(p, 16)) {
+            size_t n = scan_scalar(p, 16 - ((uintptr_t)p & 15));
+            if (n < 16 - ((uintptr_t)p & 15)) {
+                return (size_t)(p - s) + n;
+            }
+            p += n;
+            continue;
+        }
+
+        __m128i v = _mm_loadu_si128((const __m128i *)(const void *)p);
+        __m128i hit = _mm_or_si128(
+            _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, zero), _mm_cmpeq_epi8(v, sp)),
+                _mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, sq))),
+            _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, dq), _mm_cmpeq_epi8(v, bs)),
+                _mm_cmpeq_epi8(v, dollar)));
+
+        int mask = _mm_movemask_epi8(hit);
+        if (mask) {
+            return (size_t)(p - s) + (size_t)__builtin_ctz((unsigned)mask);
+        }
+        p += 16;
+    }
+}
+
+/* AVX2: 32 bytes at a time, only called if the CPU supports it */
+__attribute__((target("avx2"))) static size_t scan_avx2(const char *s) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i sp = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i sq = _mm256_set1_epi8('\'');
+    const __m256i dq = _mm256_set1_epi8('"');
+    const __m256i bs = _mm256_set1_epi8('\\');
+    const __m256i dollar = _mm256_set1_epi8('$');
+
+    const char *p = s;
+    while (1) {
+        if (CROSSES_PAGE(p, 32)) {
+            size_t n = scan_scalar(p, 32 - ((uintptr_t)p & 31));
+            if (n < 32 - ((uintptr_t)p & 31)) {
+                return (size_t)(p - s) + n;
+            }
+            p += n;
+            continue;
+        }
+
+        __m256i v = _mm256_loadu_si256((const __m256i *)(const void *)p);
+        __m256i hit = _mm256_or_si256(
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, zero),
+                                            _mm256_cmpeq_epi8(v, sp)),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(v, tab),
+                                            _mm256_cmpeq_epi8(v, sq))),
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, dq),
+                                            _mm256_cmpeq_epi8(v, bs)),
+                            _mm256_cmpeq_epi8(v, dollar)));
+
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask) {
+            return (size_t)(p - s) + (size_t)__builtin_ctz(mask);
+        }
+        p += 32;
+    }
+}
+#endif
+
+/*
+ * Counting for wc: newlines are compared 32 (or 16) at a time, each match
+ * subtracting 1 (i.e. adding -1, the comparison's all-ones) from a byte
+ * counter per lane; the lanes are summed with a SAD against zero before they
+ * can overflow, every 255 vectors. Words are counted from the bit masks of
+ * blank and printable bytes: a word starts at each printable byte whose
+ * previous byte (carried over from the last vector) is blank. Other bytes
+ * neither start nor end a word, so a vector holding any is counted by the
+ * scalar loop instead, which is rare outside binary files.
+ */
+#define LANE_MAX 255
+
+/* the bytes that separate words: ' ' and \t to \r */
+#define IS_BLANK(c) ((c) == ' ' || (unsigned char)((c) - '\t') <= 4)
+/* the bytes that make up words: printable ASCII other than ' ' */
+#define IS_WORD(c) ((unsigned char)((c) - '!') <= '~' - '!')
+
+/* scalar fallback for count_lines() */
+static size_t lines_scalar(const char *s, size_t n) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        count += s[i] == '\n';
+    }
+    return count;
+}
+
+/* scalar fallback for count_words() */
+static size_t words_scalar(const char *s, size_t n, int *between) {
+    size_t count = 0;
+    int apart = *between;
+    for (size_t i = 0; i < n; i++) {
+        if (IS_BLANK(s[i])) {
+            apart = 1;
+        } else if (IS_WORD(s[i])) {
+            count += (size_t)apart;
+            apart = 0;
+        }
+    }
+    *between = apart;
+    return count;
+}
+
+#ifdef SCAN_SIMD
+/* adds up the 64-bit halves of a SAD result */
+static size_t sum_sad(__m128i sums) {
+    return (size_t)_mm_cvtsi128_si64(sums) +
+           (size_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+}
+
+/* SSE2: 16 bytes at a time */
+static size_t lines_sse2(const char *s, size_t n) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t count = 0, i = 0;
+    while (n - i >= 16) {
+        size_t vectors = (n - i) / 16 < LANE_MAX ? (n - i) / 16 : LANE_MAX;
+        __m128i acc = _mm_setzero_si128();
+        for (size_t end = i + 16 * vectors; i < end; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(s + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, nl));
+        }
+        count += sum_sad(_mm_sad_epu8(acc, _mm_setzero_si128()));
+    }
+    return count + lines_scalar(s + i, n - i);
+}
+
+/* SSE2: 16 bytes at a time */
+static size_t words_sse2(const char *s, size_t n, int *between) {
+    const __m128i sp = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i four = _mm_set1_epi8(4);
+    const __m128i bang = _mm_set1_epi8('!');
+    const __m128i range = _mm_set1_epi8('~' - '!');
+    const __m128i zero = _mm_setzero_si128();
+    size_t count = 0, i = 0;
+    for (; n - i >= 16; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(s + i));
+        // (x - lo <= hi - lo unsigned, as a saturated subtraction giving 0)
+        __m128i blank = _mm_or_si128(
+            _mm_cmpeq_epi8(v, sp),
+            _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(v, tab), four), zero));
+        __m128i word =
+            _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(v, bang), range), zero);
+        unsigned b = (unsigned)_mm_movemask_epi8(blank);
+        unsigned w = (unsigned)_mm_movemask_epi8(word);
+        if ((b | w) != 0xffffu) {
+            count += words_scalar(s + i, 16, between);
+            continue;
+        }
+        count +=
+            (size_t)__builtin_popcount(w & ((b << 1) | (unsigned)*between));
+        *between = (int)(b >> 15);
+    }
+    return count + words_scalar(s + i, n - i, between);
+}
+
+/* AVX2: 32 bytes at a time, only called if the CPU supports it */
+__attribute__((target("avx2"))) static size_t lines_avx2(const char *s,
+                                                         size_t n) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t count = 0, i = 0;
+    while (n - i >= 32) {
+        size_t vectors = (n - i) / 32 < LANE_MAX ? (n - i) / 32 : LANE_MAX;
+        __m256i acc = _mm256_setzero_si256();
+        for (size_t end = i + 32 * vectors; i < end; i += 32) {
+            __m256i v =
+                _mm256_loadu_si256((const __m256i *)(const void *)(s + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, nl));
+        }
+        __m256i sums = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+        count += sum_sad(_mm_add_epi64(_mm256_castsi256_si128(sums),
+                                       _mm256_extracti128_si256(sums, 1)));
+    }
+    return count + lines_scalar(s + i, n - i);
+}
+
+/* AVX2: 32 bytes at a time, only called if the CPU supports it */
+__attribute__((target("avx2"))) static size_t words_avx2(const char *s,
+                                                         size_t n,
+                                                         int *between) {
+    const __m256i sp = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i four = _mm256_set1_epi8(4);
+    const __m256i bang = _mm256_set1_epi8('!');
+    const __m256i range = _mm256_set1_epi8('~' - '!');
+    const __m256i zero = _mm256_setzero_si256();
+    size_t count = 0, i = 0;
+    for (; n - i >= 32; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(const void *)(s + i));
+        __m256i blank = _mm256_or_si256(
+            _mm256_cmpeq_epi8(v, sp),
+            _mm256_cmpeq_epi8(_mm256_subs_epu8(_mm256_sub_epi8(v, tab), four),
+                              zero));
+        __m256i word = _mm256_cmpeq_epi8(
+            _mm256_subs_epu8(_mm256_sub_epi8(v, bang), range), zero);
+        uint64_t b = (uint32_t)_mm256_movemask_epi8(blank);
+        uint64_t w = (uint32_t)_mm256_movemask_epi8(word);
+        if ((b | w) != 0xffffffffu) {
+            count += words_scalar(s + i, 32, between);
+            continue;
+        }
+        count += (size_t)__builtin_popcountll(
+            (unsigned long long)(w & ((b << 1) | (uint64_t)*between)));
+        *between = (int)(b >> 31);
+    }
+    return count + words_scalar(s + i, n - i, between);
+}
+
+/*
+ * whether to use the AVX2 versions (the CPU's features are read once, before
+ * main(), so this is only a load, and safe from any thread)
+ */
+static int have_avx2(void) { return __builtin_cpu_supports("avx2") ? 1 : 0; }
+#endif
+
+/*
+ * count_lines()
+ *
+ * - Description: counts the newlines in a buffer, 32 or 16 bytes at a time
+ * with AVX2 or SSE2 where available.
+ *
+ * - Arguments: s: the buffer, n: its length
+ */
+size_t count_lines(const char *s, size_t n) {
+#ifdef SCAN_SIMD
+    return have_avx2() ? lines_avx2(s, n) : lines_sse2(s, n);
+#else
+    return lines_scalar(s, n);
+#endif
+}
+
+/*
+ * count_words()
+ *
+ * - Description: counts the words starting in a buffer, like wc -w does in
+ * the C locale, 32 or 16 bytes at a time with AVX2 or SSE2 where available.
+ *
+ * - Arguments: s: the buffer, n: its length, between: see scan.h
+ *
+ * - Usage: a file read in pieces is counted by passing the same between
+ * (initially 1) for every piece.
+ */
+size_t count_words(const char *s, size_t n, int *between) {
+#ifdef SCAN_SIMD
+    return have_avx2() ? words_avx2(s, n, between) : words_sse2(s, n, between);
+#else
+    return words_scalar(s, n, between);
+#endif
+}
+
+/*
+ * words_between()
+ *
+ * - Description: returns what count_words() needs to be passed as between
+ * to count the bytes that follow the n bytes at s, looking back from the
+ * end of s for the last byte that is blank or part of a word.
+ */
+int words_between(const char *s, size_t n) {
+    while (n > 0) {
+        n--;
+        if (IS_BLANK(s[n]) || IS_WORD(s[n])) {
+            return IS_BLANK(s[n]);
+        }
+    }
+    return 1;
+}
+
+/*
+ * scan_plain()
+ *
+ * - Description: returns the length of the longest prefix of s that contains
+ * no blanks, quotes, backslashes or '$', stopping at the terminating NUL.
+ * Uses AVX2 or SSE2 where available, so plain text is skipped 32 or 16 bytes
+ * at a time.
+ *
+ * - Arguments: s: NUL-terminated string to scan
+ *
+ * - Usage: scan_plain("/bin/echo 'hi'") -> 9
+ */
+size_t scan_plain(const char *s) {
+#ifdef SCAN_SIMD
+    return have_avx2() ? scan_avx2(s) : scan_sse2(s);
+#else
+    return scan_scalar(s, (size_t)-1);
+#endif
+}
@@ -0,0 +1,26 @@
+#ifndef SCAN_H_
+#define SCAN_H_
+
+#include <stddef.h>
+
+/*
+ * returns the number of bytes at the start of the NUL-terminated string s
+ * that the lexer can copy without looking at them: everything except blanks,
+ * quotes, backslashes, '$' and the terminating NUL
+ */
+size_t scan_plain(const char *s);
+
+/* returns the number of newlines in the n bytes at s */
+size_t count_lines(const char *s, size_t n);
+/*
+ * returns the number of words (runs of printable bytes other than ' ',
+ * delimited by ' ', \t, \n, \v, \f and \r, like wc -w in the C locale) that
+ * start in the n bytes at s. *between says whether the bytes before s ended
+ * between words (1 at the start of a file), and is updated for the bytes
+ * that follow
+ */
+size_t count_words(const char *s, size_t n, int *between);
+/* returns between (see count_words()) for the bytes following the n at s */
+int words_between(const char *s, size_t n);
+
+#endif  // SCAN_H_
@@ -0,0 +1,282 @@
+#include "./script.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "./stream.h"
+
+// maximum number of compiled scripts kept around
+#define MAX_CACHED 64
+
+// a cached script is identified by the file it came from and that file's
+// modification time and size; any change to the file invalidates the entry
+struct script {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+
+    command_t **cmds;
+    int ncmds;
+    void *map;  // mapping the commands point into, if any (see make_script())
+    size_t maplen;
+
+    int refs;   // number of load_script() calls not yet released
+    int stale;  // set once evicted; freed when the last user releases it
+    struct script *next;
+};
+
+// most recently used script is at the head
+static script_t *cache = NULL;
+static int ncached = 0;
+
+/* frees a script and all of its commands */
+static void free_script(script_t *script) {
+    for (int i = 0; i < script->ncmds; i++) {
+        free_command(script->cmds[i]);
+    }
+
+    free(script->cmds);
+    if (script->map) {
+        munmap(script->map, script->maplen);
+    }
+
+    free(script);
+}
+
+/* removes a script from the cache, freeing it unless it is in use */
+static void evict(script_t *script, script_t *prev) {
+    if (prev) {
+        prev->next = script->next;
+    } else {
+        cache = script->next;
+    }
+
+    script->next = NULL;
+    ncached--;
+
+    if (script->refs) {
+        script->stale = 1;
+    } else {
+        free_script(script);
+    }
+}
+
+/*
+ * compile_script()
+ *
+ * - Description: reads a script file line by line and compiles each line.
+ * Blank lines, comment lines (starting with '#') and lines that do not parse
+ * are left out. Returns 0 on success, -1 on failure.
+ *
+ * - Arguments: script: the script to fill in, fd: open file descriptor of the
+ * script file
+ */
+static int compile_script(script_t *script, int fd) {
+    int cap = 16;
+    script->ncmds = 0;
+    if (!(script->cmds =
+              (command_t **)malloc((size_t)cap * sizeof(command_t *)))) {
+        perror("malloc");
+        return -1;
+    }
+
+    stream_t *stream;
+    if (!(stream = open_stream(fd))) {
+        return -1;
+    }
+
+    const char *line;
+    size_t len;
+    int ret;
+    while ((ret = stream_next(stream, &line, &len)) > 0) {
+        command_t *cmd;
+        if (is_comment(line, len) || !(cmd = compile_command(line, len))) {
+            continue;
+        }
+
+        if (script->ncmds == cap) {
+            cap *= 2;
+            command_t **cmds = (command_t **)realloc(
+                script->cmds, (size_t)cap * sizeof(command_t *));
+            if (!cmds) {
+                perror("realloc");
+                free_command(cmd);
+                ret = -1;
+                break;
+            }
+
+            script->cmds = cmds;
+        }
+
+        script->cmds[script->ncmds++] = cmd;
+    }
+
+    close_stream(stream);
+    return ret;
+}
+
+/*
+ * read_script()
+ *
+ * - Description: compiles the given open file into a new script. Returns NULL
+ * on failure.
+ *
+ * - Arguments: fd: open file descriptor of the script, st: the result of
+ * fstat() on fd
+ */
+static script_t *read_script(int fd, struct stat *st) {
+    script_t *script = (script_t *)calloc(1, sizeof(script_t));
+    if (!script) {
+        perror("calloc");
+        return NULL;
+    }
+
+    script->dev = st->st_dev;
+    script->ino = st->st_ino;
+    script->mtime = st->st_mtim;
+    script->size = st->st_size;
+
+    if (compile_script(script, fd) < 0) {
+        free_script(script);
+        return NULL;
+    }
+
+    return script;
+}
+
+/*
+ * load_script()
+ *
+ * - Description: returns the compiled form of the script at path. Scripts are
+ * cached by device, inode, modification time and size, so loading a file that
+ * has not changed since the last load neither reads nor parses it again. Parse
+ * errors are therefore only reported the first time a file is loaded. Returns
+ * NULL and prints an error message if the file cannot be opened or read.
+ *
+ * - Arguments: dirfd: directory relative paths are resolved against (or
+ * AT_FDCWD), path: path to the script file
+ *
+ * - Usage: the returned script stays valid until it is passed to
+ * release_script(), even if the file changes (or is loaded again) in between.
+ */
+script_t *load_script(int dirfd, const char *path) {
+    struct stat st;
+    if (fstatat(dirfd, path, &st, 0) < 0) {
+        perror(path);
+        return NULL;
+    }
+
+    script_t *prev = NULL;
+    for (script_t *cur = cache; cur; prev = cur, cur = cur->next) {
+        if (cur->dev != st.st_dev || cur->ino != st.st_ino) {
+            continue;
+        }
+
+        if (cur->size == st.st_size && cur->mtime.tv_sec == st.st_mtim.tv_sec &&
+            cur->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            // cache hit: move to the front of the list
+            if (prev) {
+                prev->next = cur->next;
+                cur->next = cache;
+                cache = cur;
+            }
+
+            cur->refs++;
+            return cur;
+        }
+
+        // file has changed since it was compiled
+        evict(cur, prev);
+        break;
+    }
+
+    int fd;
+    if ((fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC)) < 0) {
+        perror(path);
+        return NULL;
+    }
+
+    // stat the file we actually opened, in case path changed in between
+    script_t *script = NULL;
+    if (fstat(fd, &st) < 0) {
+        perror(path);
+    } else if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s: not a regular file\n", path);
+    } else {
+        script = read_script(fd, &st);
+    }
+
+    close(fd);
+    if (!script) {
+        return NULL;
+    }
+
+    // make room in the cache by dropping the least recently used script
+    if (ncached == MAX_CACHED) {
+        script_t *last = cache;
+        prev = NULL;
+        while (last->next) {
+            prev = last;
+            last = last->next;
+        }
+
+        evict(last, prev);
+    }
+
+    script->refs = 1;
+    script->next = cache;
+    cache = script;
+    ncached++;
+    return script;
+}
+
+/*
+ * make_script()
+ *
+ * - Description: wraps commands that were compiled elsewhere (i.e. loaded from
+ * a bytecode file) in a script that is not cached. Returns NULL on failure.
+ *
+ * - Arguments: cmds: malloc'd array of commands, which the script takes
+ * ownership of, ncmds: number of commands, map: memory mapping the commands'
+ * strings point into (unmapped when the script is freed) or NULL, maplen: size
+ * of the mapping
+ *
+ * - Usage: the script is freed by the matching release_script() call.
+ */
+script_t *make_script(command_t **cmds, int ncmds, void *map, size_t maplen) {
+    script_t *script = (script_t *)calloc(1, sizeof(script_t));
+    if (!script) {
+        perror("calloc");
+        return NULL;
+    }
+
+    script->cmds = cmds;
+    script->ncmds = ncmds;
+    script->map = map;
+    script->maplen = maplen;
+    script->refs = 1;
+    script->stale = 1;  // never in the cache
+    return script;
+}
+
+/* releases a script returned by load_script() */
+void release_script(script_t *script) {
+    if (!script) {
+        return;
+    }
+
+    script->refs--;
+    if (!script->refs && script->stale) {
+        free_script(script);
+    }
+}
+
+/* returns the number of commands in the script */
+int script_length(script_t *script) { return script->ncmds; }
+
+/* returns the i-th command of the script */
+command_t *script_command(script_t *script, int i) { return script->cmds[i]; }
@@ -0,0 +1,29 @@
+#ifndef SCRIPT_H_
+#define SCRIPT_H_
+
+#include "parsing.h"
+
+/* a script file compiled into a sequence of commands */
+typedef struct script script_t;
+
+/*
+ * loads the script at path (relative to dirfd, or AT_FDCWD), reusing the cached
+ * compiled form if the file has not changed since it was last loaded. returns
+ * NULL (after printing an error) if the file could not be read. every
+ * successful call must be paired with a call to release_script()
+ */
+script_t *load_script(int dirfd, const char *path);
+/*
+ * wraps already compiled commands (whose strings may point into the memory
+ * mapping map) in an uncached script, to be freed by release_script()
+ */
+script_t *make_script(command_t **cmds, int ncmds, void *map, size_t maplen);
+/* releases a script returned by load_script() or make_script() */
+void release_script(script_t *script);
+
+/* returns the number of commands in the script */
+int script_length(script_t *script);
+/* returns the i-th command of the script */
+command_t *script_command(script_t *script, int i);
+
+#endif  // SCRIPT_H_
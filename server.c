@@ -0,0 +1,297 @@
+#include "./server.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// number of descriptors passed with each request (stdin, stdout, stderr)
+#define NFDS 3
+// pending connections queued by the kernel
+#define BACKLOG 64
+
+/*
+ * fill_addr()
+ *
+ * - Description: fills in a Unix socket address for path. Returns 0, or -1
+ * (after printing an error) if the path does not fit.
+ *
+ * - Arguments: addr: address to fill in, path: filesystem path of the socket
+ */
+static int fill_addr(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return -1;
+    }
+
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/*
+ * open_server()
+ *
+ * - Description: creates a Unix stream socket listening at path. A socket
+ * already at path is assumed to belong to a server that has exited and is
+ * removed; any other kind of file is left alone and bind() fails. Returns the
+ * listening socket, or -1 (after printing an error) on failure.
+ *
+ * - Arguments: path: filesystem path to listen at
+ *
+ * - Usage: int sock = open_server("/tmp/33sh.sock");
+ */
+int open_server(const char *path) {
+    struct sockaddr_un addr;
+    if (fill_addr(&addr, path) < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (!lstat(path, &st) && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    int sock;
+    if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(sock, BACKLOG) < 0) {
+        perror(path);
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/*
+ * connect_server()
+ *
+ * - Description: connects to the server listening at path. Returns the
+ * connected socket, or -1 (after printing an error) on failure.
+ *
+ * - Arguments: path: filesystem path the server listens at
+ */
+int connect_server(const char *path) {
+    struct sockaddr_un addr;
+    if (fill_addr(&addr, path) < 0) {
+        return -1;
+    }
+
+    int sock;
+    if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/*
+ * read_full()
+ *
+ * - Description: reads exactly len bytes from sock. Returns 0, or -1 on an
+ * error or if the peer closed the connection first.
+ */
+static int read_full(int sock, char *buf, size_t len) {
+    while (len) {
+        ssize_t n = read(sock, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return -1;
+        }
+
+        buf += n;
+        len -= (size_t)n;
+    }
+
+    return 0;
+}
+
+/*
+ * write_full()
+ *
+ * - Description: writes all len bytes to sock, without raising SIGPIPE if the
+ * peer has gone away. Returns 0 or -1 on failure.
+ */
+static int write_full(int sock, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return -1;
+        }
+
+        buf += n;
+        len -= (size_t)n;
+    }
+
+    return 0;
+}
+
+/*
+ * send_request()
+ *
+ * - Description: sends a command line to the server. The descriptors are
+ * attached to the length header, so they arrive with the first byte of the
+ * request. Returns 0 or -1 (after printing an error) on failure.
+ *
+ * - Arguments: sock: connected socket, line: the command line (without a
+ * newline), len: its length, fds: the descriptors to run the command with
+ */
+int send_request(int sock, const char *line, size_t len, int fds[3]) {
+    uint32_t hdr = (uint32_t)len;
+    struct iovec iov = {.iov_base = &hdr, .iov_len = sizeof(hdr)};
+
+    union {
+        char buf[CMSG_SPACE(NFDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(NFDS * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, NFDS * sizeof(int));
+
+    ssize_t n;
+    while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+    }
+
+    if (n != (ssize_t)sizeof(hdr) || write_full(sock, line, len) < 0) {
+        perror("send");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * recv_request()
+ *
+ * - Description: receives a request sent by send_request(). The line is
+ * copied into buf and NUL-terminated, and the descriptors that came with it
+ * are stored in fds (with close-on-exec set, since they are meant to be
+ * dup2()ed into place). Returns the length of the line, or -1 if the request
+ * was malformed, too long for buf or cut short; no received descriptors are
+ * left open in that case.
+ *
+ * - Arguments: sock: accepted connection, buf: buffer for the line, size:
+ * size of buf, fds: array of 3 descriptors to fill in
+ */
+ssize_t recv_request(int sock, char *buf, size_t size, int fds[3]) {
+    uint32_t hdr;
+    struct iovec iov = {.iov_base = &hdr, .iov_len = sizeof(hdr)};
+
+    union {
+        char buf[CMSG_SPACE(NFDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    if (n < 0) {
+        return -1;
+    }
+
+    // collect whatever descriptors arrived so they can be closed on error
+    int nfds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (nfds < NFDS) {
+                fds[nfds] = fd;
+            } else {
+                close(fd);
+            }
+            nfds++;
+        }
+    }
+
+    // (the header may legitimately arrive in pieces after the first byte)
+    if (n > 0 && (size_t)n < sizeof(hdr)) {
+        if (read_full(sock, (char *)&hdr + n, sizeof(hdr) - (size_t)n) < 0) {
+            n = 0;
+        } else {
+            n = sizeof(hdr);
+        }
+    }
+
+    if (nfds != NFDS || (size_t)n != sizeof(hdr) || hdr >= size ||
+        read_full(sock, buf, hdr) < 0) {
+        for (int i = 0; i < nfds && i < NFDS; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+
+    buf[hdr] = '\0';
+    return (ssize_t)hdr;
+}
+
+/*
+ * send_status()
+ *
+ * - Description: sends the exit status of a request back to the client.
+ * Returns 0, or -1 if the client has gone away.
+ */
+int send_status(int sock, int status) {
+    int32_t val = status;
+    return write_full(sock, (char *)&val, sizeof(val));
+}
+
+/*
+ * recv_status()
+ *
+ * - Description: waits for the exit status of a request. Returns 0, or -1 if
+ * the server closed the connection without replying.
+ */
+int recv_status(int sock, int *status) {
+    int32_t val;
+    if (read_full(sock, (char *)&val, sizeof(val)) < 0) {
+        return -1;
+    }
+
+    *status = val;
+    return 0;
+}
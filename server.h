@@ -0,0 +1,38 @@
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * protocol between 33sh --server and 33sh-client: the client sends one
+ * request per connection, made of a 4-byte length and the command line, with
+ * its standard input, output and error attached as SCM_RIGHTS; the server
+ * runs the command with those descriptors and replies with a 4-byte exit
+ * status
+ */
+
+/*
+ * creates a Unix socket listening at path, replacing a stale socket left
+ * there by a previous server. returns -1 (after printing an error) on failure
+ */
+int open_server(const char *path);
+/* connects to the server at path, returns -1 (after printing an error) on
+ * failure */
+int connect_server(const char *path);
+
+/* sends a command line along with fds[3], returns 0 or -1 on failure */
+int send_request(int sock, const char *line, size_t len, int fds[3]);
+/*
+ * receives a request into buf (NUL-terminated) and fds[3] (close-on-exec).
+ * returns the length of the line, or -1 if the request was malformed or the
+ * client went away (no descriptors are left open in that case)
+ */
+ssize_t recv_request(int sock, char *buf, size_t size, int fds[3]);
+
+/* sends an exit status, returns 0 or -1 on failure */
+int send_status(int sock, int status);
+/* receives an exit status, returns 0 or -1 if the connection was closed */
+int recv_status(int sock, int *status);
+
+#endif  // SERVER_H_
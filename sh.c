@@ -1,20 +1,120 @@
+#define _GNU_SOURCE  // memfd_create(), pipe2(), close_range(), spawn *_np()
+#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include "bytecode.h"
+#include "capture.h"
+#include "complete.h"
+#include "dirs.h"
+#include "editor.h"
+#include "events.h"
+#include "history.h"
 #include "jobs.h"
 #include "lib_checks.c"
+#include "ls.h"
+#include "merge.h"
+#include "onchange.h"
 #include "parsing.h"
+#include "script.h"
+#include "server.h"
+#include "stream.h"
+#include "tail.h"
+#include "vars.h"
+#include "wc.h"
+#include "zygote.h"
+
+// maximum nesting depth of the source builtin
+#define MAX_SOURCE_DEPTH 32
+// seconds between runs of watch's command when not told
+#define WATCH_INTERVAL 2
+// compiled commands the reader of a script may be ahead by
+#define BATCH_QUEUE 256
+// most copies of a program spawn starts at once
+#define MAX_SPAWN 100000
+
+/* a line of a script, compiled by the reader (see run_stream()) */
+typedef struct {
+    command_t *cmd;    // NULL if it did not compile
+    char errors[256];  // what compiling it wrote to standard error
+    size_t nerrors;
+} batch_item_t;
+
+/* a script being read by one thread and run by another */
+typedef struct {
+    stream_t *stream;
+    batch_item_t items[BATCH_QUEUE];  // (a ring)
+    size_t head;                      // number of items queued so far
+    size_t tail;                      // number of items taken so far
+    int done;  // set at end of input, -1 after a read error
+    pthread_mutex_t lock;
+    pthread_cond_t added;
+    pthread_cond_t taken;
+} batch_t;
 
 // initialize our job list
 job_list_t *my_jobs;
 int next_job = 1;
 
+// current nesting depth of sourced scripts
+int source_depth = 0;
+
+// exit status of the last command, reported to clients in server mode
+int last_status = 0;
+
+// directory relative paths are resolved against: AT_FDCWD, except while
+// serving a session, which has a directory of its own (see run_sessions())
+int cwd_fd = AT_FDCWD;
+
+// set while running a session's command: foreground jobs are then not waited
+// for, but left in fg_pid (and fg_cmd) for the event loop, see wait_fg()
+int in_session = 0;
+pid_t fg_pid = -1;
+char *fg_cmd = NULL;
+// set by the exit builtin in server mode: it ends the session only, or with
+// --server (in_server) stops the server once the client has its answer
+int session_done = 0;
+int in_server = 0;
+
+// set capture on: background jobs write to a ring buffer (see capture.c)
+// instead of the terminal, to be read back with joblog
+int capture_jobs = 0;
+// set merge: otherwise, background jobs' output is written on by the shell
+// in whole lines (see merge.c)
+merge_mode_t merge_jobs = MERGE_OFF;
+// set outlimit: per-second output budgets for merged jobs; a budget makes
+// background jobs merged (with no prefix) even if merge is off
+outlimit_t outlimit = {0, 0};
+// set by SIGINT while joblog -f follows a job
+volatile sig_atomic_t interrupted = 0;
+// set while the watch builtin runs its command, which it waits for even in a
+// session (see wait_fg())
+int watch_running = 0;
+// set while the shell waits for a command to be typed (or sent), when
+// onchange may run its commands (see run_trigger())
+int shell_idle = 0;
+
+extern char **environ;
+
+int exec_command(command_t *cmd);
+void export_variables(char *argv[], int argc);
+int is_assignment(const char *word);
+int run_command(command_t *cmd, char **extra, int nextra, int bg);
+
 /*
  * handle_signals()
  *
@@ -35,6 +135,9 @@ void handle_signals(int status, pid_t pgid, char *cmd) {
     char *act;
     int job = get_job_jid(my_jobs, pgid);  // returns -1 if job not found
     int sig = 0;
+    if (job > 0) {  // (before the job may be removed below)
+        notify_status(my_jobs, pgid, status, NULL);
+    }
     if (WIFSIGNALED(status)) {  // process terminated by signal
         sig = WTERMSIG(status);
         act = "terminated by signal";
@@ -52,6 +155,7 @@ void handle_signals(int status, pid_t pgid, char *cmd) {
         if (job < 0) {  // job is new
             // add job to list
             add_job(my_jobs, next_job, pgid, STOPPED, cmd);
+            notify_status(my_jobs, pgid, status, NULL);
             job = next_job;
             next_job++;
         } else {
@@ -71,6 +175,59 @@ void handle_signals(int status, pid_t pgid, char *cmd) {
     }
 }
 
+/*
+ * wait_status()
+ *
+ * - Description: converts a status set by waitpid() into a shell exit status:
+ * the exit code of a process that exited, or 128 plus the signal number for
+ * one that was terminated or stopped by a signal
+ *
+ * - Arguments: status: status of a foreground child as set by waitpid()
+ */
+int wait_status(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    } else if (WIFSTOPPED(status)) {
+        return 128 + WSTOPSIG(status);
+    }
+
+    return 0;
+}
+
+/*
+ * wait_fg()
+ *
+ * - Description: waits for a foreground job to terminate or stop, reports it
+ * with handle_signals() and sets last_status. While running a session's
+ * command (other than from a sourced script), the job is instead left in
+ * fg_pid and fg_cmd, to be finished by the event loop once it changes state,
+ * so that other sessions are not held up.
+ *
+ * - Arguments: pid: process group of the job, cmd: its command (for adding it
+ * to the job list if it stops), or NULL if it is already in the list
+ */
+void wait_fg(pid_t pid, char *cmd) {
+    if (in_session && !source_depth && !watch_running) {
+        fg_pid = pid;
+        fg_cmd = cmd ? strdup(cmd) : NULL;
+        return;
+    }
+
+    int status;
+    if (watching()) {
+        // keep draining the output of captured jobs in the meantime
+        while (!checked_waitpid(pid, &status, WUNTRACED | WNOHANG)) {
+            wait_events(-1, -1);
+        }
+    } else {
+        checked_waitpid(pid, &status, WUNTRACED);
+    }
+    handle_signals(status, pid, cmd);
+    last_status = wait_status(status);
+}
+
 /*
  * reap()
  *
@@ -79,6 +236,8 @@ void handle_signals(int status, pid_t pgid, char *cmd) {
  * have terminated
  *
  * - Arguments: status: int containing status information as set by waitpid()
+ * pgid: the process that changed state, ru: its resource usage as returned by
+ * wait4() (or NULL), which is passed on to subscribers of job events
  *
  * - Usage: called after a positive (some child process) return to waitpid()
  * with the -1 (all child processes) argument and the WNOHANG, WUNTRACED, and
@@ -86,10 +245,11 @@ void handle_signals(int status, pid_t pgid, char *cmd) {
  * list appropriately.
  *
  */
-void reap(int status, pid_t pgid) {
+void reap(int status, pid_t pgid, struct rusage *ru) {
     int code = 0;
     char act[64];
     int job = get_job_jid(my_jobs, pgid);
+    notify_status(my_jobs, pgid, status, ru);
 
     if (WIFSIGNALED(status)) {  // process terminated by signal
         code = WTERMSIG(status);
@@ -125,6 +285,33 @@ void reap(int status, pid_t pgid) {
     }
 }
 
+/*
+ * reap_jobs()
+ *
+ * - Description: reports and reaps every child process whose state has
+ * changed since the last call, without blocking
+ *
+ * - Arguments: none
+ *
+ * - Usage: called before each prompt (and between the commands of a script)
+ */
+void reap_jobs() {
+    pid_t pid;
+    int status;
+    struct rusage ru;
+    // drain captured output first, so that it is complete when a job that
+    // has exited is reported (and again for each job, for what it wrote
+    // just before exiting)
+    run_events();
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) >
+           0) {
+        if (!zygote_reaped(pid, status)) {  // idle helpers are not jobs
+            run_events();
+            reap(status, pid, &ru);
+        }
+    }
+}
+
 /*
  * change_def_handlers()
  *
@@ -145,280 +332,2346 @@ void change_def_handlers(__sighandler_t handler) {
 }
 
 /*
- * exec_builtins()
+ * run_source()
  *
- * - Description: takes in the current argv array and argc count and attempts to
- * execute one of the supported builtin commands jobs, fg, bg, cd, ln, rm, or
- * exit. Returns 0 if a command was attempted, -1 if the command was not
- * recognized as one of the builtins.
+ * - Description: runs every command in the given script file in the current
+ * shell, as if each line had been typed at the prompt. The compiled script is
+ * cached (see load_script()), so sourcing an unchanged file again skips
+ * reading and parsing it.
  *
- * - Arguments: argv: an array of pointers to parsed arguments, argc: an int
- * representing the number of arguments
+ * - Arguments: path: path to the script to run
  *
- * - Usage:
- *          if argv[0] is:
- *              "exit" -> exits the program
- *              "cd" -> calls chdir to change working directory to argv[1]
- *              "ln" -> calls link to create a new hardlink between argv[1] and
- *  argv[2]
- *              "rm" -> calls unlink to remove argv[1]
- *          else returns -1
+ * - Usage: called by the source and . builtins. Scripts may source other
+ * scripts, up to MAX_SOURCE_DEPTH levels deep.
  */
-int exec_builtins(char *argv[512], int argc) {
-    char *cmd = argv[0];
-
-    // builtin recognized as exit
-    if (!strncmp(cmd, "exit", 5)) {
-        if (argc != 1) {
-            write(STDERR_FILENO, "exit: syntax error\n", 20);
-        } else {
-            cleanup_job_list(my_jobs);
-            exit(0);
-        }
+void run_source(char *path) {
+    if (source_depth >= MAX_SOURCE_DEPTH) {
+        write(STDERR_FILENO, "source: maximum nesting depth exceeded\n", 39);
+        return;
+    }
 
-        // builtin recognized as cd
-    } else if (!strncmp(cmd, "cd", 3)) {
-        if (argc != 2) {  // no filepath to cd
-            write(STDERR_FILENO, "cd: syntax error\n", 17);
-        } else if (chdir(argv[1]) < 0) {  // chdir errors
-            perror("cd");
-        }
+    script_t *script;
+    if (!(script = load_script(cwd_fd, path))) {
+        last_status = 1;
+        return;
+    }
 
-        // builtin recognized as ln
-    } else if (!strncmp(cmd, "ln", 3)) {
-        if (argc != 3) {
-            write(STDERR_FILENO, "ln: syntax error\n", 17);
-        }
-        if (link(argv[1], argv[2]) < 0) {
-            perror("ln");
-        }
+    source_depth++;
+    for (int i = 0; i < script_length(script); i++) {
+        exec_command(script_command(script, i));
+    }
+    source_depth--;
 
-        // builtin recognized as rm
-    } else if (!strncmp(cmd, "rm", 3)) {
-        if (argc != 2) {
-            write(STDERR_FILENO, "rm: syntax error\n", 17);
-        } else if (unlink(argv[1]) < 0) {
-            perror("rm");
-        }
+    release_script(script);
+}
 
-        // builtin recognized as jobs
-    } else if (!strncmp(cmd, "jobs", 5)) {
-        if (argc != 1) {
-            write(STDERR_FILENO, "jobs: syntax error\n", 20);
-        } else {
-            jobs(my_jobs);
-        }
+/*
+ * find_job_arg()
+ *
+ * - Description: looks up the job named by a %<jid> argument. Returns the
+ * job's pid, or -1 (after printing an error like fg and bg do) if arg is
+ * malformed or there is no such job.
+ *
+ * - Arguments: name: name of the builtin, for error messages, arg: argument
+ */
+pid_t find_job_arg(char *name, char *arg) {
+    if (*arg != '%') {
+        fprintf(stderr, "%s: job input does not begin with %%\n", name);
+        return -1;
+    }
 
-        // builtin recognized as fg
-    } else if (!strncmp(cmd, "fg", 3)) {
-        if (argc != 2) {
-            write(STDERR_FILENO, "fg: syntax error\n", 18);
-        } else if (*argv[1] != '%') {  // leading %
-            write(STDERR_FILENO, "fg: job input does not begin with %\n", 37);
-        } else {
-            // get jid
-            char *jid_str = argv[1];
-            jid_str++;
-            int jid = atoi(jid_str);  // some number or -1
+    pid_t pid;
+    if ((pid = get_job_pid(my_jobs, atoi(arg + 1))) < 0) {
+        write(STDERR_FILENO, "job not found\n", 14);
+        return -1;
+    }
 
-            // get pid
-            pid_t pid;
-            int status;
-            if ((pid = get_job_pid(my_jobs, jid)) < 0) {
-                write(STDERR_FILENO, "job not found\n", 15);
-            } else {
-                kill(-pid, SIGCONT);                    // continue
-                update_job_pid(my_jobs, pid, RUNNING);  // update job list
-                // give terminal control to child
-                checked_setpgrp(pid);
+    return pid;
+}
 
-                // wait for child to terminate or moved to bg
-                checked_waitpid(pid, &status, WUNTRACED);
-                handle_signals(status, pid, NULL);
+/*
+ * parse_signal()
+ *
+ * - Description: parses a -<signal> argument, either a number or a name with
+ * or without the SIG prefix (i.e. -9, -KILL, -SIGKILL). Returns the signal
+ * number or -1.
+ *
+ * - Arguments: arg: the argument
+ */
+int parse_signal(char *arg) {
+    static const struct {
+        const char *name;
+        int sig;
+    } names[] = {{"HUP", SIGHUP},   {"INT", SIGINT},   {"QUIT", SIGQUIT},
+                 {"KILL", SIGKILL}, {"USR1", SIGUSR1}, {"USR2", SIGUSR2},
+                 {"TERM", SIGTERM}, {"CONT", SIGCONT}, {"STOP", SIGSTOP},
+                 {"TSTP", SIGTSTP}};
 
-                // take terminal control from child
-                pid_t old = getpgrp();
-                checked_setpgrp(old);
-            }
-        }
+    if (*arg++ != '-') {
+        return -1;
+    }
 
-        // builtin recognized as bg
-    } else if (!strncmp(cmd, "bg", 3)) {
-        if (argc != 2) {
-            write(STDERR_FILENO, "bg: syntax error\n", 18);
-        } else if (*argv[1] != '%') {  // leading %
-            write(STDERR_FILENO, "bg: job input does not begin with %\n", 37);
-        } else {
-            // get jid
-            char *jid_str = argv[1];
-            jid_str++;
-            int jid = atoi(jid_str);  // some number or -1
+    char *end;
+    long sig = strtol(arg, &end, 10);
+    if (end != arg) {
+        return (*end || sig < 0 || sig >= NSIG) ? -1 : (int)sig;
+    }
 
-            // get pid
-            pid_t pid;
-            if ((pid = get_job_pid(my_jobs, jid)) < 0) {
-                write(STDERR_FILENO, "job not found\n", 15);
-            } else {
-                kill(-pid, SIGCONT);                    // continue
-                update_job_pid(my_jobs, pid, RUNNING);  // update job list
-            }
+    if (!strncmp(arg, "SIG", 3)) {
+        arg += 3;
+    }
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (!strcmp(arg, names[i].name)) {
+            return names[i].sig;
         }
-    } else {
-        // builtin not recognized, try execv
-        return -1;
     }
 
-    // successfully executed builtin
-    return 0;
+    return -1;
 }
 
 /*
- * run_prog()
+ * set_option()
  *
- * - Description: Attempts to run execv within a child process with the given
- * argv. Supports i/o redirection and the & operator, which launches a job in
- * the background.
+ * - Description: sets a shell option for the set builtin. Returns 0, or -1
+ * (after printing an error) if there is no such option or the value is not
+ * valid for it.
  *
- * - Arguments: argv: array of pointers to parsed arguments, tokens: array of
- * pointers to parsed tokens (including redirection symbols and files), redir:
- * array of ints indicating the index of the redirection file for input, output,
- * or appending respectively within the tokens array, along with an int
- * representing a boolean for whether the job should be launched in the
- * background or not.
+ * - Arguments: name: the option, value: its new value
  *
- * - Usage: argv[0] should contain the name of the binary file to be executed,
- * preceded by a "/" (to prevent conflict with builtins with the same name).
- * The other elements of argv should be the inputs for the executable in
- * question. If redirects are desired, tokens should contain the input, output,
- * and/or append filepaths at the indices specified in redir. Redir[3] contains
- * information about whether or not the job should be launched in the foreground
- * or background.
+ * - Usage: set zygote <n>: keep n pre-forked helpers (see zygote.c)
+ *          set capture on|off: capture the output of background jobs
+ *          set merge off|on|tag|time: merge the output of background jobs
+ *          line by line, with no prefix, a [jid] prefix or a [jid] and
+ *          timestamp prefix
+ *          set outlimit off|<lines>[/<bytes>]: limit each background job to
+ *          that many lines (and bytes, with an optional k or m suffix) of
+ *          output per second
  */
-int *run_prog(char *argv[512], char *tokens[512], int redir[4]) {
-    pid_t pid;
-    int status;
-    int bg = redir[3];
-
-    // find index of full file path in tokens array
-    int f_index = 0;
-    for (int i = 0; i < 3; i++) {
-        if ((redir[i] == 1) || (f_index == 1 && redir[i] == 3)) {
-            f_index += 2;
+int set_option(char *name, char *value) {
+    if (!strncmp(name, "zygote", 7)) {
+        char *end;
+        long n = strtol(value, &end, 10);
+        if (n < 0 || n > MAX_ZYGOTES || *end || end == value) {
+            fprintf(stderr, "set: zygote: must be between 0 and %d\n",
+                    MAX_ZYGOTES);
+            return -1;
         }
-    }
 
-    if ((pid = fork()) == 0) {  // start child process
-        // change pgid
-        pid = getpid();
-        if (setpgid(pid, pid) < 0) {
-            perror("setpgid");
-            exit(1);
+        set_zygotes((int)n);
+    } else if (!strncmp(name, "capture", 8)) {
+        if (!strncmp(value, "on", 3)) {
+            capture_jobs = 1;
+        } else if (!strncmp(value, "off", 4)) {
+            capture_jobs = 0;
+        } else {
+            write(STDERR_FILENO, "set: capture: must be on or off\n", 32);
+            return -1;
         }
-
-        // set terminal control group to pid if this is a fg job
-        // TODO: if (!command ends with & symbol)
-        if (!bg) {  // give terminal control to foreground processes
-            checked_setpgrp(pid);
+    } else if (!strncmp(name, "merge", 6)) {
+        static const char *modes[] = {"off", "on", "tag", "time"};
+        int i = 0;
+        while (i < 4 && strcmp(value, modes[i])) {
+            i++;
         }
-
-        // reset signal handlers to default
-        change_def_handlers(SIG_DFL);
-
-        // set up redirection
-        if (redir[0]) {  // input redirection
-            checked_close(STDIN_FILENO);
-            checked_open(tokens[redir[0]], O_RDONLY, 0);
+        if (i == 4) {
+            write(STDERR_FILENO, "set: merge: must be off, on, tag or time\n",
+                  41);
+            return -1;
         }
 
-        if (redir[1]) {  // output redirection
-            checked_close(STDOUT_FILENO);
-            checked_open(tokens[redir[1]], O_WRONLY | O_TRUNC | O_CREAT, 0600);
-        } else if (redir[2]) {
-            checked_close(STDOUT_FILENO);
-            checked_open(tokens[redir[2]], O_WRONLY | O_APPEND | O_CREAT, 0600);
-        }
+        merge_jobs = (merge_mode_t)i;
+    } else if (!strncmp(name, "outlimit", 9)) {
+        outlimit_t limit = {0, 0};
+        char *end = value;
+        if (strncmp(value, "off", 4)) {
+            limit.lines = strtol(value, &end, 10);
+            if (end != value && *end == '/') {
+                char *bytes = end + 1;
+                limit.bytes = strtol(bytes, &end, 10);
+                if (end == bytes) {
+                    end = value;  // (an error)
+                } else if (*end == 'k' || *end == 'K') {
+                    limit.bytes *= 1024;
+                    end++;
+                } else if (*end == 'm' || *end == 'M') {
+                    limit.bytes *= 1024 * 1024;
+                    end++;
+                }
+            }
 
-        if (!strncmp(argv[0], "/", 1)) {
-            (argv[0])++;  // remove starting '/' from argv[0]
+            if (end == value || *end || limit.lines < 0 || limit.bytes < 0) {
+                write(STDERR_FILENO,
+                      "set: outlimit: must be off or <lines>[/<bytes>]\n", 48);
+                return -1;
+            }
         }
 
-        // execute
-        execv(tokens[f_index], argv);
-        perror("execv");
-
-        exit(1);
-    }
-
-    if (bg) {  // job set up in background
-        // add job to job list
-        add_job(my_jobs, next_job, pid, RUNNING, tokens[f_index]);
-        next_job++;
-
-        // print job and process id
-        char output[32];
-        int job = get_job_jid(my_jobs, pid);
-        snprintf(output, 32, "[%d] (%d)\n", job, pid);
-        checked_stdwrite(output);
+        outlimit = limit;
     } else {
-        // wait for child process
-        checked_waitpid(pid, &status, WUNTRACED);
-        handle_signals(status, pid, tokens[f_index]);
+        fprintf(stderr, "set: %s: unknown option\n", name);
+        return -1;
     }
 
-    // return terminal control to parent
-    pid_t old = getpgrp();
-    checked_setpgrp(old);
-
     return 0;
 }
 
+/* SIGINT handler while following a job's output (or a file) */
+void note_interrupt(int sig) {
+    (void)sig;
+    interrupted = 1;
+}
+
 /*
- * main()
- *
- * - Description: Sets up and executes a fully funcitonal REPL shell with built-
- * in commands rm, ln, cd, bg, fg, jobs, and exit. Attempts to execute commands
- * that do not correspond to builtins.
+ * catch_interrupt()
  *
- * - Arguments: none
+ * - Description: the shell ignores SIGINT, so this catches it while a
+ * builtin follows something until ^C, setting interrupted. The handler is
+ * installed without SA_RESTART, so that it interrupts the wait. Undo with
+ * sigaction(SIGINT, old, NULL).
  *
- * - Usage: type in commands to the REPL like you normally would in a shell!
- *          supports cd, rm, ln, exit, exiting with ctrl+D, and executing
- *          programs with execv, along with file redirection using "<", ">", and
- *          ">>". Also supports signal handling, launching jobs in the
- *          background with the ampersand ("&") operator, and moving jobs from
- *          the foreground to background.
+ * - Arguments: old: set to the SIGINT action to restore
  */
-int main() {
-    my_jobs = init_job_list();
+void catch_interrupt(struct sigaction *old) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = note_interrupt;
+    sigaction(SIGINT, &sa, old);
+    interrupted = 0;
+}
 
-    do {
-        // setting up default signal behaviors for our shell
-        change_def_handlers(SIG_IGN);
+/*
+ * show_capture()
+ *
+ * - Description: writes the output captured from a background job to
+ * standard output and, if follow is set, keeps writing new output as it
+ * arrives until the job is done or ^C is pressed.
+ *
+ * - Arguments: cap: the job's capture, follow: set for joblog -f
+ */
+void show_capture(capture_t *cap, int follow) {
+    uint64_t pos = write_capture(cap, STDOUT_FILENO, 0);
+    if (!follow) {
+        return;
+    }
+
+    struct sigaction old;
+    catch_interrupt(&old);
+    while (capture_live(cap) && !interrupted) {
+        wait_events(-1, -1);
+        pos = write_capture(cap, STDOUT_FILENO, pos);
+    }
+
+    sigaction(SIGINT, &old, NULL);
+}
+
+/*
+ * read_output()
+ *
+ * - Description: reads what a command wrote to the memfd fd (from its start)
+ * into *buf, growing it as needed. Returns the number of bytes, or -1 on
+ * failure.
+ *
+ * - Arguments: fd: the memfd, buf and cap: a malloc()ed buffer and its size
+ */
+ssize_t read_output(int fd, char **buf, size_t *cap) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+
+    size_t len = (size_t)st.st_size;
+    if (len > *cap) {
+        char *grown;
+        if (!(grown = (char *)realloc(*buf, len))) {
+            return -1;
+        }
+        *buf = grown;
+        *cap = len;
+    }
+
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = pread(fd, *buf + got, len - got, (off_t)got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+        got += (size_t)n;
+    }
+    return (ssize_t)got;
+}
+
+/*
+ * run_watch()
+ *
+ * - Description: the watch builtin. Compiles the command once, then runs it
+ * every interval seconds (argv[2] with -n, else WATCH_INTERVAL; fractions
+ * allowed) until ^C, or until the command itself is interrupted or stopped.
+ * Runs are scheduled by a periodic timerfd, i.e. at absolute times, so they
+ * do not drift; a run that overruns its interval drops the ticks it missed,
+ * so the next run starts at the first tick after it. The command's output
+ * (and errors) go to a memfd, and the screen is only cleared and redrawn when
+ * the output differs from the last run's. Background jobs are still handled
+ * while waiting. Returns 0, or 1 on a syntax or setup error.
+ *
+ * - Arguments: argv: watch [-n secs] cmd..., argc: number of arguments
+ *
+ * - Usage: watch -n 1 ls -l, watch 'wc -l log'. Several words are run as
+ * they were parsed, each one argument however it was quoted; a single word is
+ * compiled as a line of its own, so redirections quoted into it apply to each
+ * run, while unquoted ones apply to watch as a whole.
+ */
+int run_watch(char *argv[], int argc) {
+    double secs = WATCH_INTERVAL;
+    int i = 1;
+    if (i < argc && !strncmp(argv[i], "-n", 2)) {
+        char *arg = argv[i][2] ? argv[i] + 2 : i + 1 < argc ? argv[++i] : "";
+        char *end;
+        secs = strtod(arg, &end);
+        if (end == arg || *end || !(secs >= 0.1)) {  // (also rejects NaN)
+            write(STDERR_FILENO, "watch: syntax error\n", 20);
+            return 1;
+        }
+        i++;
+    }
+    if (i >= argc) {
+        write(STDERR_FILENO, "watch: syntax error\n", 20);
+        return 1;
+    }
+
+    // the command, built once for all runs, and its words joined with
+    // spaces for the header
+    size_t len = 0;
+    for (int k = i; k < argc; k++) {
+        len += strlen(argv[k]) + 1;
+    }
+    char line[len];
+    char *at = line;
+    for (int k = i; k < argc; k++) {
+        at = stpcpy(at, argv[k]);
+        *at++ = k + 1 < argc ? ' ' : '\0';
+    }
+    command_t *cmd = i + 1 == argc ? compile_command(line, len - 1)
+                                   : words_command(argv + i, argc - i);
+    if (!cmd) {
+        return 1;
+    }
+
+    int out = memfd_create("watch", MFD_CLOEXEC), timer = -1;
+    if (out < 0 || (timer = timerfd_create(CLOCK_MONOTONIC,
+                                           TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        perror("watch");
+        if (out >= 0) {
+            close(out);
+        }
+        free_command(cmd);
+        return 1;
+    }
+
+    // first run now, then every interval from now on
+    struct itimerspec when;
+    when.it_interval.tv_sec = (time_t)secs;
+    when.it_interval.tv_nsec = (long)((secs - (double)(time_t)secs) * 1e9);
+    clock_gettime(CLOCK_MONOTONIC, &when.it_value);
+    when.it_value.tv_sec += when.it_interval.tv_sec;
+    when.it_value.tv_nsec += when.it_interval.tv_nsec;
+    if (when.it_value.tv_nsec >= 1000000000) {
+        when.it_value.tv_sec++;
+        when.it_value.tv_nsec -= 1000000000;
+    }
+    timerfd_settime(timer, TFD_TIMER_ABSTIME, &when, NULL);
+
+    char header[64];
+    int hlen =
+        snprintf(header, sizeof(header), "\033[H\033[2JEvery %gs: ", secs);
+    char *shown = NULL, *now = NULL;
+    size_t shown_cap = 0, now_cap = 0;
+    ssize_t shown_len = -1;
+
+    struct sigaction old;
+    catch_interrupt(&old);
+    int ret = 0;
+    while (!interrupted) {
+        // (before the redirection, so that job reports are not taken for the
+        // command's output)
+        reap_jobs();
+
+        // run the command with its output going to the memfd (emptied
+        // first); if that cannot be set up, its output would go to the
+        // terminal and be compared with stale contents, so stop instead
+        int saved[2] = {fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0),
+                        fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0)};
+        int ready = saved[0] >= 0 && saved[1] >= 0 && !ftruncate(out, 0) &&
+                    !lseek(out, 0, SEEK_SET) && dup2(out, STDOUT_FILENO) >= 0 &&
+                    dup2(out, STDERR_FILENO) >= 0;
+        if (ready) {
+            watch_running = 1;
+            exec_command(cmd);
+            fflush(stdout);
+            watch_running = 0;
+        }
+        int err = errno;
+        for (int fd = 0; fd < 2; fd++) {
+            if (saved[fd] >= 0) {
+                if (dup2(saved[fd], fd + 1) < 0) {
+                    err = errno;
+                    ready = 0;
+                }
+                close(saved[fd]);
+            }
+        }
+        if (!ready) {
+            errno = err;
+            perror("watch");
+            ret = 1;
+            break;
+        }
+        refill_zygotes();
+
+        int status = last_status;
+        if (status == 128 + SIGINT || status == 128 + SIGTSTP) {
+            break;  // (^C or ^Z while it ran)
+        }
+
+        ssize_t n;
+        if ((n = read_output(out, &now, &now_cap)) < 0) {
+            perror("watch");
+            ret = 1;
+            break;
+        }
+        if (n != shown_len || memcmp(now, shown, (size_t)n)) {  // redraw
+            write(STDOUT_FILENO, header, (size_t)hlen);
+            write(STDOUT_FILENO, line, len - 1);
+            write(STDOUT_FILENO, "\n\n", 2);
+            write(STDOUT_FILENO, now, (size_t)n);
+
+            char *swap = shown;
+            size_t swap_cap = shown_cap;
+            shown = now;
+            shown_cap = now_cap;
+            shown_len = n;
+            now = swap;
+            now_cap = swap_cap;
+        }
+
+        // wait for the next tick; those that expired during the run (read
+        // here without waiting) are dropped
+        uint64_t ticks = 0;
+        read(timer, &ticks, sizeof(ticks));
+        ticks = 0;
+        while (!interrupted && !ticks) {
+            if (wait_events(timer, -1) &&
+                read(timer, &ticks, sizeof(ticks)) < 0) {
+                ticks = 0;
+            }
+        }
+    }
+    sigaction(SIGINT, &old, NULL);
+
+    free(shown);
+    free(now);
+    close(timer);
+    close(out);
+    free_command(cmd);
+    last_status = ret;
+    return ret;
+}
+
+/*
+ * run_trigger()
+ *
+ * - Description: runs the command of an onchange (see onchange.c) once the
+ * paths it watches have changed: a program is started as a background job,
+ * with the changed paths as extra arguments, or with in as its standard
+ * input. This only happens while the shell is idle, i.e. waiting at its
+ * prompt, so that the job never competes with a foreground one for the
+ * terminal; otherwise returns -1, and onchange tries again later. The
+ * shell's own last_status is left as it was.
+ */
+int run_trigger(command_t *cmd, char **paths, int npaths, int in) {
+    if (!shell_idle) {
+        return -1;
+    }
+
+    int status = last_status, saved = -1;
+    if (in >= 0 && (saved = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0)) >= 0) {
+        dup2(in, STDIN_FILENO);
+    }
+    shell_idle = 0;
+    run_command(cmd, paths, npaths, 1);
+    shell_idle = 1;
+    if (saved >= 0) {
+        dup2(saved, STDIN_FILENO);
+        close(saved);
+    }
+
+    last_status = status;
+    return 0;
+}
+
+/* the descriptors found by note_fd() */
+typedef struct {
+    int fds[1024];
+    int n;
+} fd_list_t;
+
+/* list_dir() callback for /proc/self/fd: notes a descriptor */
+void note_fd(const char *name, unsigned char type, void *arg) {
+    (void)type;
+    fd_list_t *list = (fd_list_t *)arg;
+    if (list->n < 1024) {
+        list->fds[list->n++] = atoi(name);
+    }
+}
+
+/* orders ints (a qsort() comparator) */
+int compare_ints(const void *a, const void *b) {
+    return (*(const int *)a > *(const int *)b) -
+           (*(const int *)a < *(const int *)b);
+}
+
+/*
+ * list_fds()
+ *
+ * - Description: the fds builtin, for debugging descriptor leaks. Lists the
+ * shell's open descriptors that are not close-on-exec, i.e. that a program
+ * would inherit if run_prog() did not close them (standard input, output and
+ * error aside, which are meant to be), with what they refer to. With -a,
+ * lists every descriptor, marking those that are close-on-exec. Returns 0,
+ * or 1 on an error.
+ */
+int list_fds(char *argv[], int argc) {
+    int all = argc == 2 && !strncmp(argv[1], "-a", 3);
+    if (argc > 2 || (argc == 2 && !all)) {
+        write(STDERR_FILENO, "fds: syntax error\n", 18);
+        return 1;
+    }
+
+    static fd_list_t list;  // (a bit big for the stack)
+    list.n = 0;
+    int dir;
+    if ((dir = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        perror("fds");
+        return 1;
+    }
+    list_dir(dir, note_fd, &list);
+    close(dir);
+    qsort(list.fds, (size_t)list.n, sizeof(int), compare_ints);
+
+    for (int i = 0; i < list.n; i++) {
+        int fd = list.fds[i], flags;
+        if (fd == dir || (flags = fcntl(fd, F_GETFD)) < 0 ||
+            (!all && (fd < 3 || (flags & FD_CLOEXEC)))) {
+            continue;
+        }
+
+        char link[64], target[4096];
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+        ssize_t len = readlink(link, target, sizeof(target) - 1);
+        target[len < 0 ? 0 : len] = '\0';
+        printf("%d -> %s%s\n", fd, target,
+               all && (flags & FD_CLOEXEC) ? " (close-on-exec)" : "");
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/*
+ * spawn_jobs()
+ *
+ * - Description: the spawn builtin, for load tests. Starts n copies of a
+ * program as n background jobs, preparing everything the copies share only
+ * once: the command has been parsed (and expanded) once, its environment is
+ * the cached one (see var_envp_with()), and its redirections are opened
+ * once, so all copies share the same open files. The copies are started with
+ * posix_spawn(), which clones without copying the shell's address space
+ * (vfork-style), rather than forking, and are then added to the job list with
+ * a single add_jobs(), and reported with one line for them all, on the
+ * shell's own standard output. Returns 0, or 1 on an error (the copies
+ * started before a failed one are still jobs).
+ *
+ * - Arguments: argv: spawn -n n cmd..., argc: number of arguments, tokens,
+ * redir: the command's tokens and redirections, as for run_prog()
+ *
+ * - Usage: spawn -n 500 ./worker > log. Called by run_command() before the
+ * command's redirections would be applied to a builtin, since they are for
+ * the copies.
+ */
+int spawn_jobs(char *argv[], int argc, char **tokens, const int redir[4]) {
+    long n = 0;
+    char *end = NULL;
+    if (argc > 3 && !strncmp(argv[1], "-n", 3)) {
+        n = strtol(argv[2], &end, 10);
+    }
+    if (!end || *end || end == argv[2] || n < 1 || n > MAX_SPAWN) {
+        write(STDERR_FILENO, "spawn: syntax error\n", 20);
+        return 1;
+    }
+
+    // leading NAME=value words only go to the copies' environment (see
+    // run_command())
+    char **assigns = argv + 3;
+    int nassign = 0;
+    while (3 + nassign < argc && is_assignment(assigns[nassign])) {
+        nassign++;
+    }
+    if (3 + nassign == argc) {
+        write(STDERR_FILENO, "spawn: syntax error\n", 20);
+        return 1;
+    }
+    char **args = assigns + nassign;
+    int nargs = argc - 3 - nassign;
+
+    // the program is run as run_prog() runs it: argv[0] of a path starting
+    // with '/' loses its directory
+    char *path = args[0];
+    char **copy = NULL, **envp = NULL, **exec_argv = NULL;
+    pid_t *pids = NULL;
+    int fds[2] = {-1, -1}, ret = 1;
+    if (!(exec_argv = malloc((size_t)(nargs + 1) * sizeof(char *))) ||
+        !(pids = malloc((size_t)n * sizeof(pid_t)))) {
+        perror("spawn");
+        goto done;
+    }
+    memcpy(exec_argv, args, (size_t)nargs * sizeof(char *));
+    exec_argv[nargs] = NULL;
+    if (path[0] == '/') {
+        exec_argv[0] = strrchr(path, '/') + 1;
+    }
+
+    // the redirections, opened once and shared by all copies
+    if (redir[0] &&
+        (fds[0] = openat(cwd_fd, tokens[redir[0]], O_RDONLY | O_CLOEXEC)) < 0) {
+        perror(tokens[redir[0]]);
+        goto done;
+    }
+    if ((redir[1] || redir[2]) &&
+        (fds[1] = openat(
+             cwd_fd, tokens[redir[1] ? redir[1] : redir[2]],
+             O_WRONLY | O_CREAT | O_CLOEXEC | (redir[1] ? O_TRUNC : O_APPEND),
+             0600)) < 0) {
+        perror(tokens[redir[1] ? redir[1] : redir[2]]);
+        goto done;
+    }
+
+    if (!(envp = var_envp_with(shell_vars, assigns, nassign, &copy))) {
+        goto done;
+    }
+
+    // each copy gets a process group of its own, default signal handlers
+    // and no blocked signals, runs in the shell's directory, and inherits
+    // only its standard input, output and error
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t all, none;
+    sigfillset(&all);
+    sigemptyset(&none);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP |
+                                        POSIX_SPAWN_SETSIGDEF |
+                                        POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setsigdefault(&attr, &all);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawn_file_actions_init(&actions);
+    if (cwd_fd != AT_FDCWD) {
+        posix_spawn_file_actions_addfchdir_np(&actions, cwd_fd);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (fds[i] >= 0) {
+            posix_spawn_file_actions_adddup2(&actions, fds[i], i);
+        }
+    }
+    posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+
+    int started = 0, err = 0;
+    while (started < n && !(err = posix_spawn(&pids[started], path, &actions,
+                                              &attr, exec_argv, envp))) {
+        started++;
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err) {
+        fprintf(stderr, "spawn: %s: %s\n", path, strerror(err));
+    }
+
+    if (started) {
+        add_jobs(my_jobs, next_job, pids, started, RUNNING, path);
+        for (int i = 0; i < started; i++) {
+            notify_started(my_jobs, pids[i]);
+        }
+
+        // (one line however many, as run_prog() would print for one)
+        char output[80];
+        if (started == 1) {
+            snprintf(output, sizeof(output), "[%d] (%d)\n", next_job, pids[0]);
+        } else {
+            snprintf(output, sizeof(output), "[%d-%d] %d jobs (%d ... %d)\n",
+                     next_job, next_job + started - 1, started, pids[0],
+                     pids[started - 1]);
+        }
+        checked_stdwrite(output);
+        next_job += started;
+    }
+    ret = err != 0;
+
+done:
+    for (int i = 0; i < 2; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    free(pids);
+    free(exec_argv);
+    free(copy);
+    return ret;
+}
+
+/*
+ * exec_builtins()
+ *
+ * - Description: takes in the current argv array and argc count and attempts to
+ * execute one of the supported builtin commands jobs, fg, bg, kill, wait,
+ * joblog, history, cd, pushd, popd, dirs, ls, wc, head, tail, watch,
+ * onchange, ln, rm, set, export, unset, fds, source, or exit (spawn is run
+ * by run_command(), see spawn_jobs()).
+ * Returns 0 if a command was attempted, -1 if the command was not recognized
+ * as one of the builtins.
+ *
+ * - Arguments: argv: an array of pointers to parsed arguments, argc: an int
+ * representing the number of arguments
+ *
+ * - Usage:
+ *          if argv[0] is:
+ *              "exit" -> exits the program
+ *              "cd" -> changes working directory to argv[1] (looked up in
+ *  CDPATH), or to the previous one for -
+ *              "pushd" -> changes working directory to argv[1] (or the top
+ *  of the directory stack), pushing the old one
+ *              "popd" -> changes working directory to the top of the
+ *  directory stack, removing it
+ *              "dirs" -> prints the directory stack
+ *              "ls" -> lists the files in argv[1...] (see ls.c)
+ *              "wc" -> counts the lines, words and bytes in argv[1...] (see
+ *  wc.c)
+ *              "head", "tail" -> print the first or last lines of argv[1...]
+ *  (see tail.c)
+ *              "watch" -> runs the command argv[1...] every few seconds,
+ *  redrawing the screen when its output changes
+ *              "onchange" -> runs a command in the background whenever the
+ *  paths in argv[1...] change (see onchange.c)
+ *              "ln" -> calls link to create a new hardlink between argv[1] and
+ *  argv[2]
+ *              "rm" -> calls unlink to remove argv[1]
+ *              "kill" -> sends a signal (default SIGTERM) to job argv[argc-1]
+ *              "wait" -> waits for job argv[1] to finish or stop
+ *              "joblog" -> shows (or, with -f, follows) the captured output
+ *  of job argv[1]
+ *              "history" -> prints the command history (the last argv[1]
+ *  entries, or with -s, those containing argv[2])
+ *              "set" -> sets the shell option argv[1] to argv[2]
+ *              "export" -> exports the variables argv[1...] to programs (or
+ *  lists the exported ones)
+ *              "unset" -> unsets the variables argv[1...]
+ *              "fds" -> lists the descriptors programs would inherit (or,
+ *  with -a, all of them)
+ *              "source" or "." -> runs the commands in argv[1] in this shell
+ *          else returns -1
+ */
+int exec_builtins(char *argv[512], int argc) {
+    char *cmd = argv[0];
+
+    // builtin recognized as exit
+    if (!strncmp(cmd, "exit", 5)) {
+        if (argc != 1) {
+            write(STDERR_FILENO, "exit: syntax error\n", 20);
+            last_status = 1;
+        } else if (in_session || in_server) {  // after the reply, see above
+            session_done = 1;
+        } else {
+            cleanup_job_list(my_jobs);
+            exit(0);
+        }
+
+        // builtin recognized as cd
+    } else if (!strncmp(cmd, "cd", 3)) {
+        if (argc != 2) {  // no filepath to cd
+            write(STDERR_FILENO, "cd: syntax error\n", 17);
+            last_status = 1;
+        } else if (cd_dir(argv[1], &cwd_fd) < 0) {  // (see dirs.c)
+            last_status = 1;
+        }
+
+        // builtin recognized as pushd
+    } else if (!strncmp(cmd, "pushd", 6)) {
+        if (argc > 2) {
+            write(STDERR_FILENO, "pushd: syntax error\n", 20);
+            last_status = 1;
+        } else if (push_dir(argv[1], &cwd_fd) < 0) {
+            last_status = 1;
+        }
+
+        // builtin recognized as popd
+    } else if (!strncmp(cmd, "popd", 5)) {
+        if (argc != 1) {
+            write(STDERR_FILENO, "popd: syntax error\n", 19);
+            last_status = 1;
+        } else if (pop_dir(&cwd_fd) < 0) {
+            last_status = 1;
+        }
+
+        // builtin recognized as dirs
+    } else if (!strncmp(cmd, "dirs", 5)) {
+        if (argc != 1) {
+            write(STDERR_FILENO, "dirs: syntax error\n", 19);
+            last_status = 1;
+        } else {
+            print_dirs();
+        }
+
+        // builtin recognized as ls
+    } else if (!strncmp(cmd, "ls", 3)) {
+        last_status = list_files(argv, argc, cwd_fd);  // (see ls.c)
+
+        // builtin recognized as wc
+    } else if (!strncmp(cmd, "wc", 3)) {
+        last_status = count_files(argv, argc, cwd_fd);  // (see wc.c)
+
+        // builtin recognized as head
+    } else if (!strncmp(cmd, "head", 5)) {
+        last_status = print_head(argv, argc, cwd_fd);  // (see tail.c)
+
+        // builtin recognized as tail
+    } else if (!strncmp(cmd, "tail", 5)) {
+        struct sigaction old;
+        catch_interrupt(&old);  // (for -f)
+        last_status = print_tail(argv, argc, cwd_fd, &interrupted);
+        sigaction(SIGINT, &old, NULL);
+
+        // builtin recognized as watch
+    } else if (!strncmp(cmd, "watch", 6)) {
+        run_watch(argv, argc);
+
+        // builtin recognized as onchange
+    } else if (!strncmp(cmd, "onchange", 9)) {
+        last_status = onchange(argv, argc, cwd_fd, run_trigger);
+
+        // builtin recognized as ln
+    } else if (!strncmp(cmd, "ln", 3)) {
+        if (argc != 3) {
+            write(STDERR_FILENO, "ln: syntax error\n", 17);
+            last_status = 1;
+        }
+        if (linkat(cwd_fd, argv[1], cwd_fd, argv[2], 0) < 0) {
+            perror("ln");
+            last_status = 1;
+        }
+
+        // builtin recognized as rm
+    } else if (!strncmp(cmd, "rm", 3)) {
+        if (argc != 2) {
+            write(STDERR_FILENO, "rm: syntax error\n", 17);
+            last_status = 1;
+        } else if (unlinkat(cwd_fd, argv[1], 0) < 0) {
+            perror("rm");
+            last_status = 1;
+        }
+
+        // builtin recognized as jobs
+    } else if (!strncmp(cmd, "jobs", 5)) {
+        if (argc == 2 && !strncmp(argv[1], "--json", 7)) {
+            jobs_json(my_jobs);
+            fflush(stdout);
+        } else if (argc == 2 && !strncmp(argv[1], "--subscribe", 12)) {
+            // events go to (a copy of) whatever stdout is now, i.e. the
+            // client's in server mode, until it stops reading
+            if (subscribe_jobs(my_jobs,
+                               fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3)) < 0) {
+                write(STDERR_FILENO, "jobs: too many subscribers\n", 27);
+                last_status = 1;
+            }
+        } else if (argc != 1) {
+            write(STDERR_FILENO, "jobs: syntax error\n", 20);
+            last_status = 1;
+        } else {
+            jobs(my_jobs);
+            fflush(stdout);  // jobs() uses stdio, everything else write()
+        }
+
+        // builtin recognized as fg
+    } else if (!strncmp(cmd, "fg", 3)) {
+        if (argc != 2) {
+            write(STDERR_FILENO, "fg: syntax error\n", 18);
+            last_status = 1;
+        } else if (*argv[1] != '%') {  // leading %
+            write(STDERR_FILENO, "fg: job input does not begin with %\n", 37);
+            last_status = 1;
+        } else {
+            // get jid
+            char *jid_str = argv[1];
+            jid_str++;
+            int jid = atoi(jid_str);  // some number or -1
+
+            // get pid
+            pid_t pid;
+            if ((pid = get_job_pid(my_jobs, jid)) < 0) {
+                write(STDERR_FILENO, "job not found\n", 15);
+                last_status = 1;
+            } else {
+                kill(-pid, SIGCONT);                    // continue
+                update_job_pid(my_jobs, pid, RUNNING);  // update job list
+                // give terminal control to child
+                checked_setpgrp(pid);
+
+                // wait for child to terminate or moved to bg
+                wait_fg(pid, NULL);
+
+                // take terminal control from child
+                pid_t old = getpgrp();
+                checked_setpgrp(old);
+            }
+        }
+
+        // builtin recognized as bg
+    } else if (!strncmp(cmd, "bg", 3)) {
+        if (argc != 2) {
+            write(STDERR_FILENO, "bg: syntax error\n", 18);
+            last_status = 1;
+        } else if (*argv[1] != '%') {  // leading %
+            write(STDERR_FILENO, "bg: job input does not begin with %\n", 37);
+            last_status = 1;
+        } else {
+            // get jid
+            char *jid_str = argv[1];
+            jid_str++;
+            int jid = atoi(jid_str);  // some number or -1
+
+            // get pid
+            pid_t pid;
+            if ((pid = get_job_pid(my_jobs, jid)) < 0) {
+                write(STDERR_FILENO, "job not found\n", 15);
+                last_status = 1;
+            } else {
+                kill(-pid, SIGCONT);                    // continue
+                update_job_pid(my_jobs, pid, RUNNING);  // update job list
+            }
+        }
+
+        // builtin recognized as kill
+    } else if (!strncmp(cmd, "kill", 5)) {
+        int sig = SIGTERM;
+        pid_t pid;
+        if (argc == 3 && (sig = parse_signal(argv[1])) < 0) {
+            fprintf(stderr, "kill: %s: invalid signal\n", argv[1]);
+            last_status = 1;
+        } else if (argc != 2 && argc != 3) {
+            write(STDERR_FILENO, "kill: syntax error\n", 19);
+            last_status = 1;
+        } else if ((pid = find_job_arg("kill", argv[argc - 1])) < 0) {
+            last_status = 1;
+        } else if (kill(-pid, sig) < 0) {
+            perror("kill");
+            last_status = 1;
+        }
+
+        // builtin recognized as wait
+    } else if (!strncmp(cmd, "wait", 5)) {
+        pid_t pid;
+        if (argc != 2) {
+            write(STDERR_FILENO, "wait: syntax error\n", 19);
+            last_status = 1;
+        } else if ((pid = find_job_arg("wait", argv[1])) < 0) {
+            last_status = 1;
+        } else {
+            // like fg, but without continuing the job or giving it the
+            // terminal; the exit status becomes the status of wait
+            wait_fg(pid, NULL);
+        }
+
+        // builtin recognized as joblog
+    } else if (!strncmp(cmd, "joblog", 7)) {
+        capture_t *cap;
+        int follow = argc == 3 && !strncmp(argv[2], "-f", 3);
+        if (argc != 2 && !follow) {
+            write(STDERR_FILENO, "joblog: syntax error\n", 21);
+            last_status = 1;
+        } else if (*argv[1] != '%') {
+            write(STDERR_FILENO, "joblog: job input does not begin with %\n",
+                  40);
+            last_status = 1;
+        } else if (!(cap = find_capture(my_jobs, atoi(argv[1] + 1)))) {
+            // (the job itself may be long gone, its output is kept)
+            fprintf(stderr, "joblog: %s: no captured output\n", argv[1]);
+            last_status = 1;
+        } else {
+            show_capture(cap, follow);
+        }
+
+        // builtin recognized as history
+    } else if (!strncmp(cmd, "history", 8)) {
+        char *end = NULL;
+        long n = argc == 2 ? strtol(argv[1], &end, 10) : 0;
+        if (!have_history()) {
+            write(STDERR_FILENO, "history: no history file\n", 25);
+            last_status = 1;
+        } else if (argc == 3 && !strncmp(argv[1], "-s", 3)) {
+            print_matches(argv[2]);
+            fflush(stdout);
+        } else if (argc > 2 || (end && (*end || end == argv[1] || n < 0))) {
+            write(STDERR_FILENO, "history: syntax error\n", 22);
+            last_status = 1;
+        } else {
+            print_history((int)n);
+            fflush(stdout);
+        }
+
+        // builtin recognized as set
+    } else if (!strncmp(cmd, "set", 4)) {
+        if (argc != 3) {
+            write(STDERR_FILENO, "set: syntax error\n", 18);
+            last_status = 1;
+        } else if (set_option(argv[1], argv[2]) < 0) {
+            last_status = 1;
+        }
+
+        // builtin recognized as export
+    } else if (!strncmp(cmd, "export", 7)) {
+        export_variables(argv, argc);
+
+        // builtin recognized as unset
+    } else if (!strncmp(cmd, "unset", 6)) {
+        for (int i = 1; i < argc; i++) {
+            if (var_unset(shell_vars, argv[i]) < 0) {
+                last_status = 1;
+            }
+        }
+
+        // builtin recognized as fds
+    } else if (!strncmp(cmd, "fds", 4)) {
+        last_status = list_fds(argv, argc);
+
+        // builtin recognized as source
+    } else if (!strncmp(cmd, "source", 7) || !strncmp(cmd, ".", 2)) {
+        if (argc != 2) {
+            fprintf(stderr, "%s: syntax error\n", cmd);
+            last_status = 1;
+        } else {
+            run_source(argv[1]);
+        }
+    } else {
+        // builtin not recognized, try execv
+        return -1;
+    }
+
+    // successfully executed builtin
+    return 0;
+}
+
+/*
+ * launch_helper()
+ *
+ * - Description: runs a program in a pre-forked helper from the zygote pool
+ * (see zygote.c), with the same argv, redirections and terminal handling a
+ * child forked by run_prog() would get. Returns the helper's pid, or -1 if
+ * the pool is disabled or empty.
+ *
+ * - Arguments: argv, tokens, redir, envp: as passed to run_prog(), path: full
+ * path of the program, out: descriptor for the program's standard output and
+ * error (-1 for the shell's own)
+ *
+ * - Usage: called by run_prog() before falling back to fork()
+ */
+pid_t launch_helper(char *argv[512], char *tokens[512], int redir[4],
+                    char *path, int out, char **envp) {
+    if (!zygote_count()) {
+        return -1;
+    }
+
+    // copy argv, since argv[0] loses its starting '/' as in run_prog()
+    char *args[512];
+    int nargs = 0;
+    while (nargs < 511 && argv[nargs]) {
+        args[nargs] = argv[nargs];
+        nargs++;
+    }
+    args[nargs] = NULL;
+    if (!strncmp(args[0], "/", 1)) {
+        args[0]++;
+    }
+
+    const char *files[3];
+    for (int i = 0; i < 3; i++) {
+        files[i] = redir[i] ? tokens[redir[i]] : NULL;
+    }
+
+    int stdfds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    if (out >= 0) {
+        stdfds[1] = stdfds[2] = out;
+    }
+
+    pid_t pid =
+        zygote_launch(path, args, envp, files, stdfds, cwd_fd, 0, !redir[3]);
+    return pid;
+}
+
+/*
+ * run_prog()
+ *
+ * - Description: Attempts to run execv within a child process with the given
+ * argv. Supports i/o redirection and the & operator, which launches a job in
+ * the background.
+ *
+ * - Arguments: argv: array of pointers to parsed arguments, tokens: array of
+ * pointers to parsed tokens (including redirection symbols and files), redir:
+ * array of ints indicating the index of the redirection file for input, output,
+ * or appending respectively within the tokens array, along with an int
+ * representing a boolean for whether the job should be launched in the
+ * background or not, envp: the environment to run it in (see var_envp()).
+ *
+ * - Usage: argv[0] should contain the name of the binary file to be executed,
+ * preceded by a "/" (to prevent conflict with builtins with the same name).
+ * The other elements of argv should be the inputs for the executable in
+ * question. If redirects are desired, tokens should contain the input, output,
+ * and/or append filepaths at the indices specified in redir. Redir[3] contains
+ * information about whether or not the job should be launched in the foreground
+ * or background.
+ */
+int *run_prog(char *argv[512], char *tokens[512], int redir[4], char **envp) {
+    pid_t pid;
+    int bg = redir[3];
+
+    // find index of full file path in tokens array
+    int f_index = 0;
+    for (int i = 0; i < 3; i++) {
+        if ((redir[i] == 1) || (f_index == 1 && redir[i] == 3)) {
+            f_index += 2;
+        }
+    }
+
+    // with set capture on (or set merge), a background job's output goes to
+    // a pipe drained into its capture (or merged onto standard output);
+    // output redirections still take precedence
+    int out[2] = {-1, -1};
+    int merged = merge_jobs || outlimit.lines || outlimit.bytes;
+    if (bg && (capture_jobs || merged) && pipe2(out, O_CLOEXEC) < 0) {
+        perror("capture");
+        out[0] = out[1] = -1;
+    }
+
+    if ((pid = launch_helper(argv, tokens, redir, tokens[f_index], out[1],
+                             envp)) > 0) {
+        // a pre-forked helper is running the program, nothing to set up
+    } else if ((pid = fork()) == 0) {  // start child process
+        // change pgid
+        pid = getpid();
+        if (setpgid(pid, pid) < 0) {
+            perror("setpgid");
+            exit(1);
+        }
+
+        // set terminal control group to pid if this is a fg job
+        // TODO: if (!command ends with & symbol)
+        if (!bg) {  // give terminal control to foreground processes
+            checked_setpgrp(pid);
+        }
+
+        // reset signal handlers to default (SIGPIPE is ignored by servers)
+        change_def_handlers(SIG_DFL);
+        checked_signal(SIGPIPE, SIG_DFL);
+
+        // a session's commands run in the session's directory
+        if (cwd_fd != AT_FDCWD && fchdir(cwd_fd) < 0) {
+            perror("cd");
+            exit(1);
+        }
+
+        if (out[1] >= 0) {  // a captured (or merged) job
+            dup2(out[1], STDOUT_FILENO);
+            dup2(out[1], STDERR_FILENO);
+        }
+
+        // set up redirection (the files become the program's standard input
+        // and output, so they are the one thing not opened close-on-exec)
+        if (redir[0]) {  // input redirection
+            checked_close(STDIN_FILENO);
+            checked_open(tokens[redir[0]], O_RDONLY, 0);
+        }
+
+        if (redir[1]) {  // output redirection
+            checked_close(STDOUT_FILENO);
+            checked_open(tokens[redir[1]], O_WRONLY | O_TRUNC | O_CREAT, 0600);
+        } else if (redir[2]) {
+            checked_close(STDOUT_FILENO);
+            checked_open(tokens[redir[2]], O_WRONLY | O_APPEND | O_CREAT, 0600);
+        }
+
+        if (!strncmp(argv[0], "/", 1)) {
+            (argv[0])++;  // remove starting '/' from argv[0]
+        }
+
+        // execute, without any descriptor the shell has open (or inherited)
+        // that is not close-on-exec
+        close_range(3, ~0U, 0);
+        execve(tokens[f_index], argv, envp);
+        perror("execv");
+
+        exit(1);
+    }
+
+    if (out[1] >= 0) {  // only the job may hold the write end
+        close(out[1]);
+    }
+
+    if (pid < 0) {
+        perror("fork");
+        if (out[0] >= 0) {
+            close(out[0]);
+        }
+    } else if (bg) {  // job set up in background
+        // add job to job list
+        add_job(my_jobs, next_job, pid, RUNNING, tokens[f_index]);
+        notify_started(my_jobs, pid);
+        if (out[0] >= 0 && capture_jobs) {
+            start_capture(my_jobs, next_job, out[0]);
+        } else if (out[0] >= 0) {
+            start_merge(next_job, out[0], STDOUT_FILENO,
+                        merge_jobs ? merge_jobs : MERGE_ON, &outlimit);
+        }
+        next_job++;
+
+        // print job and process id
+        char output[32];
+        int job = get_job_jid(my_jobs, pid);
+        snprintf(output, 32, "[%d] (%d)\n", job, pid);
+        checked_stdwrite(output);
+    } else {
+        // wait for child process
+        wait_fg(pid, tokens[f_index]);
+    }
+
+    // return terminal control to parent
+    pid_t old = getpgrp();
+    checked_setpgrp(old);
+
+    return 0;
+}
+
+/*
+ * restore_builtin()
+ *
+ * - Description: puts back the standard input and output saved by
+ * redirect_builtin().
+ */
+void restore_builtin(int saved[2]) {
+    fflush(stdout);
+    for (int i = 0; i < 2; i++) {
+        if (saved[i] >= 0) {
+            dup2(saved[i], i);
+            close(saved[i]);
+            saved[i] = -1;
+        }
+    }
+}
+
+/*
+ * redirect_builtin()
+ *
+ * - Description: points standard input and output at the files a command's
+ * input and output are redirected to (with <, > or >>), for builtins, which
+ * read and write them from the shell itself. Returns 0, or -1 (after
+ * printing an error) if a file could not be opened.
+ *
+ * - Arguments: tokens, redir: as passed to run_prog(), saved: set to copies
+ * of the old standard input and output to restore them from with
+ * restore_builtin(), -1 for those not redirected
+ *
+ * - Usage: called before trying the builtins, so a command that turns out
+ * not to be one opens its files twice, which does no harm.
+ */
+int redirect_builtin(char **tokens, const int redir[4], int saved[2]) {
+    saved[0] = saved[1] = -1;
+    for (int i = 0; i < 2; i++) {
+        int flags = O_CLOEXEC;
+        const char *file;
+        if (i == 0 && redir[0]) {
+            file = tokens[redir[0]];
+            flags |= O_RDONLY;
+        } else if (i == 1 && redir[1]) {
+            file = tokens[redir[1]];
+            flags |= O_WRONLY | O_CREAT | O_TRUNC;
+        } else if (i == 1 && redir[2]) {
+            file = tokens[redir[2]];
+            flags |= O_WRONLY | O_CREAT | O_APPEND;
+        } else {
+            continue;
+        }
+
+        int fd;
+        if ((fd = openat(cwd_fd, file, flags | O_CLOEXEC, 0600)) < 0) {
+            perror(file);
+            restore_builtin(saved);
+            return -1;
+        }
+        fflush(stdout);
+        if ((saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 0)) < 0) {
+            perror("dup");
+            close(fd);
+            restore_builtin(saved);
+            return -1;
+        }
+        dup2(fd, i);
+        close(fd);
+    }
+    return 0;
+}
+
+/*
+ * is_assignment()
+ *
+ * - Description: returns 1 if word is a variable assignment, NAME=value
+ * (where NAME is a letter or _, then letters, digits or _), 0 otherwise.
+ */
+int is_assignment(const char *word) {
+    if (!(isalpha((unsigned char)*word) || *word == '_')) {
+        return 0;
+    }
+    while (isalnum((unsigned char)*word) || *word == '_') {
+        word++;
+    }
+    return *word == '=';
+}
+
+/*
+ * set_variables()
+ *
+ * - Description: sets the shell variables of n NAME=value words, as a command
+ * of nothing but assignments does. Sets last_status.
+ */
+void set_variables(char **assigns, int n) {
+    last_status = 0;
+    for (int i = 0; i < n; i++) {
+        char *eq = strchr(assigns[i], '=');
+        char name[eq - assigns[i] + 1];
+        memcpy(name, assigns[i], (size_t)(eq - assigns[i]));
+        name[eq - assigns[i]] = '\0';
+        if (var_set(shell_vars, name, eq + 1) < 0) {
+            last_status = 1;
+        }
+    }
+}
+
+/* orders "NAME=value" strings by name (a qsort() comparator) */
+int compare_env(const void *a, const void *b) {
+    const char *x = *(char *const *)a, *y = *(char *const *)b;
+    for (; *x == *y && *x != '=' && *x; x++, y++) {
+    }
+    return (*x == '=' ? 0 : (unsigned char)*x) -
+           (*y == '=' ? 0 : (unsigned char)*y);
+}
+
+/*
+ * export_variables()
+ *
+ * - Description: the export builtin. Exports the variables NAME (or
+ * NAME=value, setting them too) of argv[1...], so that programs are passed
+ * them; with no arguments, lists the exported variables, sorted by name.
+ * Sets last_status.
+ */
+void export_variables(char *argv[], int argc) {
+    last_status = 0;
+    if (argc == 1) {
+        char **envp = var_envp(shell_vars);
+        size_t n = 0;
+        while (envp && envp[n]) {
+            n++;
+        }
+
+        char *sorted[n + 1];
+        memcpy(sorted, envp, n * sizeof(char *));
+        qsort(sorted, n, sizeof(char *), compare_env);
+        for (size_t i = 0; i < n; i++) {
+            printf("export %s\n", sorted[i]);
+        }
+        fflush(stdout);
+        return;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        char *eq = strchr(argv[i], '=');
+        size_t len = eq ? (size_t)(eq - argv[i]) : strlen(argv[i]);
+        char name[len + 1];
+        memcpy(name, argv[i], len);
+        name[len] = '\0';
+
+        char assign[len + 2];
+        snprintf(assign, sizeof(assign), "%s=", name);
+        if (!is_assignment(assign)) {
+            fprintf(stderr, "export: %s: not a valid name\n", name);
+            last_status = 1;
+        } else if (var_export(shell_vars, name, eq ? eq + 1 : NULL) < 0) {
+            last_status = 1;
+        }
+    }
+}
+
+/*
+ * exec_command()
+ *
+ * - Description: executes a compiled command, either as a builtin or by
+ * running the program it names. Returns 0. The command's exit status is left
+ * in last_status.
+ *
+ * - Arguments: cmd: the command to execute, as returned by compile_command()
+ *
+ * - Usage: the command is not modified, so it may be executed again later.
+ */
+int exec_command(command_t *cmd) { return run_command(cmd, NULL, 0, 0); }
+
+/*
+ * run_command()
+ *
+ * - Description: exec_command(), with more arguments after the command's own,
+ * and optionally in the background even without a trailing &.
+ *
+ * - Arguments: cmd: the command to execute, extra: nextra arguments to add,
+ * bg: whether to run a program in the background
+ *
+ * - Usage: used by onchange to run its command with the paths that changed
+ */
+int run_command(command_t *cmd, char **extra, int nextra, int bg) {
+    char **tokens = cmd->tokens;
+    char **argv = cmd->argv;
+    int argc = cmd->argc;
+
+    // evaluate arithmetic expansions that could not be folded at compile time
+    char *exp_tokens[cmd->ntok + 1];
+    char *exp_argv[cmd->ntok + 1];
+    last_status = 0;
+    if (cmd->dynamic) {
+        if ((argc = expand_command(cmd, exp_tokens, exp_argv)) < 0) {
+            last_status = 1;
+            return 0;
+        }
+
+        tokens = exp_tokens;
+        argv = exp_argv;
+    }
+
+    // redir is passed by pointer, so hand run_prog its own copy
+    int redir[4];
+    memcpy(redir, cmd->redir, sizeof(redir));
+    redir[3] |= bg;
+
+    // leading NAME=value words set variables, or only in the environment of
+    // the program they come before
+    int nassign = 0;
+    while (nassign < argc && tokens[nassign] == argv[nassign] &&
+           is_assignment(argv[nassign])) {
+        nassign++;
+    }
+    char **assigns = argv;
+    if (nassign && nassign == argc && !nextra) {
+        set_variables(assigns, nassign);
+    }
+
+    // (up to the 511 arguments run_prog() takes)
+    if (argc + nextra > 511) {
+        nextra = 511 - argc;
+    }
+    char *all[argc + nextra + 1];
+    if (nextra > 0 || nassign) {
+        memcpy(all, argv, (size_t)argc * sizeof(char *));
+        memcpy(all + argc, extra, (size_t)nextra * sizeof(char *));
+        all[argc + nextra] = NULL;
+        argv = all + nassign;
+        argc += nextra - nassign;
+    }
+    if (nassign) {  // (see parse(): argv[0] of a path keeps its last '/')
+        tokens += nassign;
+        for (int i = 0; i < 3; i++) {
+            redir[i] -= redir[i] ? nassign : 0;
+        }
+        if (argc && argv[0][0] == '/') {
+            argv[0] = strrchr(argv[0], '/');
+        }
+    }
+
+    // a builtin's input and output go where the command's are redirected,
+    // except spawn's, which are for the programs it starts
+    int spawn = argc && !strncmp(argv[0], "spawn", 6);
+    int saved[2] = {-1, -1};
+    if (argc && argv[0][0] != '/' && !spawn &&
+        redirect_builtin(tokens, redir, saved) < 0) {
+        last_status = 1;
+        return 0;
+    }
+
+    int builtin = -1;
+    if (!argc && nassign) {  // (only assignments, done above)
+        builtin = 0;
+    } else if (!argc) {
+        // everything expanded away (i.e. only redirections left)
+        write(STDERR_FILENO, "error: redirects with no command\n", 33);
+        last_status = 1;
+    } else if (spawn) {  // builtin recognized as spawn
+        last_status = spawn_jobs(argv, argc, tokens, redir);
+        builtin = 0;
+    } else {
+        builtin = exec_builtins(argv, argc);
+    }
+
+    restore_builtin(saved);
+
+    if (argc && builtin < 0) {
+        // the environment is cached, with the assignments laid over it
+        char **copy, **envp;
+        if ((envp = var_envp_with(shell_vars, assigns, nassign, &copy))) {
+            run_prog(argv, tokens, redir, envp);
+            free(copy);
+        } else {
+            last_status = 1;
+        }
+    }
+
+    if (cmd->dynamic) {
+        free_expansion(cmd, exp_tokens);
+    }
+
+    return 0;
+}
+
+/*
+ * run_lines()
+ *
+ * - Description: reads, compiles and runs the lines of a stream one after
+ * another, on this thread. Returns 0 at end of input, 1 on a read error.
+ */
+int run_lines(stream_t *stream) {
+    const char *line;
+    size_t len;
+    int ret;
+    while ((ret = stream_next(stream, &line, &len)) > 0) {
+        command_t *cmd;
+        if (is_comment(line, len) || !(cmd = compile_command(line, len))) {
+            continue;
+        }
+
+        reap_jobs();
+        exec_command(cmd);
+        free_command(cmd);
+        refill_zygotes();
+    }
+
+    return ret < 0;
+}
+
+/*
+ * read_batch()
+ *
+ * - Description: the reader of run_stream() (a thread function): reads and
+ * compiles lines, and queues the commands (or the syntax errors of lines
+ * that do not compile, to be written in their turn), waiting while the
+ * queue is full.
+ *
+ * - Arguments: arg: the batch_t being run
+ */
+void *read_batch(void *arg) {
+    batch_t *b = (batch_t *)arg;
+    const char *line;
+    size_t len;
+    int ret;
+
+    // errors of skipped lines (see stream_next()) are deferred as well, and
+    // queued with the next line, or on their own at the end of the input
+    batch_item_t item;
+    item.nerrors = 0;
+    defer_errors(item.errors, sizeof(item.errors), &item.nerrors);
+    while (1) {
+        ret = stream_next(b->stream, &line, &len);
+        item.cmd = ret > 0 && !is_comment(line, len)
+                       ? compile_command(line, len)
+                       : NULL;
+        if (!item.cmd && !item.nerrors) {  // (nothing to run)
+            if (ret <= 0) {
+                break;
+            }
+            continue;
+        }
+
+        // (each side is only woken when the other has gone some way, so
+        // the two do not take turns at every command)
+        pthread_mutex_lock(&b->lock);
+        while (b->head - b->tail == BATCH_QUEUE) {
+            pthread_cond_wait(&b->taken, &b->lock);
+        }
+        if (b->head++ == b->tail) {
+            pthread_cond_signal(&b->added);
+        }
+        b->items[(b->head - 1) % BATCH_QUEUE] = item;
+        pthread_mutex_unlock(&b->lock);
+
+        item.nerrors = 0;
+        if (ret <= 0) {
+            break;
+        }
+    }
+    defer_errors(NULL, 0, NULL);
+
+    pthread_mutex_lock(&b->lock);
+    b->done = ret < 0 ? -1 : 1;
+    pthread_cond_signal(&b->added);
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+/*
+ * run_batch()
+ *
+ * - Description: the executor of run_stream(): takes commands off the queue
+ * filled by read_batch() and runs them, in order, until the queue is empty
+ * and the reader is done. Returns 0 at end of input, 1 on a read error.
+ */
+int run_batch(batch_t *b) {
+    while (1) {
+        pthread_mutex_lock(&b->lock);
+        while (b->head == b->tail && !b->done) {
+            pthread_cond_wait(&b->added, &b->lock);
+        }
+        if (b->head == b->tail) {
+            pthread_mutex_unlock(&b->lock);
+            return b->done < 0;
+        }
+        batch_item_t *item = &b->items[b->tail % BATCH_QUEUE];
+        command_t *cmd = item->cmd;
+        if (item->nerrors) {
+            write(STDERR_FILENO, item->errors, item->nerrors);
+        }
+        if (++b->tail == b->head - BATCH_QUEUE / 2) {
+            pthread_cond_signal(&b->taken);
+        }
+        pthread_mutex_unlock(&b->lock);
+
+        if (cmd) {
+            reap_jobs();
+            exec_command(cmd);
+            free_command(cmd);
+            refill_zygotes();
+        }
+    }
+}
+
+/*
+ * run_stream()
+ *
+ * - Description: reads, compiles and executes commands from fd one line at a
+ * time, so that execution starts right away and memory use stays bounded no
+ * matter how long the input is. Reading and compiling are done by a thread
+ * of their own (given more than one CPU), up to BATCH_QUEUE commands ahead,
+ * so that this thread only
+ * launches and reaps jobs; commands still run one at a time and in order,
+ * each after the one before has finished (or been sent to the background),
+ * and syntax errors are written when their line would have run. Returns 0
+ * at end of input, 1 on a read error.
+ *
+ * - Arguments: fd: file descriptor to read commands from
+ *
+ * - Usage: used for script files and for standard input when it is not a
+ * terminal (i.e. a generator piping commands into the shell).
+ */
+int run_stream(int fd) {
+    batch_t *b;
+    if (!(b = (batch_t *)calloc(1, sizeof(batch_t)))) {
+        perror("calloc");
+        return 1;
+    } else if (!(b->stream = open_stream(fd))) {
+        free(b);
+        return 1;
+    }
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->added, NULL);
+    pthread_cond_init(&b->taken, NULL);
+
+    // signals (SIGCHLD, and SIGINT for builtins that catch it) are left to
+    // this thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    // (with a single CPU, the two would only take turns)
+    pthread_t reader;
+    int threaded = sysconf(_SC_NPROCESSORS_ONLN) > 1 &&
+                   !pthread_create(&reader, NULL, read_batch, b);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    int ret;
+    if (threaded) {
+        ret = run_batch(b);
+        pthread_join(reader, NULL);
+    } else {
+        ret = run_lines(b->stream);
+    }
+
+    pthread_cond_destroy(&b->taken);
+    pthread_cond_destroy(&b->added);
+    pthread_mutex_destroy(&b->lock);
+    close_stream(b->stream);
+    free(b);
+    return ret;
+}
+
+/*
+ * run_file()
+ *
+ * - Description: runs a script file (or a bytecode file written by
+ * --compile) non-interactively, then cleans up. Script files are streamed
+ * with run_stream(). Returns the shell's exit status.
+ *
+ * - Arguments: path: path to the script or bytecode file
+ *
+ * - Usage: 33sh script.sh, 33sh script.33c
+ */
+int run_file(char *path) {
+    change_def_handlers(SIG_IGN);
+
+    int ret = 0;
+    if (is_bytecode(path)) {
+        script_t *script;
+        if (!(script = load_bytecode(path))) {
+            cleanup_job_list(my_jobs);
+            return 1;
+        }
+
+        for (int i = 0; i < script_length(script); i++) {
+            reap_jobs();
+            exec_command(script_command(script, i));
+            refill_zygotes();
+        }
+
+        release_script(script);
+    } else {
+        int fd;
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+            perror(path);
+            cleanup_job_list(my_jobs);
+            return 1;
+        }
+
+        ret = run_stream(fd);
+        close(fd);
+    }
+
+    reap_jobs();
+    cleanup_job_list(my_jobs);
+    return ret;
+}
+
+/*
+ * start_server()
+ *
+ * - Description: sets the shell up to serve clients and opens the listening
+ * socket. Returns the socket, or -1 (after printing an error) on failure.
+ *
+ * - Arguments: path: filesystem path to listen at, saved: filled in with
+ * copies of the server's own standard descriptors, to be put back after
+ * running a command with a client's
+ *
+ * - Usage: called by run_server() and run_sessions()
+ */
+int start_server(char *path, int saved[3]) {
+    change_def_handlers(SIG_IGN);
+    // a client that goes away mid-command must not take the server with it
+    checked_signal(SIGPIPE, SIG_IGN);
+
+    // make sure 0, 1 and 2 are taken, so received descriptors land above them
+    for (int i = 0; i < 3; i++) {
+        if (fcntl(i, F_GETFD) < 0 && open("/dev/null", O_RDWR) < 0) {
+            perror("/dev/null");
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < 3; i++) {
+        if ((saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 3)) < 0) {
+            perror("fcntl");
+            return -1;
+        }
+    }
+
+    return open_server(path);
+}
+
+/*
+ * run_server()
+ *
+ * - Description: runs the shell as a server listening on a Unix socket, so
+ * that callers can run commands without starting a new shell each time. Each
+ * connection carries one command line along with the client's standard input,
+ * output and error (see server.h); the command is run through the normal
+ * executor with those descriptors in place of the server's own, and its exit
+ * status is sent back. Background jobs started by one client stay in the
+ * server's job list and are reported to whichever client connects next.
+ * Returns 1 if the socket could not be set up, otherwise runs until the exit
+ * builtin is used or the server is killed.
+ *
+ * - Arguments: path: filesystem path to listen at
+ *
+ * - Usage: 33sh --server /tmp/33sh.sock, then
+ *          33sh-client /tmp/33sh.sock /bin/ls -l
+ */
+int run_server(char *path) {
+    int sock;
+    int saved[3];
+    if ((sock = start_server(path, saved)) < 0) {
+        cleanup_job_list(my_jobs);
+        return 1;
+    }
+
+    in_server = 1;
+    while (1) {
+        // drain the output of captured jobs until the next client comes
+        while (watching() && !wait_events(sock, -1)) {
+        }
+
+        int conn;
+        // (close-on-exec, to keep it out of the command's jobs)
+        if ((conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("accept");
+            }
+            continue;
+        }
+
+        // clients are served one at a time, so one that connects and then
+        // sends nothing (or stalls halfway) must not hold up the rest
+        struct timeval timeout = {1, 0};
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
-        // set up buffers
         char buf[1024];
-        memset(buf, 0, 1024);
-        char *tokens[512];
-        memset(tokens, 0, 512 * sizeof(char *));
-        char *argv[512];
-        memset(argv, 0, 512 * sizeof(char *));
+        int fds[3];
+        ssize_t len;
+        if ((len = recv_request(conn, buf, sizeof(buf), fds)) < 0) {
+            close(conn);
+            continue;
+        }
 
-        // check for changes in child process status and reap zombie processes
-        pid_t pid;
-        int status;
-        while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) >
-               0) {
-            reap(status, pid);
+        // run the command with the client's descriptors
+        for (int i = 0; i < 3; i++) {
+            dup2(fds[i], i);
+            close(fds[i]);
+        }
+
+        reap_jobs();
+
+        command_t *cmd;
+        if ((cmd = compile_command(buf, (size_t)len))) {
+            exec_command(cmd);
+            free_command(cmd);
+        } else {
+            // nothing to run, or a syntax error (which was already reported)
+            last_status = is_comment(buf, (size_t)len) ? 0 : 2;
+        }
+
+        fflush(stdout);
+        for (int i = 0; i < 3; i++) {
+            dup2(saved[i], i);
+        }
+
+        send_status(conn, last_status);
+        close(conn);
+
+        if (session_done) {
+            cleanup_job_list(my_jobs);
+            exit(0);
+        }
+
+        // the client has its answer, so now is the time to fork
+        refill_zygotes();
+    }
+}
+
+/*
+ * The state of a --sessions client. While one of its commands runs (or one
+ * of its jobs is reported), the session's job list, directory, variables and
+ * standard descriptors are swapped into the shell's globals, so the rest of
+ * the shell runs unchanged; everything else (code, the script cache, the
+ * zygote pool) is shared by all sessions.
+ */
+typedef struct session {
+    int sock;
+    int fds[3];  // descriptors sent with the last request (-1 before that)
+    job_list_t *jobs;
+    int next_job;
+    int cwd;  // directory fd, see cwd_fd
+    dirstack_t *dirs;
+    vars_t *vars;  // layered over the server's own variables
+    int last_status;
+    int capture;  // see capture_jobs
+    merge_mode_t merge;
+    outlimit_t outlimit;
+    pid_t fg_pid;  // foreground job being waited for, or -1
+    char *fg_cmd;
+    struct session *next;
+} session_t;
+
+session_t *sessions = NULL;
+// the server's own state, while a session's is swapped in
+session_t home;
+// the server's own standard descriptors, see start_server()
+int server_fds[3];
+
+/*
+ * enter_session()
+ *
+ * - Description: swaps the state of a session into the shell's globals and
+ * standard descriptors. Must be paired with leave_session().
+ *
+ * - Arguments: s: the session
+ */
+void enter_session(session_t *s) {
+    home.jobs = my_jobs;
+    home.next_job = next_job;
+    home.vars = shell_vars;
+    home.dirs = dir_stack;
+    home.last_status = last_status;
+    home.capture = capture_jobs;
+    home.merge = merge_jobs;
+    home.outlimit = outlimit;
+
+    my_jobs = s->jobs;
+    next_job = s->next_job;
+    cwd_fd = s->cwd;
+    dir_stack = s->dirs;
+    shell_vars = s->vars;
+    last_status = s->last_status;
+    capture_jobs = s->capture;
+    merge_jobs = s->merge;
+    outlimit = s->outlimit;
+    for (int i = 0; i < 3; i++) {
+        if (s->fds[i] >= 0) {
+            dup2(s->fds[i], i);
+        }
+    }
+
+    in_session = 1;
+}
+
+/*
+ * leave_session()
+ *
+ * - Description: saves the globals back into a session (including a
+ * foreground job left by wait_fg()) and restores the server's own state.
+ *
+ * - Arguments: s: the session passed to enter_session()
+ */
+void leave_session(session_t *s) {
+    fflush(stdout);
+
+    s->next_job = next_job;
+    s->cwd = cwd_fd;  // cd replaces it
+    s->last_status = last_status;
+    s->capture = capture_jobs;
+    s->merge = merge_jobs;
+    s->outlimit = outlimit;
+    if (fg_pid > 0) {
+        s->fg_pid = fg_pid;
+        s->fg_cmd = fg_cmd;
+        fg_pid = -1;
+        fg_cmd = NULL;
+    }
+
+    my_jobs = home.jobs;
+    next_job = home.next_job;
+    cwd_fd = AT_FDCWD;
+    dir_stack = home.dirs;
+    shell_vars = home.vars;
+    last_status = home.last_status;
+    capture_jobs = home.capture;
+    merge_jobs = home.merge;
+    outlimit = home.outlimit;
+    for (int i = 0; i < 3; i++) {
+        dup2(server_fds[i], i);
+    }
+
+    in_session = 0;
+}
+
+/*
+ * watch_session()
+ *
+ * - Description: sets the events the event loop waits for on a session:
+ * EPOLLIN while it may send a request, nothing while its foreground job runs.
+ */
+void watch_session(int ep, session_t *s, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = s;
+    epoll_ctl(ep, EPOLL_CTL_MOD, s->sock, &ev);
+}
+
+/*
+ * accept_session()
+ *
+ * - Description: accepts a connection and starts a session for it, with an
+ * empty job list, the server's working directory and an empty table of
+ * variables over the server's own.
+ *
+ * - Arguments: ep: the event loop's epoll instance, sock: listening socket
+ */
+void accept_session(int ep, int sock) {
+    int conn;
+    if ((conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+        if (errno != EINTR && errno != ECONNABORTED) {
+            perror("accept");
+        }
+        return;
+    }
+
+    // a client that stalls halfway through a request must not hold up the rest
+    struct timeval timeout = {1, 0};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    session_t *s = (session_t *)calloc(1, sizeof(session_t));
+    if (!s) {
+        perror("malloc");
+        close(conn);
+        return;
+    }
+
+    s->sock = conn;
+    s->fds[0] = s->fds[1] = s->fds[2] = -1;
+    s->next_job = 1;
+    s->fg_pid = -1;
+    s->jobs = init_job_list();
+    s->vars = new_vars(shell_vars);
+    s->cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    s->dirs = new_dirstack();
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+    if (!s->jobs || !s->vars || s->cwd < 0 || !s->dirs ||
+        epoll_ctl(ep, EPOLL_CTL_ADD, conn, &ev) < 0) {
+        perror("session");
+        cleanup_job_list(s->jobs);
+        free_vars(s->vars);
+        free_dirstack(s->dirs);
+        if (s->cwd >= 0) {
+            close(s->cwd);
+        }
+        close(conn);
+        free(s);
+        return;
+    }
+
+    s->next = sessions;
+    sessions = s;
+}
+
+/*
+ * end_session()
+ *
+ * - Description: ends a session whose client has disconnected (or used
+ * exit), killing its jobs and freeing its state.
+ */
+void end_session(int ep, session_t *s) {
+    epoll_ctl(ep, EPOLL_CTL_DEL, s->sock, NULL);
+
+    if (s->fg_pid > 0) {  // (not in the job list unless it was stopped)
+        kill(-s->fg_pid, SIGKILL);
+    }
+    drop_captures(s->jobs);
+    cleanup_job_list(s->jobs);
+
+    close(s->sock);
+    close(s->cwd);
+    for (int i = 0; i < 3; i++) {
+        if (s->fds[i] >= 0) {
+            close(s->fds[i]);
+        }
+    }
+    free_vars(s->vars);
+    free_dirstack(s->dirs);
+    free(s->fg_cmd);
+
+    session_t **link = &sessions;
+    while (*link != s) {
+        link = &(*link)->next;
+    }
+    *link = s->next;
+    free(s);
+}
+
+/*
+ * serve_request()
+ *
+ * - Description: receives one request from a session and runs it with the
+ * session's state swapped in. The exit status is sent back right away,
+ * unless the command left a foreground job running, in which case the
+ * session is not read from again until reap_sessions() has seen the job
+ * finish (or stop). Returns 0, or -1 if the session should end.
+ *
+ * - Arguments: ep: the event loop's epoll instance, s: the session
+ */
+int serve_request(int ep, session_t *s) {
+    char buf[1024];
+    int fds[3];
+    ssize_t len;
+    if ((len = recv_request(s->sock, buf, sizeof(buf), fds)) < 0) {
+        return -1;
+    }
+
+    // keep the descriptors, for reporting the session's background jobs
+    for (int i = 0; i < 3; i++) {
+        if (s->fds[i] >= 0) {
+            close(s->fds[i]);
+        }
+        s->fds[i] = fds[i];
+    }
+
+    enter_session(s);
+
+    command_t *cmd;
+    if ((cmd = compile_command(buf, (size_t)len))) {
+        exec_command(cmd);
+        free_command(cmd);
+    } else {
+        last_status = is_comment(buf, (size_t)len) ? 0 : 2;
+    }
+
+    leave_session(s);
+
+    if (s->fg_pid > 0) {
+        watch_session(ep, s, 0);
+        return 0;
+    }
+
+    int done = session_done;
+    session_done = 0;
+    if (send_status(s->sock, s->last_status) < 0 || done) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * reap_sessions()
+ *
+ * - Description: the --sessions counterpart of reap_jobs(). Every child whose
+ * state has changed is matched to the session it belongs to and reported
+ * with that session's state swapped in; a session's foreground job that has
+ * terminated or stopped completes the session's pending request.
+ *
+ * - Arguments: ep: the event loop's epoll instance
+ */
+void reap_sessions(int ep) {
+    pid_t pid;
+    int status;
+    struct rusage ru;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) >
+           0) {
+        if (zygote_reaped(pid, status)) {
+            continue;
+        }
+
+        session_t *s = sessions;
+        while (s && s->fg_pid != pid && get_job_jid(s->jobs, pid) < 0) {
+            s = s->next;
+        }
+
+        if (!s) {  // a job of a session that has ended
+            continue;
+        } else if (s->fg_pid != pid) {
+            enter_session(s);
+            reap(status, pid, &ru);
+            leave_session(s);
+        } else if (!WIFCONTINUED(status)) {
+            enter_session(s);
+            handle_signals(status, pid, s->fg_cmd);
+            last_status = wait_status(status);
+            leave_session(s);
+
+            free(s->fg_cmd);
+            s->fg_cmd = NULL;
+            s->fg_pid = -1;
+            send_status(s->sock, s->last_status);
+            watch_session(ep, s, EPOLLIN);
+        }
+    }
+}
+
+/*
+ * run_sessions()
+ *
+ * - Description: runs the shell as a server for many independent sessions,
+ * each a connection from a client (see server.h). A session has its own job
+ * list, working directory (kept as a directory descriptor, so the server
+ * never changes its own) and variables, and may send any number of command
+ * lines. All sessions are served by a single epoll loop: commands run with
+ * the session's state swapped in, and foreground jobs are not waited for,
+ * but finished when SIGCHLD reports them, so a long-running command in one
+ * session does not hold up the others. Returns 1 if the server could not be
+ * set up, otherwise runs until it is killed.
+ *
+ * - Arguments: path: filesystem path to listen at
+ *
+ * - Usage: 33sh --sessions /tmp/33sh.sock, then 33sh-client /tmp/33sh.sock
+ *          (which sends the lines it reads, all in one session)
+ */
+int run_sessions(char *path) {
+    int sock;
+    if ((sock = start_server(path, server_fds)) < 0) {
+        cleanup_job_list(my_jobs);
+        return 1;
+    }
+
+    int ep;
+    if (init_events() < 0 || (ep = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("sessions");
+        cleanup_job_list(my_jobs);
+        return 1;
+    }
+
+    // the listening socket is marked by NULL, and the shell's own event
+    // loop (SIGCHLD and captured output, see events.c) by &home
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(ep, EPOLL_CTL_ADD, sock, &ev);
+    ev.data.ptr = &home;
+    epoll_ctl(ep, EPOLL_CTL_ADD, events_fd(), &ev);
+
+    while (1) {
+        struct epoll_event events[64];
+        int n;
+        if ((n = epoll_wait(ep, events, 64, -1)) < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+            }
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (!ptr) {
+                accept_session(ep, sock);
+            } else if (ptr == &home) {
+                shell_idle = 1;
+                run_events();
+                shell_idle = 0;
+            } else if (serve_request(ep, (session_t *)ptr) < 0) {
+                end_session(ep, (session_t *)ptr);
+            }
+        }
+
+        // (a child may also have been noticed while serving a request)
+        if (take_child_event()) {
+            reap_sessions(ep);
         }
+        refill_zygotes();
+    }
+}
+
+/*
+ * main()
+ *
+ * - Description: Sets up and executes a fully funcitonal REPL shell with built-
+ * in commands rm, ln, cd, bg, fg, jobs, source, and exit. Attempts to execute
+ * commands that do not correspond to builtins. If given a file, runs it as a
+ * script instead, and with --compile, writes a bytecode file for a script.
+ * With --server, runs commands sent by 33sh-client over a Unix socket, and
+ * with --sessions, serves many independent sessions over one. If standard
+ * input is not a terminal, it is streamed like a script.
+ *
+ * - Arguments: argc, argv: either nothing (REPL), a script or bytecode file
+ * to run, --compile <script> -o <output>, --server <socket> or
+ * --sessions <socket>
+ *
+ * - Usage: type in commands to the REPL like you normally would in a shell!
+ *          supports cd, rm, ln, exit, exiting with ctrl+D, and executing
+ *          programs with execv, along with file redirection using "<", ">", and
+ *          ">>". Also supports signal handling, launching jobs in the
+ *          background with the ampersand ("&") operator, and moving jobs from
+ *          the foreground to background.
+ */
+int main(int argc, char *argv[]) {
+    my_jobs = init_job_list();
+    if (!(shell_vars = load_vars(environ))) {
+        return 1;
+    }
+    init_dirs();
+
+    if (argc == 5 && !strcmp(argv[1], "--compile") && !strcmp(argv[3], "-o")) {
+        int ret = compile_bytecode(argv[2], argv[4]) < 0;
+        cleanup_job_list(my_jobs);
+        return ret;
+    } else if (argc == 3 && !strcmp(argv[1], "--server")) {
+        return run_server(argv[2]);
+    } else if (argc == 3 && !strcmp(argv[1], "--sessions")) {
+        return run_sessions(argv[2]);
+    } else if (argc == 2 && argv[1][0] != '-') {
+        return run_file(argv[1]);
+    } else if (argc != 1) {
+        write(STDERR_FILENO,
+              "usage: 33sh [script | --compile script -o output | "
+              "--server socket | --sessions socket]\n",
+              88);
+        cleanup_job_list(my_jobs);
+        return 2;
+    } else if (!isatty(STDIN_FILENO)) {
+        // commands are being piped in: stream them instead of prompting
+        change_def_handlers(SIG_IGN);
+        int ret = run_stream(STDIN_FILENO);
+        reap_jobs();
+        cleanup_job_list(my_jobs);
+        return ret;
+    }
 
-// prompt user input
 #ifdef PROMPT
-        checked_stdwrite("mysh> ");
+    // keep a history of the commands typed in, in $HISTFILE or else
+    // ~/.33sh_history (not for 33noprompt, which is driven by tests)
+    const char *histfile = var_get(shell_vars, "HISTFILE");
+    const char *home_dir = var_get(shell_vars, "HOME");
+    if (histfile && *histfile) {
+        open_history(histfile);
+    } else if (home_dir) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/.33sh_history", home_dir);
+        open_history(path);
+    }
+
+    // index the commands in $PATH for tab completion, in the background
+    start_completion(var_get(shell_vars, "PATH"));
 #endif
 
+    do {
+        // setting up default signal behaviors for our shell
+        change_def_handlers(SIG_IGN);
+
+        // set up buffers
+        char buf[1024];
+        memset(buf, 0, 1024);
+
+        // check for changes in child process status and reap zombie processes
+        reap_jobs();
+        refill_zygotes();
+
         // read in commands
         ssize_t rd_state;
-        if ((rd_state = read(STDIN_FILENO, buf, 1024)) < 0) {
+#ifdef PROMPT
+        // prompt user input, and let them edit it (see editor.c)
+        shell_idle = 1;
+        rd_state = read_line("mysh> ", buf, 1024);
+#else
+        // while jobs are captured, drain their output until input comes
+        shell_idle = 1;
+        while (watching() && !wait_events(STDIN_FILENO, -1)) {
+        }
+
+        rd_state = read(STDIN_FILENO, buf, 1024);
+#endif
+        shell_idle = 0;
+        if (rd_state < 0) {
             perror("read");
             cleanup_job_list(my_jobs);
             return 1;
@@ -438,19 +2691,20 @@ int main() {
             rd_state++;
         }
 
+#ifdef PROMPT
+        add_history(buf, strlen(buf));
+#endif
+
         // read was successful, parse input
-        int redir[4] = {0, 0, 0, 0};
-        int argc;
-        if ((argc = parse(buf, tokens, argv, redir)) < 0) {
-            // buf was empty or i/o redirection error was found
+        command_t *cmd;
+        if (!(cmd = compile_command(buf, strlen(buf)))) {
+            // buf was empty or a syntax error was found
             continue;
         }
 
-        // execute builtins
-        if (exec_builtins(argv, argc) < 0) {
-            // if argv[0] not a builtin: attempt to execute program
-            run_prog(argv, tokens, redir);
-        }
+        // execute builtins or attempt to execute program
+        exec_command(cmd);
+        free_command(cmd);
 
     } while (1);  // continues until ctrl+D is pressed or other fatal error
 }
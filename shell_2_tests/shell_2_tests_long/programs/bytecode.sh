@@ -0,0 +1,4 @@
+/bin/echo hello
+/bin/echo to file > f.txt
+/bin/cat < f.txt
+/bin/echo n $((6 * 7))
@@ -0,0 +1 @@
+/bin/echo count $((n += 1 + 2 * 2))
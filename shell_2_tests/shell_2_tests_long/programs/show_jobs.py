@@ -0,0 +1,16 @@
+import json, sys
+
+# Copies the shell's output, but prints a summary of each JSON line (from
+# jobs --json and job events), whose times and sizes change from run to run.
+for line in sys.stdin:
+    line = line.rstrip("\n")
+    if line.startswith("{"):
+        e = json.loads(line)
+        print(e["event"], e["jid"], e.get("status"), e.get("signal"), e["command"])
+    elif line == "[]":
+        print("no jobs")
+    elif line.startswith("[{"):
+        for j in json.loads(line):
+            print(j["jid"], j["state"], j["command"], sorted(j))
+    else:
+        print(line)
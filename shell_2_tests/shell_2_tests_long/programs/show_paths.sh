@@ -0,0 +1,11 @@
+#!/bin/sh
+
+# Prints the file name of each argument, and whether its path is absolute,
+# so that output does not depend on where the traces are run.
+for path in "$@"
+do
+    case $path in
+        /*) echo "absolute ${path##*/}" ;;
+        *) echo "relative $path" ;;
+    esac
+done
@@ -0,0 +1,8 @@
+/bin/echo one \
+two \
+  three
+/bin/echo escaped\\
+/bin/echo 'quoted\'
+/bin/echo not continued
+/bin/echo a < 
+/bin/echo after
@@ -0,0 +1,370 @@
+#include "./stream.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "./parsing.h"
+
+// size of the window mapped over a regular file
+#define WINDOW (1 << 20)
+// size of the buffer used for pipes and terminals
+#define BUFSIZE (1 << 16)
+// longest line (after joining continuation lines) the parser accepts
+#define MAXLINE 1024
+
+/*
+ * Regular files are read through a fixed-size window that is mapped at the
+ * page containing the start of the current line and moved forward as lines
+ * are consumed. Pages behind the cursor are dropped with MADV_DONTNEED, so the
+ * memory used is bounded by the window size no matter how large the file is.
+ * Anything else (pipes, terminals) is read into a fixed-size buffer.
+ */
+struct stream {
+    int fd;
+    int mapped;  // set for regular files
+
+    // window over a regular file
+    off_t size;      // size of the file when the stream was opened
+    char *map;       // current window, or NULL
+    off_t map_off;   // file offset of the window
+    size_t map_len;  // length of the window
+    off_t pos;       // file offset of the next unread byte
+    off_t dropped;   // file offset up to which pages have been dropped
+
+    // buffer for everything else
+    char *buf;
+    size_t start;  // offset of the next unread byte
+    size_t end;    // offset past the last byte read
+    int eof;
+
+    char line[MAXLINE];  // continuation lines are joined here
+};
+
+static long page_size = 0;
+
+/*
+ * open_stream()
+ *
+ * - Description: creates a line stream over fd. Returns NULL on failure.
+ *
+ * - Arguments: fd: file descriptor to read from, positioned at the start of
+ * the input
+ */
+stream_t *open_stream(int fd) {
+    stream_t *stream = (stream_t *)calloc(1, sizeof(stream_t));
+    if (!stream) {
+        perror("calloc");
+        return NULL;
+    }
+
+    if (!page_size) {
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+
+    struct stat st;
+    stream->fd = fd;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        stream->mapped = 1;
+        stream->size = st.st_size;
+        stream->pos = lseek(fd, 0, SEEK_CUR);
+        if (stream->pos < 0) {
+            stream->pos = 0;
+        }
+
+        stream->dropped = stream->pos;
+    } else if (!(stream->buf = (char *)malloc(BUFSIZE))) {
+        perror("malloc");
+        free(stream);
+        return NULL;
+    }
+
+    return stream;
+}
+
+/*
+ * map_window()
+ *
+ * - Description: moves the window of a regular file so that it starts at the
+ * page containing the cursor. Returns 0 on success, -1 on failure.
+ *
+ * - Arguments: stream: the stream
+ */
+static int map_window(stream_t *stream) {
+    if (stream->map) {
+        munmap(stream->map, stream->map_len);
+        stream->map = NULL;
+    }
+
+    off_t off = stream->pos - stream->pos % page_size;
+    size_t len = (size_t)(stream->size - off);
+    if (len > WINDOW) {
+        len = WINDOW;
+    }
+
+    void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, stream->fd, off);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    madvise(map, len, MADV_SEQUENTIAL);
+    stream->map = (char *)map;
+    stream->map_off = off;
+    stream->map_len = len;
+    stream->dropped = off;
+    return 0;
+}
+
+/* drops the pages of the window that lie entirely behind the cursor */
+static void drop_behind(stream_t *stream) {
+    off_t end = stream->pos - stream->pos % page_size;
+    if (end > stream->dropped) {
+        madvise(stream->map + (stream->dropped - stream->map_off),
+                (size_t)(end - stream->dropped), MADV_DONTNEED);
+        stream->dropped = end;
+    }
+}
+
+/*
+ * next_mapped()
+ *
+ * - Description: reads the next physical line of a regular file. Returns 1 if
+ * there was a line, 0 at end of file, -1 on failure. Sets *toolong if the
+ * line did not fit in the window (the line is skipped).
+ *
+ * - Arguments: stream: the stream, line, len: where to store the line,
+ * toolong: set if the line was too long
+ */
+static int next_mapped(stream_t *stream, const char **line, size_t *len,
+                       int *toolong) {
+    while (stream->pos < stream->size) {
+        if (!stream->map ||
+            stream->pos >= stream->map_off + (off_t)stream->map_len) {
+            if (map_window(stream) < 0) {
+                return -1;
+            }
+        }
+
+        char *start = stream->map + (stream->pos - stream->map_off);
+        size_t avail = stream->map_len - (size_t)(start - stream->map);
+        char *nl = memchr(start, '\n', avail);
+        off_t win_end = stream->map_off + (off_t)stream->map_len;
+
+        if (!nl && win_end < stream->size) {
+            if (stream->map_off < stream->pos - stream->pos % page_size) {
+                // slide the window forward to start at this line
+                if (map_window(stream) < 0) {
+                    return -1;
+                }
+            } else {
+                // the line is longer than the window: skip past it
+                *toolong = 1;
+                stream->pos = win_end;
+            }
+
+            continue;
+        }
+
+        *line = start;
+        *len = nl ? (size_t)(nl - start) : avail;
+        stream->pos += (off_t)*len + (nl ? 1 : 0);
+        drop_behind(stream);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * next_buffered()
+ *
+ * - Description: reads the next physical line from a pipe or terminal.
+ * Returns 1 if there was a line, 0 at end of input, -1 on failure. Sets
+ * *toolong if the line did not fit in the buffer (the line is skipped).
+ *
+ * - Arguments: stream: the stream, line, len: where to store the line,
+ * toolong: set if the line was too long
+ */
+static int next_buffered(stream_t *stream, const char **line, size_t *len,
+                         int *toolong) {
+    size_t scanned = stream->start;
+    while (1) {
+        char *nl = memchr(stream->buf + scanned, '\n', stream->end - scanned);
+        if (nl) {
+            *line = stream->buf + stream->start;
+            *len = (size_t)(nl - *line);
+            stream->start = (size_t)(nl - stream->buf) + 1;
+            return 1;
+        }
+
+        if (stream->eof) {
+            if (stream->start == stream->end) {
+                return 0;
+            }
+
+            // last line has no newline
+            *line = stream->buf + stream->start;
+            *len = stream->end - stream->start;
+            stream->start = stream->end;
+            return 1;
+        }
+
+        // shift the partial line to the front of the buffer and read more
+        if (stream->start) {
+            memmove(stream->buf, stream->buf + stream->start,
+                    stream->end - stream->start);
+            stream->end -= stream->start;
+            stream->start = 0;
+        }
+
+        if (stream->end == BUFSIZE) {  // line longer than the buffer
+            *toolong = 1;
+            stream->end = 0;
+        }
+
+        scanned = stream->end;
+        ssize_t n;
+        do {
+            n = read(stream->fd, stream->buf + stream->end,
+                     BUFSIZE - stream->end);
+        } while (n < 0 && errno == EINTR);
+
+        if (n < 0) {
+            perror("read");
+            return -1;
+        } else if (n == 0) {
+            stream->eof = 1;
+        }
+
+        stream->end += (size_t)n;
+    }
+}
+
+/*
+ * scans text for quotes the way next_token() does, starting with quote (a
+ * quote character, or 0) open. returns the quote open at the end, and sets
+ * *escaped if text ends in a backslash that escapes the newline after it
+ */
+static char scan_quotes(const char *text, size_t len, char quote,
+                        int *escaped) {
+    *escaped = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (quote == '\'') {
+            quote = text[i] == '\'' ? 0 : quote;
+        } else if (text[i] == '\\') {
+            *escaped = ++i == len;
+        } else if (text[i] == '"') {
+            quote = quote ? 0 : '"';
+        } else if (text[i] == '\'' && !quote) {
+            quote = '\'';
+        }
+    }
+
+    return quote;
+}
+
+/*
+ * stream_next()
+ *
+ * - Description: reads the next line of input. A line ending in a backslash
+ * (that is not itself escaped or in single quotes) is joined with the line
+ * after it (without the backslash and newline), so a long command can be
+ * spread over several lines. Lines that are too long to be parsed are skipped
+ * with an error message, reported through syntax_error() so that it can be
+ * deferred like a parse error (see read_batch()). Returns 1 if there was a
+ * line, 0 at end of input, or -1 on a read error.
+ *
+ * - Arguments: stream: the stream, line, len: where to store the line
+ *
+ * - Usage: the returned line points into the stream (or the mapped file) and
+ * is only valid until the next call.
+ */
+int stream_next(stream_t *stream, const char **line, size_t *len) {
+    size_t joined = 0;  // length of the line built up in stream->line
+    int toolong = 0;
+
+    while (1) {
+        const char *part;
+        size_t part_len;
+        int ret = stream->mapped
+                      ? next_mapped(stream, &part, &part_len, &toolong)
+                      : next_buffered(stream, &part, &part_len, &toolong);
+
+        if (ret < 0) {
+            return -1;
+        } else if (ret == 0) {
+            if (!joined) {
+                return 0;
+            }
+
+            // input ended in the middle of a continued line
+            *line = stream->line;
+            *len = joined;
+            return 1;
+        }
+
+        int cont = 0;
+        if (part_len && part[part_len - 1] == '\\') {  // (rare, so scanned)
+            char quote = scan_quotes(stream->line, joined, 0, &cont);
+            scan_quotes(part, part_len, quote, &cont);
+        }
+        if (!cont && !joined && !toolong) {  // common case: nothing to copy
+            *line = part;
+            *len = part_len;
+            return 1;
+        }
+
+        if (cont) {
+            part_len--;
+        }
+
+        if (joined + part_len >= MAXLINE) {
+            toolong = 1;
+        } else if (!toolong) {
+            memcpy(stream->line + joined, part, part_len);
+            joined += part_len;
+        }
+
+        if (cont) {
+            continue;
+        }
+
+        if (toolong) {
+            syntax_error("syntax error: line too long\n", 28);
+            joined = 0;
+            toolong = 0;
+            continue;
+        }
+
+        *line = stream->line;
+        *len = joined;
+        return 1;
+    }
+}
+
+/* frees a stream, leaving its file descriptor open */
+void close_stream(stream_t *stream) {
+    if (!stream) {
+        return;
+    }
+
+    if (stream->map) {
+        munmap(stream->map, stream->map_len);
+    }
+
+    free(stream->buf);
+    free(stream);
+}
+
+/* returns 1 if a line is blank or a comment (first non-blank char is #) */
+int is_comment(const char *line, size_t len) {
+    size_t skip = 0;
+    while (skip < len && (line[skip] == ' ' || line[skip] == '\t')) {
+        skip++;
+    }
+
+    return skip == len || line[skip] == '#';
+}
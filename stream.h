@@ -0,0 +1,27 @@
+#ifndef STREAM_H_
+#define STREAM_H_
+
+#include <stddef.h>
+
+/* reads a script one line at a time in bounded memory */
+typedef struct stream stream_t;
+
+/*
+ * creates a stream over the open file descriptor fd (which stays owned by
+ * the caller). returns NULL (after printing an error) on failure
+ */
+stream_t *open_stream(int fd);
+/*
+ * reads the next line (without its newline, with continuation lines joined)
+ * into *line and *len. returns 1 if there was a line, 0 at end of input, or
+ * -1 (after printing an error) on a read error. the line is valid until the
+ * next call
+ */
+int stream_next(stream_t *stream, const char **line, size_t *len);
+/* frees a stream, leaving its file descriptor open */
+void close_stream(stream_t *stream);
+
+/* returns 1 if a line is blank or a comment (first non-blank char is #) */
+int is_comment(const char *line, size_t len);
+
+#endif  // STREAM_H_
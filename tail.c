@@ -0,0 +1,463 @@
+#define _GNU_SOURCE  // memrchr()
+#include "./tail.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "./events.h"
+#include "./scan.h"
+
+/*
+ * tail never reads more of a file than the lines it prints: it reads blocks
+ * backwards from the end with pread(), counting each block's newlines with
+ * count_lines() (see scan.c) until it has enough, then finds the exact one
+ * with memrchr() and copies the rest out with sendfile(). head reads blocks
+ * forwards and stops at the block holding its last line (giving the rest
+ * back with lseek(), if it can). Pipes cannot be read backwards, so tail
+ * reads them to the end, keeping only the blocks its lines can reach back
+ * to. tail -f follows a file with inotify, waiting in the event loop, so
+ * background jobs' output is still handled meanwhile.
+ */
+
+// bytes read at a time
+#define TAIL_BLOCK 65536
+// lines printed when not told
+#define DEFAULT_LINES 10
+
+/* a block of input kept by tail while reading a pipe */
+typedef struct block {
+    struct block *next;
+    size_t len;
+    size_t lines;  // newlines in it
+    char data[TAIL_BLOCK];
+} block_t;
+
+/* a file being printed */
+typedef struct {
+    const char *name;  // NULL for standard input
+    int fd;
+    off_t pos;  // how far it was printed, when following it
+    int watch;  // inotify watch descriptor, when following it
+} tail_file_t;
+
+/* writes n bytes to standard output, returns 0 or -1 */
+static int write_out(const char *s, size_t n) {
+    while (n) {
+        ssize_t done = write(STDOUT_FILENO, s, n);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        } else if (done < 0) {
+            return -1;
+        }
+        s += done;
+        n -= (size_t)done;
+    }
+    return 0;
+}
+
+/* copies bytes from up to to of fd to standard output, returns 0 or -1 */
+static int copy_out(int fd, off_t from, off_t to) {
+    while (from < to) {
+        ssize_t n = sendfile(STDOUT_FILENO, fd, &from, (size_t)(to - from));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;  // (the file shrank, or sendfile() cannot be used)
+        }
+    }
+
+    char buf[TAIL_BLOCK];
+    while (from < to) {
+        size_t len = to - from < TAIL_BLOCK ? (size_t)(to - from) : TAIL_BLOCK;
+        ssize_t n = pread(fd, buf, len, from);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return n < 0 ? -1 : 0;
+        } else if (write_out(buf, (size_t)n) < 0) {
+            return -1;
+        }
+        from += n;
+    }
+    return 0;
+}
+
+/* reads up to n bytes, retrying on EINTR */
+static ssize_t read_some(int fd, char *buf, size_t n) {
+    ssize_t got;
+    while ((got = read(fd, buf, n)) < 0 && errno == EINTR) {
+    }
+    return got;
+}
+
+/* prints the first lines of fd, returns 0 or -1 */
+static int head_fd(int fd, long lines) {
+    char buf[TAIL_BLOCK];
+    long left = lines;
+    while (left > 0) {
+        ssize_t n = read_some(fd, buf, TAIL_BLOCK);
+        if (n <= 0) {
+            return n < 0 ? -1 : 0;
+        }
+
+        size_t len = (size_t)n, count = count_lines(buf, len);
+        if (count >= (size_t)left) {  // the last line ends in this block
+            const char *end = buf;
+            for (; left > 0; left--) {
+                end =
+                    (const char *)memchr(end, '\n', len - (size_t)(end - buf)) +
+                    1;
+            }
+            len = (size_t)(end - buf);
+            lseek(fd, (off_t)len - n, SEEK_CUR);  // (fails on pipes)
+        } else {
+            left -= (long)count;
+        }
+
+        if (write_out(buf, len) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * tail_start()
+ *
+ * - Description: returns the offset the last lines of a file start at, or
+ * -1 on a read error. A last line without a newline counts as a line.
+ *
+ * - Arguments: fd: the file, size: its size, lines: how many lines
+ */
+static off_t tail_start(int fd, off_t size, long lines) {
+    char buf[TAIL_BLOCK];
+    off_t end = size;
+    long left = lines;
+    int first = 1;
+    while (end > 0 && left > 0) {
+        // (blocks are aligned, except for the one holding the end)
+        size_t len = end % TAIL_BLOCK ? (size_t)(end % TAIL_BLOCK) : TAIL_BLOCK;
+        off_t at = end - (off_t)len;
+        ssize_t n;
+        while ((n = pread(fd, buf, len, at)) < 0 && errno == EINTR) {
+        }
+        if (n != (ssize_t)len) {
+            return n < 0 ? -1 : at + n;  // (it shrank: print from there)
+        }
+
+        if (first && buf[len - 1] == '\n') {  // it ends the last line
+            len--;
+        }
+        first = 0;
+
+        size_t count = count_lines(buf, len);
+        if (count >= (size_t)left) {
+            const char *p = buf + len;
+            for (; left > 0; left--) {
+                p = (const char *)memrchr(buf, '\n', (size_t)(p - buf));
+            }
+            return at + (p - buf) + 1;
+        }
+        left -= (long)count;
+        end = at;
+    }
+    return left ? 0 : end;
+}
+
+/*
+ * tail_pipe()
+ *
+ * - Description: prints the last lines of input that cannot be read
+ * backwards. Blocks are read (and filled) in turn, and the oldest dropped as
+ * long as the ones after it hold more newlines than there are lines to
+ * print, so memory stays bounded by the length of those lines. Returns 0 or
+ * -1 on a read error.
+ */
+static int tail_pipe(int fd, long lines) {
+    block_t *first = NULL, *last = NULL, *spare = NULL;
+    size_t total = 0;
+    int ret = 0;
+    while (lines > 0) {
+        block_t *b = spare ? spare : (block_t *)malloc(sizeof(block_t));
+        spare = NULL;
+        if (!b) {
+            ret = -1;
+            break;
+        }
+
+        ssize_t n = 1;
+        for (b->len = 0; b->len < TAIL_BLOCK && n > 0; b->len += (size_t)n) {
+            if ((n = read_some(fd, b->data + b->len, TAIL_BLOCK - b->len)) <
+                0) {
+                ret = -1;
+                n = 0;
+            }
+        }
+        if (!b->len) {
+            spare = b;
+            break;
+        }
+
+        b->lines = count_lines(b->data, b->len);
+        b->next = NULL;
+        *(last ? &last->next : &first) = b;
+        last = b;
+        total += b->lines;
+        while (first != last && total - first->lines > (size_t)lines) {
+            block_t *gone = first;
+            first = first->next;
+            total -= gone->lines;
+            free(spare);
+            spare = gone;
+        }
+
+        if (n <= 0) {  // end of input
+            break;
+        }
+    }
+    free(spare);
+
+    // skip the lines before the last ones
+    long skip =
+        first ? (long)total + (last->data[last->len - 1] != '\n') - lines : 0;
+    size_t off = 0;
+    block_t *b = first;
+    for (; b && skip > 0 && (long)b->lines < skip; b = b->next) {
+        skip -= (long)b->lines;
+    }
+    if (b && skip > 0) {
+        const char *p = b->data;
+        for (; skip > 0; skip--) {
+            p = (const char *)memchr(p, '\n', b->len - (size_t)(p - b->data)) +
+                1;
+        }
+        off = (size_t)(p - b->data);
+    }
+
+    for (; b; b = b->next, off = 0) {
+        if (ret == 0 && write_out(b->data + off, b->len - off) < 0) {
+            ret = -1;
+        }
+    }
+    while (first) {
+        b = first->next;
+        free(first);
+        first = b;
+    }
+    return ret;
+}
+
+/* prints the last lines of a file, returns 0 or -1 */
+static int tail_fd(tail_file_t *f, long lines) {
+    struct stat st;
+    if (fstat(f->fd, &st) < 0) {
+        return -1;
+    } else if (!S_ISREG(st.st_mode) || lseek(f->fd, 0, SEEK_CUR) < 0) {
+        return tail_pipe(f->fd, lines);
+    }
+
+    off_t start = tail_start(f->fd, st.st_size, lines);
+    if (start < 0 || copy_out(f->fd, start, st.st_size) < 0) {
+        return -1;
+    }
+    f->pos = st.st_size;
+    return 0;
+}
+
+/* parses -n N (or -nN, or -N) and, if follow is not NULL, -f. returns the
+ * index of the first file name, or -1 on a syntax error */
+static int parse_lines(char *argv[], int argc, long *lines, int *follow) {
+    *lines = DEFAULT_LINES;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        const char *o = argv[i] + 1;
+        if (follow && !strcmp(o, "f")) {
+            *follow = 1;
+            continue;
+        }
+
+        const char *num = o;
+        if (*o == 'n') {
+            num = o[1] ? o + 1 : i + 1 < argc ? argv[++i] : "";
+        }
+        char *end;
+        errno = 0;
+        *lines = strtol(num, &end, 10);
+        if (!*num || *end || errno || *lines < 0) {
+            return -1;
+        }
+    }
+    return i;
+}
+
+/* opens the files named by argv[first...] (or standard input) */
+static int open_files(char *argv[], int argc, int first, int cwd,
+                      tail_file_t *files) {
+    int nfiles = first < argc ? argc - first : 1;
+    for (int f = 0; f < nfiles; f++) {
+        files[f].name = first < argc ? argv[first + f] : NULL;
+        files[f].fd = STDIN_FILENO;
+        files[f].pos = -1;
+        files[f].watch = -1;
+        if (files[f].name && (files[f].fd = openat(cwd, files[f].name,
+                                                   O_RDONLY | O_CLOEXEC)) < 0) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], files[f].name,
+                    strerror(errno));
+        }
+    }
+    return nfiles;
+}
+
+/* prints the "==> name <==" heading of a file among several */
+static void print_heading(const tail_file_t *f, int first) {
+    char heading[4096 + 16];
+    int n = snprintf(heading, sizeof(heading), "%s==> %s <==\n",
+                     first ? "" : "\n", f->name ? f->name : "standard input");
+    write_out(heading,
+              (size_t)n < sizeof(heading) ? (size_t)n : sizeof(heading) - 1);
+}
+
+/* closes the files opened by open_files() */
+static void close_files(tail_file_t *files, int nfiles) {
+    for (int f = 0; f < nfiles; f++) {
+        if (files[f].name && files[f].fd >= 0) {
+            close(files[f].fd);
+        }
+    }
+}
+
+/*
+ * print_head()
+ *
+ * - Description: the head builtin, see tail.h.
+ */
+int print_head(char *argv[], int argc, int cwd) {
+    long lines;
+    int first;
+    if ((first = parse_lines(argv, argc, &lines, NULL)) < 0) {
+        write(STDERR_FILENO, "head: syntax error\n", 19);
+        return 1;
+    }
+
+    tail_file_t files[argc > first ? argc - first : 1];
+    int nfiles = open_files(argv, argc, first, cwd, files), ret = 0;
+    fflush(stdout);
+    for (int f = 0, shown = 0; f < nfiles; f++) {
+        if (files[f].fd < 0) {
+            ret = 1;
+            continue;
+        }
+        if (nfiles > 1) {
+            print_heading(&files[f], !shown++);
+        }
+        if (head_fd(files[f].fd, lines) < 0) {
+            perror("head");
+            ret = 1;
+        }
+    }
+    close_files(files, nfiles);
+    return ret;
+}
+
+/*
+ * follow()
+ *
+ * - Description: prints what is appended to the files (with a heading when
+ * it is not from the one printed last, if there are several) until *stop is
+ * set. Each file is watched with inotify (through /proc/self/fd, so it is
+ * the file opened that is followed, wherever it is); without inotify, they
+ * are checked every second. A file that shrinks is printed again from its
+ * start.
+ */
+static void follow(tail_file_t *files, int nfiles,
+                   volatile sig_atomic_t *stop) {
+    int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC), last = nfiles - 1;
+    for (int f = 0; ifd >= 0 && f < nfiles; f++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", files[f].fd);
+        if (files[f].pos >= 0) {
+            files[f].watch =
+                inotify_add_watch(ifd, path, IN_MODIFY | IN_ATTRIB);
+        }
+    }
+
+    while (!*stop) {
+        if (ifd >= 0) {
+            wait_events(ifd, -1);
+            // (only whether anything happened matters)
+            char events[4096]
+                __attribute__((aligned(__alignof__(struct inotify_event))));
+            while (read(ifd, events, sizeof(events)) > 0) {
+            }
+        } else {
+            wait_events(-1, 1000);
+        }
+
+        for (int f = 0; f < nfiles && !*stop; f++) {
+            struct stat st;
+            if (files[f].pos < 0 || fstat(files[f].fd, &st) < 0 ||
+                st.st_size == files[f].pos) {
+                continue;
+            }
+
+            if (st.st_size < files[f].pos) {
+                fprintf(stderr, "tail: %s: file truncated\n",
+                        files[f].name ? files[f].name : "standard input");
+                files[f].pos = 0;
+            }
+            if (nfiles > 1 && f != last) {
+                print_heading(&files[f], 0);
+                last = f;
+            }
+            copy_out(files[f].fd, files[f].pos, st.st_size);
+            files[f].pos = st.st_size;
+        }
+    }
+
+    if (ifd >= 0) {
+        close(ifd);
+    }
+}
+
+/*
+ * print_tail()
+ *
+ * - Description: the tail builtin, see tail.h. Only regular files are
+ * followed with -f.
+ */
+int print_tail(char *argv[], int argc, int cwd, volatile sig_atomic_t *stop) {
+    long lines;
+    int first, follows = 0;
+    if ((first = parse_lines(argv, argc, &lines, &follows)) < 0) {
+        write(STDERR_FILENO, "tail: syntax error\n", 19);
+        return 1;
+    }
+
+    tail_file_t files[argc > first ? argc - first : 1];
+    int nfiles = open_files(argv, argc, first, cwd, files), ret = 0;
+    fflush(stdout);
+    for (int f = 0, shown = 0; f < nfiles; f++) {
+        if (files[f].fd < 0) {
+            ret = 1;
+            continue;
+        }
+        if (nfiles > 1) {
+            print_heading(&files[f], !shown++);
+        }
+        if (tail_fd(&files[f], lines) < 0) {
+            perror("tail");
+            ret = 1;
+        }
+    }
+
+    if (follows) {
+        follow(files, nfiles, stop);
+    }
+    close_files(files, nfiles);
+    return ret;
+}
@@ -0,0 +1,19 @@
+#ifndef TAIL_H_
+#define TAIL_H_
+
+#include <signal.h>
+
+/*
+ * the head builtin: prints the first lines (10, or n with -n n) of the files
+ * named by argv[1...] (standard input if there are none), relative to
+ * directory cwd (i.e. cwd_fd). returns 0, or 1 if a file could not be read
+ */
+int print_head(char *argv[], int argc, int cwd);
+/*
+ * the tail builtin: prints the last lines of files, like print_head(). with
+ * -f, then keeps printing what is appended to them until *stop is set (by a
+ * signal handler, e.g. for ^C)
+ */
+int print_tail(char *argv[], int argc, int cwd, volatile sig_atomic_t *stop);
+
+#endif  // TAIL_H_
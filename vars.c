@@ -0,0 +1,531 @@
+#include "./vars.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// initial number of slots in a table (always a power of two)
+#define MIN_SLOTS 16
+// free slots kept in front of a cached environment, for VAR=x overrides
+#define ENV_HEADROOM 16
+
+/*
+ * Variables are kept in an open-addressed hash table of "NAME=value"
+ * strings. A table may be layered over a base table: lookups fall through to
+ * the base, and assignments always go to the top table. Sessions of a
+ * --sessions server each get an empty table over the server's own, so a
+ * session only pays for the variables it actually sets. An unset variable
+ * leaves its bare "NAME" behind, which hides it in the bases (and keeps the
+ * probe sequences of the table intact).
+ *
+ * Only exported variables are passed on to programs. Every change to one
+ * gives its table a new version (from one counter), so the newest version
+ * along a chain of tables tells whether the environment built from them is
+ * still current. That environment is built once per version, as an arena:
+ * the envp array, followed by copies of its strings, so it stays valid
+ * whatever happens to the tables. Launching a program costs nothing more
+ * than a lookup of the version, and VAR=x overrides are slipped into the
+ * free slots in front of the array, unless one replaces an exported
+ * variable, which makes a copy of the array (and only of the array).
+ */
+struct vars {
+    char **slots;  // "NAME=value" (or unset "NAME") strings, NULL if empty
+    unsigned char *exported;  // (per slot)
+    size_t nslots;
+    size_t count;      // number of occupied slots
+    uint64_t version;  // of the last change to an exported variable
+    vars_t *base;
+    char **env;  // the cached environment arena (from its headroom on)
+    size_t env_len;
+    uint64_t env_version;  // newest version of the chain it was built from
+};
+
+vars_t *shell_vars = NULL;
+
+// the last version given to a table
+static uint64_t last_version = 0;
+
+/* hashes the name part of str (up to '=' or the end of the string) */
+static uint32_t hash_name(const char *str, size_t *len) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    size_t i = 0;
+    for (; str[i] && str[i] != '='; i++) {
+        h = (h ^ (unsigned char)str[i]) * 16777619u;
+    }
+
+    *len = i;
+    return h;
+}
+
+/* returns the slot holding name (of length len), or the empty slot for it */
+static char **find_slot(vars_t *vars, const char *name, size_t len,
+                        uint32_t h) {
+    size_t mask = vars->nslots - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        char *str = vars->slots[i];
+        if (!str ||
+            (!strncmp(str, name, len) && (str[len] == '=' || !str[len]))) {
+            return &vars->slots[i];
+        }
+    }
+}
+
+/* doubles the number of slots of a table, returns 0 or -1 on failure */
+static int grow(vars_t *vars) {
+    size_t nslots = vars->nslots * 2;
+    char **slots = (char **)calloc(nslots, sizeof(char *));
+    unsigned char *exported = (unsigned char *)calloc(nslots, 1);
+    if (!slots || !exported) {
+        perror("vars");
+        free(slots);
+        free(exported);
+        return -1;
+    }
+
+    char **old = vars->slots;
+    unsigned char *old_exported = vars->exported;
+    size_t nold = vars->nslots;
+    vars->slots = slots;
+    vars->exported = exported;
+    vars->nslots = nslots;
+    for (size_t i = 0; i < nold; i++) {
+        if (old[i]) {
+            size_t len;
+            uint32_t h = hash_name(old[i], &len);
+            char **slot = find_slot(vars, old[i], len, h);
+            *slot = old[i];
+            exported[slot - slots] = old_exported[i];
+        }
+    }
+
+    free(old);
+    free(old_exported);
+    return 0;
+}
+
+/*
+ * new_vars()
+ *
+ * - Description: creates an empty table of variables. Variables that are not
+ * set in the table are looked up in base. Returns NULL (after printing an
+ * error) on failure.
+ *
+ * - Arguments: base: table to fall back to (or NULL), which must outlive the
+ * new table
+ */
+vars_t *new_vars(vars_t *base) {
+    vars_t *vars = (vars_t *)calloc(1, sizeof(vars_t));
+    char **slots = (char **)calloc(MIN_SLOTS, sizeof(char *));
+    unsigned char *exported = (unsigned char *)calloc(MIN_SLOTS, 1);
+    if (!vars || !slots || !exported) {
+        perror("vars");
+        free(vars);
+        free(slots);
+        free(exported);
+        return NULL;
+    }
+
+    vars->slots = slots;
+    vars->exported = exported;
+    vars->nslots = MIN_SLOTS;
+    vars->base = base;
+    return vars;
+}
+
+/*
+ * find_var()
+ *
+ * - Description: returns the slot of the variable name (of length len, with
+ * hash h) visible through vars, i.e. in the first table of the chain that
+ * has it (even unset), or NULL. *in is set to that table.
+ */
+static char **find_var(vars_t *vars, const char *name, size_t len, uint32_t h,
+                       vars_t **in) {
+    for (; vars; vars = vars->base) {
+        char **slot = find_slot(vars, name, len, h);
+        if (*slot) {
+            *in = vars;
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * put_var()
+ *
+ * - Description: puts str (a "NAME=value" or unset "NAME" string, whose name
+ * is len bytes long and hashes to h) into vars, replacing what the table
+ * had for that name, and marks it as exported or not. Returns 0, or -1
+ * (after printing an error, and freeing str) on failure.
+ */
+static int put_var(vars_t *vars, char *str, size_t len, uint32_t h,
+                   int exported) {
+    if ((vars->count + 1) * 4 > vars->nslots * 3 && grow(vars) < 0) {
+        free(str);
+        return -1;
+    }
+
+    char **slot = find_slot(vars, str, len, h);
+    if (*slot) {
+        free(*slot);
+    } else {
+        vars->count++;
+    }
+
+    *slot = str;
+    vars->exported[slot - vars->slots] = (unsigned char)exported;
+    return 0;
+}
+
+/* notes a change to what programs are passed */
+static void touch(vars_t *vars) { vars->version = ++last_version; }
+
+/*
+ * load_vars()
+ *
+ * - Description: creates a table holding a copy of every "NAME=value" string
+ * in env, all of them exported. Returns NULL (after printing an error) on
+ * failure.
+ *
+ * - Arguments: env: NULL-terminated environment, i.e. environ
+ */
+vars_t *load_vars(char **env) {
+    vars_t *vars;
+    if (!(vars = new_vars(NULL))) {
+        return NULL;
+    }
+
+    for (int i = 0; env[i]; i++) {
+        char *eq = strchr(env[i], '=');
+        if (!eq) {
+            continue;
+        }
+
+        size_t len;
+        uint32_t h = hash_name(env[i], &len);
+        char *str;
+        if (!(str = strdup(env[i]))) {
+            perror("vars");
+            free_vars(vars);
+            return NULL;
+        } else if (put_var(vars, str, len, h, 1) < 0) {
+            free_vars(vars);
+            return NULL;
+        }
+    }
+
+    touch(vars);
+    return vars;
+}
+
+/* frees a table (but not its base) */
+void free_vars(vars_t *vars) {
+    if (!vars) {
+        return;
+    }
+
+    for (size_t i = 0; i < vars->nslots; i++) {
+        free(vars->slots[i]);
+    }
+
+    free(vars->slots);
+    free(vars->exported);
+    if (vars->env) {
+        free(vars->env - ENV_HEADROOM);
+    }
+    free(vars);
+}
+
+/*
+ * var_get()
+ *
+ * - Description: returns the value of a variable, looking in vars and then
+ * in its bases, or NULL if it is not set anywhere.
+ *
+ * - Arguments: vars: table to look in, name: name of the variable
+ */
+const char *var_get(vars_t *vars, const char *name) {
+    size_t len;
+    uint32_t h = hash_name(name, &len);
+    vars_t *in;
+    char **slot = find_var(vars, name, len, h, &in);
+    return slot && (*slot)[len] ? *slot + len + 1 : NULL;
+}
+
+/*
+ * var_set()
+ *
+ * - Description: sets a variable in vars, shadowing any value it has in the
+ * bases of vars. A variable that was exported stays exported, a new one is
+ * not. Returns 0, or -1 (after printing an error) on failure.
+ *
+ * - Arguments: vars: table to set the variable in, name: name of the
+ * variable (which must not contain '='), value: its new value
+ */
+int var_set(vars_t *vars, const char *name, const char *value) {
+    size_t len;
+    uint32_t h = hash_name(name, &len);
+    size_t vlen = strlen(value);
+    char *str = (char *)malloc(len + vlen + 2);
+    if (!str) {
+        perror("vars");
+        return -1;
+    }
+
+    memcpy(str, name, len);
+    str[len] = '=';
+    memcpy(str + len + 1, value, vlen + 1);
+
+    vars_t *in;
+    char **slot = find_var(vars, name, len, h, &in);
+    int exported = slot && in->exported[slot - in->slots];
+    if (put_var(vars, str, len, h, exported) < 0) {
+        return -1;
+    }
+    if (exported) {
+        touch(vars);
+    }
+    return 0;
+}
+
+/*
+ * var_export()
+ *
+ * - Description: marks a variable as exported (after setting it to value,
+ * unless that is NULL), so that it is passed on to programs. Exporting a
+ * variable that is not set does nothing. Returns 0, or -1 (after printing an
+ * error) on failure.
+ *
+ * - Arguments: vars: table to export the variable from, name: its name,
+ * value: its new value (or NULL to keep its value)
+ */
+int var_export(vars_t *vars, const char *name, const char *value) {
+    if (value && var_set(vars, name, value) < 0) {
+        return -1;
+    }
+
+    size_t len;
+    uint32_t h = hash_name(name, &len);
+    vars_t *in;
+    char **slot = find_var(vars, name, len, h, &in);
+    if (!slot || !(*slot)[len] || in->exported[slot - in->slots]) {
+        return 0;  // (not set, or exported already)
+    }
+
+    if (in == vars) {
+        vars->exported[slot - vars->slots] = 1;
+    } else {  // (exported from this table only, so it gets its own copy)
+        char *str;
+        if (!(str = strdup(*slot))) {
+            perror("vars");
+            return -1;
+        } else if (put_var(vars, str, len, h, 1) < 0) {
+            return -1;
+        }
+    }
+
+    touch(vars);
+    return 0;
+}
+
+/*
+ * var_unset()
+ *
+ * - Description: unsets a variable in vars, hiding it in the bases of vars
+ * too. Returns 0, or -1 (after printing an error) on failure.
+ *
+ * - Arguments: vars: table to unset the variable in, name: its name
+ */
+int var_unset(vars_t *vars, const char *name) {
+    size_t len;
+    uint32_t h = hash_name(name, &len);
+    vars_t *in;
+    char **slot = find_var(vars, name, len, h, &in);
+    if (!slot || !(*slot)[len]) {
+        return 0;  // (not set)
+    }
+
+    int exported = in->exported[slot - in->slots];
+    char *str;
+    if (!(str = strndup(name, len))) {
+        perror("vars");
+        return -1;
+    } else if (put_var(vars, str, len, h, 0) < 0) {
+        return -1;
+    }
+    if (exported) {
+        touch(vars);
+    }
+    return 0;
+}
+
+/*
+ * build_env()
+ *
+ * - Description: builds the environment arena of vars: ENV_HEADROOM free
+ * slots, the envp array of every exported variable visible through vars,
+ * then copies of their strings. Returns 0, or -1 (after printing an error)
+ * on failure.
+ */
+static int build_env(vars_t *vars) {
+    size_t total = 0;
+    for (vars_t *v = vars; v; v = v->base) {
+        total += v->count;
+    }
+
+    char **visible = (char **)malloc((total + 1) * sizeof(char *));
+    if (!visible) {
+        perror("vars");
+        return -1;
+    }
+
+    size_t n = 0, bytes = 0;
+    for (vars_t *v = vars; v; v = v->base) {
+        for (size_t i = 0; i < v->nslots; i++) {
+            char *str = v->slots[i];
+            if (!str || !v->exported[i]) {
+                continue;
+            }
+
+            // skip variables hidden by a table above this one
+            size_t len;
+            uint32_t h = hash_name(str, &len);
+            int hidden = 0;
+            for (vars_t *above = vars; above != v; above = above->base) {
+                if (*find_slot(above, str, len, h)) {
+                    hidden = 1;
+                    break;
+                }
+            }
+
+            if (!hidden) {
+                visible[n++] = str;
+                bytes += strlen(str) + 1;
+            }
+        }
+    }
+
+    size_t ptrs = (ENV_HEADROOM + n + 1) * sizeof(char *);
+    char **arena = (char **)malloc(ptrs + bytes);
+    if (!arena) {
+        perror("vars");
+        free(visible);
+        return -1;
+    }
+
+    char **env = arena + ENV_HEADROOM;
+    char *at = (char *)arena + ptrs;
+    for (size_t i = 0; i < n; i++) {
+        env[i] = at;
+        at = stpcpy(at, visible[i]) + 1;
+    }
+    env[n] = NULL;
+    free(visible);
+
+    if (vars->env) {
+        free(vars->env - ENV_HEADROOM);
+    }
+    vars->env = env;
+    vars->env_len = n;
+    return 0;
+}
+
+/*
+ * var_envp()
+ *
+ * - Description: returns an environment for execve() holding every exported
+ * variable visible through vars (a variable set in vars hides the same
+ * variable in its bases), or NULL (after printing an error) on failure. It
+ * is only built again once an exported variable has changed.
+ *
+ * - Arguments: vars: the table to build the environment from
+ *
+ * - Usage: the array belongs to vars, and stays valid until the next change
+ * to its exported variables.
+ *
+ *      char **envp = var_envp(shell_vars);
+ *      execve(path, argv, envp);
+ */
+char **var_envp(vars_t *vars) {
+    uint64_t version = 0;
+    for (vars_t *v = vars; v; v = v->base) {
+        version = v->version > version ? v->version : version;
+    }
+
+    if ((!vars->env || vars->env_version != version) && build_env(vars) < 0) {
+        return NULL;
+    }
+    vars->env_version = version;
+    return vars->env;
+}
+
+/*
+ * var_envp_with()
+ *
+ * - Description: var_envp(), with the "NAME=value" strings of assigns (n of
+ * them, the last one winning for a name given twice) added to it or
+ * replacing its variables. Returns NULL (after printing an error) on
+ * failure. New variables go into the free slots in front of the cached
+ * array, so it is not copied; only replacing a variable (or running out of
+ * slots) makes a copy of the array, which *copy is then set to.
+ *
+ * - Arguments: vars: the table, assigns and n: the overrides, copy: set to
+ * an array to free() after use (or NULL)
+ *
+ * - Usage: the array is only valid until the next call.
+ *
+ *      char **copy;
+ *      char **envp = var_envp_with(shell_vars, argv, nassign, &copy);
+ *      ... fork() and execve(path, argv + nassign, envp) ...
+ *      free(copy);
+ */
+char **var_envp_with(vars_t *vars, char **assigns, int n, char ***copy) {
+    *copy = NULL;
+    char **env;
+    if (!(env = var_envp(vars)) || !n) {
+        return env;
+    }
+
+    // does any override replace a variable (or another override)?
+    int replaces = n > ENV_HEADROOM;
+    for (int i = 0; i < n && !replaces; i++) {
+        size_t len;
+        hash_name(assigns[i], &len);
+        for (size_t k = 0; k < vars->env_len && !replaces; k++) {
+            replaces = !strncmp(env[k], assigns[i], len + 1);
+        }
+        for (int k = 0; k < i && !replaces; k++) {
+            replaces = !strncmp(assigns[k], assigns[i], len + 1);
+        }
+    }
+
+    if (!replaces) {  // (into the headroom)
+        memcpy(env - n, assigns, (size_t)n * sizeof(char *));
+        return env - n;
+    }
+
+    char **arr =
+        (char **)malloc((vars->env_len + (size_t)n + 1) * sizeof(char *));
+    if (!arr) {
+        perror("vars");
+        return NULL;
+    }
+    memcpy(arr, env, vars->env_len * sizeof(char *));
+    size_t len = vars->env_len;
+    for (int i = 0; i < n; i++) {
+        size_t nlen;
+        hash_name(assigns[i], &nlen);
+        size_t k = 0;
+        while (k < len && strncmp(arr[k], assigns[i], nlen + 1)) {
+            k++;
+        }
+        arr[k] = assigns[i];
+        len += k == len;
+    }
+    arr[len] = NULL;
+
+    *copy = arr;
+    return arr;
+}
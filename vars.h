@@ -0,0 +1,57 @@
+#ifndef VARS_H_
+#define VARS_H_
+
+/* a table of shell variables, the exported ones of which are passed on to
+ * programs */
+typedef struct vars vars_t;
+
+/*
+ * the variables of the running shell (or of the session being served), used
+ * by arithmetic expansion and for the environment of launched programs
+ */
+extern vars_t *shell_vars;
+
+/*
+ * creates an empty table layered over base (or NULL): variables not set in
+ * the new table are looked up in base, which must outlive it. returns NULL
+ * (after printing an error) on failure
+ */
+vars_t *new_vars(vars_t *base);
+/*
+ * creates a table holding a copy of env (i.e. environ), all exported, NULL on
+ * failure
+ */
+vars_t *load_vars(char **env);
+/* frees a table (but not its base) */
+void free_vars(vars_t *vars);
+
+/* returns the value of a variable, or NULL if it is not set */
+const char *var_get(vars_t *vars, const char *name);
+/*
+ * sets a variable in vars (never in its base), keeping it exported if it was.
+ * returns 0 or -1 on failure
+ */
+int var_set(vars_t *vars, const char *name, const char *value);
+/*
+ * exports a variable that is set (setting it to value first, unless that is
+ * NULL), returns 0 or -1 on failure
+ */
+int var_export(vars_t *vars, const char *name, const char *value);
+/* unsets a variable (hiding it in the bases too), returns 0 or -1 on failure */
+int var_unset(vars_t *vars, const char *name);
+
+/*
+ * returns a NULL-terminated array of the exported variables as "NAME=value"
+ * strings for execve(), or NULL on failure. the array is cached in vars, and
+ * stays valid until an exported variable changes
+ */
+char **var_envp(vars_t *vars);
+/*
+ * like var_envp(), with the "NAME=value" strings of assigns (n of them) added
+ * or replacing variables, without copying the array unless a variable is
+ * replaced; then *copy is set to the copy, to be freed with free() (else to
+ * NULL). valid until the next call
+ */
+char **var_envp_with(vars_t *vars, char **assigns, int n, char ***copy);
+
+#endif  // VARS_H_
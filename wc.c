@@ -0,0 +1,311 @@
+#include "./wc.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "./scan.h"
+
+/*
+ * Regular files are mapped and cut into pieces of WC_PIECE bytes, other
+ * input (pipes, terminals, /proc files) is one piece read with large
+ * read()s; a few threads then take pieces off the list until it is empty,
+ * so one big file is counted by all of them, and many small files at once.
+ * Each piece is counted WC_BLOCK bytes at a time, lines then words, while
+ * the block is in cache (see count_lines() and count_words() in scan.c). A
+ * piece finds out whether it starts inside a word by looking at the bytes
+ * before it, so the word counts of the pieces of a file just add up. A byte
+ * count of a regular file is its size: wc -c reads nothing.
+ */
+
+// bytes of a mapped file counted by one thread at a time
+#define WC_PIECE (16 << 20)
+// bytes counted for lines and then words in one go
+#define WC_BLOCK 65536
+// bytes read at a time from input that cannot be mapped
+#define WC_BUF (1 << 20)
+// most threads counting
+#define MAX_WC_THREADS 8
+
+/* an input of wc, and its counts */
+typedef struct {
+    const char *name;  // NULL for standard input
+    int fd;
+    char *map;    // its contents, if it is a regular file (else NULL)
+    size_t size;  // (of map)
+    int regular;
+    size_t lines;
+    size_t words;
+    size_t bytes;
+    int failed;
+} wc_file_t;
+
+/* a part of a file for a thread to count */
+typedef struct {
+    wc_file_t *file;
+    size_t from;  // (of its map; a file read instead is one piece)
+    size_t to;
+    size_t lines;
+    size_t words;
+    size_t bytes;
+    int failed;  // errno of a read error
+} piece_t;
+
+/* the work shared by the counting threads */
+typedef struct {
+    piece_t *pieces;
+    size_t n;
+    size_t next;  // next piece to take (atomically)
+    int words;    // whether words are counted
+} wc_work_t;
+
+/* counts a piece of a mapped file */
+static void count_mapped(piece_t *p, int words) {
+    const char *map = p->file->map;
+    int between = words_between(map, p->from);
+    for (size_t at = p->from; at < p->to; at += WC_BLOCK) {
+        size_t n = p->to - at < WC_BLOCK ? p->to - at : WC_BLOCK;
+        p->lines += count_lines(map + at, n);
+        if (words) {
+            p->words += count_words(map + at, n, &between);
+        }
+    }
+    p->bytes = p->to - p->from;
+}
+
+/* counts a file that is read rather than mapped */
+static void count_read(piece_t *p, int words) {
+    char *buf = (char *)malloc(WC_BUF);
+    if (!buf) {
+        p->failed = ENOMEM;
+        return;
+    }
+
+    int between = 1;
+    ssize_t n;
+    while ((n = read(p->file->fd, buf, WC_BUF)) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            p->failed = errno;
+            break;
+        }
+
+        p->lines += count_lines(buf, (size_t)n);
+        if (words) {
+            p->words += count_words(buf, (size_t)n, &between);
+        }
+        p->bytes += (size_t)n;
+    }
+    free(buf);
+}
+
+/* takes pieces off the list and counts them (a thread function) */
+static void *count_pieces(void *arg) {
+    wc_work_t *work = (wc_work_t *)arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) <
+           work->n) {
+        piece_t *p = &work->pieces[i];
+        if (p->file->map) {
+            count_mapped(p, work->words);
+        } else {
+            count_read(p, work->words);
+        }
+    }
+    return NULL;
+}
+
+/* opens an input, mapping it if it is a regular file; returns 0 or -1 */
+static int open_input(wc_file_t *f, int cwd, int read_bytes) {
+    if (f->name && (f->fd = openat(cwd, f->name, O_RDONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(f->fd, &st) < 0) {
+        return -1;
+    } else if (!S_ISREG(st.st_mode)) {
+        return 0;
+    }
+
+    f->regular = 1;
+    if (!st.st_size) {
+        return 0;  // (possibly a /proc file, whose size says nothing)
+    }
+
+    f->size = (size_t)st.st_size;
+    if (!read_bytes) {  // just the byte count: it is the size
+        f->bytes = f->size;
+        return 0;
+    }
+
+    void *map = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, f->fd, 0);
+    if (map == MAP_FAILED) {
+        f->size = 0;  // read it instead
+        return 0;
+    }
+    madvise(map, f->size, MADV_SEQUENTIAL);
+    f->map = (char *)map;
+    return 0;
+}
+
+/* prints the counts asked for (show: lines, words, bytes), and a name */
+static void print_counts(size_t counts[3], const int show[3], int width,
+                         const char *name) {
+    const char *sep = "";
+    for (int i = 0; i < 3; i++) {
+        if (show[i]) {
+            printf("%s%*zu", sep, width, counts[i]);
+            sep = " ";
+        }
+    }
+    printf(name ? " %s\n" : "\n", name);
+}
+
+/*
+ * count_files()
+ *
+ * - Description: the wc builtin, see wc.h. Counts are printed in the width
+ * coreutils' wc uses: wide enough for the total size of the files, and at
+ * least 7 if any of them is not a regular file.
+ */
+int count_files(char *argv[], int argc, int cwd) {
+    int show[3] = {0, 0, 0}, i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        for (const char *o = argv[i] + 1; *o; o++) {
+            if (*o == 'l' || *o == 'w' || *o == 'c') {
+                show[*o == 'l' ? 0 : *o == 'w' ? 1 : 2] = 1;
+            } else {
+                write(STDERR_FILENO, "wc: syntax error\n", 17);
+                return 1;
+            }
+        }
+    }
+    if (!show[0] && !show[1] && !show[2]) {
+        show[0] = show[1] = show[2] = 1;
+    }
+
+    int nfiles = i < argc ? argc - i : 1;
+    wc_file_t files[nfiles];
+    memset(files, 0, sizeof(files));
+    piece_t *pieces = NULL;
+    size_t npieces = 0, cap = 0;
+    int ret = 0, width = 1, min_width = 1;
+    size_t total_size = 0;
+
+    for (int f = 0; f < nfiles; f++) {
+        wc_file_t *file = &files[f];
+        file->name = i < argc ? argv[i + f] : NULL;
+        if (open_input(file, cwd, show[0] || show[1]) < 0) {
+            fprintf(stderr, "wc: %s: %s\n", file->name ? file->name : "-",
+                    strerror(errno));
+            file->failed = 1;
+            ret = 1;
+            continue;
+        }
+        if (file->regular) {
+            total_size += file->size;
+        } else {
+            min_width = 7;
+        }
+        if (file->size && !file->map) {  // counted already
+            continue;
+        }
+
+        // (a read file is one piece, a mapped one as many as it takes)
+        size_t parts = file->map ? (file->size + WC_PIECE - 1) / WC_PIECE : 1;
+        if (npieces + parts > cap) {
+            cap = 2 * (npieces + parts);
+            piece_t *grown = (piece_t *)realloc(pieces, cap * sizeof(piece_t));
+            if (!grown) {
+                perror("wc");
+                file->failed = 1;
+                ret = 1;
+                continue;
+            }
+            pieces = grown;
+        }
+        for (size_t k = 0; k < parts; k++) {
+            piece_t *p = &pieces[npieces++];
+            memset(p, 0, sizeof(piece_t));
+            p->file = file;
+            p->from = k * WC_PIECE;
+            p->to = file->map && (k + 1) * WC_PIECE < file->size
+                        ? (k + 1) * WC_PIECE
+                        : file->size;
+        }
+    }
+
+    // count, in this thread and (for several pieces) a few more
+    wc_work_t work = {pieces, npieces, 0, show[1]};
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = npieces < MAX_WC_THREADS ? npieces : MAX_WC_THREADS;
+    if (cpus > 0 && nthreads > (size_t)cpus) {
+        nthreads = (size_t)cpus;
+    }
+    pthread_t threads[MAX_WC_THREADS];
+    size_t started = 0;
+    while (started + 1 < nthreads &&
+           !pthread_create(&threads[started], NULL, count_pieces, &work)) {
+        started++;
+    }
+    count_pieces(&work);
+    for (size_t t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    for (size_t k = 0; k < npieces; k++) {
+        wc_file_t *file = pieces[k].file;
+        file->lines += pieces[k].lines;
+        file->words += pieces[k].words;
+        file->bytes += pieces[k].bytes;
+        if (pieces[k].failed && !file->failed) {
+            fprintf(stderr, "wc: %s: %s\n", file->name ? file->name : "-",
+                    strerror(pieces[k].failed));
+            file->failed = 1;
+            ret = 1;
+        }
+    }
+    free(pieces);
+
+    for (; total_size >= 10; total_size /= 10) {
+        width++;
+    }
+    if (width < min_width) {
+        width = min_width;
+    }
+    if (nfiles == 1 && show[0] + show[1] + show[2] == 1) {  // (no columns)
+        width = 1;
+    }
+
+    size_t total[3] = {0, 0, 0};
+    for (int f = 0; f < nfiles; f++) {
+        wc_file_t *file = &files[f];
+        if (file->map) {
+            munmap(file->map, file->size);
+        }
+        if (file->name && file->fd >= 0) {
+            close(file->fd);
+        }
+        if (file->failed) {
+            continue;
+        }
+
+        size_t counts[3] = {file->lines, file->words, file->bytes};
+        print_counts(counts, show, width, file->name);
+        for (int c = 0; c < 3; c++) {
+            total[c] += counts[c];
+        }
+    }
+    if (nfiles > 1) {
+        print_counts(total, show, width, "total");
+    }
+
+    fflush(stdout);
+    return ret;
+}
@@ -0,0 +1,13 @@
+#ifndef WC_H_
+#define WC_H_
+
+/*
+ * the wc builtin: prints the newline, word and byte counts (or, with -l, -w
+ * or -c, only those asked for) of the files named by argv[1...] (standard
+ * input if there are none), relative to directory cwd (i.e. cwd_fd), and
+ * their total if there is more than one. returns 0, or 1 if a file could not
+ * be read
+ */
+int count_files(char *argv[], int argc, int cwd);
+
+#endif  // WC_H_
@@ -0,0 +1,527 @@
+#define _GNU_SOURCE  // close_range()
+#include "./zygote.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+// descriptors passed with each launch: stdin, stdout, stderr and the cwd
+#define NFDS 4
+
+/*
+ * The pool is a stack of helpers, each forked from the shell ahead of time
+ * with its signal dispositions reset and a process group of its own, and
+ * blocked reading a SOCK_SEQPACKET socket. A launch pops a helper and sends
+ * it one message: a header, the path, argv, the environment and the
+ * redirection files as NUL-terminated strings, with the shell's standard
+ * descriptors and working directory attached. The helper puts those in
+ * place, does the redirections and execs, so the launch itself costs a
+ * sendmsg() instead of a fork() of the whole shell. Helpers stay children of
+ * the shell, so they are waited for and job-controlled like forked ones.
+ *
+ * The pool is refilled by a thread of its own, so the fork() a launch saves
+ * is not just paid right after it instead: the shell only wakes the thread
+ * (see refill_zygotes()), which forks helpers while the shell goes on. A
+ * helper forked by that thread is still a child of the shell. The pool is
+ * shared with the thread under lock; the shell's threads only ever wait for
+ * helpers on the main thread, so helpers the thread has to get rid of are
+ * retired (their socket closed, so that they exit) and left to be reaped
+ * there like the others.
+ */
+typedef struct {
+    pid_t pgid;
+    int argc;
+    int envc;
+    int files;  // bit i is set if files[i] was given
+} launch_t;
+
+typedef struct {
+    pid_t pid;
+    int sock;  // the shell's end of the helper's socket
+} zygote_t;
+
+static zygote_t pool[MAX_ZYGOTES];
+static int npool = 0;     // number of ready helpers
+static int pool_cap = 0;  // number of helpers to keep ready
+
+static pid_t retired[MAX_ZYGOTES];  // surplus helpers, exiting
+static int nretired = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wanted = PTHREAD_COND_INITIALIZER;  // refill needed
+static int started = 0;  // set once the refill thread is running
+
+/*
+ * next_string()
+ *
+ * - Description: returns the NUL-terminated string at *pos in a message and
+ * moves *pos past it, or NULL if the message ends before the NUL.
+ */
+static char *next_string(char **pos, char *end) {
+    char *str = *pos;
+    char *nul = memchr(str, '\0', (size_t)(end - str));
+    if (!nul) {
+        return NULL;
+    }
+
+    *pos = nul + 1;
+    return str;
+}
+
+/*
+ * run_helper()
+ *
+ * - Description: body of a helper process. Waits for a launch message, sets
+ * up the process as described by it and execs. Exits quietly if the shell
+ * closes the socket (i.e. the helper was killed off or the shell exited).
+ * Never returns.
+ *
+ * - Arguments: sock: the helper's end of its socket
+ */
+static void run_helper(int sock) {
+    // the same dispositions (and mask) run_prog() gives a freshly forked
+    // child; the refill thread that forked this one blocks all signals
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+
+    ssize_t size;
+    while ((size = recv(sock, NULL, 0, MSG_PEEK | MSG_TRUNC)) < 0 &&
+           errno == EINTR) {
+    }
+    if (size < (ssize_t)sizeof(launch_t)) {
+        _exit(0);
+    }
+
+    char *msg = (char *)malloc((size_t)size);
+    union {
+        char buf[CMSG_SPACE(NFDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = msg, .iov_len = (size_t)size};
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    if (!msg || recvmsg(sock, &mh, MSG_CMSG_CLOEXEC) != size) {
+        _exit(1);
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(NFDS * sizeof(int))) {
+        _exit(1);
+    }
+
+    int fds[NFDS];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    // unpack the message
+    launch_t hdr;
+    memcpy(&hdr, msg, sizeof(hdr));
+    char *pos = msg + sizeof(hdr);
+    char *end = msg + size;
+    if (hdr.argc < 1 || hdr.envc < 0 ||
+        (size_t)hdr.argc + (size_t)hdr.envc > (size_t)size) {
+        _exit(1);
+    }
+
+    char *path = next_string(&pos, end);
+    char **argv = (char **)calloc((size_t)hdr.argc + 1, sizeof(char *));
+    char **envp = (char **)calloc((size_t)hdr.envc + 1, sizeof(char *));
+    if (!path || !argv || !envp) {
+        _exit(1);
+    }
+    for (int i = 0; i < hdr.argc; i++) {
+        if (!(argv[i] = next_string(&pos, end))) {
+            _exit(1);
+        }
+    }
+    for (int i = 0; i < hdr.envc; i++) {
+        if (!(envp[i] = next_string(&pos, end))) {
+            _exit(1);
+        }
+    }
+    char *files[3] = {NULL, NULL, NULL};
+    for (int i = 0; i < 3; i++) {
+        if ((hdr.files & (1 << i)) && !(files[i] = next_string(&pos, end))) {
+            _exit(1);
+        }
+    }
+
+    if (hdr.pgid && setpgid(0, hdr.pgid) < 0) {
+        perror("setpgid");
+        _exit(1);
+    }
+
+    // take on the shell's descriptors and working directory
+    for (int i = 0; i < 3; i++) {
+        if (dup2(fds[i], i) < 0) {
+            perror("dup2");
+            _exit(1);
+        }
+    }
+    if (fchdir(fds[3]) < 0) {
+        perror("fchdir");
+        _exit(1);
+    }
+    for (int i = 0; i < NFDS; i++) {
+        if (fds[i] > 2) {
+            close(fds[i]);
+        }
+    }
+
+    // set up redirection, exactly as run_prog() does
+    if (files[0]) {
+        close(STDIN_FILENO);
+        if (open(files[0], O_RDONLY, 0) < 0) {
+            perror("open");
+            _exit(1);
+        }
+    }
+
+    if (files[1] || files[2]) {
+        close(STDOUT_FILENO);
+        int flags = files[1] ? O_TRUNC : O_APPEND;
+        if (open(files[1] ? files[1] : files[2], O_WRONLY | O_CREAT | flags,
+                 0600) < 0) {
+            perror("open");
+            _exit(1);
+        }
+    }
+
+    close_range(3, ~0U, 0);  // (as run_prog() does)
+    execve(path, argv, envp);
+    perror("execv");
+
+    // (_exit, since stdio buffers were copied from whatever the shell had)
+    _exit(1);
+}
+
+/*
+ * set_zygotes()
+ *
+ * - Description: sets the number of helpers to keep ready. Shrinking the pool
+ * kills the surplus idle helpers right away; growing it takes effect at the
+ * next call to refill_zygotes().
+ *
+ * - Arguments: n: number of helpers, between 0 and MAX_ZYGOTES
+ */
+void set_zygotes(int n) {
+    zygote_t surplus[MAX_ZYGOTES];
+    int nsurplus = 0;
+    pthread_mutex_lock(&lock);
+    pool_cap = n;
+    while (npool > pool_cap) {
+        surplus[nsurplus++] = pool[--npool];
+    }
+    pthread_mutex_unlock(&lock);
+
+    for (int i = 0; i < nsurplus; i++) {
+        close(surplus[i].sock);  // the helper sees EOF and exits
+        kill(surplus[i].pid, SIGKILL);
+        waitpid(surplus[i].pid, NULL, 0);
+    }
+}
+
+/* returns the number of helpers the pool keeps */
+int zygote_count() {
+    pthread_mutex_lock(&lock);
+    int n = pool_cap;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+/*
+ * fork_helper()
+ *
+ * - Description: forks one helper, in a process group of its own. Returns
+ * its pid, with the shell's end of its socket in *sock, or -1 on an error.
+ */
+static pid_t fork_helper(int *sock) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+
+    pid_t pid;
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    } else if (!pid) {
+        // keep nothing of the shell's but the socket: not the other helpers'
+        // sockets (so that each sees EOF as soon as the shell closes its
+        // end), nor anything the shell has open at the moment, such as a
+        // session's descriptors, which an idle helper would hold open for
+        // as long as it waits. its standard descriptors are sent with each
+        // launch, so until then they are /dev/null
+        if (dup2(sv[1], 3) < 0) {
+            _exit(1);
+        }
+        close_range(4, ~0U, 0);
+        int null = open("/dev/null", O_RDWR);
+        for (int i = 0; i < 3 && null >= 0; i++) {
+            dup2(null, i);
+        }
+        if (null > 2) {
+            close(null);
+        }
+        setpgid(0, 0);
+        run_helper(3);
+    }
+
+    // also set the group here, so it is in place before any launch
+    setpgid(pid, pid);
+    close(sv[1]);
+    *sock = sv[0];
+    return pid;
+}
+
+/*
+ * refill()
+ *
+ * - Description: body of the refill thread. Waits until the pool holds fewer
+ * helpers than it should, and forks one more, for as long as the shell runs.
+ * A helper that is no longer wanted by the time it is ready (the pool was
+ * shrunk meanwhile) is retired.
+ */
+static void *refill(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (npool >= pool_cap) {
+            pthread_cond_wait(&wanted, &lock);
+        }
+        pthread_mutex_unlock(&lock);
+
+        int sock;
+        pid_t pid = fork_helper(&sock);
+
+        pthread_mutex_lock(&lock);
+        if (pid < 0) {  // (tried again at the next refill_zygotes())
+            pthread_cond_wait(&wanted, &lock);
+        } else if (npool < pool_cap) {
+            pool[npool].pid = pid;
+            pool[npool].sock = sock;
+            npool++;
+        } else {
+            close(sock);  // the helper sees EOF and exits
+            if (nretired < MAX_ZYGOTES) {
+                retired[nretired++] = pid;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * refill_zygotes()
+ *
+ * - Description: has the pool refilled until it holds as many helpers as it
+ * should. The helpers are forked by the refill thread (started on the first
+ * call), so this only wakes it up and returns right away.
+ *
+ * - Usage: called by the shell between commands (after a command has been
+ * launched or has finished).
+ */
+void refill_zygotes() {
+    pthread_mutex_lock(&lock);
+    if (npool < pool_cap) {
+        if (!started) {
+            // (signals are for the main thread to handle)
+            sigset_t all, old;
+            sigfillset(&all);
+            pthread_sigmask(SIG_SETMASK, &all, &old);
+            pthread_t thread;
+            if (!pthread_create(&thread, NULL, refill, NULL)) {
+                pthread_detach(thread);
+                started = 1;
+            }
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+        }
+        pthread_cond_signal(&wanted);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * zygote_launch()
+ *
+ * - Description: runs a program in a ready helper instead of forking. The
+ * helper is sent the path, argv, environment and redirection files, along
+ * with its standard input, output and error and the working directory, and
+ * execs the program with them (see run_helper()). Returns the helper's pid,
+ * which is from then on the pid (and, unless pgid is given, the process group)
+ * of the job, or -1 if no helper was ready or the launch could not be sent, in
+ * which case nothing has been run.
+ *
+ * - Arguments: path: program to exec, argv: its arguments and envp: its
+ * environment (both NULL-terminated), files: input, output and append
+ * redirection files (or NULL), stdfds: standard input, output and error for
+ * the program (i.e. 0, 1 and 2), cwd: working directory to run in (AT_FDCWD
+ * for the shell's own), pgid: process group to join (0 to keep the helper's
+ * own), fg: set to give the helper the terminal before it execs
+ *
+ * - Usage: pid = zygote_launch("/bin/ls", argv, envp, files, stdfds,
+ *                              AT_FDCWD, 0, 1);
+ *          if (pid < 0) { fork as usual }
+ */
+pid_t zygote_launch(const char *path, char **argv, char **envp,
+                    const char *files[3], const int stdfds[3], int cwd,
+                    pid_t pgid, int fg) {
+    launch_t hdr = {pgid, 0, 0, 0};
+    size_t size = sizeof(hdr) + strlen(path) + 1;
+    while (argv[hdr.argc]) {
+        size += strlen(argv[hdr.argc++]) + 1;
+    }
+    while (envp[hdr.envc]) {
+        size += strlen(envp[hdr.envc++]) + 1;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (files[i]) {
+            hdr.files |= 1 << i;
+            size += strlen(files[i]) + 1;
+        }
+    }
+
+    char *msg;
+    if (!(msg = (char *)malloc(size))) {
+        return -1;
+    }
+
+    // pack the message
+    char *pos = msg;
+    memcpy(pos, &hdr, sizeof(hdr));
+    pos += sizeof(hdr);
+    pos = stpcpy(pos, path) + 1;
+    for (int i = 0; i < hdr.argc; i++) {
+        pos = stpcpy(pos, argv[i]) + 1;
+    }
+    for (int i = 0; i < hdr.envc; i++) {
+        pos = stpcpy(pos, envp[i]) + 1;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (files[i]) {
+            pos = stpcpy(pos, files[i]) + 1;
+        }
+    }
+
+    int own_cwd = cwd == AT_FDCWD;
+    if (own_cwd && (cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        free(msg);
+        return -1;
+    }
+
+    union {
+        char buf[CMSG_SPACE(NFDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = {.iov_base = msg, .iov_len = size};
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(NFDS * sizeof(int));
+    int fds[NFDS] = {stdfds[0], stdfds[1], stdfds[2], cwd};
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    pthread_mutex_lock(&lock);
+    zygote_t helper = {-1, -1};
+    if (npool) {
+        helper = pool[--npool];
+        pthread_cond_signal(&wanted);
+    }
+    pthread_mutex_unlock(&lock);
+    if (helper.pid < 0) {  // none ready
+        free(msg);
+        if (own_cwd) {
+            close(cwd);
+        }
+        return -1;
+    }
+
+    // hand over the terminal before the program can touch it
+    if (fg && tcgetsid(STDIN_FILENO) == getsid(0)) {
+        tcsetpgrp(STDIN_FILENO, pgid ? pgid : helper.pid);
+    }
+
+    ssize_t sent;
+    while ((sent = sendmsg(helper.sock, &mh, MSG_NOSIGNAL)) < 0 &&
+           errno == EINTR) {
+    }
+    free(msg);
+    if (own_cwd) {
+        close(cwd);
+    }
+    close(helper.sock);
+
+    if (sent != (ssize_t)size) {
+        // e.g. the environment is too large for one message, or the helper
+        // died: get rid of it and let the caller fork instead
+        kill(helper.pid, SIGKILL);
+        waitpid(helper.pid, NULL, 0);
+        return -1;
+    }
+
+    return helper.pid;
+}
+
+/*
+ * zygote_reaped()
+ *
+ * - Description: checks whether a pid returned by waitpid() belongs to an
+ * idle helper, and if so removes it from the pool. A helper that was merely
+ * stopped or continued is killed and waited for, so that it cannot turn up
+ * again later. Returns 1 if pid was a helper, 0 if it is a job.
+ *
+ * - Arguments: pid, status: pid and status returned by waitpid()
+ */
+int zygote_reaped(pid_t pid, int status) {
+    int found = 0;
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < npool && !found; i++) {
+        if (pool[i].pid == pid) {
+            close(pool[i].sock);
+            pool[i] = pool[--npool];
+            pthread_cond_signal(&wanted);
+            found = 1;
+        }
+    }
+    for (int i = 0; i < nretired && !found; i++) {
+        if (retired[i] == pid) {
+            retired[i] = retired[--nretired];
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (found && !WIFEXITED(status) && !WIFSIGNALED(status)) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    return found;
+}
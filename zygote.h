@@ -0,0 +1,38 @@
+#ifndef ZYGOTE_H_
+#define ZYGOTE_H_
+
+#include <sys/types.h>
+
+// largest number of helpers the pool may be set to keep
+#define MAX_ZYGOTES 64
+
+/*
+ * sets the number of pre-forked helper processes to keep ready (0 disables
+ * the pool and kills idle helpers)
+ */
+void set_zygotes(int n);
+/* returns the number of helpers the pool keeps */
+int zygote_count();
+/* forks helpers until the pool is full. called when the shell is idle */
+void refill_zygotes();
+
+/*
+ * runs path with argv and envp (and stdfds as its standard input, output and
+ * error) in a ready
+ * helper, in directory cwd (AT_FDCWD for the current one). files are the
+ * paths to redirect input, output and appended output to (or NULL). the
+ * helper joins process
+ * group pgid (0 for a group of its own) and, if fg is set, is given the
+ * terminal first. returns the pid of the helper, or -1 if none was ready, in
+ * which case the caller should fork as usual
+ */
+pid_t zygote_launch(const char *path, char **argv, char **envp,
+                    const char *files[3], const int stdfds[3], int cwd,
+                    pid_t pgid, int fg);
+/*
+ * returns 1 if pid (with status, as returned by waitpid()) is an idle helper,
+ * which is removed from the pool, so that it is not reported as a job
+ */
+int zygote_reaped(pid_t pid, int status);
+
+#endif  // ZYGOTE_H_